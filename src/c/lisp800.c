@@ -15,149 +15,33 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef __MACH__
-#define setjmp(e) sigsetjmp(e, 0)
-#define longjmp siglongjmp
-#endif
+#define LISP800_RUNTIME
+#include "lisp800.h"
 
 #ifdef _WIN32
 #include <windows.h>
-#define X __declspec(dllexport)
 #else
-#define X
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/utsname.h>
+#include <sys/stat.h>
 #endif
 
 #ifndef countof
 #define countof(x) (sizeof(x)/sizeof((x)[0]))
 #endif
 
-/* TODO: forget about windows and use stdbool? */
-typedef int lbool;
-#define L_FALSE (0)
-#define L_TRUE (1)
-
-/**
- * Integer type, compatible with lval type. All the resultant integers
- * should be placed into this type to avoid overflow error.
- */
-typedef intptr_t lint;
-
-/**
- * Main lvalue representation.
- * </p>
- * First two bits represents a value type.
- * </p>
- * Note, that pointer types (e.g. cons cells) - are expected to be *ALWAYS*
- * aligned at least by 4, since the trailing bits are used to represent type
- * information and considered to always be zero.
- * This seems to not be a problem for all the modern unix.
- * </p>
- * Zero value is reinterpreted as nil.
- *
- * @see #LVAL_TYPE_MASK
- * @see #LVAL_ANUM_TYPE
- * @see #LVAL_CONS_TYPE
- * @see #LVAL_IREF_TYPE
- * @see #LVAL_JREF_TYPE
- */
-typedef lint lval;
-
-
-/**
- * Value that represents lval's nil
- */
-#define LVAL_NIL            ((lval) 0)
-
-/**
- * Represents bit mask that should be applied to lval to extract type info.
- * Changing this to the different value will have immediate impact on all the
- * bitwise type operations.
- */
-#define LVAL_TYPE_MASK      (3)
-
-
-/**
- * Extracts lval type (first two bits)
- */
-#define LVAL_GET_TYPE(l) ((l) & LVAL_TYPE_MASK)
-
-/**
- * Simple objects written as is into the lval.
- */
-#define LVAL_INLINE_TYPE    (0)
-
-
-/**
- * Cons cell
- */
-#define LVAL_CONS_TYPE      (1)
-
-/**
- * IREF objects.
- * Sub types: symbol, simple-vector, array, package, function
- */
-#define LVAL_IREF_TYPE      (2)
-
-/**
- * JREF objects.
- * Sub types: simple-string, double, simple-bit-vector, file-stream
- */
-#define LVAL_JREF_TYPE      (3)
-
-
-
-/**
- * JREF objects.
- * Sub types: simple-string, double, simple-bit-vector, file-stream
- */
-#define LVAL_JREF_TYPE      (3)
-
-/**
- * Char code bit - applicable for ANUM type
- */
-#define LVAL_CHAR_BIT       (8)
-
-/* Int conversion to/from lval */
-#define LVAL_AS_INT(l)      ((l) >> 5)
-#define INT_AS_LVAL(l)      ((l) << 5)
-
-
-
-/**
- * GC marker bit
- *
- * @see #gcm
- * @see #gc
- */
-#define LVAL_GCM_BIT        (4)
-
-
-/* Subtype codes */
-
-#define LVAL_IREF_FUNCTION_SUBTYPE              (212)
-#define LVAL_IREF_SYMBOL_SUBTYPE                (20)
-#define LVAL_IREF_SIMPLE_VECTOR_SUBTYPE         (116)
-#define LVAL_IREF_PACKAGE_SUBTYPE               (180)
-
-#define LVAL_JREF_SIMPLE_STRING_SUBTYPE         (20)
-#define LVAL_JREF_DOUBLE_SUBTYPE                (84)
-#define LVAL_JREF_BIT_VECTOR_SUBTYPE            (116)
-
-#define LVAL_JREF_SIZE_BIT_SHIFT                (6)
-
-#define LVAL_IREF_SIZE_BIT_SHIFT                (8)
-
 
 /**
  * Interprets lval object as cons, this function is for cons'es only
  * @see #LVAL_CONS_TYPE
  */
-lval * o2c(lval o) {
+X lval * o2c(lval o) {
     assert(LVAL_GET_TYPE(o) == LVAL_CONS_TYPE);
     return (lval *) (o - 1);
 }
@@ -166,41 +50,41 @@ lval * o2c(lval o) {
  * Interprets cons as object, this function is for cons'es only
  * @see #LVAL_CONS_TYPE
  */
-lval c2o(lval * c) {
+X lval c2o(lval * c) {
     return (lval) c + 1;
 }
 
-int cp(lval o) {
+X int cp(lval o) {
     return (o & 3) == 1;
 }
 
-lval *o2a(lval o) {
+X lval *o2a(lval o) {
     assert(LVAL_GET_TYPE(o) == LVAL_IREF_TYPE);
     return (lval *) (o - LVAL_IREF_TYPE);
 }
 
-lval a2o(lval * a) {
+X lval a2o(lval * a) {
     return (lval) a + LVAL_IREF_TYPE;
 }
 
-int ap(lval o) {
+X int ap(lval o) {
     return (o & LVAL_TYPE_MASK) == LVAL_IREF_TYPE;
 }
 
-lval *o2s(lval o) {
+X lval *o2s(lval o) {
     assert(LVAL_GET_TYPE(o) == LVAL_JREF_TYPE);
     return (lval *) (o - 3);
 }
 
-char *o2z(lval o) {
+X char *o2z(lval o) {
     return (char *) (o - LVAL_JREF_TYPE + 2 * sizeof(lval));
 }
 
-lval s2o(lval * s) {
+X lval s2o(lval * s) {
     return (lval) s + LVAL_JREF_TYPE;
 }
 
-int sp(lval o) {
+X int sp(lval o) {
     return (o & LVAL_TYPE_MASK) == LVAL_JREF_TYPE;
 }
 
@@ -225,11 +109,11 @@ extern struct symbol_init symi[];
 #define E *f
 #define NE *g
 
-lval car(lval c) {
+X lval car(lval c) {
     return (c & 3) == 1 ? o2c(c)[0] : LVAL_NIL;
 }
 
-lval cdr(lval c) {
+X lval cdr(lval c) {
     return (c & 3) == 1 ? o2c(c)[1] : LVAL_NIL;
 }
 
@@ -265,6 +149,8 @@ int dbgr(lval *, int, lval, lval *);
 
 void print(lval);
 
+lval l2(lval *, lval, lval);
+
 lval * binding(lval * f, lval sym, int type, int *macro) {
     lval env;
     st:
@@ -291,13 +177,39 @@ lval * memory;
 lval * memf;
 int memory_size;
 lval * stack;
-lval xvalues = 8;
-lval dyns = 0;
+lval * stack_end;
+X lval xvalues = 8;
+X lval dyns = 0;
 jmp_buf top_jmp;
+
+/**
+ * Nonzero when the next safepoint has some work to do: a pending stack
+ * overflow or interrupt, or a stack reserve zone to close.
+ * Safepoints are polled on function entry, on go and on allocation.
+ */
+X volatile int safepoint_pending;
+volatile int interrupt_pending;
+void safepoint(lval *);
+
+/**
+ * The internal real time at which evaluation is interrupted, or nil.
+ */
+lval deadline = LVAL_NIL;
 lval pkg;
 lval pkgs;
 lval kwp = 0;
 
+/**
+ * Constants of the loaded compiled modules, see fasr.
+ */
+lval fasls = 0;
+
+/**
+ * The open output file streams, whose buffers are written on exit.
+ */
+lval fs_open = 0;
+call_link *links = 0;
+
 void gcm(lval v) {
     lval *t;
     int i;
@@ -338,6 +250,15 @@ lval gc(lval * f) {
     gcm(xvalues);
     gcm(pkgs);
     gcm(dyns);
+    gcm(fasls);
+    gcm(fs_open);
+    gcm(deadline);
+    {
+        call_link *k;
+        for (k = links; k; k = k->next) {
+            gcm(k->fn);
+        }
+    }
     for (; f > stack; f--) {
         if ((*f & 3) && (*f < memory ||
                          *f > (memory + memory_size / sizeof(lval)))) {
@@ -422,6 +343,9 @@ lval * m0(int n) {
 lval * cm0(lval * g, int n) {
     lval * m;
     int i;
+    if (safepoint_pending) {
+        safepoint(g);
+    }
     for (i = 0; i < GC_MAX_RETRY; ++i) {
         m = m0(n);
         if (m) {
@@ -437,6 +361,26 @@ lval * cm0(lval * g, int n) {
     return m;
 }
 
+/**
+ * Nonzero if n lval units can be allocated in one block, collecting first
+ * if need be; for sizes that come from outside, which must not make cm0
+ * give up.
+ */
+int m0_fits(lval * g, lint n) {
+    lval *m;
+    int i;
+    n = (n + 1) & ~1;
+    for (i = 0; i < GC_MAX_RETRY; ++i) {
+        for (m = memf; m; m = (lval *) m[0]) {
+            if (n <= m[1]) {
+                return 1;
+            }
+        }
+        gc(g);
+    }
+    return 0;
+}
+
 /**
  * Allocates iref
  */
@@ -487,11 +431,11 @@ X lval ms(lval * g, int n,...) {
     return s2o(m);
 }
 
-double o2d(lval o) {
+X double o2d(lval o) {
     return sp(o) ? *(double *) (o2s(o) + 2) : o >> 5;
 }
 
-lval d2o(lval * g, double d) {
+X lval d2o(lval * g, double d) {
     lval x = (lval) d << 5 | 16;
     lval *a;
     if (o2d(x) == d) {
@@ -516,8 +460,12 @@ unsigned o2u(lval o) {
  * Creates cons cell of a and b.
  * Stack pointer f is used for garbage collecting.
  */
-lval cons(lval * g, lval a, lval d) {
-    lval *c = m0(2);
+X lval cons(lval * g, lval a, lval d) {
+    lval *c;
+    if (safepoint_pending) {
+        safepoint(g);
+    }
+    c = m0(2);
     if (!c) {
         gcm(a);
         gcm(d);
@@ -534,13 +482,7 @@ lval cons(lval * g, lval a, lval d) {
 }
 
 int string_equal_do(lval a, lval b) {
-    int i;
-    for (i = 0; i < o2s(a)[0] / 64 - 4; i++) {
-        if (o2z(a)[i] != o2z(b)[i]) {
-            return 0;
-        }
-    }
-    return 1;
+    return !memcmp(o2z(a), o2z(b), o2s(a)[0] / 64 - 4);
 }
 
 int string_equal(lval a, lval b) {
@@ -558,7 +500,7 @@ lval argi(lval a, lval * b) {
     return a;
 }
 
-lval rest(lval * h, lval * g) {
+X lval rest(lval * h, lval * g) {
     lval *f = h - 1;
     lval r = 0;
     for (; f >= g; f--) {
@@ -619,6 +561,7 @@ lval args(lval * f, lval m, int c) {
                 } *h = argd(h, n, *g);
                 break;
             case 1:
+                h[-1] = *h;     /* rest does not scan the slot at h */
                 *h = cons(h, cons(h, n, rest(h - 1, g)), *h);
                 t = -1;
                 continue;
@@ -637,6 +580,7 @@ lval args(lval * f, lval m, int c) {
 		*h = argd(h, n, l < h - 1 ? k : evca(h, k));
                 continue;
             case 4:
+                h[-1] = *h;
                 *h = cons(h, cons(h, n, rest(h - 1, f + 1)), *h);
                 t = 0;
                 continue;
@@ -649,6 +593,7 @@ lval args(lval * f, lval m, int c) {
 	g++;
     }
     if (m) {
+        h[-1] = *h;
         return cons(h, cons(h, m, rest(h - 1, g)), *h);
     }
 
@@ -685,24 +630,363 @@ lval eval(lval * f, lval expr) {
     return evca(g, T);
 }
 
-lval rvalues(lval * g, lval v) {
+X lval rvalues(lval * g, lval v) {
     return xvalues == 8 ? cons(g, v, 0) : xvalues;
 }
 
-lval mvalues(lval a) {
+X lval mvalues(lval a) {
     xvalues = a;
     return car(a);
 }
 
+/**
+ * Stack overflow detection.
+ * </p>
+ * The lisp stack is a single reservation of address space laid out as
+ * [committed segments | uncommitted up to stack_max | reserve zone | red page].
+ * Everything past the committed part is inaccessible, so the first store
+ * beyond it faults into stack_fault(), which commits the next segment, or,
+ * once stack_max is reached, opens the reserve zone and leaves a note for
+ * the next safepoint, which signals a storage-condition running on the reserve; the reserve is closed again once the stack has unwound.
+ * Touching the red page means that the condition handlers themselves ran out
+ * of stack and the interpreter gives up to the toplevel.
+ * </p>
+ * The C stack gets a soft limit, checked by call() in the same way, backed by
+ * the hard guard of the system which is caught on the alternate signal stack.
+ */
+#define STACK_DEFAULT_SIZE      (sizeof(lval) * 64 * 1024)
+#define STACK_RESERVE_SIZE      (sizeof(lval) * 64 * 1024)
+#define STACK_REARM_SLACK       (1024)
+#define CSTACK_DEFAULT_SIZE     (8 * 1024 * 1024)
+#define CSTACK_RESERVE_SIZE     (256 * 1024)
+#define ALTSTACK_SIZE           (64 * 1024)
+
+size_t stack_segment = STACK_DEFAULT_SIZE;
+size_t stack_max = STACK_DEFAULT_SIZE;
+size_t stack_committed;
+size_t page_size = 4096;
+
+volatile int stack_overflow;
+volatile int stack_reserve_open;
+
+char *cstack_base;
+char *cstack_soft_limit;
+X char *cstack_limit;
+size_t cstack_size;
+int cstack_reserve_open;
+int top_jmp_armed;
+
+static const char stack_fatal_msg[] = ";fatal: lisp stack exhausted while handling stack exhaustion\n";
+static const char cstack_fatal_msg[] = ";fatal: C stack exhausted\n";
+
+static size_t round_to_page(size_t n) {
+    return (n + page_size - 1) & ~(page_size - 1);
+}
+
+static void stack_give_up(const char *msg, size_t len) {
+#ifdef _WIN32
+    fputs(msg, stderr);
+#else
+    write(2, msg, len);
+#endif
+    if (!top_jmp_armed) {
+        exit(-1);
+    }
+    longjmp(top_jmp, 1);
+}
+
+#ifdef _WIN32
+void stack_init(void) {
+    stack_max = round_to_page(stack_max);
+    stack = calloc(1, stack_max + STACK_RESERVE_SIZE);
+    stack_committed = stack_max;
+    stack_end = stack + (stack_max + STACK_RESERVE_SIZE) / sizeof(lval);
+    cstack_soft_limit = cstack_limit = 0;
+}
+#else
+static void stack_fault(int sig, siginfo_t * si, void *ctx) {
+    char *a = (char *) si->si_addr;
+    char *base = (char *) stack;
+    size_t n;
+
+    if (a >= base + stack_committed && a < base + stack_max) {
+        /* grow by as many segments as needed to cover the faulting store */
+        n = ((a - base) / stack_segment + 1) * stack_segment;
+        if (n > stack_max) {
+            n = stack_max;
+        }
+        mprotect(base + stack_committed, n - stack_committed, PROT_READ | PROT_WRITE);
+        stack_committed = n;
+        return;
+    }
+    if (a >= base + stack_max && a < base + stack_max + STACK_RESERVE_SIZE
+        && !stack_reserve_open) {
+        mprotect(base + stack_max, STACK_RESERVE_SIZE, PROT_READ | PROT_WRITE);
+        stack_reserve_open = 1;
+        stack_overflow = 1;
+        safepoint_pending = 1;
+        return;
+    }
+    if (a >= base + stack_max && a < (char *) stack_end) {
+        stack_give_up(stack_fatal_msg, sizeof(stack_fatal_msg) - 1);
+    }
+    if (a < cstack_base && a >= cstack_base - cstack_size - CSTACK_RESERVE_SIZE) {
+        stack_give_up(cstack_fatal_msg, sizeof(cstack_fatal_msg) - 1);
+    }
+    /* not ours, let the default action take place on return */
+    signal(sig, SIG_DFL);
+}
+
+void stack_init(void) {
+    struct rlimit rl;
+    struct sigaction sa;
+    stack_t ss;
+    char *base;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    stack_segment = round_to_page(stack_segment);
+    stack_max = round_to_page(stack_max);
+    if (stack_max < stack_segment) {
+        stack_max = stack_segment;
+    }
+
+    base = mmap(NULL, stack_max + STACK_RESERVE_SIZE + page_size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Can't reserve lisp stack");
+        exit(-1);
+    }
+    mprotect(base, stack_segment, PROT_READ | PROT_WRITE);
+    stack = (lval *) base;
+    stack_committed = stack_segment;
+    stack_end = (lval *) (base + stack_max + STACK_RESERVE_SIZE + page_size);
+
+    cstack_size = CSTACK_DEFAULT_SIZE;
+    if (!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY) {
+        cstack_size = rl.rlim_cur;
+    }
+    cstack_soft_limit = cstack_limit = cstack_base - cstack_size + 2 * CSTACK_RESERVE_SIZE;
+
+    ss.ss_sp = malloc(ALTSTACK_SIZE);
+    ss.ss_size = ALTSTACK_SIZE;
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = stack_fault;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+}
+#endif
+
+/**
+ * Stack part of the safepoint: signals pending overflows and closes the
+ * reserve zones once the stacks have unwound far enough.
+ */
+void stack_check(lval * g) {
+    char *sp = (char *) &g;
+    lval x;
+#ifdef _WIN32
+    if (g >= stack + stack_max / sizeof(lval) && !stack_reserve_open) {
+        stack_reserve_open = 1;
+        stack_overflow = 1;
+    }
+#endif
+    if (sp < cstack_limit && !cstack_reserve_open) {
+        cstack_reserve_open = 1;
+        cstack_limit = cstack_soft_limit - CSTACK_RESERVE_SIZE;
+        safepoint_pending = 1;
+        dbgr(g, 10, 0, &x);
+        return;
+    }
+    if (stack_overflow) {
+        stack_overflow = 0;
+        dbgr(g, 10, 0, &x);
+        return;
+    }
+    if (stack_reserve_open && g + STACK_REARM_SLACK < stack + stack_max / sizeof(lval)) {
+#ifndef _WIN32
+        mprotect((char *) stack + stack_max, STACK_RESERVE_SIZE, PROT_NONE);
+#endif
+        stack_reserve_open = 0;
+    }
+    if (cstack_reserve_open && sp > cstack_soft_limit + CSTACK_RESERVE_SIZE) {
+        cstack_reserve_open = 0;
+        cstack_limit = cstack_soft_limit;
+    }
+    safepoint_pending = stack_reserve_open || cstack_reserve_open || interrupt_pending;
+}
+
+/**
+ * Interrupts.
+ * </p>
+ * lisp_interrupt() only raises a flag, so it may be called from a signal
+ * handler, a timer or another thread. The interrupt is delivered at the next
+ * safepoint as an ierror, which unwinds like any other non-local exit and
+ * runs the unwind-protect cleanups on the way out.
+ * The evaluation deadline is a one-shot timer that interrupts this way.
+ */
+volatile int deadline_expired;
+double start_ms;
+
+X void lisp_interrupt(void) {
+    interrupt_pending = 1;
+    safepoint_pending = 1;
+}
+
+static double now_ms(void) {
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000;
+#endif
+}
+
+#ifdef _WIN32
+static HANDLE deadline_timer;
+
+static VOID CALLBACK deadline_fire(PVOID p, BOOLEAN t) {
+    deadline_expired = 1;
+    lisp_interrupt();
+}
+
+static void arm_deadline(double ms) {
+    if (deadline_timer) {
+        DeleteTimerQueueTimer(NULL, deadline_timer, NULL);
+        deadline_timer = NULL;
+    }
+    if (ms >= 0) {
+        CreateTimerQueueTimer(&deadline_timer, NULL, deadline_fire, NULL, (DWORD) ms, 0, 0);
+    }
+}
+#else
+static void deadline_fire(int sig) {
+    deadline_expired = 1;
+    lisp_interrupt();
+}
+
+static void arm_deadline(double ms) {
+    struct itimerval t;
+    memset(&t, 0, sizeof(t));
+    if (ms >= 0) {
+        signal(SIGALRM, deadline_fire);
+        t.it_value.tv_sec = (long) ms / 1000;
+        t.it_value.tv_usec = ((long) ms % 1000) * 1000;
+        if (!t.it_value.tv_sec && !t.it_value.tv_usec) {
+            /* already expired: a zero timer would disarm instead */
+            t.it_value.tv_usec = 1;
+        }
+    }
+    setitimer(ITIMER_REAL, &t, NULL);
+}
+#endif
+
+X void safepoint(lval * g) {
+    lval x;
+    if (interrupt_pending) {
+        interrupt_pending = 0;
+        if (deadline_expired) {
+            deadline_expired = 0;
+            deadline = LVAL_NIL;
+            dbgr(g, 12, 0, &x);
+        } else {
+            dbgr(g, 11, 0, &x);
+        }
+    }
+    stack_check(g);
+}
+
+lval lget_internal_real_time(lval * f) {
+    return d2o(f, now_ms() - start_ms);
+}
+
+lval ldeadline(lval * f) {
+    return deadline;
+}
+
+/**
+ * Replaces the deadline, nil for none. The timer is stopped first, so that
+ * an expiry of the old deadline still waiting for a safepoint can be
+ * dropped along with its interrupt.
+ */
+lval setfdeadline(lval * f) {
+    arm_deadline(-1);
+    if (deadline_expired) {
+        deadline_expired = 0;
+        interrupt_pending = 0;
+    }
+    deadline = f[1];
+    if (deadline) {
+        arm_deadline(o2d(deadline) - (now_ms() - start_ms));
+    }
+    return deadline;
+}
+
+/**
+ * Tiered execution.
+ * </p>
+ * Interpreted functions count their calls and the back-edges of the
+ * tagbody loops in their bodies, in the last word of their code object.
+ * When the count of a function reaches auto_compile_threshold the function
+ * is handed to AUTO-COMPILE, which compiles it and installs the result in
+ * its symbol's function cell unless the symbol was redefined meanwhile.
+ * This runs right where the count is taken, with the frame rooted; the
+ * running invocation carries on interpreted and later calls go to the
+ * compiled code. AUTO-COMPILE returns nil while it is busy compiling
+ * another function and the count is then taken again by the next call.
+ * A threshold of 0 turns counting off.
+ */
+lint auto_compile_threshold;
+
+void count_call(lval * g, lval fn) {
+    lval *code = o2s(o2a(fn)[2]);
+    if (++code[5] == auto_compile_threshold) {
+        g[2] = fn;
+        if (!call(g, symi[94].sym, 1)) {
+            code[5]--;
+        }
+    }
+}
+
+/**
+ * The interpreted function whose body env belongs to: infn marks its
+ * block with a type 20 jref that holds the function besides the jump
+ * buffer. Nil outside of any interpreted function.
+ */
+lval running_function(lval env) {
+    for (; env; env = cdr(env)) {
+        if (cp(caar(env)) && cdr(caar(env)) == 64 &&
+            o2s(cddr(car(env)))[1] == 20) {
+            return o2s(cddr(car(env)))[3];
+        }
+    }
+    return 0;
+}
+
+lval lauto_compile_threshold(lval * f) {
+    return auto_compile_threshold << 5 | 16;
+}
+
+lval setfauto_compile_threshold(lval * f) {
+    auto_compile_threshold = f[1] ? o2i(f[1]) : 0;
+    return f[1];
+}
+
 lval infn(lval * f, lval * h) {
     jmp_buf jmp;
     lval vs;
     lval *g = h + 1;
     lval fn = *f;
     int d = h - f - 1;
+    if (auto_compile_threshold) {
+        count_call(h, fn);
+    }
     h[1] = o2a(fn)[3];
     NE = args(f, o2a(fn)[4], d);
-    g[-1] = cons(g, dyns, ms(g, 1, 20, &jmp));
+    g[-1] = cons(g, dyns, ms(g, 2, 20, &jmp, fn));
     NE = cons(g, cons(g, cons(g, o2a(fn)[6], 64), g[-1]), NE);
     g[-1] = (d << 5) | 16;
     if (!(vs = setjmp(jmp))) {
@@ -711,11 +995,37 @@ lval infn(lval * f, lval * h) {
     return mvalues(car(vs));
 }
 
+/**
+ * Function object running fn, with the environment, lambda list, body
+ * and name slots as infn expects them.
+ * </p>
+ * The code object is kept at g[1] while the function object is made:
+ * ma does not protect its arguments.
+ */
+lval mkfn(lval * g, lval(*fn) (), int min, int max, lval env, lval ll,
+          lval body, lval name) {
+    g[1] = ms(g, 4, 212, fn, min, max, 0);
+    return ma(g + 1, 5, 212, g[1], env, ll, body, name);
+}
+
 X lval call(lval * f, lval fn, unsigned d) {
-    lval *g = f + d + 3;
+    lval *g = f + d + 2;
+    f[1] = fn;                  /* rooted for the safepoint */
+#ifdef _WIN32
+    if (g >= stack + stack_max / sizeof(lval)) {
+        safepoint_pending = 1;
+    }
+#endif
+    if (safepoint_pending || (char *) &g < cstack_limit) {
+        safepoint(g);
+    }
     xvalues = 8;
     if (o2a(fn)[1] == 20) {
+        lval sym = fn;
         fn = o2a(fn)[5];
+        if (fn == 8) {
+            dbgr(g, 1, sym, &fn);
+        }
     }
 
     if (o2a(fn)[0] & 16) {
@@ -732,50 +1042,249 @@ X lval call(lval * f, lval fn, unsigned d) {
     return ((lval(*) ()) o2s(fn)[2]) (f, f + d + 1);
 }
 
-lval eval_quote(lval * g, lval ex) {
-    return car(ex);
+/**
+ * Slow path of call_linked: (re)links the site k to the current function
+ * of sym and makes the call through call.
+ * </p>
+ * Only plain functions whose arity admits d arguments are linked; for
+ * anything else, including funcallable instances whose function may change
+ * behind the symbol's back, the site is unlinked and every call goes
+ * through call, which also signals the errors.
+ */
+X lval link_call(lval * f, call_link * k, lval sym, unsigned d) {
+    lval fn = o2a(sym)[5];
+    k->fn = 0;
+    if (fn != 8 && !(o2a(fn)[0] & 16) &&
+        d >= (unsigned) o2s(o2a(fn)[2])[3] &&
+        d <= (unsigned) o2s(o2a(fn)[2])[4]) {
+        if (!k->code) {
+            k->next = links;
+            links = k;
+        }
+        k->fn = fn;
+        k->code = (lval(*)()) o2s(o2a(fn)[2])[2];
+    }
+    return call(f, sym, d);
 }
 
-/* TODO: f seems redundant here */
-int specp(lval * f, lval ex, lval s) {
-    for (; ex; ex = cdr(ex)) {
-        if (ap(caar(ex)) && o2a(caar(ex))[7] == 3 << 3) {
-            lval e = cdar(ex);
-            for (; e; e = cdr(e)) {
-                if (o2a(caar(e))[7] == 4 << 3) {
-                    lval sp = cdar(e);
-                    for (; sp; sp = cdr(sp)) {
-                        if (car(sp) == s) {
-                            return 1;
-                        }
-                    }
-                }
-            }
-        } else {
-            break;
-        }
+/**
+ * Generic function dispatch.
+ * </p>
+ * The discriminating function of a standard generic function is a closure
+ * of dispatch over a cache vector: the generic function, the dispatch
+ * epoch the cache was filled in, the number n of specialized arguments,
+ * the line to fill next, then up to eight lines of n class keys followed
+ * by the effective method function. The first line makes a monomorphic
+ * call site as cheap as a few compares; a miss goes to DISPATCH-MISS,
+ * which fills a line. Redefining a class advances the epoch, emptying
+ * every cache at its next call.
+ */
+lint dispatch_epoch;
+
+/**
+ * What class-of depends on: the class of a standard object, or a fixnum
+ * standing for the built-in class of anything else.
+ */
+lval class_key(lval o) {
+    lval k;
+    switch (o & 3) {
+    case 1:
+        return 1 << 5 | 16;
+    case 2:
+        k = o2a(o)[1] & ~4;
+        return ap(k) ? k : ((k >> 5) + 16) << 5 | 16;
+    case 3:
+        return (o2s(o)[1] + 64) << 5 | 16;
+    default:
+        return (o ? (o & 31) == 16 ? 2 : 3 : 0) << 5 | 16;
     }
-    return 0;
 }
 
-void unwind(lval * f, lval c) {
-    lval e;
-    NF(0) for (; dyns != c; dyns = cdr(dyns))
-        if (ap(car(dyns))) {
-            if (o2a(car(dyns))[1] == 52) {
-                NE = o2a(car(dyns))[2];
-                eval_body(g, o2a(car(dyns))[3]);
-            } else {
-                for (e = o2a(car(dyns))[2]; e; e = cdr(e)) {
-                    o2a(caar(e))[4] = cdar(e);
-                }
+lval dispatch(lval * f, lval * h) {
+    lval *c = o2a(o2a(f[0])[3]);
+    int d = h - f - 1;
+    int n = c[4] >> 5;
+    int i, j;
+    if (d >= n && c[3] >> 5 == dispatch_epoch) {
+        for (i = 6; i + n < (c[0] >> 8) + 2 && c[i + n]; i += n + 1) {
+            for (j = 0; j < n && class_key(f[j + 1]) == c[i + j]; j++) {
+            }
+            if (j == n) {
+                return call(f - 1, c[i + n], d);
             }
-        } else {
-            o2s(car(dyns))[2] = 0;
         }
+    }
+    h[2] = a2o(c);
+    for (i = 1; i <= d; i++) {
+        h[i + 2] = f[i];
+    }
+    return call(h, symi[95].sym, d + 1);
 }
 
-lval eval_let(lval * f, lval ex) {
+lval lmake_dispatch_function(lval * f) {
+    return make_closure(f + 1, dispatch, 0, -1, f[1], 0);
+}
+
+lval ldispatch_class_key(lval * f) {
+    return class_key(f[1]);
+}
+
+lval ldispatch_epoch(lval * f) {
+    return dispatch_epoch << 5 | 16;
+}
+
+lval setfdispatch_epoch(lval * f) {
+    dispatch_epoch = o2i(f[1]) & 0x3ffffff;
+    return f[1];
+}
+
+/**
+ * Slot accessors.
+ * </p>
+ * The method functions of slot readers and writers are closures of
+ * slot_reader and slot_writer over a vector: the storage of the class they
+ * last saw, the index of the slot in instances of that class, the slot
+ * name and whether it is a writer. Redefining a class gives it new
+ * storage, so the first check fails and SLOT-ACCESS-MISS looks the slot up
+ * again.
+ */
+lval *slot_place(lval * c, lval o) {
+    lval k;
+    if (c[2] && ap(o) && ap(k = o2a(o)[1] & ~4) && o2a(k)[2] == c[2]) {
+        return o2a(o2a(o)[2]) + (c[3] >> 5);
+    }
+    return 0;
+}
+
+lval slot_reader(lval * f, lval * h) {
+    lval *c = o2a(o2a(f[0])[3]);
+    lval *p = slot_place(c, car(f[1]));
+    if (p && *p != 8) {
+        return *p;
+    }
+    h[2] = a2o(c);
+    h[3] = f[1];
+    return call(h, symi[96].sym, 2);
+}
+
+lval slot_writer(lval * f, lval * h) {
+    lval *c = o2a(o2a(f[0])[3]);
+    lval *p = slot_place(c, car(cdr(f[1])));
+    if (p) {
+        return *p = car(f[1]);
+    }
+    h[2] = a2o(c);
+    h[3] = f[1];
+    return call(h, symi[96].sym, 2);
+}
+
+lval lmake_slot_accessor(lval * f) {
+    return make_closure(f + 1, o2a(f[1])[5] ? slot_writer : slot_reader,
+                        2, 2, f[1], 0);
+}
+
+/**
+ * When the only applicable method is a slot accessor, the effective method
+ * function takes the arguments of the generic function itself and shares
+ * the cache of the method function, so the call conses no argument list.
+ */
+lval slot_reader_emf(lval * f, lval * h) {
+    lval *c = o2a(o2a(f[0])[3]);
+    lval *p = slot_place(c, f[1]);
+    if (p && *p != 8) {
+        return *p;
+    }
+    h[2] = a2o(c);
+    h[3] = cons(h + 2, f[1], 0);
+    return call(h, symi[96].sym, 2);
+}
+
+lval slot_writer_emf(lval * f, lval * h) {
+    lval *c = o2a(o2a(f[0])[3]);
+    lval *p = slot_place(c, f[2]);
+    if (p) {
+        return *p = f[1];
+    }
+    h[2] = a2o(c);
+    h[3] = l2(h + 2, f[1], f[2]);
+    return call(h, symi[96].sym, 2);
+}
+
+lval lslot_accessor_emf(lval * f) {
+    lval code;
+    if (!ap(f[1]) || o2a(f[1])[1] != 212 || o2a(f[1])[0] & 16) {
+        return 0;
+    }
+    code = o2s(o2a(f[1])[2])[2];
+    if (code == (lval) slot_reader) {
+        return make_closure(f + 1, slot_reader_emf, 1, 1, o2a(f[1])[3], 0);
+    }
+    if (code == (lval) slot_writer) {
+        return make_closure(f + 1, slot_writer_emf, 2, 2, o2a(f[1])[3], 0);
+    }
+    return 0;
+}
+
+lval eval_quote(lval * g, lval ex) {
+    return car(ex);
+}
+
+/* TODO: f seems redundant here */
+int specp(lval * f, lval ex, lval s) {
+    for (; ex; ex = cdr(ex)) {
+        if (ap(caar(ex)) && o2a(caar(ex))[7] == 10 << 3) {
+            lval e = cdar(ex);
+            for (; e; e = cdr(e)) {
+                if (o2a(caar(e))[7] == 11 << 3) {
+                    lval sp = cdar(e);
+                    for (; sp; sp = cdr(sp)) {
+                        if (car(sp) == s) {
+                            return 1;
+                        }
+                    }
+                }
+            }
+        } else {
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pops the dynamic state down to c, restoring special bindings, running
+ * unwind-protect cleanups and invalidating the exit points of blocks,
+ * tagbodies and catches. Each entry is popped before its cleanup runs,
+ * so a non-local exit out of a cleanup doesn't run it again.
+ */
+X void unwind(lval * f, lval c) {
+    lval e;
+    NF(1) T = 0;
+    while (dyns != c) {
+        T = car(dyns);
+        dyns = cdr(dyns);
+        if (ap(T)) {
+            if (o2a(T)[1] == 52) {
+                if (ap(o2a(T)[3])) {
+                    call(g, o2a(T)[3], 0);
+                } else {
+                    NE = o2a(T)[2];
+                    eval_body(g, o2a(T)[3]);
+                }
+            } else {
+                for (e = o2a(T)[2]; e; e = cdr(e)) {
+                    o2a(caar(e))[4] = cdar(e);
+                }
+            }
+        } else if (cp(T)) {
+            o2s(cdr(T))[2] = 0;
+        } else {
+            o2s(T)[2] = 0;
+        }
+    }
+}
+
+lval eval_let(lval * f, lval ex) {
     lval r;
     NF(3) T = car(ex);
     U = E;
@@ -834,7 +1343,7 @@ lval eval_progv(lval * f, lval ex) {
         o2a(car(T))[4] = car(U);
     } 
     T = eval_body(g, cddr(ex));
-    unwind(f, cdr(dyns));
+    unwind(g, cdr(dyns));
     return T;
 }
 
@@ -842,7 +1351,7 @@ lval eval_flet(lval * f, lval ex) {
     NF(4) V = W = 0;
     U = E;
     for (T = car(ex); T; T = cdr(T)) {
-        V = ma(g, 5, 212, ms(f, 3, 212, infn, 0, -1), E, cadr(car(T)), cddr(car(T)), caar(T));
+        V = mkfn(g, infn, 0, -1, E, cadr(car(T)), cddr(car(T)), caar(T));
         W = cons(g, caar(T), 16);
         V = cons(g, W, V);
         U = cons(g, V, U);
@@ -858,7 +1367,7 @@ lval eval_labels(lval * f, lval ex) {
         U = cons(g, 0, U);
     NE = U;
     for (T = car(ex); T; T = cdr(T), U = cdr(U)) {
-        V = ma(g, 5, 212, ms(f, 3, 212, infn, 0, -1), NE, cadr(car(T)), cddr(car(T)), caar(T));
+        V = mkfn(g, infn, 0, -1, NE, cadr(car(T)), cddr(car(T)), caar(T));
         W = cons(g, caar(T), 16);
         set_car(U, cons(g, W, V));
     }
@@ -869,7 +1378,7 @@ lval eval_macrolet(lval * f, lval ex) {
     NF(4) V = W = 0;
     U = E;
     for (T = car(ex); T; T = cdr(T)) {
-        V = ma(g, 5, 212, ms(f, 3, 212, infn, 0, -1), E, cadr(car(T)), cddr(car(T)), caar(T));
+        V = mkfn(g, infn, 0, -1, E, cadr(car(T)), cddr(car(T)), caar(T));
         W = cons(g, caar(T), 24);
         V = cons(g, W, V);
         U = cons(g, V, U);
@@ -912,7 +1421,7 @@ lval eval_function(lval * f, lval ex) {
                 n = cadr(x);
                 x = cddr(x);
             }
-            return ma(f, 5, 212, ms(f, 3, 212, infn, 0, -1), E, cadr(ex), x, n);
+            return mkfn(f, infn, 0, -1, E, cadr(ex), x, n);
         } else {
             x = *binding(f, cadr(ex), 2, 0);
         }
@@ -951,6 +1460,12 @@ lval eval_tagbody(lval * f, lval ex) {
             }
         }
     } else {
+        if (safepoint_pending) {
+            safepoint(g);
+        }
+        if (auto_compile_threshold && (T = running_function(NE))) {
+            count_call(g, T);
+        }
         for (e = ex; e; e = cdr(e)) {
             if (car(e) == tag) {
                 e = cdr(e);
@@ -1110,6 +1625,227 @@ lval eval_setf(lval * f, lval ex) {
     return call(g, r, map_eval(g, T));
 }
 
+/**
+ * Runtime support for compiled code.
+ * </p>
+ * Functions produced by compile-file keep their variables in the lisp
+ * stack frame just like builtins do. Whatever needs the dynamic state,
+ * non-local transfer of control or can signal an error goes through the
+ * helpers below, so compiled code sees the same protocols as eval.
+ */
+
+X lval symval(lval * g, lval sym) {
+    lval v = o2a(sym)[4];
+    if (v == 8) {
+        dbgr(g, 0, sym, &v);
+    }
+    return v;
+}
+
+/**
+ * Global function of sym: i is 5 for the function, 6 for the setf function.
+ */
+X lval symfun(lval * g, lval sym, int i) {
+    lval v = o2a(sym)[i];
+    if (v == 8) {
+        dbgr(g, 1, i == 5 ? sym : l2(g, symi[33].sym, sym), &v);
+    }
+    return v;
+}
+
+/**
+ * Function object for compiled code fn.
+ * </p>
+ * env is the simple-vector of closed over values or boxes, found by
+ * the code in its own function object.
+ */
+X lval make_closure(lval * g, lval(*fn) (), int min, int max, lval env,
+                    lval name) {
+    return mkfn(g, fn, min, max, env, 0, 0, name);
+}
+
+/**
+ * Value of key in the keyword argument list l, 8 when it is missing.
+ */
+X lval getkey(lval l, lval key) {
+    for (; l; l = cddr(l)) {
+        if (car(l) == key) {
+            return cadr(l);
+        }
+    }
+    return 8;
+}
+
+X void bind_special(lval * g, lval sym, lval val) {
+    g[1] = cons(g, sym, o2a(sym)[4]);
+    g[1] = cons(g + 1, g[1], 0);
+    g[1] = ma(g + 1, 1, 84, g[1]);
+    dyns = cons(g + 1, g[1], dyns);
+    o2a(sym)[4] = val;
+}
+
+X void progv_bind(lval * g, lval syms, lval vals) {
+    lval r;
+    g[1] = ma(g, 1, 84, 0);
+    dyns = cons(g + 1, g[1], dyns);
+    for (r = car(dyns); syms && vals; syms = cdr(syms), vals = cdr(vals)) {
+        o2a(r)[2] = cons(g, cons(g, car(syms), o2a(car(syms))[4]), o2a(r)[2]);
+        o2a(car(syms))[4] = car(vals);
+    }
+}
+
+/**
+ * Return v from the block whose tag object is tag: the dynamic state
+ * to unwind to, consed with the jump buffer.
+ */
+X void block_return(lval * g, lval tag, lval v) {
+    jmp_buf *jmp = (jmp_buf *) o2s(cdr(tag))[2];
+    if (!jmp) {
+        dbgr(g, 8, 0, &v);
+        longjmp(top_jmp, 1);
+    }
+    g[1] = rvalues(g, v);
+    unwind(g + 1, car(tag));
+    longjmp(*jmp, cons(g + 1, g[1], 0));
+}
+
+/**
+ * Go to the k:th tag of the tagbody whose tag object is tag.
+ */
+X void tagbody_go(lval * g, lval tag, int k) {
+    jmp_buf *jmp = (jmp_buf *) o2s(cdr(tag))[2];
+    if (!jmp) {
+        dbgr(g, 9, 0, &tag);
+        longjmp(top_jmp, 1);
+    }
+    unwind(g, car(tag));
+    longjmp(*jmp, k);
+}
+
+X void throw_to(lval * g, lval tag, lval v) {
+    lval c;
+    g[1] = rvalues(g, v);
+
+    st:
+    for (c = dyns; c; c = cdr(c)) {
+        if (cp(car(c)) && caar(c) == tag) {
+            unwind(g + 1, c);
+            longjmp(*(jmp_buf *) (o2s(cdar(c))[2]), cons(g + 1, g[1], 0));
+        }
+    }
+    dbgr(g + 1, 5, tag, &tag);
+    goto st;
+}
+
+/**
+ * Call fn with the elements of the k value lists at l as arguments.
+ */
+X lval mv_call(lval * g, lval fn, lval * l, int k) {
+    lval *h = g + 2;
+    lval e;
+    for (; k; k--, l++) {
+        for (e = *l; e; e = cdr(e)) {
+            *h++ = car(e);
+        }
+    }
+    *h = 0;
+    return call(g, fn, h - g - 2);
+}
+
+/**
+ * Unboxed arithmetic.
+ * </p>
+ * Compiled code keeps variables declared fixnum or double-float in C
+ * locals. These check a value on its way in, unless the code was compiled
+ * with safety 0, and box an integer result on its way out. Integral
+ * doubles are fixnums, so any number passes as a double-float.
+ */
+
+X lval box_integer(lval * g, lint n) {
+    return n >= -LVAL_FIXNUM_LIMIT && n < LVAL_FIXNUM_LIMIT ? n << 5 | 16
+        : d2o(g, n);
+}
+
+X lint fixnum_value(lval * g, lval x) {
+    while ((x & 31) != 16) {
+        dbgr(g, 15, x, &x);
+    }
+    return x >> 5;
+}
+
+X lint fixnum_check(lval * g, lint n) {
+    if (n < -LVAL_FIXNUM_LIMIT || n >= LVAL_FIXNUM_LIMIT) {
+        return fixnum_value(g, box_integer(g, n));
+    }
+    return n;
+}
+
+X lint fixnum_of_double(lval * g, double d) {
+    if (d < -LVAL_FIXNUM_LIMIT || d >= LVAL_FIXNUM_LIMIT || d != (lint) d) {
+        return fixnum_value(g, d2o(g, d));
+    }
+    return (lint) d;
+}
+
+X double double_value(lval * g, lval x) {
+    while ((x & 31) != 16 && !(sp(x) && o2s(x)[1] == 84)) {
+        dbgr(g, 16, x, &x);
+    }
+    return o2d(x);
+}
+
+/**
+ * Element i of the simple-vector v, checked.
+ */
+X lval *svref_place(lval * g, lval v, lint i) {
+    while (!ap(v) || o2a(v)[1] != 116) {
+        dbgr(g, 17, v, &v);
+    }
+    if (i < 0 || i >= o2a(v)[0] >> 8) {
+        lval x = box_integer(g, i);
+        dbgr(g, 2, x, &x);
+        longjmp(top_jmp, 1);
+    }
+    return o2a(v) + 2 + i;
+}
+
+/**
+ * Foreign calls.
+ * </p>
+ * Compiled foreign-call forms pass strings to C as pointers to their
+ * characters, which are kept zero terminated and which the collector does
+ * not move, so nothing is copied; octet vectors are passed the same way.
+ * Pointers travel as integer addresses, with nil for NULL.
+ */
+
+X char *foreign_buffer(lval * g, lval x) {
+    while (x && !(sp(x) && o2s(x)[1] == 20)) {
+        dbgr(g, 18, x, &x);
+    }
+    return x ? o2z(x) : 0;
+}
+
+X unsigned char *foreign_octets(lval * g, lval x) {
+    while (x && !(sp(x) && (o2s(x)[1] == 20 || o2s(x)[1] == 148))) {
+        dbgr(g, 25, x, &x);
+    }
+    return x ? (unsigned char *) o2z(x) : 0;
+}
+
+X void *foreign_pointer(lval * g, lval x) {
+    return x ? (void *) (uintptr_t) double_value(g, x) : 0;
+}
+
+X lval box_pointer(lval * g, void *p) {
+    return p ? d2o(g, (double) (uintptr_t) p) : 0;
+}
+
+lval strf(lval * f, const char *s);
+
+X lval foreign_string(lval * g, const char *s) {
+    return s ? strf(g, s) : 0;
+}
+
 lval llist(lval * f, lval * h) {
     return rest(h, f + 1);
 }
@@ -1226,7 +1962,9 @@ lval lfloor(lval * f, lval * h) {
     double n = o2d(f[1]);
     double d = h - f > 2 ? o2d(f[2]) : 1;
     double q = floor(n / d);
-    return mvalues(l2(f, d2o(f, q), d2o(f, n - q * d)));
+    f[1] = d2o(h, q);
+    f[2] = d2o(h, n - q * d);
+    return mvalues(l2(h, f[1], f[2]));
 }
 
 int gensymc = 0;
@@ -1235,7 +1973,8 @@ lval lgensym(lval * f) {
     r[1] = 20;
     sprintf((char *) (r + 2),
         "g%3.3d", gensymc++);
-    return ma(f, 9, 20, s2o(r), 0, 8, 8, 8, -8, 16, 0, 0);
+    f[1] = s2o(r);
+    return ma(f + 1, 9, 20, f[1], 0, 8, 8, 8, -8, 16, 0, 0);
 }
 
 lval lcode_char(lval * f) {
@@ -1334,111 +2073,442 @@ lval setfjref(lval * f) {
     return o2s(f[2])[o2u(f[3])] = o2u(f[1]);
 }
 
-lval strf(lval * f, const char *s);
 
-#ifdef _WIN32
-lval lmake_fs(lval * f) {
-    HANDLE fd = CreateFile(o2z(f[1]), f[2] ? GENERIC_WRITE :
-                   GENERIC_READ, f[2] ? FILE_SHARE_WRITE : FILE_SHARE_READ, NULL, OPEN_EXISTING,
-                   FILE_ATTRIBUTE_NORMAL, NULL);
-    return ms(f, 4, 116, 1, fd, f[2], 0);
-}
 
-lval lclose_fs(lval * f) {
-    CloseHandle(o2s(f[1])[3]);
-    return 0;
-}
+/**
+ * File streams.
+ * </p>
+ * A file stream is a jref of tag 116 holding [2] 1, [3] the descriptor or
+ * handle, [4] t for output and nil for input, [5] the size of its buffer,
+ * [6] and [7] the start and end of the buffered input, or [7] the end of
+ * the buffered output, [8] nonzero if the stream is line buffered, and
+ * from [9] the buffer. Reads are served from the buffer, which is refilled
+ * with as much as the system gives; a read as large as the buffer goes to
+ * the system directly. Output is written when the buffer is full, on
+ * FINISH-FILE-STREAM and CLOSE-FILE-STREAM, for a line buffered stream at
+ * every newline, and on exit; streams on terminals are line buffered, and
+ * their output is written before reading from a terminal, so that prompts
+ * show. A buffer size of 0 makes an unbuffered stream.
+ */
+#define FS_BUFFER_SIZE 4096
+#define FS_BUFFER_MAX 32768
 
-lval llisten_fs(lval * f) {
-    return WaitForSingleObject(o2s(f[1])[3], 0) == WAIT_OBJECT_0 ? TRUE : 0;
+lval fs_sysopen(char *name, lval output);
+lval fs_error(lval * f);
+int fs_sysread(lval * s, char *p, int n);
+int fs_syswrite(lval * s, char *p, int n);
+int fs_interactive(lval fd);
+int fs_ready(lval * s);
+void fs_sysclose(lval * s);
+void fs_sync(lval * s);
+
+char *fs_buffer(lval * s) {
+    return (char *) (s + 9);
 }
 
-lval lread_fs(lval * f) {
-    int l = o2i(f[3]);
-    if (!ReadFile(o2s(f[1])[3],
-              o2z(f[2]) + l, (o2s(f[2])[0] >> 6) - 4 - l, &l, NULL))
-        return 0;
-    return d2o(f, l);
+/**
+ * Writes all n bytes from p, returning nonzero on failure.
+ */
+int fs_write_all(lval * s, char *p, int n) {
+    int l;
+    if (s[3] == 1 || s[3] == 2) {
+        fflush(stdout);
+    }
+    for (; n > 0; p += l, n -= l) {
+        l = fs_syswrite(s, p, n);
+        if (l < 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-lval lwrite_fs(lval * f) {
-    int l = o2i(f[3]);
-    if (!WriteFile(o2s(f[1])[3],
-               o2z(f[2]) + l, o2i(f[4]) - l, &l, NULL))
+int fs_flush(lval * s) {
+    int l = s[7];
+    if (!s[4] || !l) {
         return 0;
-    return d2o(f, l);
+    }
+    s[7] = 0;
+    return fs_write_all(s, fs_buffer(s), l);
 }
 
-lval lfinish_fs(lval * f) {
-    FlushFileBuffers(o2s(f[1])[3]);
-    return 0;
+void fs_flush_all(void) {
+    lval x;
+    for (x = fs_open; x; x = cdr(x)) {
+        fs_flush(o2s(car(x)));
+    }
 }
 
-lval lfasl(lval * f) {
-    HMODULE h;
-    FARPROC s;
-    h = LoadLibrary(o2z(f[1]));
-    s = GetProcAddress(h, "init");
-    return s(f);
+/**
+ * Writes the buffered output of the terminals before waiting for input.
+ */
+void fs_flush_interactive(void) {
+    lval x;
+    for (x = fs_open; x; x = cdr(x)) {
+        if (o2s(car(x))[8]) {
+            fs_flush(o2s(car(x)));
+        }
+    }
 }
 
-lval luname(lval * f) {
-    OSVERSIONINFO osvi;
-    osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
-    GetVersionEx(&osvi);
-    f[1] = cons(f + 1, strf(f + 1, osvi.szCSDVersion), 0);
-    f[1] = cons(f + 1, d2o(f + 1, osvi.dwBuildNumber), f[1]);
-    f[1] = cons(f + 1, d2o(f + 1, osvi.dwMinorVersion), f[1]);
-    return cons(f + 1, d2o(f, osvi.dwMajorVersion), f[1]);
+/**
+ * A new file stream on fd with a buffer of size bytes, or the default size
+ * if size is nil.
+ */
+lval fs_make(lval * g, lval fd, lval output, lval size) {
+    lint n = size ? o2i(size) : FS_BUFFER_SIZE;
+    lval *m = ms0(g, 7 * sizeof(lval) + n);
+    m[1] = 116;
+    m[2] = 1;
+    m[3] = fd;
+    m[4] = output;
+    m[5] = n;
+    m[6] = m[7] = 0;
+    m[8] = fs_interactive(fd);
+    if (output) {
+        g[1] = s2o(m);
+        fs_open = cons(g + 1, g[1], fs_open);
+    }
+    return s2o(m);
 }
 
-#else /* unix */
+/**
+ * Fills the input buffer, returning how many bytes were read or -1.
+ */
+int fs_fill(lval * s) {
+    int l;
+    if (s[8]) {
+        fs_flush_interactive();
+    }
+    l = fs_sysread(s, fs_buffer(s), s[5]);
+    s[6] = 0;
+    s[7] = l > 0 ? l : 0;
+    return l;
+}
 
+/**
+ * (make-file-stream name output size) opens the file name for output if
+ * output is true, for input otherwise, with a buffer of size bytes, at
+ * most FS_BUFFER_MAX so that it fits in one block of heap.
+ */
 lval lmake_fs(lval * f) {
-    int fd = open(o2z(f[1]), f[2] ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0600);
-    return fd >= 0 ? ms(f, 4, 116, 1, fd, f[2], 0) : d2o(f, errno);
+    lval fd;
+    while (f[3] && ((f[3] & 31) != 16 || f[3] < 0
+                    || o2i(f[3]) > FS_BUFFER_MAX)) {
+        dbgr(f + 3, 30, f[3], f + 3);
+    }
+    fd = fs_sysopen(o2z(f[1]), f[2]);
+    return fd != -1 ? fs_make(f + 3, fd, f[2], f[3]) : d2o(f, errno);
 }
 
 lval lclose_fs(lval * f) {
-    close(o2s(f[1])[3]);
+    lval *s = o2s(f[1]), x, *p = &fs_open;
+    fs_flush(s);
+    fs_sysclose(s);
+    for (x = fs_open; x; p = o2c(x) + 1, x = cdr(x)) {
+        if (car(x) == f[1]) {
+            *p = cdr(x);
+            break;
+        }
+    }
+    s[6] = s[7] = 0;
     return 0;
 }
 
 lval llisten_fs(lval * f) {
-    fd_set r;
-    struct timeval t;
-    t.tv_sec = 0;
-    t.tv_usec = 0;
-    FD_ZERO(&r);
-    FD_SET(o2s(f[1])[3], &r);
-    return select(o2s(f[1])[3] + 1, &r, NULL, NULL, &t) ? TRUE : 0;
+    lval *s = o2s(f[1]);
+    return s[6] < s[7] || fs_ready(s) ? TRUE : 0;
 }
 
+/**
+ * (read-file-stream stream string start end) reads into string or an octet
+ * vector from start below end, or its end if end is nil, returning how
+ * many bytes were read, 0 at the end of the file.
+ */
 lval lread_fs(lval * f) {
-    int l = o2i(f[3]);
-    l = read(o2s(f[1])[3], o2z(f[2]) + l,
-         (o2s(f[2])[0] >> 6) - 4 - l);
-    return l < 0 ? cons(f, errno, 0) : d2o(f, l);
-}
-
-lval lwrite_fs(lval * f) {
-    int l = o2i(f[3]);
-    l = write(o2s(f[1])[3],
-          o2z(f[2]) + l, o2i(f[4]) - l);
-    return l < 0 ? cons(f, errno, 0) : d2o(f, l);
+    lval *s = o2s(f[1]);
+    int start = o2i(f[3]);
+    int n = (f[4] ? o2i(f[4]) : (o2s(f[2])[0] >> 6) - 4) - start;
+    int l;
+    if (n <= 0) {
+        return 16;
+    }
+    if (s[6] == s[7] && n >= s[5]) {
+        if (s[8]) {
+            fs_flush_interactive();
+        }
+        l = fs_sysread(s, o2z(f[2]) + start, n);
+        return l < 0 ? fs_error(f) : d2o(f, l);
+    }
+    if (s[6] == s[7] && fs_fill(s) < 0) {
+        return fs_error(f);
+    }
+    l = s[7] - s[6] < n ? s[7] - s[6] : n;
+    memcpy(o2z(f[2]) + start, fs_buffer(s) + s[6], l);
+    s[6] += l;
+    return d2o(f, l);
+}
+
+/**
+ * (write-file-stream stream string start end) writes the characters of
+ * string or the octets of an octet vector from start below end.
+ */
+lval lwrite_fs(lval * f) {
+    lval *s = o2s(f[1]);
+    int start = o2i(f[3]);
+    int n = o2i(f[4]) - start;
+    char *p = o2z(f[2]) + start;
+    if (n > s[5] - s[7] && fs_flush(s)) {
+        return fs_error(f);
+    }
+    if (n >= s[5]) {
+        return fs_write_all(s, p, n) ? fs_error(f) : d2o(f, n);
+    }
+    memcpy(fs_buffer(s) + s[7], p, n);
+    s[7] += n;
+    if (s[8] && memchr(p, 10, n) && fs_flush(s)) {
+        return fs_error(f);
+    }
+    return d2o(f, n);
+}
+
+/**
+ * (read-char-file-stream stream) reads a character, or nil at the end of
+ * the file, or like read-file-stream an error if reading fails.
+ */
+lval lread_char_fs(lval * f) {
+    lval *s = o2s(f[1]);
+    unsigned char c;
+    int l;
+    if (s[6] == s[7]) {
+        if (!s[5]) {
+            if (s[8]) {
+                fs_flush_interactive();
+            }
+            l = fs_sysread(s, (char *) &c, 1);
+            return l < 0 ? fs_error(f) : l ? c << 5 | 24 : 0;
+        }
+        l = fs_fill(s);
+        if (l <= 0) {
+            return l < 0 ? fs_error(f) : 0;
+        }
+    }
+    return (lval) ((unsigned char *) fs_buffer(s))[s[6]++] << 5 | 24;
+}
+
+/**
+ * (unread-char-file-stream stream character) puts back the character last
+ * read if it is still in the buffer, returning nil if it is not.
+ */
+lval lunread_char_fs(lval * f) {
+    lval *s = o2s(f[1]);
+    if (s[6] > 0
+        && ((unsigned char *) fs_buffer(s))[s[6] - 1] == f[2] >> 5) {
+        s[6]--;
+        return TRUE;
+    }
+    return 0;
+}
+
+/**
+ * (write-char-file-stream stream character) writes character.
+ */
+lval lwrite_char_fs(lval * f) {
+    lval *s = o2s(f[1]);
+    char c = (char) (f[2] >> 5);
+    if (!s[5]) {
+        return fs_write_all(s, &c, 1) ? fs_error(f) : f[2];
+    }
+    if (s[7] == s[5] && fs_flush(s)) {
+        return fs_error(f);
+    }
+    fs_buffer(s)[s[7]++] = c;
+    if (s[8] && c == 10 && fs_flush(s)) {
+        return fs_error(f);
+    }
+    return f[2];
 }
 
 lval lfinish_fs(lval * f) {
-    fsync(o2s(f[1])[3]);
+    lval *s = o2s(f[1]);
+    fs_flush(s);
+    fs_sync(s);
+    return 0;
+}
+
+#ifdef _WIN32
+lval fs_sysopen(char *name, lval output) {
+    return (lval) CreateFile(name, output ? GENERIC_WRITE :
+                   GENERIC_READ, output ? FILE_SHARE_WRITE : FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                   FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+lval fs_error(lval * f) {
     return 0;
 }
 
-lval lfasl(lval * f) {
+int fs_sysread(lval * s, char *p, int n) {
+    DWORD l;
+    return ReadFile((HANDLE) s[3], p, n, &l, NULL) ? (int) l : -1;
+}
+
+int fs_syswrite(lval * s, char *p, int n) {
+    DWORD l;
+    return WriteFile((HANDLE) s[3], p, n, &l, NULL) ? (int) l : -1;
+}
+
+int fs_interactive(lval fd) {
+    DWORD mode;
+    return GetConsoleMode((HANDLE) fd, &mode) ? 1 : 0;
+}
+
+int fs_ready(lval * s) {
+    return WaitForSingleObject((HANDLE) s[3], 0) == WAIT_OBJECT_0;
+}
+
+void fs_sysclose(lval * s) {
+    CloseHandle((HANDLE) s[3]);
+}
+
+void fs_sync(lval * s) {
+    FlushFileBuffers((HANDLE) s[3]);
+}
+
+void *fasl_open(lval name) {
+    return LoadLibrary(o2z(name));
+}
+
+void *fasl_symbol(void *h, char *name) {
+    return (void *) GetProcAddress(h, name);
+}
+
+void fasl_close(void *h) {
+    FreeLibrary(h);
+}
+
+lval lensure_private_directory(lval * f) {
+    DWORD a;
+    CreateDirectory(o2z(f[1]), NULL);
+    a = GetFileAttributes(o2z(f[1]));
+    return a != INVALID_FILE_ATTRIBUTES && (a & FILE_ATTRIBUTE_DIRECTORY)
+        && !(a & FILE_ATTRIBUTE_REPARSE_POINT) ? TRUE : 0;
+}
+
+X void *foreign_symbol(lval * f, lval name, lval lib) {
+    HMODULE h;
+    FARPROC s;
+    while (!(h = lib ? LoadLibrary(o2z(lib)) : GetModuleHandle(NULL))) {
+        dbgr(f, 14, lib, &lib);
+    }
+    while (!(s = GetProcAddress(h, o2z(name)))) {
+        dbgr(f, 1, name, &name);
+    }
+    return (void *) s;
+}
+
+lval luname(lval * f) {
+    OSVERSIONINFO osvi;
+    osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
+    GetVersionEx(&osvi);
+    f[1] = cons(f + 1, strf(f + 1, osvi.szCSDVersion), 0);
+    f[1] = cons(f + 1, d2o(f + 1, osvi.dwBuildNumber), f[1]);
+    f[1] = cons(f + 1, d2o(f + 1, osvi.dwMinorVersion), f[1]);
+    return cons(f + 1, d2o(f, osvi.dwMajorVersion), f[1]);
+}
+
+#else /* unix */
+
+lval fs_sysopen(char *name, lval output) {
+    return open(name, output ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0600);
+}
+
+lval fs_error(lval * f) {
+    return cons(f, errno, 0);
+}
+
+int fs_sysread(lval * s, char *p, int n) {
+    return read(s[3], p, n);
+}
+
+int fs_syswrite(lval * s, char *p, int n) {
+    return write(s[3], p, n);
+}
+
+int fs_interactive(lval fd) {
+    return isatty(fd);
+}
+
+int fs_ready(lval * s) {
+    fd_set r;
+    struct timeval t;
+    t.tv_sec = 0;
+    t.tv_usec = 0;
+    FD_ZERO(&r);
+    FD_SET(s[3], &r);
+    return select(s[3] + 1, &r, NULL, NULL, &t) > 0;
+}
+
+void fs_sysclose(lval * s) {
+    close(s[3]);
+}
+
+void fs_sync(lval * s) {
+    fsync(s[3]);
+}
+
+void *fasl_open(lval name) {
+    void *h = dlopen(o2z(name), RTLD_NOW);
+    if (!h) {
+        printf(";%s\n", dlerror());
+    }
+    return h;
+}
+
+void *fasl_symbol(void *h, char *name) {
+    return dlsym(h, name);
+}
+
+void fasl_close(void *h) {
+    dlclose(h);
+}
+
+/**
+ * Creates the directory and its missing parents for the owner only.
+ * True when it is a directory, not a link, that belongs to this user and
+ * that nobody else can write or enter, so that modules kept there can be
+ * trusted.
+ */
+lval lensure_private_directory(lval * f) {
+    char *s = o2z(f[1]);
+    char *p;
+    struct stat st;
+    for (p = s + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(s, 0700);
+            *p = '/';
+        }
+    }
+    mkdir(s, 0700);
+    return !lstat(s, &st) && S_ISDIR(st.st_mode) && st.st_uid == getuid()
+        && !(st.st_mode & 077) ? TRUE : 0;
+}
+
+/**
+ * Address of the C function name in the shared library lib, or in the
+ * program and the libraries it was linked with when lib is nil.
+ */
+X void *foreign_symbol(lval * f, lval name, lval lib) {
     void *h;
-    lval(*s) ();
-    h = dlopen(o2z(f[1]), RTLD_NOW);
-    s = dlsym(h, "init");
-    return s(f);
+    void *s;
+    while (!(h = dlopen(lib ? o2z(lib) : 0, RTLD_NOW))) {
+        printf(";%s\n", dlerror());
+        dbgr(f, 14, lib, &lib);
+    }
+    while (!(s = dlsym(h, o2z(name)))) {
+        dbgr(f, 1, name, &name);
+    }
+    return s;
 }
 
 lval luname(lval * f) {
@@ -1451,6 +2521,50 @@ lval luname(lval * f) {
 }
 #endif
 
+/**
+ * Loads a compiled module and runs its init. Modules record the runtime
+ * ABI they were compiled against and the key they were compiled under;
+ * when a key is given, a module recording another one or another ABI is
+ * unloaded unrun and nil returned.
+ */
+lval lfasl(lval * f, lval * h) {
+    lval key = h - f > 2 ? f[2] : 0;
+    void *m = fasl_open(f[1]);
+    int *abi = m ? fasl_symbol(m, "lisp800_module_abi") : 0;
+    char *k = m ? fasl_symbol(m, "lisp800_module_key") : 0;
+    lval(*s) () = m ? fasl_symbol(m, "init") : 0;
+    if (key && m && !(abi && *abi == LISP800_ABI_VERSION && k
+                      && strlen(k) == (size_t) (o2s(key)[0] / 64 - 4)
+                      && !memcmp(k, o2z(key), strlen(k)))) {
+        fasl_close(m);
+        return 0;
+    }
+    if (!s || !abi || *abi != LISP800_ABI_VERSION) {
+        if (m) {
+            fasl_close(m);
+        }
+        dbgr(f + 1, 14, f[1], &f[1]);
+        return 0;
+    }
+    return s(f);
+}
+
+lval lfasl_version(lval * f) {
+    return LISP800_ABI_VERSION << 5 | 16;
+}
+
+lval lposix_getenv(lval * f) {
+    char *s = getenv(o2z(f[1]));
+    return s ? strf(f, s) : 0;
+}
+
+lval ldelete_file(lval * f) {
+    while (remove(o2z(f[1]))) {
+        dbgr(f + 1, 14, f[1], &f[1]);
+    }
+    return TRUE;
+}
+
 FILE *ins;
 
 void load(lval * f, char *s) {
@@ -1466,8 +2580,18 @@ void load(lval * f, char *s) {
     ins = oldins;
 }
 
+/**
+ * Loads a source file, or a compiled module named *.so or *.dll.
+ */
 lval lload(lval * f) {
-    load(f, o2z(f[1]));
+    char *s = o2z(f[1]);
+    size_t n = strlen(s);
+    if ((n > 3 && !strcmp(s + n - 3, ".so"))
+        || (n > 4 && !strcmp(s + n - 4, ".dll"))) {
+        lfasl(f, f + 2);
+        return symi[1].sym;
+    }
+    load(f, s);
     return symi[1].sym;
 }
 
@@ -1475,9 +2599,13 @@ lval lstring_equal(lval * f) {
     return string_equal(f[1], f[2]) ? TRUE : 0;
 }
 
+/**
+ * The environment goes to the free slot at h: the slot below f belongs
+ * to the caller, which may still need its own environment.
+ */
 lval leval(lval * f, lval * h) {
-    f[-1] = h - f > 2 ? f[2] : 0;
-    return eval(f - 1, f[1]);
+    *h = h - f > 2 ? f[2] : 0;
+    return eval(h, f[1]);
 }
 
 void psym(lval p, lval n) {
@@ -1663,6 +2791,7 @@ int ep(lval * g, lval expr) {
     if (car(v) == 8) {
         return 0;
     }
+    fs_flush_all();
     if (v) {
         for (i = 0; v; v = cdr(v)) {
             printf(";%d: ", i++);
@@ -1685,10 +2814,20 @@ char *exmsg[] = {
     "too many arguments",
     "too few arguments",
     "dynamic extent of block exited",
-    "dynamic extent of tagbody exited"
+    "dynamic extent of tagbody exited",
+    "stack exhausted",
+    "interrupted",
+    "deadline exceeded",
+    "package not found",
+    "cannot load compiled module",
+    "not a fixnum",
+    "not a number",
+    "not a simple-vector",
+    "not a simple-string",
+    "not a hash-table"
 };
 
-int dbgr(lval * f, int x, lval val, lval * vp) {
+X int dbgr(lval * f, int x, lval val, lval * vp) {
     lval ex;
     int i;
     lval *h = f;
@@ -1759,7 +2898,7 @@ lval evca(lval * f, lval co) {
         lval fn = 8;
         if (ap(car(ex)) && o2a(car(ex))[1] == 20) {
             int i = o2a(car(ex))[7] >> 3;
-            if (i > 11 && i < 34)
+            if (i == 10 || (i > 11 && i < 34))
                 return symi[i].fun(f, cdr(ex));
             fn = *binding(f, car(ex), 1, &m);
             if (m) {
@@ -1839,94 +2978,2802 @@ lval read_string_list(lval * g) {
     return cons(g, (c << 5) | 24, read_string_list(g));
 }
 
-unsigned hash(lval s) {
-    unsigned char * z = (unsigned char *) o2z(s);
-    unsigned i = 0, h = 0, g;
-    while (i < o2s(s)[0] / 64 - 4) {
-        h = (h << 4) + z[i++];
-        g = h & 0xf0000000;
-        if (g) {
-            h = h ^ (g >> 24) ^ g;
-	}
+/**
+ * Hashes the bytes of a string four at a time, folding the odd tail bytes
+ * into one last word.
+ */
+unsigned hash_bytes(unsigned char *z, lint n) {
+    lint i = 0;
+    unsigned h = (unsigned) n, t = 0, w;
+    for (; i + 4 <= n; i += 4) {
+        memcpy(&w, z + i, 4);
+        h = (h ^ w) * 0x9e3779b1u;
+        h ^= h >> 15;
     }
-    return h;
+    for (; i < n; i++) {
+        t = t << 8 | z[i];
+    }
+    h = (h ^ t) * 0x9e3779b1u;
+    return h ^ h >> 16;
+}
+
+unsigned hash(lval s) {
+    return hash_bytes((unsigned char *) o2z(s), o2s(s)[0] / 64 - 4);
 }
 
 lval lhash(lval * f) {
     return d2o(f, hash(f[1]));
 }
 
-lval make_symbol(lval * g, lval p, lval s) {
-    int h = hash(s) % 1021;
-    int i = 3;
-    lval m;
-    for (; i < 5; i++) {
-        m = o2a(o2a(p)[i])[2 + h];
-        for (; m; m = cdr(m)) {
-            lval y = car(m);
-            if (string_equal(o2a(y)[2], s)) {
-                return o2a(y)[7] ? y : 0;
+/**
+ * Equality and hashing.
+ * </p>
+ * EQUAL and EQUALP walk conses iteratively, keeping the cdrs still to be
+ * compared on the lisp stack above g, so only nesting through cars uses
+ * stack. SXHASH and the EQUALP hash look at no more than HASH_BUDGET
+ * conses and array elements in all, which also stops them on circular
+ * structures.
+ */
+
+#define HASH_BUDGET 64
+
+unsigned mix(unsigned h) {
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+}
+
+int eql(lval a, lval b) {
+    return a == b || (sp(a) && sp(b) && o2s(a)[1] == 84 && o2s(b)[1] == 84
+                      && o2d(a) == o2d(b));
+}
+
+/**
+ * Bit vectors.
+ * </p>
+ * Bits are kept 32 to the word from bit 0 up, and the bits past the end of
+ * the last word are not cleared, so whole-word loops mask that word. The
+ * population count and the bit scans use the compiler's builtins where
+ * there are any.
+ */
+
+int popcount(unsigned w) {
+#ifdef __GNUC__
+    return __builtin_popcount(w);
+#else
+    w = w - (w >> 1 & 0x55555555u);
+    w = (w & 0x33333333u) + (w >> 2 & 0x33333333u);
+    return (int) (((w + (w >> 4)) & 0x0f0f0f0fu) * 0x01010101u >> 24);
+#endif
+}
+
+/**
+ * The index of the lowest and of the highest set bit of w, which is not 0.
+ */
+int lowest_bit(unsigned w) {
+#ifdef __GNUC__
+    return __builtin_ctz(w);
+#else
+    int i = 0;
+    for (; !(w & 1); w >>= 1, i++);
+    return i;
+#endif
+}
+
+int highest_bit(unsigned w) {
+#ifdef __GNUC__
+    return 31 - __builtin_clz(w);
+#else
+    int i = 31;
+    for (; !(w & 0x80000000u); w <<= 1, i--);
+    return i;
+#endif
+}
+
+/**
+ * Word k of the bits of d from start below end, with the bits outside them
+ * cleared, flipped first if bit is 0 so that the wanted bits are set.
+ */
+unsigned bits_word(lval d, lint k, lint start, lint end, int bit) {
+    unsigned w = (unsigned) o2s(d)[2 + k];
+    if (!bit) {
+        w = ~w;
+    }
+    if (k == start / 32) {
+        w &= ~0u << (start & 31);
+    }
+    if (k == (end - 1) / 32 && end & 31) {
+        w &= (1u << (end & 31)) - 1;
+    }
+    return w;
+}
+
+lint bits_count(lval d, lint start, lint end, int bit) {
+    lint k, n = 0;
+    for (k = start / 32; start < end && k <= (end - 1) / 32; k++) {
+        n += popcount(bits_word(d, k, start, end, bit));
+    }
+    return n;
+}
+
+/**
+ * The index of the first, or last, bit from start below end that is bit,
+ * -1 if there is none.
+ */
+lint bits_find(lval d, lint start, lint end, int bit, int from_end) {
+    lint k;
+    unsigned w;
+    if (start >= end) {
+        return -1;
+    }
+    if (from_end) {
+        for (k = (end - 1) / 32; k >= start / 32; k--) {
+            if ((w = bits_word(d, k, start, end, bit)) != 0) {
+                return k * 32 + highest_bit(w);
+            }
+        }
+    } else {
+        for (k = start / 32; k <= (end - 1) / 32; k++) {
+            if ((w = bits_word(d, k, start, end, bit)) != 0) {
+                return k * 32 + lowest_bit(w);
             }
         }
     }
-    m = ma(g, 9, 20, s, 0, 8, 8, 8, -8, 16, p, 0);
-    if (p == kwp) {
-        o2a(m)[4] = m;
-    }
+    return -1;
+}
 
-    o2a(o2a(p)[3])[2 + h] = cons(g, m, o2a(o2a(p)[3])[2 + h]);
-    return m;
+int bits_equal(lval a, lval b) {
+    lint n = o2s(a)[0] / 8 - 31, k;
+    for (k = 0; k < (n + 31) / 32; k++) {
+        if (bits_word(a, k, 0, n, 1) != bits_word(b, k, 0, n, 1)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-lval read_symbol(lval * g) {
-    int c = getc(ins);
-    if (isspace(c) || c == ')' || c == EOF) {
-        if (c != EOF) {
-            ungetc(c, ins);
-	}
+int vector_storage(lval v, lval * d, lint * o, lint * n);
+
+/**
+ * The simple string or bit-vector holding the active elements of string or
+ * bit vector o, their offset in it and how many there are; nonzero if o is
+ * one. Displacements are followed to the end.
+ */
+int equal_storage(lval o, lval * d, lint * k, lint * n) {
+    if (!vector_storage(o, d, k, n)
+        && !(ap(o) && o2a(o)[1] == 148 && !cp(o2a(o)[3]))) {
         return 0;
-    } 
-    if (c > 96 && c < 123) {
-        c -= 32;
     }
-    return cons(g, (c << 5) | 24, read_symbol(g));
+    for (; ap(*d) && o2a(*d)[1] == 148; *d = o2a(*d)[4]) {
+        *k += o2a(*d)[5] ? o2i(o2a(*d)[5]) : 0;
+    }
+    return sp(*d) && (o2s(*d)[1] == 20 || o2s(*d)[1] == 116);
 }
 
-lval list2(lval * g, int a) {
-    return l2(g, symi[a].sym, lread(g));
+lint bit_at(lval d, lint i) {
+    return o2s(d)[2 + i / 32] >> (i & 31) & 1;
 }
 
-lval lread(lval * g) {
-    int c = getnws();
-    if (c == EOF) {
-        return 8;
+/**
+ * Equal for atoms that are not eql, which are strings and bit vectors.
+ */
+int equal_atoms(lval a, lval b) {
+    lval da, db;
+    lint ka, kb, na, nb, i;
+    if (sp(a) && sp(b)) {
+        return o2s(a)[0] == o2s(b)[0] && o2s(a)[1] == o2s(b)[1]
+            && (o2s(a)[1] == 20 ? string_equal_do(a, b)
+                : o2s(a)[1] == 116 && bits_equal(a, b));
     }
-    if (c == '(')
-        return read_list(g);
-    if (c == '\"')
-        return stringify(g, read_string_list(g));
-    if (c == '\'')
-        return list2(g, 12);
-    if (c == '#') {
-        c = getnws();
-        if (c == '\'') {
-            return list2(g, 20);
-        }
+    if (!equal_storage(a, &da, &ka, &na) || !equal_storage(b, &db, &kb, &nb)
+        || na != nb || o2s(da)[1] != o2s(db)[1]) {
         return 0;
     }
-    if (c == '`') {
-        return list2(g, 38);
+    if (o2s(da)[1] == 20) {
+        return !memcmp(o2z(da) + ka, o2z(db) + kb, na);
     }
-    if (c == ',') {
-        c = getnws();
-        if (c == '@') {
-            return list2(g, 40);
+    for (i = 0; i < na; i++) {
+        if (bit_at(da, ka + i) != bit_at(db, kb + i)) {
+            return 0;
         }
-        ungetc(c, ins);
-        return list2(g, 39);
     }
-    ungetc(c, ins);
-    if (isdigit(c)) {
+    return 1;
+}
+
+int equal(lval * g, lval a, lval b) {
+    lval *s = g;
+    for (;;) {
+        if (cp(a) && cp(b) && a != b) {
+            s[1] = cdr(a);
+            s[2] = cdr(b);
+            s += 2;
+            a = car(a);
+            b = car(b);
+            continue;
+        }
+        if (!eql(a, b) && !equal_atoms(a, b)) {
+            return 0;
+        }
+        if (s == g) {
+            return 1;
+        }
+        a = s[-1];
+        b = s[0];
+        s -= 2;
+    }
+}
+
+int upcase(lint c) {
+    return c < 256 ? toupper((int) c) : (int) c;
+}
+
+/**
+ * Finds the simple array holding the elements of array o, if o is an array,
+ * and its total size. The elements of a nil array are not looked at.
+ */
+int array_data(lval o, lval * d, lint * n) {
+    if (sp(o) && (o2s(o)[1] == 20 || o2s(o)[1] == 116 || o2s(o)[1] == 148)) {
+        *d = o;
+        *n = o2s(o)[1] != 116 ? o2s(o)[0] / 64 - 4 : o2s(o)[0] / 8 - 31;
+        return 1;
+    }
+    if (!ap(o) || (o2a(o)[1] != 116 && o2a(o)[1] != 148
+                   && o2a(o)[1] != 244)) {
+        return 0;
+    }
+    *n = o2a(o)[1] == 116 ? o2a(o)[0] >> 8 : o2a(o)[2] >> 5;
+    for (*d = o; ap(*d) && o2a(*d)[1] == 148; *d = o2a(*d)[4]);
+    if (!sp(*d) && !(ap(*d) && o2a(*d)[1] == 116)) {
+        *d = 0;
+    }
+    return 1;
+}
+
+/**
+ * The dimensions of an array of rank other than one, nil otherwise.
+ */
+lval array_dims(lval o) {
+    return ap(o) && o2a(o)[1] != 116 && cp(o2a(o)[3]) ? o2a(o)[3] : 0;
+}
+
+lval array_elt(lval d, lint i) {
+    if (ap(d)) {
+        return o2a(d)[2 + i];
+    }
+    if (o2s(d)[1] == 20) {
+        return ((unsigned char *) o2z(d))[i] << 5 | 24;
+    }
+    if (o2s(d)[1] == 148) {
+        return ((unsigned char *) o2z(d))[i] << 5 | 16;
+    }
+    return (o2s(d)[2 + i / 32] >> (i & 31) & 1) << 5 | 16;
+}
+
+int equalp(lval * g, lval a, lval b);
+
+/**
+ * Equalp for atoms that are not eql: characters, arrays, and structures
+ * of the same class.
+ */
+int equalp_atoms(lval * g, lval a, lval b) {
+    lval da, db;
+    lint na, nb, i;
+    if ((a & 31) == 24) {
+        return (b & 31) == 24 && upcase(a >> 5) == upcase(b >> 5);
+    }
+    if (array_data(a, &da, &na)) {
+        if (!array_data(b, &db, &nb) || na != nb
+            || !equal(g, array_dims(a), array_dims(b))) {
+            return 0;
+        }
+        if (!da || !db) {
+            return !na;
+        }
+        for (i = 0; i < na; i++) {
+            if (!equalp(g, array_elt(da, i), array_elt(db, i))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (!ap(a) || !ap(b) || (o2a(a)[1] & 3) != 2 || o2a(a)[1] != o2a(b)[1]) {
+        return 0;
+    }
+    for (i = 0; i < o2a(a)[0] >> 8; i++) {
+        if (!equalp(g, o2a(a)[2 + i], o2a(b)[2 + i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int equalp(lval * g, lval a, lval b) {
+    lval *s = g;
+    for (;;) {
+        if (cp(a) && cp(b) && a != b) {
+            s[1] = cdr(a);
+            s[2] = cdr(b);
+            s += 2;
+            a = car(a);
+            b = car(b);
+            continue;
+        }
+        if (!eql(a, b) && !equalp_atoms(s, a, b)) {
+            return 0;
+        }
+        if (s == g) {
+            return 1;
+        }
+        a = s[-1];
+        b = s[0];
+        s -= 2;
+    }
+}
+
+unsigned hash_eql(lval o) {
+    if (sp(o) && o2s(o)[1] == 84) {
+        return mix((unsigned) o2s(o)[2] ^ mix((unsigned) o2s(o)[3]));
+    }
+    return mix((unsigned) o);
+}
+
+unsigned hash_equal(lval o, int *budget) {
+    unsigned h = 7, w;
+    lval d;
+    lint k, n;
+    if (equal_storage(o, &d, &k, &n)) {
+        if (o2s(d)[1] == 20) {
+            return mix(hash_bytes((unsigned char *) o2z(d) + k, n));
+        }
+        w = n ? (unsigned) o2s(d)[2 + k / 32] >> (k & 31) : 0;
+        if (k & 31 && (k & 31) + n > 32) {
+            w |= (unsigned) o2s(d)[3 + k / 32] << (32 - (k & 31));
+        }
+        return mix(n * 31 + (w & (n < 32 ? (1u << n) - 1 : ~0u)));
+    }
+    if (!cp(o)) {
+        return hash_eql(o);
+    }
+    for (; cp(o) && --*budget > 0; o = cdr(o)) {
+        h = mix(h * 31 + hash_equal(car(o), budget));
+    }
+    return cp(o) ? h : mix(h * 31 + hash_equal(o, budget));
+}
+
+unsigned hash_equalp(lval o, int *budget) {
+    unsigned h = 7;
+    lval d;
+    lint n, i;
+    if ((o & 31) == 24) {
+        return mix(upcase(o >> 5));
+    }
+    if (array_data(o, &d, &n)) {
+        h = mix((unsigned) n);
+        for (i = 0; d && i < n && --*budget > 0; i++) {
+            h = mix(h * 31 + hash_equalp(array_elt(d, i), budget));
+        }
+        return h;
+    }
+    if (ap(o) && (o2a(o)[1] & 3) == 2) {
+        return mix((unsigned) o2a(o)[1]);
+    }
+    if (!cp(o)) {
+        return hash_eql(o);
+    }
+    for (; cp(o) && --*budget > 0; o = cdr(o)) {
+        h = mix(h * 31 + hash_equalp(car(o), budget));
+    }
+    return cp(o) ? h : mix(h * 31 + hash_equalp(o, budget));
+}
+
+lval sxhash(lval o) {
+    int budget = HASH_BUDGET;
+    return (lval) (hash_equal(o, &budget) & 0x3ffffff) << 5 | 16;
+}
+
+lval leql(lval * f) {
+    return eql(f[1], f[2]) ? TRUE : 0;
+}
+
+lval lequal(lval * f, lval * h) {
+    return equal(h, f[1], f[2]) ? TRUE : 0;
+}
+
+lval lequalp(lval * f, lval * h) {
+    return equalp(h, f[1], f[2]) ? TRUE : 0;
+}
+
+lval lsxhash(lval * f) {
+    return sxhash(f[1]);
+}
+
+/**
+ * Hash tables.
+ * </p>
+ * A hash table is a structure of class *HASH-TABLE* holding [2] the count,
+ * [3] the rehash size, [4] the rehash threshold, [5] the test name, [6] the
+ * test number (0 eq, 1 eql, 2 equal, 3 equalp), [7] the entries, [8] the
+ * entries it is growing out of, [9] how many of those have been moved and
+ * [10] how many entries are in use, removed ones included.
+ * </p>
+ * Entries are hash, key and value triples, a power of two of them, probed
+ * linearly; a nil hash marks a free entry and an unbound one a removed entry.
+ * They are kept in simple-vectors of at most 256 triples, themselves held by
+ * a simple-vector, since the heap rarely has room for one large block. A full
+ * table is not rehashed at once: every new key moves a few of the old
+ * entries over and lookups search the old entries until they are all gone,
+ * so no single insertion pays for the whole table.
+ */
+
+lval ht_hash(lval ht, lval key) {
+    int budget = HASH_BUDGET;
+    switch (o2a(ht)[6] >> 5) {
+    case 0:
+        return (lval) (mix((unsigned) key) & 0x3ffffff) << 5 | 16;
+    case 1:
+        return (lval) (hash_eql(key) & 0x3ffffff) << 5 | 16;
+    case 2:
+        return sxhash(key);
+    default:
+        return (lval) (hash_equalp(key, &budget) & 0x3ffffff) << 5 | 16;
+    }
+}
+
+int ht_same(lval * g, lval ht, lval a, lval b) {
+    switch (o2a(ht)[6] >> 5) {
+    case 0:
+        return a == b;
+    case 1:
+        return eql(a, b);
+    case 2:
+        return equal(g, a, b);
+    default:
+        return equalp(g, a, b);
+    }
+}
+
+lint ht_capacity(lval v) {
+    return (o2a(v)[0] >> 8) * ((o2a(o2a(v)[2])[0] >> 8) / 3);
+}
+
+lval *ht_entry(lval v, lint i) {
+    return o2a(o2a(v)[2 + (i >> 8)]) + 2 + 3 * (i & 255);
+}
+
+lval *ht_find(lval * g, lval ht, lval v, lval hv, lval key) {
+    lint m, i;
+    lval *e;
+    if (!v) {
+        return 0;
+    }
+    m = ht_capacity(v) - 1;
+    for (i = hv >> 5 & m;; i = (i + 1) & m) {
+        e = ht_entry(v, i);
+        if (!e[0]) {
+            return 0;
+        }
+        if (e[0] == hv && ht_same(g, ht, e[1], key)) {
+            return e;
+        }
+    }
+}
+
+lval *ht_lookup(lval * g, lval ht, lval hv, lval key) {
+    lval *e = ht_find(g, ht, o2a(ht)[7], hv, key);
+    return e ? e : ht_find(g, ht, o2a(ht)[8], hv, key);
+}
+
+/**
+ * Stores a key that is known not to be in the table.
+ */
+void ht_put(lval ht, lval hv, lval key, lval value) {
+    lval v = o2a(ht)[7];
+    lint m = ht_capacity(v) - 1;
+    lint i = hv >> 5 & m;
+    lval *e = ht_entry(v, i);
+    while (e[0] && e[0] != 8) {
+        i = (i + 1) & m;
+        e = ht_entry(v, i);
+    }
+    if (!e[0]) {
+        o2a(ht)[10] += 32;
+    }
+    e[0] = hv;
+    e[1] = key;
+    e[2] = value;
+}
+
+/**
+ * Moves the next n old entries into the table.
+ */
+void ht_migrate(lval ht, lint n) {
+    lval old = o2a(ht)[8];
+    lint i = o2a(ht)[9] >> 5;
+    lint end;
+    lval *e;
+    if (!old) {
+        return;
+    }
+    end = ht_capacity(old);
+    for (; n > 0 && i < end; n--, i++) {
+        e = ht_entry(old, i);
+        if (e[0] && e[0] != 8) {
+            ht_put(ht, e[0], e[1], e[2]);
+            e[0] = 8;
+        }
+    }
+    o2a(ht)[8] = i < end ? old : 0;
+    o2a(ht)[9] = i < end ? i << 5 | 16 : 16;
+}
+
+/**
+ * Allocates empty entries for n keys, rooting them in g[1].
+ */
+lval ht_entries(lval * g, lint n) {
+    lint k, l = n > 256 ? n / 256 : 1;
+    lval *v, *s;
+    v = ma0(g, l);
+    v[1] = 116;
+    memset(v + 2, 0, l * sizeof(lval));
+    g[1] = a2o(v);
+    for (k = 0; k < l; k++) {
+        s = ma0(g + 1, 3 * (n / l));
+        s[1] = 116;
+        memset(s + 2, 0, 3 * (n / l) * sizeof(lval));
+        v[2 + k] = a2o(s);
+    }
+    return g[1];
+}
+
+void ht_grow(lval * g, lval ht) {
+    lint n = ht_capacity(o2a(ht)[7]);
+    ht_migrate(ht, n);
+    if ((o2a(ht)[2] >> 5) * 2 >= n) {
+        n *= 2;
+    }
+    o2a(ht)[8] = o2a(ht)[7];
+    o2a(ht)[7] = ht_entries(g, n);
+    o2a(ht)[9] = 16;
+    o2a(ht)[10] = 16;
+}
+
+/**
+ * Adds a key that is known not to be in the table, growing it first if
+ * need be. The caller keeps key and value reachable.
+ */
+void ht_add(lval * g, lval ht, lval hv, lval key, lval value) {
+    if ((o2a(ht)[10] >> 5) * 4 >= ht_capacity(o2a(ht)[7]) * 3) {
+        ht_grow(g, ht);
+    }
+    ht_migrate(ht, 8);
+    ht_put(ht, hv, key, value);
+    o2a(ht)[2] += 32;
+}
+
+lval hash_table_arg(lval * g, lval x) {
+    while (!ap(x) || (o2a(x)[1] & ~4) != o2a(symi[97].sym)[4]) {
+        dbgr(g, 19, x, &x);
+    }
+    return x;
+}
+
+lval lgethash(lval * f, lval * h) {
+    lval *e;
+    f[2] = hash_table_arg(h, f[2]);
+    e = ht_lookup(h, f[2], ht_hash(f[2], f[1]), f[1]);
+    return mvalues(e ? l2(h, e[2], TRUE)
+                   : l2(h, h - f > 3 ? f[3] : 0, 0));
+}
+
+lval setfgethash(lval * f, lval * h) {
+    lval hv;
+    lval *e;
+    lval ht = f[3] = hash_table_arg(h, f[3]);
+    hv = ht_hash(ht, f[2]);
+    e = ht_lookup(h, ht, hv, f[2]);
+    if (e) {
+        return e[2] = f[1];
+    }
+    ht_add(h, ht, hv, f[2], f[1]);
+    return f[1];
+}
+
+lval lremhash(lval * f, lval * h) {
+    lval *e;
+    f[2] = hash_table_arg(h, f[2]);
+    e = ht_lookup(h, f[2], ht_hash(f[2], f[1]), f[1]);
+    if (!e) {
+        return 0;
+    }
+    e[0] = 8;
+    e[1] = e[2] = 0;
+    o2a(f[2])[2] -= 32;
+    return TRUE;
+}
+
+lval lclrhash(lval * f, lval * h) {
+    lval ht = f[1] = hash_table_arg(h, f[1]);
+    lval v = o2a(ht)[7];
+    lint k;
+    for (k = 0; k < o2a(v)[0] >> 8; k++) {
+        lval s = o2a(v)[2 + k];
+        memset(o2a(s) + 2, 0, (o2a(s)[0] >> 8) * sizeof(lval));
+    }
+    o2a(ht)[2] = 16;
+    o2a(ht)[8] = 0;
+    o2a(ht)[9] = 16;
+    o2a(ht)[10] = 16;
+    return ht;
+}
+
+/**
+ * Sorting.
+ * </p>
+ * Lists are merge sorted bottom-up by relinking their conses: sorted runs
+ * of 1, 2, 4... cells wait in bins on the lisp stack like the digits of a
+ * binary counter, so nothing is consed. Simple-vectors are sorted by
+ * insertion into runs of SORT_RUN elements which are then merged pairwise,
+ * the shorter run of each pair being copied to a scratch vector of at most
+ * SORT_SCRATCH elements. Pairs whose shorter run is longer than that are
+ * first cut by a binary search and a rotation into two pairs to merge on
+ * their own. Both sorts are stable, so SORT and STABLE-SORT share them.
+ * </p>
+ * p points to the predicate, the key or nil and a kind naming a predicate
+ * that is compared inline when both keys allow it: 1 for <, 2 for >, 3 for
+ * STRING< and 4 for STRING>. Everything else is called.
+ */
+#define SORT_RUN 16
+#define SORT_SCRATCH 512
+
+int sort_number(lval o) {
+    return (o & 31) == 16 || (sp(o) && o2s(o)[1] == 84);
+}
+
+int sort_string(lval o) {
+    return sp(o) && o2s(o)[1] == 20;
+}
+
+int string_compare(lval a, lval b) {
+    lint m = o2s(a)[0] / 64 - 4;
+    lint n = o2s(b)[0] / 64 - 4;
+    int c = memcmp(o2z(a), o2z(b), m < n ? m : n);
+    return c ? c : m < n ? -1 : m > n;
+}
+
+int sort_before(lval * g, lval * p, lval a, lval b) {
+    if (p[1]) {
+        g[3] = a;
+        g[1] = call(g + 1, p[1], 1);
+        g[4] = b;
+        g[2] = call(g + 2, p[1], 1);
+        a = g[1];
+        b = g[2];
+    }
+    switch (p[2] >> 5) {
+    case 1:
+    case 2:
+        if (sort_number(a) && sort_number(b)) {
+            return p[2] >> 5 == 1 ? o2d(a) < o2d(b) : o2d(a) > o2d(b);
+        }
+        break;
+    case 3:
+    case 4:
+        if (sort_string(a) && sort_string(b)) {
+            return p[2] >> 5 == 3 ? string_compare(a, b) < 0
+                : string_compare(a, b) > 0;
+        }
+        break;
+    }
+    g[2] = a;
+    g[3] = b;
+    return call(g, p[0], 2) != 0;
+}
+
+/**
+ * Merges the sorted lists a and b, taking from b only what comes strictly
+ * before the head of a.
+ */
+lval merge_lists(lval * g, lval * p, lval a, lval b) {
+    lval c, tail = 0;
+    g[1] = 0;
+    g[2] = a;
+    g[3] = b;
+    while (g[2] && g[3]) {
+        if (sort_before(g + 3, p, car(g[3]), car(g[2]))) {
+            c = g[3];
+            g[3] = cdr(c);
+        } else {
+            c = g[2];
+            g[2] = cdr(c);
+        }
+        if (tail) {
+            set_cdr(tail, c);
+        } else {
+            g[1] = c;
+        }
+        tail = c;
+    }
+    c = g[2] ? g[2] : g[3];
+    if (tail) {
+        set_cdr(tail, c);
+    } else {
+        g[1] = c;
+    }
+    return g[1];
+}
+
+lval sort_list(lval * g, lval * p, lval l) {
+    lval *bins = g + 1;
+    lval c;
+    int i, n = 0;
+    memset(bins, 0, 32 * sizeof(lval));
+    g[33] = l;
+    while (g[33]) {
+        c = g[33];
+        g[33] = cdr(c);
+        set_cdr(c, 0);
+        g[34] = c;
+        for (i = 0; bins[i]; i++) {
+            g[34] = merge_lists(g + 34, p, bins[i], g[34]);
+            bins[i] = 0;
+        }
+        bins[i] = g[34];
+        n = i < n ? n : i + 1;
+    }
+    g[34] = 0;
+    for (i = 0; i < n; i++) {
+        if (bins[i]) {
+            g[34] = merge_lists(g + 34, p, bins[i], g[34]);
+        }
+    }
+    return g[34];
+}
+
+/**
+ * Reverses x[lo..hi).
+ */
+void reverse_run(lval * x, lint lo, lint hi) {
+    lval c;
+    for (hi--; lo < hi; lo++, hi--) {
+        c = x[lo];
+        x[lo] = x[hi];
+        x[hi] = c;
+    }
+}
+
+/**
+ * Merges the sorted runs x[lo..mid) and x[mid..hi) through t, which has
+ * room for tn elements.
+ */
+void merge_runs(lval * g, lval * p, lval * x, lval * t, lint tn, lint lo,
+                lint mid, lint hi) {
+    lint i, j, k, a, b;
+    if (lo == mid || mid == hi || !sort_before(g, p, x[mid], x[mid - 1])) {
+        return;
+    }
+    if (mid - lo > tn && hi - mid > tn) {
+        if (mid - lo >= hi - mid) {
+            i = lo + (mid - lo) / 2;
+            for (a = mid, b = hi; a < b;) {
+                k = a + (b - a) / 2;
+                if (sort_before(g, p, x[k], x[i])) {
+                    a = k + 1;
+                } else {
+                    b = k;
+                }
+            }
+            j = a;
+        } else {
+            j = mid + (hi - mid) / 2;
+            for (a = lo, b = mid; a < b;) {
+                k = a + (b - a) / 2;
+                if (sort_before(g, p, x[j], x[k])) {
+                    b = k;
+                } else {
+                    a = k + 1;
+                }
+            }
+            i = a;
+        }
+        reverse_run(x, i, mid);
+        reverse_run(x, mid, j);
+        reverse_run(x, i, j);
+        k = i + j - mid;
+        merge_runs(g, p, x, t, tn, lo, i, k);
+        merge_runs(g, p, x, t, tn, k, j, hi);
+        return;
+    }
+    if (mid - lo <= hi - mid) {
+        memcpy(t, x + lo, (mid - lo) * sizeof(lval));
+        for (i = 0, j = mid, k = lo; i < mid - lo && j < hi; k++) {
+            x[k] = sort_before(g, p, x[j], t[i]) ? x[j++] : t[i++];
+        }
+        memcpy(x + k, t + i, (mid - lo - i) * sizeof(lval));
+    } else {
+        memcpy(t, x + mid, (hi - mid) * sizeof(lval));
+        for (i = mid - 1, j = hi - mid - 1, k = hi - 1; i >= lo && j >= 0;
+             k--) {
+            x[k] = sort_before(g, p, t[j], x[i]) ? x[i--] : t[j--];
+        }
+        memcpy(x + lo, t, (j + 1) * sizeof(lval));
+    }
+}
+
+/**
+ * Sorts elements start to end of the simple-vector v, which the caller
+ * keeps reachable.
+ */
+void sort_vector(lval * g, lval * p, lval v, lint start, lint end) {
+    lint n = end - start;
+    lint i, j, lo, w, tn = n / 2 < SORT_SCRATCH ? n / 2 : SORT_SCRATCH;
+    lval *x, *t;
+    if (n < 2) {
+        return;
+    }
+    t = ma0(g, tn);
+    t[1] = 116;
+    memset(t + 2, 0, tn * sizeof(lval));
+    g[1] = a2o(t);
+    x = o2a(v) + 2;
+    for (lo = start; lo < end; lo += SORT_RUN) {
+        for (i = lo + 1; i < lo + SORT_RUN && i < end; i++) {
+            g[2] = x[i];
+            for (j = i; j > lo && sort_before(g + 2, p, g[2], x[j - 1]); j--) {
+                x[j] = x[j - 1];
+            }
+            x[j] = g[2];
+        }
+    }
+    for (w = SORT_RUN; w < n; w *= 2) {
+        for (lo = start; lo + w < end; lo += 2 * w) {
+            merge_runs(g + 2, p, x, t + 2, tn, lo, lo + w,
+                       lo + 2 * w < end ? lo + 2 * w : end);
+        }
+    }
+}
+
+lval lsort_list(lval * f, lval * h) {
+    return sort_list(h, f + 2, f[1]);
+}
+
+lval lsort_vector(lval * f, lval * h) {
+    sort_vector(h, f + 2, f[1], o2i(f[5]), o2i(f[6]));
+    return f[1];
+}
+
+lval lmerge_lists(lval * f, lval * h) {
+    return merge_lists(h, f + 3, f[1], f[2]);
+}
+
+/**
+ * Strings.
+ * </p>
+ * Comparison, search and case conversion run over the bytes of the simple
+ * strings holding the characters. They go four bytes to the word where
+ * they can, and otherwise use memcmp and memchr, which the C library
+ * vectorises. Case folding is ASCII only, as in CHAR-UPCASE.
+ */
+
+int fold_byte(int c) {
+    return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+/**
+ * The index of the first of the n bytes at a and b that differ, ignoring
+ * case if fold is set, or n.
+ */
+lint bytes_mismatch(const unsigned char *a, const unsigned char *b,
+                    lint n, int fold) {
+    lint i = 0, k;
+    unsigned x, y;
+    for (; i + (lint) sizeof x <= n; i += sizeof x) {
+        memcpy(&x, a + i, sizeof x);
+        memcpy(&y, b + i, sizeof y);
+        if (x != y) {
+            if (!fold) {
+                break;
+            }
+            for (k = i; k < i + (lint) sizeof x
+                     && fold_byte(a[k]) == fold_byte(b[k]); k++);
+            if (k < i + (lint) sizeof x) {
+                return k;
+            }
+        }
+    }
+    for (; i < n && (fold ? fold_byte(a[i]) == fold_byte(b[i])
+                     : a[i] == b[i]); i++);
+    return i;
+}
+
+/**
+ * Where the m bytes of needle first, or last, occur in the n bytes of
+ * hay, or -1. Candidates are found by the first byte with memchr.
+ */
+lint bytes_search(const unsigned char *hay, lint n,
+                  const unsigned char *needle, lint m, int from_end,
+                  int fold) {
+    const unsigned char *p;
+    lint i;
+    if (m == 0) {
+        return from_end ? n : 0;
+    }
+    if (from_end || fold) {
+        for (i = 0; i <= n - m; i++) {
+            lint j = from_end ? n - m - i : i;
+            if (bytes_mismatch(hay + j, needle, m, fold) == m) {
+                return j;
+            }
+        }
+        return -1;
+    }
+    for (i = 0; i <= n - m; i = p - hay + 1) {
+        p = memchr(hay + i, needle[0], n - m + 1 - i);
+        if (!p) {
+            return -1;
+        }
+        if (!memcmp(p + 1, needle + 1, m - 1)) {
+            return p - hay;
+        }
+    }
+    return -1;
+}
+
+/**
+ * The fold flag for a mismatch or search of f between two strings with a
+ * test that compares characters and no key, -1 if it is not one.
+ */
+int string_scan(lval * f) {
+    lint kind = o2i(f[12]);
+    if (!sp(f[1]) || o2s(f[1])[1] != 20 || !sp(f[5]) || o2s(f[5])[1] != 20
+        || f[11] || kind < 1 || kind > 4) {
+        return -1;
+    }
+    return kind == 4;
+}
+
+/**
+ * Converts the ASCII letters from lo to hi in the four bytes of w to the
+ * other case, finding them all at once: a byte below 128 gets its top bit
+ * set by adding 128 - lo if it is lo or more and by adding 127 - hi if it
+ * is past hi.
+ */
+unsigned case_word(unsigned w, unsigned lo, unsigned hi) {
+    unsigned low7 = w & 0x7f7f7f7fu;
+    unsigned m = (low7 + (0x80 - lo) * 0x01010101u)
+        & ~(low7 + (0x7f - hi) * 0x01010101u) & ~w & 0x80808080u;
+    return w ^ m >> 2;
+}
+
+/**
+ * The simple string holding the string at s, its offset there, and start
+ * and end checked against the length of the string. If octets is true, s
+ * may be an octet vector as well.
+ */
+lval string_range(lval * h, lval * s, lval start, lval end, lint * o,
+                  lint * a, lint * b, int octets) {
+    lval d;
+    lint n;
+    while (!vector_storage(*s, &d, o, &n) || !sp(d)
+           || (o2s(d)[1] != 20 && (!octets || o2s(d)[1] != 148))) {
+        dbgr(h, 18, *s, s);
+    }
+    *a = fixnum_value(h, start);
+    *b = end ? fixnum_value(h, end) : n;
+    if (*a < 0 || *a > *b || *b > n) {
+        dbgr(h, 2, *s, s);
+        longjmp(top_jmp, 1);
+    }
+    return d;
+}
+
+/**
+ * (string-case string start end down) upcases or, if down is true,
+ * downcases the characters from start below end in place.
+ */
+lval lstring_case(lval * f, lval * h) {
+    lint o, start, end, i;
+    lval d = string_range(h, f + 1, f[2], f[3], &o, &start, &end, 0);
+    unsigned char *p = (unsigned char *) o2z(d) + o;
+    unsigned lo = f[4] ? 'A' : 'a', hi = f[4] ? 'Z' : 'z', w;
+    for (i = start; i + (lint) sizeof w <= end; i += sizeof w) {
+        memcpy(&w, p + i, sizeof w);
+        w = case_word(w, lo, hi);
+        memcpy(p + i, &w, sizeof w);
+    }
+    for (; i < end; i++) {
+        p[i] = (unsigned char) (p[i] >= lo && p[i] <= hi ? p[i] ^ 32 : p[i]);
+    }
+    return f[1];
+}
+
+/**
+ * (string-compare string-1 start-1 end-1 string-2 start-2 end-2 fold)
+ * returns the index into string-1 where the two stop matching, ignoring
+ * case if fold is true, and 0, 1 or 2 as string-1 is less than, equal to
+ * or greater than string-2 there.
+ */
+lval lstring_compare(lval * f, lval * h) {
+    lint o1, s1, e1, o2, s2, e2, m, n, k;
+    lval d1 = string_range(h, f + 1, f[2], f[3], &o1, &s1, &e1, 0);
+    lval d2 = string_range(h, f + 4, f[5], f[6], &o2, &s2, &e2, 0);
+    unsigned char *a = (unsigned char *) o2z(d1) + o1 + s1;
+    unsigned char *b = (unsigned char *) o2z(d2) + o2 + s2;
+    int order;
+    m = e1 - s1;
+    n = e2 - s2;
+    k = bytes_mismatch(a, b, m < n ? m : n, f[7] != 0);
+    if (k < m && k < n) {
+        order = (f[7] ? fold_byte(a[k]) < fold_byte(b[k]) : a[k] < b[k])
+            ? 0 : 2;
+    } else {
+        order = m < n ? 0 : m > n ? 2 : 1;
+    }
+    return mvalues(l2(h, (s1 + k) << 5 | 16, order << 5 | 16));
+}
+
+/**
+ * (string-copy-into string start source start-2 end-2) copies as many of
+ * the characters of source from start-2 below end-2 as fit into string
+ * from start, returning how many. Either may be an octet vector, whose
+ * octets are taken as character codes.
+ */
+lval lstring_copy_into(lval * f, lval * h) {
+    lint o, start, end, o2, start2, end2, n;
+    lval d = string_range(h, f + 1, f[2], 0, &o, &start, &end, 1);
+    lval d2 = string_range(h, f + 3, f[4], f[5], &o2, &start2, &end2, 1);
+    n = end2 - start2 < end - start ? end2 - start2 : end - start;
+    memmove(o2z(d) + o + start, o2z(d2) + o2 + start2, n);
+    return n << 5 | 16;
+}
+
+/**
+ * (string-chunks chunks string end) joins the simple strings of the list
+ * chunks, the last written first, and the first end characters of string
+ * into one new string.
+ */
+lval lstring_chunks(lval * f, lval * h) {
+    lval x, *r;
+    lint n = o2i(f[3]), k;
+    for (x = f[1]; cp(x); x = cdr(x)) {
+        n += o2s(car(x))[0] / 64 - 4;
+    }
+    r = ms0(h, n);
+    r[1] = 20;
+    r[2 + n / sizeof(lval)] = 0;
+    k = n - o2i(f[3]);
+    memcpy((char *) (r + 2) + k, o2z(f[2]), n - k);
+    for (x = f[1]; cp(x); x = cdr(x)) {
+        k -= o2s(car(x))[0] / 64 - 4;
+        memcpy((char *) (r + 2) + k, o2z(car(x)), o2s(car(x))[0] / 64 - 4);
+    }
+    return s2o(r);
+}
+
+/**
+ * (string-trim-bounds string bag left right) returns the start and end
+ * of what is left of string once the characters in bag, a sequence, are
+ * taken off the left and right ends as asked.
+ */
+lval lstring_trim_bounds(lval * f, lval * h) {
+    unsigned char in[256];
+    lval x, d;
+    lint o, start, end, i, n;
+    unsigned char *p;
+    memset(in, 0, sizeof in);
+    if (!f[2] || cp(f[2])) {
+        for (x = f[2]; cp(x); x = cdr(x)) {
+            if ((car(x) & 31) == 24 && car(x) >> 5 < 256) {
+                in[car(x) >> 5] = 1;
+            }
+        }
+    } else {
+        while (!vector_storage(f[2], &d, &o, &n)) {
+            dbgr(h, 20, f[2], f + 2);
+        }
+        for (i = 0; i < n; i++) {
+            x = array_elt(d, o + i);
+            if ((x & 31) == 24 && x >> 5 < 256) {
+                in[x >> 5] = 1;
+            }
+        }
+    }
+    d = string_range(h, f + 1, 16, 0, &o, &start, &end, 0);
+    p = (unsigned char *) o2z(d) + o;
+    for (; f[3] && start < end && in[p[start]]; start++);
+    for (; f[4] && end > start && in[p[end - 1]]; end--);
+    return mvalues(l2(h, start << 5 | 16, end << 5 | 16));
+}
+
+/**
+ * Sequence scans.
+ * </p>
+ * FIND, POSITION, COUNT, REMOVE, SUBSTITUTE, MISMATCH and SEARCH run these
+ * loops directly over the simple-vector, string or bit-vector holding the
+ * elements of a vector. The builtins take the item, the storage, the
+ * offset and length of the vector in it, the bounds relative to the
+ * vector, from-end, then the test, key and kind at f[8..10], so indexes
+ * in and out are those of the vector itself.
+ * </p>
+ * The kind, worked out by SEQUENCE-TEST-KIND, is 1 to compare with EQ (also
+ * used for CHAR=), 2 with EQL, 3 with EQUAL and 4 with EQUALP (also used
+ * for CHAR-EQUAL, which folds case as it does on characters); 5 calls the
+ * item on the key as the -IF functions do and 0 calls the test. Adding 8
+ * negates the result, for :TEST-NOT and the -IF-NOT functions.
+ */
+int seq_test(lval * g, lval * p, lval item, lval elem) {
+    int r;
+    if (p[1]) {
+        g[3] = elem;
+        elem = g[1] = call(g + 1, p[1], 1);
+    }
+    switch (p[2] >> 5 & 7) {
+    case 1:
+        r = item == elem;
+        break;
+    case 2:
+        r = eql(item, elem);
+        break;
+    case 3:
+        r = equal(g + 1, item, elem);
+        break;
+    case 4:
+        r = equalp(g + 1, item, elem);
+        break;
+    case 5:
+        g[2] = elem;
+        r = call(g, item, 1) != 0;
+        break;
+    default:
+        g[2] = item;
+        g[3] = elem;
+        r = call(g, p[0], 2) != 0;
+    }
+    return p[2] >> 8 & 1 ? !r : r;
+}
+
+/**
+ * Applies the key to a and tests it against b, which gets the key too.
+ */
+int seq_test2(lval * g, lval * p, lval a, lval b) {
+    if (p[1]) {
+        g[3] = a;
+        a = g[1] = call(g + 1, p[1], 1);
+        return seq_test(g + 1, p, a, b);
+    }
+    return seq_test(g, p, a, b);
+}
+
+void array_set(lval d, lint i, lval x) {
+    if (ap(d)) {
+        o2a(d)[2 + i] = x;
+    } else if (o2s(d)[1] != 116) {
+        ((unsigned char *) o2z(d))[i] = (unsigned char) (x >> 5);
+    } else if (x >> 5) {
+        o2s(d)[2 + i / 32] |= 1u << (i & 31);
+    } else {
+        o2s(d)[2 + i / 32] &= ~(1u << (i & 31));
+    }
+}
+
+/**
+ * The bit to look for when f scans a bit-vector for a bit with a test
+ * that compares numbers and no key, which a word at a time will do; -1
+ * for any other scan.
+ */
+int bit_scan(lval * f) {
+    lint kind = o2i(f[10]);
+    if (!sp(f[2]) || o2s(f[2])[1] != 116 || f[9] || (f[1] != 16 && f[1] != 48)
+        || (kind & 7) < 1 || (kind & 7) > 4) {
+        return -1;
+    }
+    return (int) ((f[1] >> 5) ^ (kind >> 3));
+}
+
+lval lvector_position(lval * f, lval * h) {
+    lint o = o2i(f[3]);
+    lint start = o + o2i(f[5]), end = o + o2i(f[6]), i;
+    int bit = bit_scan(f);
+    if (bit >= 0) {
+        i = bits_find(f[2], start, end, bit, f[7] != 0);
+        return i < 0 ? 0 : (i - o) << 5 | 16;
+    }
+    if (f[7]) {
+        for (i = end - 1; i >= start; i--) {
+            if (seq_test(h, f + 8, f[1], array_elt(f[2], i))) {
+                return (i - o) << 5 | 16;
+            }
+        }
+    } else {
+        for (i = start; i < end; i++) {
+            if (seq_test(h, f + 8, f[1], array_elt(f[2], i))) {
+                return (i - o) << 5 | 16;
+            }
+        }
+    }
+    return 0;
+}
+
+lval lvector_count(lval * f, lval * h) {
+    lint o = o2i(f[3]);
+    lint end = o + o2i(f[6]), i, n = 0;
+    int bit = bit_scan(f);
+    if (bit >= 0) {
+        return bits_count(f[2], o + o2i(f[5]), end, bit) << 5 | 16;
+    }
+    for (i = o + o2i(f[5]); i < end; i++) {
+        n += seq_test(h, f + 8, f[1], array_elt(f[2], i));
+    }
+    return n << 5 | 16;
+}
+
+/**
+ * Marks the elements to remove or replace, honouring :count and
+ * :from-end, and returns how many there are.
+ */
+lint seq_mark(lval * f, lval * h, unsigned *m) {
+    lint o = o2i(f[3]);
+    lint start = o + o2i(f[5]), end = o + o2i(f[6]), i, n = 0;
+    lint count = f[11] ? o2i(f[11]) : end - start;
+    for (i = 0; i < end - start && n < count; i++) {
+        lint k = f[7] ? end - 1 - i : start + i;
+        if (seq_test(h, f + 8, f[1], array_elt(f[2], k))) {
+            m[(k - o) / 32] |= 1u << ((k - o) & 31);
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * A fresh simple-vector, string, octet vector or bit-vector of n elements,
+ * of the same kind as the simple array d. Its elements are not set.
+ */
+lval make_like(lval * g, lval d, lint n) {
+    lval *r;
+    if (ap(d)) {
+        r = ma0(g, n);
+        r[1] = 116;
+        return a2o(r);
+    }
+    if (o2s(d)[1] != 116) {
+        r = ms0(g, n);
+        r[1] = o2s(d)[1];
+        memset(r + 2, 0, (n / 4 + 1) * sizeof(lval));
+    } else {
+        r = mb0(g, n);
+        r[1] = 116;
+        memset(r + 2, 0, ((n + 95) / 32 - 2) * sizeof(lval));
+    }
+    return s2o(r);
+}
+
+/**
+ * (vector-subseq vector start end) copies the elements from start below
+ * end of the simple array vector, whole words and bytes at a time. Bits
+ * are shifted into place a word at a time.
+ */
+lval lvector_subseq(lval * f, lval * h) {
+    lval d;
+    lint o, n, start, end, i, k, s;
+    unsigned w;
+    while (!vector_storage(f[1], &d, &o, &n) || d != f[1]) {
+        dbgr(h, 20, f[1], f + 1);
+    }
+    start = fixnum_value(h, f[2]);
+    end = f[3] ? fixnum_value(h, f[3]) : n;
+    if (start < 0 || start > end || end > n) {
+        dbgr(h, 2, f[2], f + 2);
+        longjmp(top_jmp, 1);
+    }
+    h[1] = make_like(h + 1, f[1], end - start);
+    if (ap(d)) {
+        memcpy(o2a(h[1]) + 2, o2a(d) + 2 + start, (end - start) * sizeof(lval));
+    } else if (o2s(d)[1] != 116) {
+        memcpy(o2z(h[1]), o2z(d) + start, end - start);
+    } else {
+        s = start & 31;
+        for (i = 0, k = start / 32; 32 * i < end - start; i++, k++) {
+            w = (unsigned) o2s(d)[2 + k] >> s;
+            if (s && start + 32 * i + 32 - s < end) {
+                w |= (unsigned) o2s(d)[3 + k] << (32 - s);
+            }
+            if (end - start - 32 * i < 32) {
+                w &= (1u << (end - start - 32 * i)) - 1;
+            }
+            o2s(h[1])[2 + i] = (lval) w;
+        }
+    }
+    return h[1];
+}
+
+/**
+ * Allocates the marks for seq_mark as a bit-vector at h[1], one bit for
+ * each element.
+ */
+unsigned *seq_marks(lval * h, lint l) {
+    lval *m = mb0(h, l);
+    m[1] = 116;
+    memset(m + 2, 0, ((l + 95) / 32 - 2) * sizeof(lval));
+    h[1] = s2o(m);
+    return (unsigned *) m + 2;
+}
+
+/**
+ * Returns a fresh simple vector like the storage with the marked elements
+ * of the vector left out, or the vector itself if none are.
+ */
+lval lvector_remove(lval * f, lval * h) {
+    lint o = o2i(f[3]), l = o2i(f[4]), i, k, n;
+    unsigned *m = seq_marks(h, l);
+    n = seq_mark(f, h + 1, m);
+    if (!n) {
+        return f[12];
+    }
+    h[2] = make_like(h + 1, f[2], l - n);
+    for (i = k = 0; i < l; i++) {
+        if (!(m[i / 32] >> (i & 31) & 1)) {
+            array_set(h[2], k++, array_elt(f[2], o + i));
+        }
+    }
+    return h[2];
+}
+
+lval lvector_substitute(lval * f, lval * h) {
+    lint o = o2i(f[3]), l = o2i(f[4]), i;
+    unsigned *m = seq_marks(h, l);
+    seq_mark(f, h + 1, m);
+    for (i = 0; i < l; i++) {
+        if (m[i / 32] >> (i & 31) & 1) {
+            array_set(f[2], o + i, f[12]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * The index into the first vector where the two ranges stop matching, or
+ * -1 if they match to the end. a and b are the storage offsets plus the
+ * starts, m and n the lengths.
+ */
+lint seq_mismatch(lval * h, lval * f, lint a, lint m, lint b, lint n,
+                  int from_end) {
+    lint i;
+    int fold = string_scan(f);
+    const unsigned char *p, *q;
+    if (fold >= 0 && !from_end) {
+        p = (unsigned char *) o2z(f[1]) + a;
+        q = (unsigned char *) o2z(f[5]) + b;
+        i = bytes_mismatch(p, q, m < n ? m : n, fold);
+        return i == m && m == n ? -1 : i;
+    }
+    for (i = 0; i < m && i < n; i++) {
+        lint j = from_end ? m - 1 - i : i;
+        lint k = from_end ? n - 1 - i : i;
+        if (!seq_test2(h, f + 10, array_elt(f[1], a + j),
+                       array_elt(f[5], b + k))) {
+            return from_end ? j + 1 : j;
+        }
+    }
+    if (m == n) {
+        return -1;
+    }
+    return from_end ? m - i : i;
+}
+
+/**
+ * (vector-mismatch vector-1 offset-1 start-1 end-1 vector-2 offset-2
+ * start-2 end-2 from-end test key kind), indexes relative to the vectors
+ * as for the scans above.
+ */
+lval lvector_mismatch(lval * f, lval * h) {
+    lint s1 = o2i(f[3]), s2 = o2i(f[7]);
+    lint i = seq_mismatch(h, f, o2i(f[2]) + s1, o2i(f[4]) - s1,
+                          o2i(f[6]) + s2, o2i(f[8]) - s2, f[9] != 0);
+    return i < 0 ? 0 : (s1 + i) << 5 | 16;
+}
+
+lval lvector_search(lval * f, lval * h) {
+    lint s1 = o2i(f[3]), s2 = o2i(f[7]);
+    lint m = o2i(f[4]) - s1, n = o2i(f[8]) - s2, i;
+    int fold = string_scan(f);
+    if (fold >= 0) {
+        i = bytes_search((unsigned char *) o2z(f[5]) + o2i(f[6]) + s2, n,
+                         (unsigned char *) o2z(f[1]) + o2i(f[2]) + s1, m,
+                         f[9] != 0, fold);
+        return i < 0 ? 0 : (s2 + i) << 5 | 16;
+    }
+    for (i = 0; i <= n - m; i++) {
+        lint j = f[9] ? n - m - i : i;
+        if (seq_mismatch(h, f, o2i(f[2]) + s1, m, o2i(f[6]) + s2 + j, m, 0)
+            < 0) {
+            return (s2 + j) << 5 | 16;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Lists.
+ * </p>
+ * The list functions that everything else leans on loop here instead of
+ * recursing in lisp. New conses are linked in as they are made, the head of
+ * the result being kept at h[1], so a collection during a call of the
+ * user's function sees them all. Like car and cdr, they stop at the first
+ * atom of a dotted list.
+ */
+lval llength(lval * f, lval * h) {
+    lval x = f[1];
+    lint n = 0;
+    for (;;) {
+        if (!x || cp(x)) {
+            for (; cp(x); x = cdr(x)) {
+                n++;
+            }
+            return n << 5 | 16;
+        }
+        if (sp(x) && (o2s(x)[1] == 20 || o2s(x)[1] == 148)) {
+            return (o2s(x)[0] / 64 - 4) << 5 | 16;
+        }
+        if (sp(x) && o2s(x)[1] == 116) {
+            return (o2s(x)[0] / 8 - 31) << 5 | 16;
+        }
+        if (ap(x) && o2a(x)[1] == 116) {
+            return (o2a(x)[0] >> 8) << 5 | 16;
+        }
+        if (ap(x) && o2a(x)[1] == 148 && !cp(o2a(x)[3])) {
+            return o2a(x)[3] ? o2a(x)[3] : o2a(x)[2];
+        }
+        if (ap(x) && o2a(x)[1] == 244) {
+            return 16;
+        }
+        dbgr(h, 20, x, &x);
+    }
+}
+
+lval lnthcdr(lval * f) {
+    lint n = o2i(f[1]);
+    lval x = f[2];
+    for (; n > 0 && cp(x); n--) {
+        x = cdr(x);
+    }
+    return x;
+}
+
+lval lnth(lval * f) {
+    return car(lnthcdr(f));
+}
+
+lval llast(lval * f, lval * h) {
+    lint n = h - f > 2 ? o2i(f[2]) : 1;
+    lval x = f[1], y = f[1];
+    for (; n > 0 && cp(x); n--) {
+        x = cdr(x);
+    }
+    for (; cp(x); x = cdr(x)) {
+        y = cdr(y);
+    }
+    return y;
+}
+
+/**
+ * Appends a copy of the conses of list x to the result at g[1] whose last
+ * cons is *tail, and returns what ends x.
+ */
+lval copy_onto(lval * g, lval x, lval * tail) {
+    lval c;
+    for (; cp(x); x = cdr(x)) {
+        c = cons(g + 1, car(x), 0);
+        if (*tail) {
+            set_cdr(*tail, c);
+        } else {
+            g[1] = c;
+        }
+        *tail = c;
+    }
+    return x;
+}
+
+lval lcopy_list(lval * f, lval * h) {
+    lval tail = 0;
+    lval x = copy_onto(h, f[1], &tail);
+    if (!tail) {
+        return x;
+    }
+    set_cdr(tail, x);
+    return h[1];
+}
+
+lval lappend(lval * f, lval * h) {
+    lval tail = 0;
+    h[1] = 0;
+    for (f++; f < h - 1; f++) {
+        copy_onto(h, *f, &tail);
+    }
+    if (f == h) {
+        return 0;
+    }
+    if (!tail) {
+        return *f;
+    }
+    set_cdr(tail, *f);
+    return h[1];
+}
+
+lval lnconc(lval * f, lval * h) {
+    lval r = 0, tail = 0, x;
+    for (f++; f < h; f++) {
+        x = *f;
+        if (tail) {
+            set_cdr(tail, x);
+        } else {
+            r = x;
+        }
+        for (; cp(x); x = cdr(x)) {
+            tail = x;
+        }
+    }
+    return r;
+}
+
+/**
+ * The storage of vector v with the offset and length of v in it, as
+ * VECTOR-STORAGE finds them; nonzero if there is such storage.
+ */
+int vector_storage(lval v, lval * d, lint * o, lint * n) {
+    if (sp(v) && (o2s(v)[1] == 20 || o2s(v)[1] == 116 || o2s(v)[1] == 148)) {
+        *d = v;
+        *o = 0;
+        *n = o2s(v)[1] != 116 ? o2s(v)[0] / 64 - 4 : o2s(v)[0] / 8 - 31;
+        return 1;
+    }
+    if (!ap(v) || (o2a(v)[1] != 116
+                   && (o2a(v)[1] != 148 || cp(o2a(v)[3])))) {
+        return 0;
+    }
+    if (o2a(v)[1] == 116) {
+        *d = v;
+        *o = 0;
+        *n = o2a(v)[0] >> 8;
+        return 1;
+    }
+    *d = o2a(v)[4];
+    *o = o2a(v)[5] ? o2i(o2a(v)[5]) : 0;
+    *n = o2i(o2a(v)[3] ? o2a(v)[3] : o2a(v)[2]);
+    return sp(*d) || (ap(*d) && o2a(*d)[1] == 116);
+}
+
+lval lreverse(lval * f, lval * h) {
+    lval x = f[1], d;
+    lint o, n, i;
+    if (!x || cp(x)) {
+        for (h[1] = 0; cp(x); x = cdr(x)) {
+            h[1] = cons(h + 1, car(x), h[1]);
+        }
+        return h[1];
+    }
+    while (!vector_storage(f[1], &d, &o, &n)) {
+        dbgr(h, 20, f[1], f + 1);
+    }
+    h[1] = d;
+    h[2] = make_like(h + 2, d, n);
+    for (i = 0; i < n; i++) {
+        array_set(h[2], i, array_elt(d, o + n - 1 - i));
+    }
+    return h[2];
+}
+
+lval lnreverse(lval * f, lval * h) {
+    lval x = f[1], r = 0, next, d, t;
+    lint o, n, i;
+    if (!x || cp(x)) {
+        for (; cp(x); x = next) {
+            next = cdr(x);
+            set_cdr(x, r);
+            r = x;
+        }
+        return r;
+    }
+    while (!vector_storage(f[1], &d, &o, &n)) {
+        dbgr(h, 20, f[1], f + 1);
+    }
+    for (i = 0; i < n / 2; i++) {
+        t = array_elt(d, o + i);
+        array_set(d, o + i, array_elt(d, o + n - 1 - i));
+        array_set(d, o + n - 1 - i, t);
+    }
+    return f[1];
+}
+
+/**
+ * The mapping functions. f[1] is the function and f[2..] the lists; the
+ * lists still to go are kept at h[2..k+1] and the calls made above them.
+ * cars is nonzero to pass the elements rather than the tails; collect is
+ * 0 to return the first list, 1 to list the results and 2 to nconc them.
+ */
+lval map_lists(lval * f, lval * h, int cars, int collect) {
+    lint k = h - f - 2, i;
+    lval *l = h + 1, *a = h + k + 1;
+    lval tail = 0, r;
+    h[1] = 0;
+    memcpy(l + 1, f + 2, k * sizeof(lval));
+    for (;;) {
+        for (i = 1; i <= k; i++) {
+            if (!cp(l[i])) {
+                return collect ? h[1] : f[2];
+            }
+            a[i + 1] = cars ? car(l[i]) : l[i];
+            l[i] = cdr(l[i]);
+        }
+        r = call(a, f[1], k);
+        if (collect == 1) {
+            r = cons(a, r, 0);
+        }
+        if (collect && cp(r)) {
+            if (tail) {
+                set_cdr(tail, r);
+            } else {
+                h[1] = r;
+            }
+            for (tail = r; cp(cdr(tail)); tail = cdr(tail));
+        }
+    }
+}
+
+lval lmapc(lval * f, lval * h) {
+    return map_lists(f, h, 1, 0);
+}
+
+lval lmapcar(lval * f, lval * h) {
+    return map_lists(f, h, 1, 1);
+}
+
+lval lmapcan(lval * f, lval * h) {
+    return map_lists(f, h, 1, 2);
+}
+
+lval lmapl(lval * f, lval * h) {
+    return map_lists(f, h, 0, 0);
+}
+
+lval lmaplist(lval * f, lval * h) {
+    return map_lists(f, h, 0, 1);
+}
+
+lval lmapcon(lval * f, lval * h) {
+    return map_lists(f, h, 0, 2);
+}
+
+int symbol_named(lval x, const char *s) {
+    lval n;
+    if (!ap(x) || o2a(x)[1] != 20) {
+        return 0;
+    }
+    n = o2a(x)[2];
+    return o2s(n)[0] / 64 - 4 == (lint) strlen(s)
+        && !memcmp(o2z(n), s, strlen(s));
+}
+
+/**
+ * Puts the :test or :test-not, the :key and the test kind, as for the
+ * sequence scans, among the keyword arguments f[3..] into p[0..2]. Unknown
+ * keywords are ignored and a repeated one is bound by its leftmost
+ * occurrence, as in lisp.
+ */
+void list_keys(lval * f, lval * h, lval * p) {
+    lval fn;
+    lval (*c) ();
+    int not, key = 0, test = 0;
+    p[0] = p[1] = 0;
+    p[2] = 2 << 5 | 16;
+    for (f += 3; f + 1 < h; f += 2) {
+        if (symbol_named(*f, "KEY")) {
+            if (!key) {
+                p[1] = f[1];
+                key = 1;
+            }
+            continue;
+        }
+        not = symbol_named(*f, "TEST-NOT");
+        if (test || (!not && !symbol_named(*f, "TEST"))) {
+            continue;
+        }
+        test = 1;
+        p[0] = fn = f[1];
+        if (ap(fn) && o2a(fn)[1] == 20) {
+            fn = o2a(fn)[5];
+        }
+        c = ap(fn) && !(o2a(fn)[0] & 16)
+            ? (lval (*) ()) o2s(o2a(fn)[2])[2] : 0;
+        p[2] = ((c == (lval (*) ()) leq ? 1 : c == (lval (*) ()) leql ? 2
+                 : c == (lval (*) ()) lequal ? 3
+                 : c == (lval (*) ()) lequalp ? 4 : 0) + 8 * not) << 5 | 16;
+    }
+}
+
+/**
+ * Nonzero when p, as list_keys leaves it, asks for no key and a test that
+ * is eq for item.
+ */
+int eq_test(lval * p, lval item) {
+    return !p[1] && (p[2] == (1 << 5 | 16) || (p[2] == (2 << 5 | 16)
+                                               && !(sp(item)
+                                                    && o2s(item)[1] == 84)));
+}
+
+lval lmember(lval * f, lval * h) {
+    lval x;
+    list_keys(f, h, h + 1);
+    if (eq_test(h + 1, f[1])) {
+        for (x = f[2]; cp(x) && car(x) != f[1]; x = cdr(x));
+        return cp(x) ? x : 0;
+    }
+    for (x = f[2]; cp(x); x = cdr(x)) {
+        h[4] = x;
+        if (seq_test(h + 4, h + 1, f[1], car(x))) {
+            return h[4];
+        }
+        x = h[4];
+    }
+    return 0;
+}
+
+lval lassoc(lval * f, lval * h) {
+    lval x;
+    list_keys(f, h, h + 1);
+    if (eq_test(h + 1, f[1])) {
+        for (x = f[2]; cp(x) && (!car(x) || caar(x) != f[1]); x = cdr(x));
+        return car(x);
+    }
+    for (x = f[2]; cp(x); x = cdr(x)) {
+        if (car(x)) {
+            h[4] = x;
+            if (seq_test(h + 4, h + 1, f[1], caar(x))) {
+                return car(h[4]);
+            }
+            x = h[4];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Arrays.
+ * </p>
+ * AREF and its relatives index the payload of the simple array holding
+ * the elements: a byte per character in strings and per element in
+ * octet vectors, 32 bits to the word in bit-vectors and a word per element
+ * in simple vectors. Octet vectors, the simple arrays of (unsigned-byte 8),
+ * are laid out as strings are but tagged 148. Complex arrays
+ * are followed to the array they hold or are displaced to, adding the
+ * displacement offset on the way.
+ */
+
+/**
+ * The total size of array a, or -1 if a has no elements to index.
+ */
+lint array_size(lval a) {
+    if (sp(a) && (o2s(a)[1] == 20 || o2s(a)[1] == 148)) {
+        return o2s(a)[0] / 64 - 4;
+    }
+    if (sp(a) && o2s(a)[1] == 116) {
+        return o2s(a)[0] / 8 - 31;
+    }
+    if (ap(a) && o2a(a)[1] == 116) {
+        return o2a(a)[0] >> 8;
+    }
+    if (ap(a) && o2a(a)[1] == 148) {
+        return o2i(o2a(a)[2]);
+    }
+    return -1;
+}
+
+/**
+ * Replaces the array at a with the simple array holding its element at
+ * row-major index i and returns the index of that element there.
+ */
+lint array_locate(lval * g, lval * a, lint i) {
+    lval d, x;
+    lint n, j;
+    while ((n = array_size(*a)) < 0) {
+        dbgr(g, 21, *a, a);
+    }
+    for (;;) {
+        if (i >= 0 && i < n) {
+            for (d = *a, j = i; ap(d) && o2a(d)[1] == 148; d = o2a(d)[4]) {
+                j += o2a(d)[5] ? o2i(o2a(d)[5]) : 0;
+            }
+            if (j < array_size(d)) {
+                *a = d;
+                return j;
+            }
+        }
+        x = box_integer(g, i);
+        dbgr(g, 2, x, &x);
+        i = fixnum_value(g, x);
+    }
+}
+
+/**
+ * The row-major index of array a for the subscripts from s up to e.
+ */
+lint array_index(lval * g, lval a, lval * s, lval * e) {
+    lval dims = array_dims(a);
+    lint i = 0, k, n;
+    if (!dims && e - s == 1) {
+        return fixnum_value(g, *s);
+    }
+    for (; cp(dims) && s < e; dims = cdr(dims), s++) {
+        n = o2i(car(dims));
+        while ((k = fixnum_value(g, *s)) < 0 || k >= n) {
+            dbgr(g, 2, *s, s);
+        }
+        i = i * n + k;
+    }
+    if (dims || s != e) {
+        dbgr(g, 2, a, &a);
+        longjmp(top_jmp, 1);
+    }
+    return i;
+}
+
+lval array_get(lval * g, lval a, lint i) {
+    g[1] = a;
+    i = array_locate(g + 1, g + 1, i);
+    return array_elt(g[1], i);
+}
+
+/**
+ * Stores x at row-major index i of the array a, checking that a string
+ * gets a character, an octet vector an octet and a bit-vector a bit.
+ */
+lval array_put(lval * g, lval x, lval a, lint i) {
+    g[1] = a;
+    g[2] = x;
+    i = array_locate(g + 2, g + 1, i);
+    while (sp(g[1]) && o2s(g[1])[1] == 20
+           && ((g[2] & 31) != 24 || g[2] >> 5 > 255)) {
+        dbgr(g + 2, 22, g[2], g + 2);
+    }
+    while (sp(g[1]) && o2s(g[1])[1] == 148
+           && ((g[2] & 31) != 16 || (g[2] >> 5 & ~255))) {
+        dbgr(g + 2, 24, g[2], g + 2);
+    }
+    while (sp(g[1]) && o2s(g[1])[1] == 116 && g[2] != 16 && g[2] != 48) {
+        dbgr(g + 2, 15, g[2], g + 2);
+    }
+    array_set(g[1], i, g[2]);
+    return g[2];
+}
+
+lval laref(lval * f, lval * h) {
+    return array_get(h, f[1], array_index(h, f[1], f + 2, h));
+}
+
+lval setfaref(lval * f, lval * h) {
+    return array_put(h, f[1], f[2], array_index(h, f[2], f + 3, h));
+}
+
+lval lrow_major_aref(lval * f, lval * h) {
+    return array_get(h, f[1], fixnum_value(h, f[2]));
+}
+
+lval setfrow_major_aref(lval * f, lval * h) {
+    return array_put(h, f[1], f[2], fixnum_value(h, f[3]));
+}
+
+lval lsvref(lval * f, lval * h) {
+    while (!ap(f[1]) || o2a(f[1])[1] != 116) {
+        dbgr(h, 17, f[1], f + 1);
+    }
+    return lrow_major_aref(f, h);
+}
+
+lval setfsvref(lval * f, lval * h) {
+    while (!ap(f[2]) || o2a(f[2])[1] != 116) {
+        dbgr(h, 17, f[2], f + 2);
+    }
+    return setfrow_major_aref(f, h);
+}
+
+lval lschar(lval * f, lval * h) {
+    while (!sp(f[1]) || o2s(f[1])[1] != 20) {
+        dbgr(h, 18, f[1], f + 1);
+    }
+    return lrow_major_aref(f, h);
+}
+
+lval setfschar(lval * f, lval * h) {
+    while (!sp(f[2]) || o2s(f[2])[1] != 20) {
+        dbgr(h, 18, f[2], f + 2);
+    }
+    return setfrow_major_aref(f, h);
+}
+
+/**
+ * Finds the bit-vector holding the bits of the bit array a, the offset of
+ * those bits in it and how many there are; nonzero if a is such an array.
+ */
+int bit_storage(lval a, lval * d, lint * o, lint * n) {
+    *n = array_size(a);
+    for (*d = a, *o = 0; ap(*d) && o2a(*d)[1] == 148; *d = o2a(*d)[4]) {
+        *o += o2a(*d)[5] ? o2i(o2a(*d)[5]) : 0;
+    }
+    return *n >= 0 && sp(*d) && o2s(*d)[1] == 116
+        && *o + *n <= array_size(*d);
+}
+
+/**
+ * Nonzero if a is an array of bits, and if simple is set a simple one: a
+ * simple-bit-vector or an undisplaced array of more dimensions.
+ */
+int bit_array(lval a, int simple) {
+    lval d;
+    lint o, n;
+    if (!bit_storage(a, &d, &o, &n)) {
+        return 0;
+    }
+    return !simple || sp(a) || (array_dims(a) && o2a(a)[4] == d
+                                && !o2a(a)[5]);
+}
+
+lval lbit(lval * f, lval * h) {
+    while (!bit_array(f[1], 0)) {
+        dbgr(h, 23, f[1], f + 1);
+    }
+    return laref(f, h);
+}
+
+lval setfbit(lval * f, lval * h) {
+    while (!bit_array(f[2], 0)) {
+        dbgr(h, 23, f[2], f + 2);
+    }
+    return setfaref(f, h);
+}
+
+lval lsbit(lval * f, lval * h) {
+    while (!bit_array(f[1], 1)) {
+        dbgr(h, 31, f[1], f + 1);
+    }
+    return laref(f, h);
+}
+
+lval setfsbit(lval * f, lval * h) {
+    while (!bit_array(f[2], 1)) {
+        dbgr(h, 31, f[2], f + 2);
+    }
+    return setfaref(f, h);
+}
+
+/**
+ * Each bit of op is the result for one pair of bits of a and b: bit 3 for
+ * 1 and 1, bit 2 for 1 and 0, bit 1 for 0 and 1 and bit 0 for 0 and 0.
+ */
+unsigned bits_boole(int op, unsigned a, unsigned b) {
+    return (op & 8 ? a & b : 0) | (op & 4 ? a & ~b : 0)
+        | (op & 2 ? ~a & b : 0) | (op & 1 ? ~a & ~b : 0);
+}
+
+/**
+ * BIT-BOOLE op a b r stores the bits of a and b combined by op into r,
+ * a word at a time when all three start on a word boundary.
+ */
+lval lbit_boole(lval * f, lval * h) {
+    int op = (int) o2i(f[1]) & 15;
+    lval da, db, dr;
+    lint ao, bo, ro, n, nb, nr, k, i;
+    unsigned m;
+    lval *w;
+    while (!bit_storage(f[2], &da, &ao, &n)) {
+        dbgr(h, 23, f[2], f + 2);
+    }
+    while (!bit_storage(f[3], &db, &bo, &nb)) {
+        dbgr(h, 23, f[3], f + 3);
+    }
+    while (!bit_storage(f[4], &dr, &ro, &nr)) {
+        dbgr(h, 23, f[4], f + 4);
+    }
+    if (nb != n || nr != n) {
+        dbgr(h, 2, f[4], f + 4);
+        longjmp(top_jmp, 1);
+    }
+    if (ao & 31 || bo & 31 || ro & 31) {
+        for (i = 0; i < n; i++) {
+            k = (o2s(da)[2 + (ao + i) / 32] >> ((ao + i) & 31) & 1) * 2
+                + (o2s(db)[2 + (bo + i) / 32] >> ((bo + i) & 31) & 1);
+            array_set(dr, ro + i, (op >> k & 1) << 5 | 16);
+        }
+        return f[4];
+    }
+    for (k = 0; k < (n + 31) / 32; k++) {
+        w = o2s(dr) + 2 + ro / 32 + k;
+        m = k < n / 32 ? ~0u : (1u << (n & 31)) - 1;
+        *w = ((unsigned) *w & ~m)
+            | (bits_boole(op, (unsigned) o2s(da)[2 + ao / 32 + k],
+                          (unsigned) o2s(db)[2 + bo / 32 + k]) & m);
+    }
+    return f[4];
+}
+
+/**
+ * Octet vectors.
+ * </p>
+ * OCTETS-REF reads a number stored in a few octets of an octet vector, as
+ * binary formats lay them out, and its setf stores one. The format is the
+ * size in octets, 1, 2, 4 or 8, plus 16 if the number is signed, 32 if it
+ * is a float and 64 if it is big-endian; the OCTETS-U32-LE family of
+ * functions names the useful ones. Integers are stored modulo 2 to the
+ * size in bits; 64 bits are for doubles only.
+ */
+
+/**
+ * The octet vector holding the octet vector at v, with the octets of a
+ * number of size octets at offset i in it checked to be there; their index
+ * into its payload is left at o.
+ */
+unsigned char *octets_at(lval * h, lval * v, lval i, lint size, lint * o) {
+    lval d;
+    lint n, k;
+    while (!vector_storage(*v, &d, o, &n) || !sp(d) || o2s(d)[1] != 148) {
+        dbgr(h, 25, *v, v);
+    }
+    k = fixnum_value(h, i);
+    if (k < 0 || k + size > n) {
+        dbgr(h, 2, i, &i);
+        longjmp(top_jmp, 1);
+    }
+    *o += k;
+    return (unsigned char *) o2z(d);
+}
+
+/**
+ * Copies the size octets at p to b, or from b to p if out is true, so that
+ * b holds them least significant first.
+ */
+void octets_order(unsigned char *p, unsigned char *b, lint size, int big,
+                  int out) {
+    lint i;
+    for (i = 0; i < size; i++) {
+        if (out) {
+            p[big ? size - 1 - i : i] = b[i];
+        } else {
+            b[i] = p[big ? size - 1 - i : i];
+        }
+    }
+}
+
+/**
+ * Reorders the size octets of a float or double at b between the order of
+ * this machine and least significant first.
+ */
+void octets_host(unsigned char *b, lint size) {
+    unsigned one = 1;
+    unsigned char c;
+    lint i;
+    if (!*(unsigned char *) &one) {
+        for (i = 0; i < size / 2; i++) {
+            c = b[i];
+            b[i] = b[size - 1 - i];
+            b[size - 1 - i] = c;
+        }
+    }
+}
+
+/**
+ * The size of the numbers of the format at x, which is checked to be one
+ * of those above: 1, 2 or 4 octets for integers, 4 or 8 for floats.
+ */
+lint octets_size(lval * h, lval * x) {
+    lint format = fixnum_value(h, *x), size = format & 15;
+    while (format & ~127 || (format & 32
+                             ? format & 16 || (size != 4 && size != 8)
+                             : size != 1 && size != 2 && size != 4)) {
+        dbgr(h, 29, *x, x);
+        format = fixnum_value(h, *x);
+        size = format & 15;
+    }
+    return size;
+}
+
+lval loctets_ref(lval * f, lval * h) {
+    lint size = octets_size(h, f + 3), format = o2i(f[3]), o, i;
+    unsigned char b[8];
+    unsigned char *p = octets_at(h, f + 1, f[2], size, &o);
+    unsigned u = 0;
+    float x;
+    double y;
+    octets_order(p + o, b, size, format & 64, 0);
+    if (format & 32) {
+        octets_host(b, size);
+        if (size == 4) {
+            memcpy(&x, b, 4);
+            return d2o(h, x);
+        }
+        memcpy(&y, b, 8);
+        return d2o(h, y);
+    }
+    for (i = size - 1; i >= 0; i--) {
+        u = u << 8 | b[i];
+    }
+    if (format & 16 && size < 4 && u >> (8 * size - 1)) {
+        u |= ~0u << 8 * size;
+    }
+    return d2o(h, format & 16 ? (double) (int32_t) u : (double) u);
+}
+
+lval setfoctets_ref(lval * f, lval * h) {
+    lint size = octets_size(h, f + 4), format = o2i(f[4]), o, i;
+    double y = double_value(h, f[1]);
+    unsigned char b[8];
+    unsigned char *p;
+    unsigned u;
+    float x;
+    if (format & 32) {
+        if (size == 4) {
+            x = (float) y;
+            memcpy(b, &x, 4);
+        } else {
+            memcpy(b, &y, 8);
+        }
+        octets_host(b, size);
+    } else {
+        y = fmod(y, 4294967296.0);
+        u = (unsigned) (y < 0 ? y + 4294967296.0 : y);
+        for (i = 0; i < size; i++) {
+            b[i] = (unsigned char) (u >> 8 * i);
+        }
+    }
+    p = octets_at(h, f + 2, f[3], size, &o);
+    octets_order(p + o, b, size, format & 64, 1);
+    return f[1];
+}
+
+/**
+ * Serialization.
+ * </p>
+ * SERIALIZE-INTO writes an object to an octet vector buffer as a tag octet
+ * followed by what the tag needs, and DESERIALIZE-FROM reads it back.
+ * Lengths, character codes and indexes are written seven bits to the
+ * octet, low bits first, with the top bit set on every octet but the last;
+ * fixnums are first zigzag encoded so that small negative ones stay short.
+ * Doubles take eight octets, least significant first.
+ * </p>
+ * Every string, octet vector, bit-vector, symbol, cons, simple-vector, hash
+ * table and structure gets the next index when it is first written or
+ * read, before its contents are: the writer keeps an EQ hash table from
+ * objects to indexes, the reader an EQL one from indexes to objects, and an
+ * object met again is written as WIRE_REF and its index. Shared and
+ * circular structure comes back as it was. Symbols are written as the
+ * names of their home package and themselves, and read back interned.
+ * </p>
+ * A full buffer is passed with the count of octets in it to the sink of
+ * the writer, or if it has none, replaced by one twice the size. The
+ * reader calls its source with the buffer when it runs out and goes on
+ * with the count returned, failing at the end of the data if there is no
+ * source or it returns 0.
+ */
+#define WIRE_NIL 0
+#define WIRE_T 1
+#define WIRE_FIXNUM 2
+#define WIRE_CHARACTER 3
+#define WIRE_DOUBLE 4
+#define WIRE_STRING 5
+#define WIRE_SYMBOL 6
+#define WIRE_CONS 7
+#define WIRE_VECTOR 8
+#define WIRE_BIT_VECTOR 9
+#define WIRE_OCTETS 10
+#define WIRE_HASH_TABLE 11
+#define WIRE_STRUCTURE 12
+#define WIRE_REF 13
+
+/**
+ * Hash tables read back start with room for at most this many entries and
+ * grow as they come, whatever count was written.
+ */
+#define WIRE_TABLE_SIZE 4096
+
+/**
+ * A buffer being written or read: f holds the arguments of the builtin,
+ * the buffer at f[1], the sink or source at f[2] and the table at f[3].
+ * Octets from pos below end are free to write or left to read.
+ */
+struct wire {
+    lval *f;
+    lint pos;
+    lint end;
+};
+
+/**
+ * The class of structure classes, which that of hash tables is.
+ */
+lval structure_class() {
+    return o2a(o2a(symi[97].sym)[4])[1] & ~4;
+}
+
+void wire_flush(lval * g, struct wire *w) {
+    lval *r;
+    if (w->f[2]) {
+        if (w->pos) {
+            g[2] = w->f[1];
+            g[3] = w->pos << 5 | 16;
+            call(g, w->f[2], 2);
+        }
+        w->pos = 0;
+        return;
+    }
+    r = ms0(g, 2 * w->end);
+    r[1] = 148;
+    memcpy(r + 2, o2z(w->f[1]), w->pos);
+    w->f[1] = s2o(r);
+    w->end *= 2;
+}
+
+void wire_byte(lval * g, struct wire *w, int b) {
+    if (w->pos == w->end) {
+        wire_flush(g, w);
+    }
+    ((unsigned char *) o2z(w->f[1]))[w->pos++] = (unsigned char) b;
+}
+
+void wire_uint(lval * g, struct wire *w, unsigned u) {
+    for (; u > 127; u >>= 7) {
+        wire_byte(g, w, (int) (u & 127) | 128);
+    }
+    wire_byte(g, w, (int) u);
+}
+
+/**
+ * Writes the length and then the n octets of the string or octet vector x.
+ */
+void wire_bytes(lval * g, struct wire *w, lval x) {
+    lint n = o2s(x)[0] / 64 - 4, i = 0, k;
+    wire_uint(g, w, (unsigned) n);
+    while (i < n) {
+        if (w->pos == w->end) {
+            wire_flush(g, w);
+        }
+        k = n - i < w->end - w->pos ? n - i : w->end - w->pos;
+        memcpy(o2z(w->f[1]) + w->pos, o2z(x) + i, k);
+        w->pos += k;
+        i += k;
+    }
+}
+
+/**
+ * Writes x as a reference if it has been written before, returning
+ * nonzero, and gives it the next index otherwise.
+ */
+int wire_seen(lval * g, struct wire *w, lval x) {
+    lval ht = w->f[3], hv = ht_hash(ht, x);
+    lval *e = ht_lookup(g, ht, hv, x);
+    if (e) {
+        wire_byte(g, w, WIRE_REF);
+        wire_uint(g, w, (unsigned) (e[2] >> 5));
+        return 1;
+    }
+    ht_add(g, ht, hv, x, o2a(ht)[2]);
+    return 0;
+}
+
+void wire_write(lval * g, struct wire *w, lval x) {
+    lval cls, v, *e;
+    lint n, i, k;
+    unsigned char b[8];
+    if (safepoint_pending || (char *) &cls < cstack_limit) {
+        safepoint(g);
+    }
+    for (; cp(x); x = cdr(x)) {
+        if (wire_seen(g, w, x)) {
+            return;
+        }
+        wire_byte(g, w, WIRE_CONS);
+        wire_write(g, w, car(x));
+    }
+    if (!x || x == TRUE) {
+        wire_byte(g, w, x ? WIRE_T : WIRE_NIL);
+        return;
+    }
+    if ((x & 31) == 16) {
+        wire_byte(g, w, WIRE_FIXNUM);
+        n = x >> 5;
+        wire_uint(g, w, n < 0 ? (unsigned) -(n + 1) << 1 | 1 : (unsigned) n << 1);
+        return;
+    }
+    if ((x & 31) == 24) {
+        wire_byte(g, w, WIRE_CHARACTER);
+        wire_uint(g, w, (unsigned) (x >> 5));
+        return;
+    }
+    if (sp(x) && o2s(x)[1] == 84) {
+        memcpy(b, o2s(x) + 2, 8);
+        octets_host(b, 8);
+        wire_byte(g, w, WIRE_DOUBLE);
+        for (i = 0; i < 8; i++) {
+            wire_byte(g, w, b[i]);
+        }
+        return;
+    }
+    if (sp(x) && (o2s(x)[1] == 20 || o2s(x)[1] == 148)) {
+        if (!wire_seen(g, w, x)) {
+            wire_byte(g, w, o2s(x)[1] == 20 ? WIRE_STRING : WIRE_OCTETS);
+            wire_bytes(g, w, x);
+        }
+        return;
+    }
+    if (sp(x) && o2s(x)[1] == 116) {
+        if (!wire_seen(g, w, x)) {
+            n = o2s(x)[0] / 8 - 31;
+            wire_byte(g, w, WIRE_BIT_VECTOR);
+            wire_uint(g, w, (unsigned) n);
+            for (i = 0; i < (n + 7) / 8; i++) {
+                k = (unsigned) o2s(x)[2 + i / 4] >> 8 * (i & 3) & 255;
+                wire_byte(g, w, (int) (8 * i + 8 > n ? k & ((1 << (n & 7)) - 1)
+                                       : k));
+            }
+        }
+        return;
+    }
+    if (ap(x) && o2a(x)[1] == 20) {
+        if (!wire_seen(g, w, x)) {
+            wire_byte(g, w, WIRE_SYMBOL);
+            if (o2a(x)[9]) {
+                v = car(o2a(o2a(x)[9])[2]);
+                wire_uint(g, w, (unsigned) (o2s(v)[0] / 64 - 3));
+                for (i = 0; i < o2s(v)[0] / 64 - 4; i++) {
+                    wire_byte(g, w, o2z(v)[i]);
+                }
+            } else {
+                wire_uint(g, w, 0);
+            }
+            wire_bytes(g, w, o2a(x)[2]);
+        }
+        return;
+    }
+    if (ap(x) && o2a(x)[1] == 116) {
+        if (!wire_seen(g, w, x)) {
+            wire_byte(g, w, WIRE_VECTOR);
+            wire_uint(g, w, (unsigned) (o2a(x)[0] >> 8));
+            for (i = 0; i < o2a(x)[0] >> 8; i++) {
+                wire_write(g, w, o2a(x)[2 + i]);
+            }
+        }
+        return;
+    }
+    cls = ap(x) && ap(o2a(x)[1]) ? o2a(x)[1] & ~4 : 0;
+    if (cls && cls == o2a(symi[97].sym)[4]) {
+        if (!wire_seen(g, w, x)) {
+            wire_byte(g, w, WIRE_HASH_TABLE);
+            wire_byte(g, w, (int) (o2a(x)[6] >> 5));
+            wire_uint(g, w, (unsigned) (o2a(x)[2] >> 5));
+            for (i = 3; i < 6; i++) {
+                wire_write(g, w, o2a(x)[i]);
+            }
+            for (k = 7; k < 9; k++) {
+                v = o2a(x)[k];
+                for (i = 0; v && i < ht_capacity(v); i++) {
+                    e = ht_entry(v, i);
+                    if (e[0] && e[0] != 8) {
+                        wire_write(g, w, e[1]);
+                        wire_write(g, w, e[2]);
+                    }
+                }
+            }
+        }
+        return;
+    }
+    if (cls && (o2a(cls)[1] & ~4) == structure_class()) {
+        if (!wire_seen(g, w, x)) {
+            wire_byte(g, w, WIRE_STRUCTURE);
+            wire_uint(g, w, (unsigned) (o2a(x)[0] >> 8));
+            wire_write(g, w, o2a(o2a(cls)[2])[2]);
+            for (i = 0; i < o2a(x)[0] >> 8; i++) {
+                wire_write(g, w, o2a(x)[2 + i]);
+            }
+        }
+        return;
+    }
+    dbgr(g, 26, x, &x);
+    longjmp(top_jmp, 1);
+}
+
+/**
+ * (serialize-into buffer sink table object) writes object into the octet
+ * vector buffer, passing full buffers to sink as said above, and returns
+ * the buffer it ends with and how many octets of it are written.
+ */
+lval lserialize_into(lval * f, lval * h) {
+    struct wire w;
+    while (!sp(f[1]) || o2s(f[1])[1] != 148 || o2s(f[1])[0] / 64 - 4 < 1) {
+        dbgr(h, 25, f[1], f + 1);
+    }
+    f[3] = hash_table_arg(h, f[3]);
+    w.f = f;
+    w.pos = 0;
+    w.end = o2s(f[1])[0] / 64 - 4;
+    wire_write(h, &w, f[4]);
+    if (f[2]) {
+        wire_flush(h, &w);
+    }
+    return mvalues(l2(h, f[1], w.pos << 5 | 16));
+}
+
+void wire_fill(lval * g, struct wire *w) {
+    lval n = 16;
+    if (w->f[2]) {
+        g[2] = w->f[1];
+        n = call(g, w->f[2], 1);
+    }
+    if ((n & 31) != 16 || n >> 5 < 1 || n >> 5 > o2s(w->f[1])[0] / 64 - 4) {
+        dbgr(g, 27, w->f[2] ? w->f[2] : w->f[1], &n);
+        longjmp(top_jmp, 1);
+    }
+    w->pos = 0;
+    w->end = n >> 5;
+}
+
+int wire_next(lval * g, struct wire *w) {
+    if (w->pos == w->end) {
+        wire_fill(g, w);
+    }
+    return ((unsigned char *) o2z(w->f[1]))[w->pos++];
+}
+
+unsigned wire_read_uint(lval * g, struct wire *w) {
+    unsigned u = 0;
+    int b, shift = 0;
+    do {
+        b = wire_next(g, w);
+        u |= (unsigned) (b & 127) << shift;
+        shift += 7;
+    } while (b & 128 && shift < 32);
+    return u;
+}
+
+/**
+ * Reads n octets into the string or octet vector x, from octet start.
+ */
+void wire_read_bytes(lval * g, struct wire *w, lval x, lint start, lint n) {
+    lint k;
+    while (n > 0) {
+        if (w->pos == w->end) {
+            wire_fill(g, w);
+        }
+        k = n < w->end - w->pos ? n : w->end - w->pos;
+        memcpy(o2z(x) + start, o2z(w->f[1]) + w->pos, k);
+        w->pos += k;
+        start += k;
+        n -= k;
+    }
+}
+
+void wire_malformed(lval * g, struct wire *w) {
+    lval x = w->f[1];
+    dbgr(g, 28, x, &x);
+    longjmp(top_jmp, 1);
+}
+
+/**
+ * Checks that an object of n lval units read from the wire can be had in
+ * one block: with a source the data is not there yet to bound it.
+ */
+void wire_fits(lval * g, struct wire *w, lint n) {
+    if (!m0_fits(g, n)) {
+        wire_malformed(g, w);
+    }
+}
+
+/**
+ * A fresh string or, if tag is 148, octet vector of the next n octets.
+ */
+lval wire_read_string(lval * g, struct wire *w, lint n, int tag) {
+    lval *r;
+    wire_fits(g, w, n / sizeof(lval) + 3);
+    r = ms0(g, n);
+    r[1] = tag;
+    r[2 + n / sizeof(lval)] = 0;
+    g[1] = s2o(r);
+    wire_read_bytes(g + 1, w, g[1], 0, n);
+    return g[1];
+}
+
+/**
+ * Gives x the next index.
+ */
+lval wire_register(lval * g, struct wire *w, lval x) {
+    lval ht = w->f[3], key = o2a(ht)[2];
+    g[1] = x;
+    ht_add(g + 1, ht, ht_hash(ht, key), key, x);
+    return x;
+}
+
+/**
+ * Reads the length of something written in at least one octet for each
+ * per elements. Lengths are checked before anything is allocated for
+ * them: they must be fixnums and, when there is no source to read more
+ * from, no longer than what is left of the buffer allows.
+ */
+lint wire_read_length(lval * g, struct wire *w, lint per) {
+    unsigned u = wire_read_uint(g, w);
+    if (u >= LVAL_FIXNUM_LIMIT
+        || (!w->f[2] && (u + per - 1) / per > (unsigned) (w->end - w->pos))) {
+        wire_malformed(g, w);
+    }
+    return (lint) u;
+}
+
+
+
+/**
+ * The symbol named by the next octets, interned in the package they name.
+ */
+lval wire_read_symbol(lval * g, struct wire *w) {
+    lint n = wire_read_length(g, w, 1), i;
+    lval x, y, *e;
+    g[1] = n ? wire_read_string(g, w, n - 1, 20) : 0;
+    g[2] = wire_read_string(g + 1, w, wire_read_length(g + 1, w, 1), 20);
+    if (!g[1]) {
+        return ma(g + 2, 9, 20, g[2], 0, 8, 8, 8, -8, 16, 0, 0);
+    }
+    for (x = o2a(symi[81].sym)[4]; cp(x); x = cdr(x)) {
+        for (y = o2a(car(x))[2]; cp(y); y = cdr(y)) {
+            if (string_equal(car(y), g[1])) {
+                break;
+            }
+        }
+        if (y) {
+            break;
+        }
+    }
+    if (!x) {
+        x = g[1];
+        dbgr(g + 2, 13, x, &x);
+        longjmp(top_jmp, 1);
+    }
+    for (i = 3; i < 5; i++) {
+        e = ht_lookup(g + 2, o2a(car(x))[i], sxhash(g[2]), g[2]);
+        if (e) {
+            return e[2];
+        }
+    }
+    g[3] = g[2];
+    g[4] = car(x);
+    return call(g + 1, symi[99].sym, 2);
+}
+
+lval wire_read(lval * g, struct wire *w);
+
+lval wire_tagged(lval * g, struct wire *w, int tag) {
+    lval x, c, *r, *e;
+    lint n, i, k;
+    unsigned u;
+    unsigned char b[8];
+    double d;
+    if (safepoint_pending || (char *) &x < cstack_limit) {
+        safepoint(g);
+    }
+    switch (tag) {
+    case WIRE_NIL:
+        return 0;
+    case WIRE_T:
+        return TRUE;
+    case WIRE_FIXNUM:
+        u = wire_read_uint(g, w);
+        n = (lint) (u >> 1);
+        return box_integer(g, u & 1 ? -n - 1 : n);
+    case WIRE_CHARACTER:
+        return (lval) wire_read_uint(g, w) << 5 | 24;
+    case WIRE_DOUBLE:
+        for (i = 0; i < 8; i++) {
+            b[i] = (unsigned char) wire_next(g, w);
+        }
+        octets_host(b, 8);
+        memcpy(&d, b, 8);
+        return d2o(g, d);
+    case WIRE_STRING:
+    case WIRE_OCTETS:
+        n = wire_read_length(g, w, 1);
+        wire_fits(g, w, n / sizeof(lval) + 3);
+        r = ms0(g, n);
+        r[1] = tag == WIRE_STRING ? 20 : 148;
+        r[2 + n / sizeof(lval)] = 0;
+        x = wire_register(g, w, s2o(r));
+        wire_read_bytes(g, w, x, 0, n);
+        return x;
+    case WIRE_SYMBOL:
+        return wire_register(g, w, wire_read_symbol(g, w));
+    case WIRE_CONS:
+        x = c = wire_register(g, w, cons(g, 0, 0));
+        for (;;) {
+            set_car(c, wire_read(g, w));
+            tag = wire_next(g, w);
+            if (tag != WIRE_CONS) {
+                set_cdr(c, wire_tagged(g, w, tag));
+                return x;
+            }
+            set_cdr(c, wire_register(g, w, cons(g, 0, 0)));
+            c = cdr(c);
+        }
+    case WIRE_VECTOR:
+        n = wire_read_length(g, w, 1);
+        wire_fits(g, w, n + 2);
+        r = ma0(g, n);
+        r[1] = 116;
+        memset(r + 2, 0, n * sizeof(lval));
+        x = wire_register(g, w, a2o(r));
+        for (i = 0; i < n; i++) {
+            c = wire_read(g, w);
+            o2a(x)[2 + i] = c;
+        }
+        return x;
+    case WIRE_BIT_VECTOR:
+        n = wire_read_length(g, w, 8);
+        wire_fits(g, w, (n + 95) / 32);
+        r = mb0(g, n);
+        r[1] = 116;
+        memset(r + 2, 0, ((n + 95) / 32 - 2) * sizeof(lval));
+        x = wire_register(g, w, s2o(r));
+        for (i = 0; i < (n + 7) / 8; i++) {
+            u = (unsigned) wire_next(g, w);
+            o2s(x)[2 + i / 4] = (lval) ((unsigned) o2s(x)[2 + i / 4]
+                                        | u << 8 * (i & 3));
+        }
+        return x;
+    case WIRE_HASH_TABLE:
+        k = wire_next(g, w);
+        n = wire_read_length(g, w, 1);
+        x = wire_register(g, w, ma(g, 9, o2a(symi[97].sym)[4] | 4, 16, 0, 0,
+                                   0, (lval) (k & 3) << 5 | 16, 0, 0, 16,
+                                   16));
+        for (k = 8; 3 * k < 4 * n && k < WIRE_TABLE_SIZE; k *= 2);
+        o2a(x)[7] = ht_entries(g, k);
+        for (i = 3; i < 6; i++) {
+            c = wire_read(g, w);
+            o2a(x)[i] = c;
+        }
+        for (i = 0; i < n; i++) {
+            g[1] = wire_read(g, w);
+            g[2] = wire_read(g + 1, w);
+            e = ht_lookup(g + 2, x, ht_hash(x, g[1]), g[1]);
+            if (e) {
+                e[2] = g[2];
+            } else {
+                ht_add(g + 2, x, ht_hash(x, g[1]), g[1], g[2]);
+            }
+        }
+        return x;
+    case WIRE_STRUCTURE:
+        n = wire_read_length(g, w, 1);
+        wire_fits(g, w, n + 2);
+        r = ma0(g, n);
+        r[1] = 4;
+        memset(r + 2, 0, n * sizeof(lval));
+        x = wire_register(g, w, a2o(r));
+        g[2] = wire_read(g, w);
+        c = call(g, symi[98].sym, 1);
+        if (!ap(c) || (o2a(c)[1] & ~4) != structure_class()
+            || o2a(o2a(c)[2])[4] >> 5 != n) {
+            wire_malformed(g, w);
+        }
+        o2a(x)[1] = c | 4;
+        for (i = 0; i < n; i++) {
+            c = wire_read(g, w);
+            o2a(x)[2 + i] = c;
+        }
+        return x;
+    case WIRE_REF:
+        x = (lval) wire_read_uint(g, w) << 5 | 16;
+        e = ht_lookup(g, w->f[3], ht_hash(w->f[3], x), x);
+        if (!e) {
+            wire_malformed(g, w);
+        }
+        return e[2];
+    }
+    wire_malformed(g, w);
+    return 0;
+}
+
+lval wire_read(lval * g, struct wire *w) {
+    return wire_tagged(g, w, wire_next(g, w));
+}
+
+/**
+ * (deserialize-from buffer source table start end) reads an object from
+ * the octets of the octet vector buffer from start below end, and from
+ * what source gives after those, and returns it and the position after it
+ * in the buffer.
+ */
+lval ldeserialize_from(lval * f, lval * h) {
+    struct wire w;
+    while (!sp(f[1]) || o2s(f[1])[1] != 148) {
+        dbgr(h, 25, f[1], f + 1);
+    }
+    f[3] = hash_table_arg(h, f[3]);
+    w.f = f;
+    w.pos = fixnum_value(h, f[4]);
+    w.end = fixnum_value(h, f[5]);
+    if (w.pos < 0 || w.pos > w.end || w.end > o2s(f[1])[0] / 64 - 4) {
+        dbgr(h, 2, f[4], f + 4);
+        longjmp(top_jmp, 1);
+    }
+    h[1] = wire_read(h + 1, &w);
+    return mvalues(l2(h + 1, h[1], w.pos << 5 | 16));
+}
+
+/**
+ * Finds or interns the symbol named s in package p. The external and
+ * internal symbols of a package are EQUAL hash tables from names to
+ * symbols, the same tables the lisp package functions use.
+ */
+lval make_symbol(lval * g, lval p, lval s) {
+    lval hv = sxhash(s);
+    lval *e;
+    lval m;
+    int i = 3;
+    g[1] = s;
+    for (; i < 5; i++) {
+        e = ht_lookup(g + 1, o2a(p)[i], hv, s);
+        if (e) {
+            return o2a(e[2])[7] ? e[2] : 0;
+        }
+    }
+    m = g[2] = ma(g + 1, 9, 20, s, 0, 8, 8, 8, -8, 16, p, 0);
+    if (p == kwp) {
+        o2a(m)[4] = m;
+    }
+    ht_add(g + 2, o2a(p)[3], hv, s, m);
+    return m;
+}
+
+lval read_symbol(lval * g) {
+    int c = getc(ins);
+    if (isspace(c) || c == ')' || c == EOF) {
+        if (c != EOF) {
+            ungetc(c, ins);
+	}
+        return 0;
+    } 
+    if (c > 96 && c < 123) {
+        c -= 32;
+    }
+    return cons(g, (c << 5) | 24, read_symbol(g));
+}
+
+lval list2(lval * g, int a) {
+    return l2(g, symi[a].sym, lread(g));
+}
+
+lval lread(lval * g) {
+    int c = getnws();
+    if (c == EOF) {
+        return 8;
+    }
+    if (c == '(')
+        return read_list(g);
+    if (c == '\"')
+        return stringify(g, read_string_list(g));
+    if (c == '\'')
+        return list2(g, 12);
+    if (c == '#') {
+        c = getnws();
+        if (c == '\'') {
+            return list2(g, 20);
+        }
+        return 0;
+    }
+    if (c == '`') {
+        return list2(g, 38);
+    }
+    if (c == ',') {
+        c = getnws();
+        if (c == '@') {
+            return list2(g, 40);
+        }
+        ungetc(c, ins);
+        return list2(g, 39);
+    }
+    ungetc(c, ins);
+    if (isdigit(c)) {
         double d;
         fscanf(ins, "%lf", &d);
         return d2o(g, d);
@@ -1947,19 +5794,22 @@ lval strf(lval * f, const char *s) {
     return s2o(str);
 }
 
+/**
+ * Makes a symbol table for a package made before the lisp side exists;
+ * core800.lisp gives it its class and test once *HASH-TABLE* is defined.
+ */
 lval mkv(lval * f) {
-    int i = 2;
-    lval *r = ma0(f, 1021);
-    r[1] = 116;
-    while (i < 1023) {
-        r[i++] = 0;
-    }
-    return a2o(r);
+    f[1] = ht_entries(f, 1024);
+    return ma(f + 1, 9, 4, 16, 0, 0, 0, 2 << 5 | 16, f[1], 0, 16, 16);
 }
 
 lval mkp(lval * f, const char *s0, const char *s1) {
-    return ma(f, 6, 180,
-          l2(f, strf(f, s0), strf(f, s1)), mkv(f), mkv(f), 0, 0, 0);
+    f[1] = strf(f, s0);
+    f[2] = strf(f + 1, s1);
+    f[1] = l2(f + 2, f[1], f[2]);
+    f[2] = mkv(f + 1);
+    f[3] = mkv(f + 2);
+    return ma(f + 3, 6, 180, f[1], f[2], f[3], 0, 0, 0);
 }
 
 #ifdef _WIN32
@@ -1993,6 +5843,143 @@ lval lrp(lval * f, lval * h) {
 }
 #endif
 
+/**
+ * Words in the heap object at m, as the collector counts them.
+ */
+static int objsize(lval * m) {
+    return (((m[1] & 4 ? m[0] >> 8 : 0) + 1) & ~1) + 2;
+}
+
+/**
+ * Copies the n words of heap objects at data into a single heap block.
+ * </p>
+ * The block starts with a simple-vector of the copied objects, which is
+ * returned and keeps them all alive; tag is the lval tag of the objects
+ * having a header (2 for irefs, 3 for jrefs), the others are conses.
+ * The copy is stored to block.
+ */
+static lval fasl_block(lval * g, lval * data, int n, int tag, lval ** block) {
+    lval *r;
+    int k = 0;
+    int i;
+    for (i = 0; i < n; i += objsize(data + i)) {
+        k++;
+    }
+    r = cm0(g, ((k + 1) & ~1) + 2 + n);
+    r[0] = k << 8;
+    r[1] = 116;
+    r[k + 2] = 0;
+    *block = r + ((k + 1) & ~1) + 2;
+    memcpy(*block, data, n * sizeof(lval));
+    for (i = 0, k = 2; i < n; i += objsize(data + i)) {
+        r[k++] = (lval) (*block + i) + (data[i + 1] & 4 ? tag : 1);
+    }
+    return a2o(r);
+}
+
+/**
+ * Relocates a word of a compiled module's value data.
+ * </p>
+ * Conses and irefs refer to the value block by offset and jrefs to the
+ * opaque block; an iref with some of the top two bits set refers to the
+ * class, symbol or package table entry number (w & 0x3fffffff) >> 3.
+ */
+static lval fasl_reloc(lval w, lval * package, lval * symbol, lval * klass,
+                       lval * value, lval * opaque) {
+    int i = (w & 0x3fffffff) >> 3;
+    switch (w & 3) {
+    case 1:
+        return (lval) value + w;
+    case 2:
+        switch ((w >> 30) & 3) {
+        case 0:
+            return (lval) value + w;
+        case 1:
+            return klass[i];
+        case 2:
+            return symbol[i];
+        default:
+            return package[i];
+        }
+    case 3:
+        return (lval) opaque + w;
+    }
+    return w;
+}
+
+/**
+ * Loads the constants of a compiled module.
+ * </p>
+ * Called by the init function of a module written by compile-file. The
+ * package, symbol and class tables come in as indices of their names
+ * and are replaced in place by the objects looked up with FIND-PACKAGE,
+ * INTERN and FIND-CLASS; a symbol with package index -1 is made afresh
+ * by MAKE-SYMBOL, once per module. value_data holds the constant conses and irefs,
+ * opaque_data the jrefs, each as a heap image with the pointers relative
+ * to the start of its block. Both are copied to the heap, kept alive by
+ * fasls, and their copies stored to value and opaque.
+ */
+X void fasr(lval * f, lval * package, int np, lval * symbol,
+            lval * symbol_package, int ns, lval * klass, int nk,
+            lval * value_data, int nv, lval * opaque_data, int no,
+            lval ** value, lval ** opaque) {
+    lval *o;
+    lval *v;
+    int i;
+    int j;
+    int n;
+    f[1] = f[2] = 0;
+    f[1] = fasl_block(f, opaque_data, no, 3, &o);
+    fasls = cons(f + 1, f[1], fasls);
+    for (i = 0; i < np; i++) {
+        f[3] = s2o(o + package[i]);
+        f[4] = 0;
+        package[i] = call(f + 1,
+                          make_symbol(f + 3, pkg, strf(f + 3, "FIND-PACKAGE")),
+                          1);
+        while (!package[i]) {
+            dbgr(f + 3, 13, f[3], package + i);
+        }
+    }
+    for (i = 0; i < ns; i++) {
+        f[3] = s2o(o + symbol[i]);
+        if (symbol_package[i] < 0) {
+            f[4] = 0;
+            symbol[i] = call(f + 1, make_symbol(f + 4, pkg,
+                                                strf(f + 4, "MAKE-SYMBOL")),
+                             1);
+            continue;
+        }
+        f[4] = package[symbol_package[i]];
+        f[5] = 0;
+        symbol[i] = call(f + 1,
+                         make_symbol(f + 4, pkg, strf(f + 4, "INTERN")), 2);
+    }
+    for (i = 0; i < nk; i++) {
+        f[3] = symbol[klass[i]];
+        f[4] = 0;
+        klass[i] = call(f + 1,
+                        make_symbol(f + 3, pkg, strf(f + 3, "FIND-CLASS")), 1);
+    }
+    f[2] = fasl_block(f + 1, value_data, nv, 2, &v);
+    for (i = 0; i < nv; i += objsize(v + i)) {
+        j = 0;
+        n = 2;
+        if (v[i + 1] & 4) {
+            v[i + 1] = fasl_reloc(v[i + 1] & ~4, package, symbol, klass, v, o)
+                | 4;
+            j = 2;
+            n = (v[i] >> 8) + 2;
+        }
+        for (; j < n; j++) {
+            v[i + j] = fasl_reloc(v[i + j], package, symbol, klass, v, o);
+        }
+    }
+    fasls = cons(f + 2, f[2], fasls);
+    *value = v;
+    *opaque = o;
+}
+
 struct symbol_init symi[] = {
     {"NIL"}, {"T"}, {"&REST"}, {"&BODY"},
     {"&OPTIONAL"}, {"&KEY"}, {"&WHOLE"}, {"&ENVIRONMENT"}, {"&AUX"},
@@ -2014,11 +6001,11 @@ struct symbol_init symi[] = {
     {"FUNCALL", lfuncall, -2}, {"APPLY", lapply, -2}, {"EQ", leq, 2}, {"CONS", lcons, 2},
     {"CAR", lcar, 1, setfcar, 2}, {"CDR", lcdr, 1, setfcdr, 2}, {"=", lequ, -2},
     {"<", lless, -2}, {"+", lplus, -1}, {"-", lminus, -2}, {"*", ltimes, -1},
-    {"/", ldivi, -2}, {"MAKE-FILE-STREAM", lmake_fs, 2}, {"HASH", lhash, 1},
-    {"IERROR"}, {"GENSYM", lgensym, 0}, {"STRING", lstring, -1}, {"FASL", lfasl, 1},
+    {"/", ldivi, -2}, {"MAKE-FILE-STREAM", lmake_fs, 3}, {"HASH", lhash, 1},
+    {"IERROR"}, {"GENSYM", lgensym, 0}, {"STRING", lstring, -1}, {"FASL", lfasl, -2},
     {"MAKEJ", lmakej, 2}, {"MAKEF", lmakef, 0}, {"FREF", lfref, 1},
     {"PRINT", lprint, 1}, {"GC", gc, 0}, {"CLOSE-FILE-STREAM", lclose_fs, 1},
-    {"IVAL", lival, 1}, {"FLOOR", lfloor, -2}, {"READ-FILE-STREAM", lread_fs, 3},
+    {"IVAL", lival, 1}, {"FLOOR", lfloor, -2}, {"READ-FILE-STREAM", lread_fs, 4},
     {"WRITE-FILE-STREAM", lwrite_fs, 4}, {"LOAD", lload, 1},
     {"IREF", liref, 2, setfiref, 3}, {"LAMBDA"}, {"CODE-CHAR", lcode_char, 1},
     {"CHAR-CODE", lchar_code, 1},
@@ -2029,22 +6016,106 @@ struct symbol_init symi[] = {
     {"IMAKUNBOUND", limakunbound, 2}, {"EVAL", leval, -2}, {"JREF", ljref, 2, setfjref, 3},
     {"RUN-PROGRAM", lrp, -2}, {"UNAME", luname, 0}, 
     {"EXIT", lexit, 1}, {"QUIT", lexit, 1},
-    {"INSPECT", linspect, 1}
+    {"INSPECT", linspect, 1},
+    {"GET-INTERNAL-REAL-TIME", lget_internal_real_time, 0},
+    {"DEADLINE", ldeadline, 0, setfdeadline, 1},
+    {"AUTO-COMPILE-THRESHOLD", lauto_compile_threshold, 0,
+     setfauto_compile_threshold, 1},
+    {"AUTO-COMPILE"}, /* must be 94 */
+    {"DISPATCH-MISS"}, /* must be 95 */
+    {"SLOT-ACCESS-MISS"}, /* must be 96 */
+    {"*HASH-TABLE*"}, /* must be 97 */
+    {"FIND-CLASS"}, /* must be 98 */
+    {"INTERN"}, /* must be 99 */
+    {"MAKE-DISPATCH-FUNCTION", lmake_dispatch_function, 1},
+    {"DISPATCH-CLASS-KEY", ldispatch_class_key, 1},
+    {"DISPATCH-EPOCH", ldispatch_epoch, 0, setfdispatch_epoch, 1},
+    {"MAKE-SLOT-ACCESSOR", lmake_slot_accessor, 1},
+    {"SLOT-ACCESSOR-EMF", lslot_accessor_emf, 1},
+    {"GETHASH", lgethash, -3, setfgethash, -4},
+    {"REMHASH", lremhash, 2}, {"CLRHASH", lclrhash, 1},
+    {"EQL", leql, 2}, {"EQUAL", lequal, 2}, {"EQUALP", lequalp, 2},
+    {"SXHASH", lsxhash, 1},
+    {"SORT-LIST", lsort_list, 4}, {"SORT-VECTOR", lsort_vector, 6},
+    {"MERGE-LISTS", lmerge_lists, 5},
+    {"VECTOR-POSITION", lvector_position, 12},
+    {"VECTOR-COUNT", lvector_count, 12},
+    {"VECTOR-REMOVE", lvector_remove, 12},
+    {"VECTOR-SUBSTITUTE", lvector_substitute, 12},
+    {"VECTOR-MISMATCH", lvector_mismatch, 12},
+    {"VECTOR-SEARCH", lvector_search, 12},
+    {"LENGTH", llength, 1}, {"NTH", lnth, 2}, {"NTHCDR", lnthcdr, 2},
+    {"LAST", llast, -2}, {"COPY-LIST", lcopy_list, 1},
+    {"APPEND", lappend, -1}, {"NCONC", lnconc, -1},
+    {"REVERSE", lreverse, 1}, {"NREVERSE", lnreverse, 1},
+    {"MAPC", lmapc, -3}, {"MAPCAR", lmapcar, -3}, {"MAPCAN", lmapcan, -3},
+    {"MAPL", lmapl, -3}, {"MAPLIST", lmaplist, -3},
+    {"MAPCON", lmapcon, -3},
+    {"MEMBER", lmember, -3}, {"ASSOC", lassoc, -3},
+    {"AREF", laref, -2, setfaref, -3},
+    {"OCTETS-REF", loctets_ref, 3, setfoctets_ref, 4},
+    {"ROW-MAJOR-AREF", lrow_major_aref, 2, setfrow_major_aref, 3},
+    {"CHAR", lrow_major_aref, 2, setfrow_major_aref, 3},
+    {"SCHAR", lschar, 2, setfschar, 3}, {"SVREF", lsvref, 2, setfsvref, 3},
+    {"BIT", lbit, -2, setfbit, -3}, {"SBIT", lsbit, -2, setfsbit, -3},
+    {"BIT-BOOLE", lbit_boole, 4},
+    {"STRING-CASE", lstring_case, 4}, {"STRING-COMPARE", lstring_compare, 7},
+    {"STRING-TRIM-BOUNDS", lstring_trim_bounds, 4},
+    {"VECTOR-SUBSEQ", lvector_subseq, 3},
+    {"STRING-COPY-INTO", lstring_copy_into, 5},
+    {"STRING-CHUNKS", lstring_chunks, 3},
+    {"SERIALIZE-INTO", lserialize_into, 4},
+    {"DESERIALIZE-FROM", ldeserialize_from, 5},
+    {"READ-CHAR-FILE-STREAM", lread_char_fs, 1},
+    {"UNREAD-CHAR-FILE-STREAM", lunread_char_fs, 2},
+    {"WRITE-CHAR-FILE-STREAM", lwrite_char_fs, 2},
+    {"FASL-VERSION", lfasl_version, 0},
+    {"ENSURE-PRIVATE-DIRECTORY", lensure_private_directory, 1},
+    {"POSIX-GETENV", lposix_getenv, 1}, {"DELETE-FILE", ldelete_file, 1}
 };
 
+/**
+ * Parses a size given in kilobytes on the command line
+ */
+size_t arg_size(const char *s) {
+    long n = atol(s);
+    if (n <= 0) {
+        fprintf(stderr, "Invalid size: %s\n", s);
+        exit(-1);
+    }
+    return (size_t) n * 1024;
+}
+
 int main(int argc, char *argv[]) {
-    int stack_size = sizeof(lval) * 64 * 1024;
     lval *g;
     int i;
+    int arg;
     lval sym;
+    cstack_base = (char *) &g;
+    start_ms = now_ms();
+    for (arg = 1; arg < argc; arg += 2) {
+        if (strcmp(argv[arg], "--stack") && strcmp(argv[arg], "--stack-max")) {
+            break;
+        }
+        if (arg == argc - 1) {
+            fprintf(stderr, "Missing size after %s\n", argv[arg]);
+            exit(-1);
+        }
+        if (!strcmp(argv[arg], "--stack")) {
+            /* initial lisp stack size, also the size of a growth segment */
+            stack_segment = arg_size(argv[arg + 1]);
+        } else {
+            /* lisp stack grows in segments up to this size */
+            stack_max = arg_size(argv[arg + 1]);
+        }
+    }
     memory_size = sizeof(lval) * 2048 * 1024;
     memory = malloc(memory_size);
     memf = memory;
     memset(memory, 0, memory_size);
     memf[0] = 0;
     memf[1] = memory_size / sizeof(lval);
-    stack = malloc(stack_size);
-    memset(stack, 0, stack_size);
+    stack_init();
     g = stack + 5; /* TODO: constants for stack management */
     pkg = mkp(g, "CL", "COMMON-LISP");
     for (i = 0; i < countof(symi); i++) {
@@ -2057,29 +6128,32 @@ int main(int argc, char *argv[]) {
         ins = stdin;
         symi[i].sym = sym;
         if (symi[i].fun) {
-            o2a(sym)[5] = ma(g, 5, 212, ms(g, 3, 212, symi[i].fun, 0, -1), 0, 0, 0, sym);
+            o2a(sym)[5] = mkfn(g, symi[i].fun, 0, -1, 0, 0, 0, sym);
         }
         if (symi[i].setfun) {
-            o2a(sym)[6] = ma(g, 5, 212, ms(g, 3, 212, symi[i].setfun, 0, -1), 8, 0, 0, sym);
+            o2a(sym)[6] = mkfn(g, symi[i].setfun, 0, -1, 8, 0, 0, sym);
         }
         o2a(sym)[7] = i << 3;
     }
     kwp = mkp(g, "KEYWORD", "");
     o2a(symi[81].sym)[4] = pkgs = l2(g, kwp, pkg);
 #ifdef _WIN32
-    o2a(symi[78].sym)[4] = ms(g, 3, 116, 1, GetStdHandle(STD_INPUT_HANDLE), 0, 0);
-    o2a(symi[79].sym)[4] = ms(g, 3, 116, 1, GetStdHandle(STD_OUTPUT_HANDLE), TRUE, 0);
-    o2a(symi[80].sym)[4] = ms(g, 3, 116, 1, GetStdHandle(STD_ERROR_HANDLE), TRUE, 0);
+    o2a(symi[78].sym)[4] = fs_make(g, (lval) GetStdHandle(STD_INPUT_HANDLE), 0, 0);
+    o2a(symi[79].sym)[4] = fs_make(g, (lval) GetStdHandle(STD_OUTPUT_HANDLE), TRUE, 0);
+    o2a(symi[80].sym)[4] = fs_make(g, (lval) GetStdHandle(STD_ERROR_HANDLE), TRUE, 16);
 #else
-    o2a(symi[78].sym)[4] = ms(g, 3, 116, 1, 0, 0, 0);
-    o2a(symi[79].sym)[4] = ms(g, 3, 116, 1, 1, TRUE, 0);
-    o2a(symi[80].sym)[4] = ms(g, 3, 116, 1, 2, TRUE, 0);
+    o2a(symi[78].sym)[4] = fs_make(g, 0, 0, 0);
+    o2a(symi[79].sym)[4] = fs_make(g, 1, TRUE, 0);
+    o2a(symi[80].sym)[4] = fs_make(g, 2, TRUE, 16);
 #endif
-    for (i = 1; i < argc; i++) {
-        load(g, argv[i]);
+    atexit(fs_flush_all);
+    for (; arg < argc; arg++) {
+        load(g, argv[arg]);
     }
     setjmp(top_jmp);
+    top_jmp_armed = 1;
     do {
+        fs_flush_all();
         printf("? ");
     } while (ep(g, lread(g)));
     return 0;
@@ -0,0 +1,274 @@
+/**
+ * Runtime interface of LISP 800 for code produced by the native compiler.
+ * </p>
+ * compile-file writes C that includes this header and is linked into a
+ * shared object, which the runtime loads back with FASL. Everything a
+ * compiled function needs from the runtime - object representation,
+ * allocation, the calling convention and the dynamic state - is declared
+ * here; the definitions live in lisp800.c.
+ */
+
+#ifndef LISP800_H
+#define LISP800_H
+
+#include <setjmp.h>
+#include <stdint.h>
+
+#ifdef __MACH__
+#define setjmp(e) sigsetjmp(e, 0)
+#define longjmp siglongjmp
+#endif
+
+/**
+ * Marks runtime entry points for export from the executable. On windows
+ * compiled modules see the same declarations as imports.
+ */
+#ifdef _WIN32
+#ifdef LISP800_RUNTIME
+#define X __declspec(dllexport)
+#else
+#define X __declspec(dllimport)
+#endif
+#else
+#define X
+#endif
+
+/**
+ * Version of the interface below. Compiled modules record the version they
+ * were built against, and FASL refuses modules built against another.
+ */
+#define LISP800_ABI_VERSION (1)
+
+/* TODO: forget about windows and use stdbool? */
+typedef int lbool;
+#define L_FALSE (0)
+#define L_TRUE (1)
+
+/**
+ * Integer type, compatible with lval type. All the resultant integers
+ * should be placed into this type to avoid overflow error.
+ */
+typedef intptr_t lint;
+
+/**
+ * Main lvalue representation.
+ * </p>
+ * First two bits represents a value type.
+ * </p>
+ * Note, that pointer types (e.g. cons cells) - are expected to be *ALWAYS*
+ * aligned at least by 4, since the trailing bits are used to represent type
+ * information and considered to always be zero.
+ * This seems to not be a problem for all the modern unix.
+ * </p>
+ * Zero value is reinterpreted as nil.
+ *
+ * @see #LVAL_TYPE_MASK
+ * @see #LVAL_ANUM_TYPE
+ * @see #LVAL_CONS_TYPE
+ * @see #LVAL_IREF_TYPE
+ * @see #LVAL_JREF_TYPE
+ */
+typedef lint lval;
+
+
+/**
+ * Value that represents lval's nil
+ */
+#define LVAL_NIL            ((lval) 0)
+
+/**
+ * Represents bit mask that should be applied to lval to extract type info.
+ * Changing this to the different value will have immediate impact on all the
+ * bitwise type operations.
+ */
+#define LVAL_TYPE_MASK      (3)
+
+
+/**
+ * Extracts lval type (first two bits)
+ */
+#define LVAL_GET_TYPE(l) ((l) & LVAL_TYPE_MASK)
+
+/**
+ * Simple objects written as is into the lval.
+ */
+#define LVAL_INLINE_TYPE    (0)
+
+
+/**
+ * Cons cell
+ */
+#define LVAL_CONS_TYPE      (1)
+
+/**
+ * IREF objects.
+ * Sub types: symbol, simple-vector, array, package, function
+ */
+#define LVAL_IREF_TYPE      (2)
+
+/**
+ * JREF objects.
+ * Sub types: simple-string, double, simple-bit-vector, file-stream
+ */
+#define LVAL_JREF_TYPE      (3)
+
+
+
+/**
+ * JREF objects.
+ * Sub types: simple-string, double, simple-bit-vector, file-stream
+ */
+#define LVAL_JREF_TYPE      (3)
+
+/**
+ * Char code bit - applicable for ANUM type
+ */
+#define LVAL_CHAR_BIT       (8)
+
+/* Int conversion to/from lval */
+#define LVAL_AS_INT(l)      ((l) >> 5)
+#define INT_AS_LVAL(l)      ((l) << 5)
+
+/**
+ * Fixnums are the integers from -LVAL_FIXNUM_LIMIT below LVAL_FIXNUM_LIMIT.
+ */
+#define LVAL_FIXNUM_LIMIT   ((lint) 1 << (sizeof(lval) * 8 - 6))
+
+
+
+/**
+ * GC marker bit
+ *
+ * @see #gcm
+ * @see #gc
+ */
+#define LVAL_GCM_BIT        (4)
+
+
+/* Subtype codes */
+
+#define LVAL_IREF_FUNCTION_SUBTYPE              (212)
+#define LVAL_IREF_SYMBOL_SUBTYPE                (20)
+#define LVAL_IREF_SIMPLE_VECTOR_SUBTYPE         (116)
+#define LVAL_IREF_PACKAGE_SUBTYPE               (180)
+
+#define LVAL_JREF_SIMPLE_STRING_SUBTYPE         (20)
+#define LVAL_JREF_DOUBLE_SUBTYPE                (84)
+#define LVAL_JREF_BIT_VECTOR_SUBTYPE            (116)
+#define LVAL_JREF_OCTET_VECTOR_SUBTYPE          (148)
+
+#define LVAL_JREF_SIZE_BIT_SHIFT                (6)
+
+#define LVAL_IREF_SIZE_BIT_SHIFT                (8)
+
+
+/**
+ * Multiple values of the last call, or 8 for a single value.
+ */
+extern X lval xvalues;
+
+/**
+ * Dynamic state stack: special bindings, catch tags, block and tagbody
+ * exits and unwind-protect cleanups, innermost first.
+ */
+extern X lval dyns;
+
+extern X volatile int safepoint_pending;
+
+/**
+ * Lowest C stack address a call may start from before the overflow
+ * reserve is used, see call.
+ */
+extern X char *cstack_limit;
+
+X lval *o2c(lval o);
+X lval c2o(lval * c);
+X int cp(lval o);
+X lval *o2a(lval o);
+X lval a2o(lval * a);
+X int ap(lval o);
+X lval *o2s(lval o);
+X char *o2z(lval o);
+X lval s2o(lval * s);
+X int sp(lval o);
+X lval car(lval c);
+X lval cdr(lval c);
+X lval cons(lval * g, lval a, lval d);
+X lval ma(lval * g, int n, ...);
+X lval ms(lval * g, int n, ...);
+X lval d2o(lval * g, double d);
+X double o2d(lval o);
+X lval rest(lval * h, lval * g);
+X lval rvalues(lval * g, lval v);
+X lval mvalues(lval a);
+X lval call(lval * f, lval fn, unsigned d);
+X int dbgr(lval * f, int x, lval val, lval * vp);
+X void safepoint(lval * g);
+X void unwind(lval * f, lval c);
+
+/* Support for compiled code, see lisp800.c */
+X lval symval(lval * g, lval sym);
+X lval symfun(lval * g, lval sym, int i);
+X lval make_closure(lval * g, lval(*fn) (), int min, int max, lval env,
+                     lval name);
+X lval getkey(lval l, lval key);
+X void bind_special(lval * g, lval sym, lval val);
+X void progv_bind(lval * g, lval syms, lval vals);
+X void block_return(lval * g, lval tag, lval v);
+X void tagbody_go(lval * g, lval tag, int k);
+X void throw_to(lval * g, lval tag, lval v);
+X lval mv_call(lval * g, lval fn, lval * l, int k);
+X lval box_integer(lval * g, lint n);
+X lint fixnum_value(lval * g, lval x);
+X lint fixnum_check(lval * g, lint n);
+X lint fixnum_of_double(lval * g, double d);
+X double double_value(lval * g, lval x);
+X lval *svref_place(lval * g, lval v, lint i);
+X void *foreign_symbol(lval * f, lval name, lval lib);
+X char *foreign_buffer(lval * g, lval x);
+X unsigned char *foreign_octets(lval * g, lval x);
+X void *foreign_pointer(lval * g, lval x);
+X lval box_pointer(lval * g, void *p);
+X lval foreign_string(lval * g, const char *s);
+
+/**
+ * Call site of compiled code linked to the global function of a symbol.
+ * </p>
+ * The site keeps the function object it was linked to and its entry
+ * point. While the symbol still names that function the call skips the
+ * lookup and arity checks done by call; redefinition changes the symbol's
+ * function slot, so the next call through the site relinks it. Linked
+ * sites are GC roots for the function they hold.
+ */
+typedef struct call_link {
+    lval fn;
+    lval (*code) ();
+    struct call_link *next;
+} call_link;
+
+X lval link_call(lval * f, call_link * k, lval sym, unsigned d);
+
+#ifndef LISP800_RUNTIME
+/**
+ * Calls the function of sym with the d arguments at f[2].. through the
+ * site k, see call_link.
+ */
+static lval call_linked(lval * f, call_link * k, lval sym, unsigned d) {
+#ifndef _WIN32
+    char here;
+    if (k->fn == ((lval *) (sym - LVAL_IREF_TYPE))[5] && k->fn &&
+        !safepoint_pending && &here >= cstack_limit) {
+        xvalues = 8;
+        f[1] = k->fn;
+        return k->code(f + 1, f + d + 2);
+    }
+#endif
+    return link_call(f, k, sym, d);
+}
+#endif
+X void fasr(lval * f, lval * package, int np, lval * symbol,
+           lval * symbol_package, int ns, lval * klass, int nk,
+           lval * value_data, int nv, lval * opaque_data, int no,
+           lval ** value, lval ** opaque);
+
+#endif /* LISP800_H */
@@ -45,25 +45,6 @@
       (cons 'funcall (cons (list 'function (list 'setf (car place)))
 			   (cons new-value (cdr place))))
       (list 'setq place new-value)))
-(defun append (&rest lists)
-  (if (cdr lists)
-      (let ((list (car lists))
-	    (result nil)
-	    (end nil))
-	(if list
-	    (tagbody
-	     start
-	       (if list
-		   (progn
-		     (setf end (if end
-				   (setf (cdr end) (list (car list)))
-				   (setf result (list (car list)))))
-		     (setf list (cdr list))
-		     (go start)))
-	       (setf (cdr end) (apply #'append (cdr lists)))
-	       (return-from append result))
-	    (apply #'append (cdr lists))))
-      (car lists)))
 (defun backquote-expand (list level)
   (if (consp list)
       (if (eq 'backquote (car list))
@@ -144,29 +125,6 @@
 		(not (eq (car form) 'quote))))))
 (defun null (object) (if object nil t))
 (defun not (object) (if object nil t))
-(defun length (sequence)
-  (let ((tag (ldb '(2 . 0) (ival sequence))))
-    (if (= tag 0)
-	0
-	(if (= tag 1)
-	    (let ((i 0)) (dolist (elem sequence i) (setf i (+ 1 i))))
-	    (if (= tag 2)
-		(let ((subtag (iref sequence 1)))
-		  (if (= subtag 3)
-		      (/ (ival (iref sequence 0)) 256)
-		      (if (= subtag 4)
-			  (let ((dimensions/fill (iref sequence 3)))
-			    (if (consp dimensions/fill)
-				(error "not a sequence")
-				(or dimensions/fill
-				    (length (iref sequence 4)))))
-			  0)))
-		(let ((subtag (jref sequence 1)))
-		  (if (= subtag 20)
-		      (- (/ (jref sequence 0) 64) 4)
-		      (if (= subtag 116)
-			  (- (/ (jref sequence 0) 8) 31)
-			  (error "not a sequence")))))))))
 (defun mod (x y) (multiple-value-call #'(lambda (q r) r) (floor x y)))
 (defun functionp (object) (eq (type-of object) 'function))
 (defun coerce (object result-type)
@@ -295,6 +253,9 @@
       (setq ,@sets ,@rest))))
 (defmacro return (&optional result)
   `(return-from nil ,result))
+;; The interpreter takes the declared type on trust.
+(defmacro the (value-type form)
+  form)
 (defmacro when (test-form &rest forms)
   `(if ,test-form (progn ,@forms)))
 (defmacro unless (test-form &rest forms)
@@ -355,6 +316,7 @@
 	 (20 'simple-string)
 	 (84 'double)
 	 (116 'simple-bit-vector)
+	 (148 '(simple-array (unsigned-byte 8) (*)))
 	 (t 'file-stream)))))
 (defmacro ecase (keyform &rest clauses)
   (let ((temp (gensym)))
@@ -396,66 +358,28 @@
       (let ((,temp ,second-form))
 	,@forms
 	,temp))))
-(defun eql (a b)
-  (or (eq a b)
-      (and (= (ldb '(2 . 0) (ival a)) 3)
-	   (= (ldb '(2 . 0) (ival b)) 3)
-	   (= (jref a 1) 84)
-	   (= (jref b 1) 84)
-	   (= a b))))
-(defun equal (a b)
-  (or (eql a b)
-      (cond
-	((not a) nil)
-	((consp a) (and (consp b)
-			(equal (car a) (car b))
-			(equal (cdr a) (cdr b))))
-	((stringp a) (and (stringp b)
-			  (string= a b)))
-	((bit-vector-p a) (and (bit-vector-p b)
-			       (= (length a) (length b))
-			       (dotimes (i (length a) t)
-				 (when (/= (aref a i) (aref b i))
-				   (return))))))))
-(defun equalp (a b)
-  (or (eql a b)
-      (cond
-	((not a) nil)
-	((characterp a) (and (characterp b)
-			     (char-equal a b)))
-	((consp a) (and (consp b)
-			(equalp (car a) (car b))
-			(equalp (cdr a) (cdr b))))
-	((arrayp a) (and (arrayp b)
-			 (equal (array-dimensions a) (array-dimensions b))
-			 (dotimes (i (apply #'* (array-dimensions a)) t)
-			   (unless (equalp (row-major-aref a i)
-					   (row-major-aref b i))
-			     (return)))))
-	((= (ldb '(2 . 0) (ival a)) 2)
-	 (and (= (ldb '(2 . 0) (ival b)) 2)
-	      (eq (iref a 1) (iref b 1))
-	      (= (ldb '(2 . 0) (ival (iref a 1))) 2)
-	      (dotimes (i (iref a 0) t)
-		(unless (equalp (iref a (+ 2 i)) (iref b (+ 2 i)))
-		  (return))))))))
 (defun identity (object) object)
 (defun complement (function)
   #'(lambda (&rest rest) (not (apply function rest))))
 (defun constantly (value) #'(lambda (&rest rest) value))
+(defun leading-declarations (forms)
+  (when (and (consp (car forms)) (eq (caar forms) 'declare))
+    (cons (car forms) (leading-declarations (cdr forms)))))
 (defmacro do (vars (end-test-form &rest result-forms) &rest forms)
   (let ((start (gensym))
 	(inits nil)
-	(steps nil))
+	(steps nil)
+	(declarations (leading-declarations forms)))
   `(block nil
     (let ,(dolist (var vars (reverse inits))
 	    (push (if (consp var)
 		      (list (car var) (cadr var))
 		      (list var)) inits))
+      ,@declarations
       (tagbody
 	 ,start
 	 (if ,end-test-form (return (progn ,@result-forms)))
-	 ,@forms
+	 ,@(nthcdr (length declarations) forms)
 	 ,@(dolist (var vars (when steps `((psetq ,@(reverse steps)))))
 	     (when (and (consp var) (cddr var))
 	       (push (car var) steps)
@@ -464,16 +388,18 @@
 (defmacro do* (vars (end-test-form &rest result-forms) &rest forms)
   (let ((start (gensym))
 	(inits nil)
-	(steps nil))
+	(steps nil)
+	(declarations (leading-declarations forms)))
   `(block nil
     (let* ,(dolist (var vars (reverse inits))
 	     (push (if (consp var)
 		       (list (car var) (cadr var))
 		       (list var)) inits))
+      ,@declarations
       (tagbody
 	 ,start
 	 (if ,end-test-form (return (progn ,@result-forms)))
-	 ,@forms
+	 ,@(nthcdr (length declarations) forms)
 	 ,@(dolist (var vars (when steps `((setq ,@(reverse steps)))))
 	     (when (and (consp var) (cddr var))
 	       (push (car var) steps)
@@ -481,14 +407,16 @@
 	 (go ,start))))))
 (defmacro dotimes ((var count-form &optional result-form) &rest forms)
   (let ((start (gensym))
-	(count (gensym)))
+	(count (gensym))
+	(declarations (leading-declarations forms)))
     `(block nil
       (let ((,var 0)
 	    (,count ,count-form))
+	,@declarations
 	(tagbody
 	   ,start
 	   (when (< ,var ,count)
-	     ,@forms
+	     ,@(nthcdr (length declarations) forms)
 	     (incf ,var)
 	     (go ,start)))
 	,result-form))))
@@ -654,15 +582,17 @@
 (defmacro handler-case (expression &rest clauses)
   (let ((tag (gensym))
 	(bindings nil))
-    `(handler-bind
-      ,(dolist (clause clauses (reverse bindings))
-	 (let ((typespec (car clause))
-	       (var-list (cadr clause))
-	       (forms (cddr clauses)))
-	   (push `(typespec #'(lambda (,(if var-list (car var-list) (gensym)))
-				(return-from tag (progn ,@forms))))
-		 bindings)))
-      ,expression)))
+    `(block ,tag
+      (handler-bind
+	  ,(dolist (clause clauses (reverse bindings))
+	     (let ((typespec (car clause))
+		   (var-list (cadr clause))
+		   (forms (cddr clause)))
+	       (push `(,typespec
+		       #'(lambda (,(if var-list (car var-list) (gensym)))
+			   (return-from ,tag (progn ,@forms))))
+		     bindings)))
+	,expression))))
 (defmacro ignore-errors (&rest forms)
   `(handler-case (progn ,@forms)
     (error (condition) (values nil condition))))
@@ -779,6 +709,7 @@
 (defun symbolp (object) (or (null object) (eq (type-of object) 'symbol)))
 (defun keywordp (object)
   (and (symbolp object)
+       (symbol-package object)
        (string= (package-name (symbol-package object)) "KEYWORD")))
 (defun make-symbol (name)
   (let ((symbol (makei 9 0 name nil nil nil nil (- 1) 0)))
@@ -801,6 +732,11 @@
     new-symbol))
 (defun fixnump (object)
   (= (ldb '(5 . 0) (ival object)) 16))
+(defconstant most-positive-fixnum
+  (labels ((limit (n)
+	     (if (fixnump (* 2 n)) (limit (* 2 n)) (+ n (- n 1)))))
+    (limit 1)))
+(defconstant most-negative-fixnum (- (- most-positive-fixnum) 1))
 (defvar *gensym-counter* 0)
 (defun gen-sym (&optional x)
   (let ((prefix (if (stringp x) x "G"))
@@ -863,33 +799,32 @@
     (unless (atom (package-get (iref package 3) (symbol-name symbol)))
       (unless (atom (package-get (iref package 4) (symbol-name symbol)))
 	(cerror 'package-error :package package))
-      (package-rem (iref package 4) symbol)
+      (package-rem (iref package 4) (symbol-name symbol))
       (package-put (iref package 3) symbol))))
-(defun package-rehash (old-vector new-vector)
-  (let ((old-length (length old-vector))
-	(new-length (length new-vector))
-	(i 0))
-    (tagbody
-     start
-       (when (< i old-length)
-	 (dolist (symbol (iref old-vector (+ 2 i)))
-	   (push symbol (iref new-vector (+ 2 (mod (hash (symbol-name symbol))
-						   new-length)))))
-	 (incf i)
-	 (go start)))
-    new-vector))
-(defun package-get (vector string)
-  (dolist (symbol (iref vector (+ 2 (mod (hash string) (length vector))))
-	   '(nil))
-    (when (string= (symbol-name symbol) string)
-      (return symbol))))
-(defun package-put (vector symbol)
-  (push symbol (iref vector (+ 2 (mod (hash (symbol-name symbol))
-				      (length vector))))))
-(defun package-rem (vector string)
-  (let ((index (+ 2 (mod (hash string) (length vector)))))
-    (setf (iref vector index)
-	  (delete string (iref vector index) :key #'symbol-name))))
+(defparameter *standard-class* (makei 1 0))
+(setf (iref *standard-class* 1) *standard-class*)
+(defparameter *structure-class* (makei 1 *standard-class*))
+(defparameter *hash-table* (makei 1 *structure-class*))
+;; The symbol tables of the packages made at startup become EQUAL hash
+;; tables here.
+(dolist (package *packages*)
+  (dolist (index '(3 4))
+    (let ((table (iref package index)))
+      (setf (iref table 1) *hash-table*)
+      (setf (iref table 3) 1.999)
+      (setf (iref table 4) 1)
+      (setf (iref table 5) 'equal))))
+(defun package-get (table string)
+  (multiple-value-bind (symbol foundp) (gethash string table)
+    (if foundp symbol '(nil))))
+(defun package-put (table symbol)
+  (setf (gethash (symbol-name symbol) table) symbol))
+(defun package-rem (table string)
+  (remhash string table))
+(defun package-symbols (table)
+  (let ((symbols nil))
+    (maphash #'(lambda (name symbol) (push symbol symbols)) table)
+    symbols))
 (defun find-symbol (string &optional (package *package*))
   (setq package (find-package package))
   (unless package
@@ -904,7 +839,7 @@
 		       (values nil nil))
 		(let ((symbol (package-get (iref used-package 3) string)))
 		  (when (atom symbol)
-		    (values symbol :inherited)))))))))
+		    (return (values symbol :inherited))))))))))
 (defun find-all-symbols (string)
   (let ((symbols nil))
     (dolist (package *packages*)
@@ -962,13 +897,14 @@
   (prog1
       (package-name package)
     (setf (iref package 2) nil)))
-(defun make-package (package-name &key nicknames (use '("cl")))
+(defun make-package (package-name &key nicknames (use '("CL")))
   (let ((all-names (cons package-name nicknames)))
     (mapc #'(lambda (name)
 	      (when (find-package name)
 		(cerror 'package-error :package name)))
 	  all-names)
-    (let ((package (makei 6 5 all-names (make-array 1021) (make-array 1021) nil
+    (let ((package (makei 6 5 all-names (make-hash-table :test 'equal)
+			  (make-hash-table :test 'equal) nil
 			  (mapcar #'find-package use))))
       (mapc #'(lambda (used-package)
 		(push package (iref (find-package used-package) 7)))
@@ -982,8 +918,8 @@
   (unless (first iterator)
     (setf (first iterator)
 	  (case (pop (third iterator))
-	    (:internal (iref (second iterator) 4))
-	    (:external (iref (second iterator) 3))
+	    (:internal (package-symbols (iref (second iterator) 4)))
+	    (:external (package-symbols (iref (second iterator) 3)))
 	    (:inherited "FIXME")
 	    ((nil) (return-from package-iterate nil)))))
   (pop (first iterator)))
@@ -1013,7 +949,7 @@
 		      (atom (package-get (iref package 4) name)))))
     (package-rem (iref package 3) name)
     (package-rem (iref package 4) name)
-    (setf (iref package 5) (delete symbol (iref package 5)))
+    (setf (iref package 5) (remove symbol (iref package 5)))
     present))
 (defmacro in-package (name)
   `(setf *package* (find-package ',name)))
@@ -1021,9 +957,9 @@
   (setq package (find-package package))
   (dolist (package-to-unuse (designator-list packages-to-unuse))
     (setq package-to-unuse (find-package package-to-unuse))
-    (setf (iref package 6) (delete package-to-unuse (iref package 6)))
+    (setf (iref package 6) (remove package-to-unuse (iref package 6)))
     (setf (iref package-to-unuse 7)
-	  (delete package (iref package-to-unuse 7))))
+	  (remove package (iref package-to-unuse 7))))
   t)
 (defun use-package (packages-to-use &optional (package *package*))
   (setq package (find-package package))
@@ -1074,41 +1010,25 @@
       ,(option :nicknames)
       ,(option :shadow) ,(options :shadowing-import-from) ,(option :use)
       ,(options :import-from) ,(option :intern) ,(option :export))))
-(defmacro do-symbols ((var &optional (package *package*) result-form)
+(defmacro do-symbols ((var &optional (package '*package*) result-form)
 		      &rest forms)
   (let ((package-sym (gensym)))
-    `(block nil
-      (let ((,package-sym (find-package package))
-	    (,var nil))
-	(dolist (,var (iref ,package-sym 3))
-	  ,@forms)
-	(dolist (,var (iref ,pakcage-sym 4))
-	  ,@forms)
-	,result-form))))
-(defmacro do-external-symbols ((var &optional (package *package*) result-form)
+    `(let ((,package-sym (find-package ,package)))
+      (dolist (,var (nconc (package-symbols (iref ,package-sym 3))
+			   (package-symbols (iref ,package-sym 4)))
+	       ,result-form)
+	,@forms))))
+(defmacro do-external-symbols ((var &optional (package '*package*) result-form)
 			       &rest forms)
   (let ((package-sym (gensym)))
     `(let ((,package-sym (find-package ,package)))
-      (dolist (,var (iref ,package-sym 3) ,result-form)
+      (dolist (,var (package-symbols (iref ,package-sym 3)) ,result-form)
 	,@forms))))
 (defmacro do-all-symbols ((var &optional result-form) &rest forms)
-  (let ((package (gensym))
-	(symbols (gensym))
-	(first (gensym))
-	(start-out (gensym))
-	(start (gensym)))
-    `(let ((,symbols nil)
-	   (,first t))
-      (dolist (,package *packages* ,result-form)
-	,start-out
-	(setq ,symbols (iref ,package (if ,first 3 4)))
-	(setq ,first (not ,first))
-	,start
-	(when ,symbols
-	  ,@forms
-	  (go ,start))
-	(when ,first
-	  (go ,start-out))))))
+  (let ((package (gensym)))
+    `(dolist (,package *packages* ,result-form)
+      (do-symbols (,var ,package)
+	,@forms))))
 (defun intern (string &optional (package *package*))
   (setq package (find-package package))
   (multiple-value-bind (symbol status)
@@ -1362,8 +1282,6 @@
 	tree)
       (let ((a (apply #'assoc tree alist rest)))
 	(if a (cdr a) tree))))
-(defun copy-list (list)
-  (if (consp list) (cons (car list) (copy-list (cdr list))) list))
 (defun make-list (size &key initial-element)
   (if (= size 0) nil
       (cons initial-element
@@ -1410,19 +1328,9 @@
 (defun (setf ninth) (new-object list) (setf (nth 8 list) new-object))
 (defun tenth (list) (nth 9 list))
 (defun (setf tenth) (new-object list) (setf (nth 9 list) new-object))
-(defun nth (n list) (if (< n 1) (car list) (nth (- n 1) (cdr list))))
 (defun (setf nth) (new-object n list)
-  (if (< n 1)
-      (setf (car list) new-object)
-      (setf (nth (- n 1) (cdr list)) new-object)))
+  (setf (car (nthcdr n list)) new-object))
 (defun endp (list) (not list))
-(defun nconc (&rest lists)
-  (if (cdr lists)
-      (if (car lists)
-	  (progn (setf (cdr (last (car lists))) (apply #'nconc (cdr lists)))
-		 (car lists))
-	  (apply #'nconc (cdr lists)))
-      (car lists)))
 (defun revappend (list tail)
   (if list
       (revappend (cdr list) (cons (car list) tail))
@@ -1474,23 +1382,6 @@
 	 (go start)))
     (setf (cdr e) nil)
     list))
-(defun last (list &optional (n 1))
-  (let* ((e list)
-	 (m 0))
-    (tagbody
-     start
-       (when (consp e)
-	 (setf m (+ m 1))
-	 (setf e (cdr e))
-	 (go start)))
-    (setf n (- m n))
-    (setf e list)
-    (tagbody
-     start
-       (when (< n 1) (return-from last e))
-       (setf e (cdr e))
-       (setf n (- n 1))
-       (go start))))
 (defun ldiff (list object)
   (let* ((r (cons nil nil))
 	 (e r))
@@ -1508,56 +1399,8 @@
      (unless (consp list) (return-from tailp nil))
      (setf list (cdr list))
      (go start)))
-(defun nthcdr (n list) (if (< n 1) list (nthcdr (- n 1) (cdr list))))
 (defun rest (list) (cdr list))
 (defun (setf rest) (new-tail list) (setf (cdr list) new-tail))
-(labels ((all-end (lists)
-	   (dolist (elem lists nil)
-	     (unless elem (return-from all-end t))))
-	 (all-car (lists)
-	   (when lists (cons (caar lists) (all-car (cdr lists)))))
-	 (all-cdr (lists)
-	   (when lists (cons (cdar lists) (all-cdr (cdr lists))))))
-  (defun mapc (function &rest lists)
-    (let ((list-1 (car lists)))
-      (tagbody
-       start
-	 (when (all-end lists) (return-from mapc list-1))
-	 (apply function (all-car lists))
-	 (setf lists (all-cdr lists))
-	 (go start))))
-  (defun mapcar (function &rest lists)
-    (let ((result nil)
-	  (end nil))
-      (tagbody
-       start
-	 (when (all-end lists) (return-from mapcar result))
-	 (let ((cons (cons (apply function (all-car lists)) nil)))
-	   (setf end (if end (setf (cdr end) cons) (setf result cons))))
-	 (setf lists (all-cdr lists))
-	 (go start))))
-  (defun mapl (function &rest lists)
-    (let ((list-1 (car lists)))
-      (tagbody
-       start
-	 (when (all-end lists) (return-from mapl list-1))
-	 (apply function lists)
-	 (setf lists (all-cdr lists))
-	 (go start))))
-  (defun maplist (function &rest lists)
-    (let ((result nil)
-	  (end nil))
-      (tagbody
-       start
-	 (when (all-end lists) (return-from maplist result))
-	 (let ((cons (cons (apply function lists) nil)))
-	   (setf end (if end (setf (cdr end) cons) (setf result cons))))
-	 (setf lists (all-cdr lists))
-	 (go start)))))
-(defun mapcan (function &rest lists)
-  (apply #'nconc (apply #'mapcar function lists)))
-(defun mapcon (function &rest lists)
-  (apply #'nconc (apply #'maplist function lists)))
 (defun acons (key datum alist) (cons (cons key datum) alist))
 (defun copy-alist (alist)
   (when alist (cons (if (consp (car alist))
@@ -1582,6 +1425,38 @@
        (pop list1)
        (pop list2)
        (go start))))
+;; Vectors whose elements sit in a simple-vector, string or bit-vector are
+;; scanned by the VECTOR- builtins in C; SEQUENCE-TEST-KIND tells them
+;; which tests they may apply inline.
+(defun sequence-test-kind (test test-not)
+  (let ((function (or test test-not)))
+    (when (symbolp function)
+      (setq function (and function (fdefinition function))))
+    (+ (if test-not 8 0)
+       (cond ((null function) 2)
+	     ((or (eq function #'eq) (eq function #'char=)) 1)
+	     ((eq function #'eql) 2)
+	     ((eq function #'equal) 3)
+	     ((or (eq function #'equalp) (eq function #'char-equal)) 4)
+	     (t 0)))))
+(defun vector-storage (sequence)
+  (unless (listp sequence)
+    (case (array-type sequence)
+      ((0 1 2 5) sequence)
+      (3 (let ((content (iref sequence 4)))
+	   (when (and (atom (iref sequence 3))
+		      (member (array-type content) '(0 1 2 5)))
+	     content))))))
+(defun vector-scan (function item sequence kind rest &optional extra)
+  (let ((content (vector-storage sequence)))
+    (apply #'vector-scan-keys function item content
+	   (if (eq content sequence) 0 (or (iref sequence 5) 0))
+	   (length sequence) kind extra rest)))
+(defun vector-scan-keys (function item vector offset length kind extra
+			 &key (start 0) end from-end key test test-not count)
+  (funcall function item vector offset length start (or end length) from-end
+	   (or test test-not) key (or kind (sequence-test-kind test test-not))
+	   count extra))
 (flet ((satisfies (object elem &key key test test-not)
 	 (let* ((zi (if key (funcall key elem) elem))
 		(r (funcall (or test test-not #'eql) object zi)))
@@ -1604,7 +1479,9 @@
 			(go start)))
 		   (list 3 acc start))
 		 (list 2 (nthcdr start sequence) start))
-	     (if from-end (cons 1 (- end 1)) (cons 0 start))))
+	     (if from-end
+		 (cons 1 (- (or end (length sequence)) 1))
+		 (cons 0 start))))
        (seq-position (iter)
 	 (case (car iter)
 	   ((0 1) (cdr iter))
@@ -1627,7 +1504,7 @@
 	   ((0 1) (setf (aref sequence (cdr iter)) value))
 	   (2 (setf (caadr iter) value))
 	   (t (setf (caaadr iter) value))))
-       (seq-end-p (sequence iter &key start end from-end)
+       (seq-end-p (sequence iter &key (start 0) end from-end)
 	 (case (car iter)
 	   (0 (or (= (cdr iter) (length sequence))
 		  (and end (= end (cdr iter)))))
@@ -1644,14 +1521,6 @@
 			  :initial-contents result))
 	   (2 (reverse result))
 	   (3 result))))
-  (defun member (item list &rest rest)
-    (tagbody
-       start
-       (when list
-	 (when (apply #'satisfies item (car list) rest)
-	   (return-from member list))
-	 (setf list (cdr list))
-	 (go start))))
   (defun member-if (predicate list &rest rest)
     (tagbody
        start
@@ -1713,10 +1582,6 @@
 	  (setf (cdr tree) (apply #'subst new predicate (cdr tree) rest))
 	  tree)
 	(if (apply #'satisfies-if-not predicate tree rest) new tree)))
-  (defun assoc (item alist &rest rest)
-    (dolist (elem alist)
-      (when (apply #'satisfies item (car elem) rest)
-	(return-from assoc elem))))
   (defun assoc-if (predicate alist &rest rest)
     (dolist (elem alist)
       (when (apply #'satisfies-if predicate (car elem) rest)
@@ -1860,6 +1725,9 @@
 		   (go start))))
 	    elem))))
   (defun count (item sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from count
+	(vector-scan #'vector-count item sequence nil rest)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (count 0))
       (tagbody
@@ -1871,6 +1739,9 @@
 	   (go start)))
       count))
   (defun count-if (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from count-if
+	(vector-scan #'vector-count predicate sequence 5 rest)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (count 0))
       (tagbody
@@ -1882,6 +1753,9 @@
 	   (go start)))
       count))
   (defun count-if-not (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from count-if-not
+	(vector-scan #'vector-count predicate sequence 13 rest)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (count 0))
       (tagbody
@@ -1894,6 +1768,10 @@
 	   (go start)))
       count))
   (defun find (item sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from find
+	(let ((index (vector-scan #'vector-position item sequence nil rest)))
+	  (when index (aref sequence index)))))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1904,6 +1782,10 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun find-if (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from find-if
+	(let ((index (vector-scan #'vector-position predicate sequence 5 rest)))
+	  (when index (aref sequence index)))))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1914,6 +1796,10 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun find-if-not (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from find-if-not
+	(let ((index (vector-scan #'vector-position predicate sequence 13 rest)))
+	  (when index (aref sequence index)))))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1924,6 +1810,9 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun position (item sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from position
+	(vector-scan #'vector-position item sequence nil rest)))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1933,6 +1822,9 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun position-if (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from position-if
+	(vector-scan #'vector-position predicate sequence 5 rest)))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1942,6 +1834,9 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun position-if-not (predicate sequence &rest rest)
+    (when (vector-storage sequence)
+      (return-from position-if-not
+	(vector-scan #'vector-position predicate sequence 13 rest)))
     (let ((iter (apply #'seq-start sequence rest)))
       (tagbody
        start
@@ -1952,6 +1847,9 @@
 	   (seq-next iter)
 	   (go start)))))
   (defun remove (item sequence &rest rest &key count)
+    (when (vector-storage sequence)
+      (return-from remove
+	(vector-scan #'vector-remove item sequence nil rest sequence)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (result nil))
       (tagbody
@@ -1965,6 +1863,9 @@
 	   (go start)))
       (seq-result sequence iter result)))
   (defun remove-if (predicate sequence &rest rest &key count)
+    (when (vector-storage sequence)
+      (return-from remove-if
+	(vector-scan #'vector-remove predicate sequence 5 rest sequence)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (result nil))
       (tagbody
@@ -1978,6 +1879,9 @@
 	   (go start)))
       (seq-result sequence iter result)))
   (defun remove-if-not (predicate sequence &rest rest &key count)
+    (when (vector-storage sequence)
+      (return-from remove-if-not
+	(vector-scan #'vector-remove predicate sequence 13 rest sequence)))
     (let ((iter (apply #'seq-start sequence rest))
 	  (result nil))
       (tagbody
@@ -1989,7 +1893,68 @@
 	       (push elem result)))
 	   (seq-next iter)
 	   (go start)))
-      (seq-result sequence iter result))))
+      (seq-result sequence iter result)))
+  (defun nsubstitute-sequence (newitem item sequence kind rest)
+    (if (vector-storage sequence)
+	(vector-scan #'vector-substitute item sequence kind rest newitem)
+	(let ((iter (apply #'seq-start sequence rest))
+	      (count (getf rest :count)))
+	  (tagbody
+	   start
+	     (unless (or (apply #'seq-end-p sequence iter rest)
+			 (and count (< count 1)))
+	       (when (apply (case kind
+			      ((nil) #'satisfies)
+			      (5 #'satisfies-if)
+			      (t #'satisfies-if-not))
+			    item (seq-ref sequence iter) rest)
+		 (seq-set sequence iter newitem)
+		 (when count
+		   (decf count)))
+	       (seq-next iter)
+	       (go start)))))
+    sequence)
+  (defun nsubstitute (newitem olditem sequence &rest rest)
+    (nsubstitute-sequence newitem olditem sequence nil rest))
+  (defun nsubstitute-if (newitem predicate sequence &rest rest)
+    (nsubstitute-sequence newitem predicate sequence 5 rest))
+  (defun nsubstitute-if-not (newitem predicate sequence &rest rest)
+    (nsubstitute-sequence newitem predicate sequence 13 rest))
+  (defun substitute (newitem olditem sequence &rest rest)
+    (nsubstitute-sequence newitem olditem (subseq sequence 0) nil rest))
+  (defun substitute-if (newitem predicate sequence &rest rest)
+    (nsubstitute-sequence newitem predicate (subseq sequence 0) 5 rest))
+  (defun substitute-if-not (newitem predicate sequence &rest rest)
+    (nsubstitute-sequence newitem predicate (subseq sequence 0) 13 rest)))
+(defun search-storage (sequence)
+  (let ((content (vector-storage sequence)))
+    (cond ((eq content sequence) (values content 0))
+	  (content (values content (or (iref sequence 5) 0)))
+	  (t (let ((vector (makei (length sequence) 3))
+		   (i 0))
+	       (if (listp sequence)
+		   (dolist (element sequence)
+		     (setf (iref vector (+ 2 i)) element)
+		     (incf i))
+		   (dotimes (i (length sequence))
+		     (setf (iref vector (+ 2 i)) (aref sequence i))))
+	       (values vector 0))))))
+(defun mismatch (sequence-1 sequence-2 &key from-end test test-not key
+		 (start1 0) end1 (start2 0) end2)
+  (multiple-value-bind (vector-1 offset-1) (search-storage sequence-1)
+    (multiple-value-bind (vector-2 offset-2) (search-storage sequence-2)
+      (vector-mismatch vector-1 offset-1 start1 (or end1 (length sequence-1))
+		       vector-2 offset-2 start2 (or end2 (length sequence-2))
+		       from-end (or test test-not) key
+		       (sequence-test-kind test test-not)))))
+(defun search (sequence-1 sequence-2 &key from-end test test-not key
+	       (start1 0) end1 (start2 0) end2)
+  (multiple-value-bind (vector-1 offset-1) (search-storage sequence-1)
+    (multiple-value-bind (vector-2 offset-2) (search-storage sequence-2)
+      (vector-search vector-1 offset-1 start1 (or end1 (length sequence-1))
+		     vector-2 offset-2 start2 (or end2 (length sequence-2))
+		     from-end (or test test-not) key
+		     (sequence-test-kind test test-not)))))
 (defun array-type (array)
   (case (ldb '(2 . 0) (ival array))
     (2 (case (iref array 1)
@@ -2000,6 +1965,7 @@
     (3 (case (jref array 1)
 	 (20 0)
 	 (116 1)
+	 (148 5)
 	 (t (error "not an array"))))
     (t (error "not an array"))))
 (defun initial-contents (array subscripts initial-contents)
@@ -2023,7 +1989,9 @@
 		      (case element-type
 			(bit (makej total-size 116))
 			(character (makej (+ 1 (* 8 total-size)) 20))
-			(t (makei total-size 3)))))
+			(t (if (eq element-type t)
+			       (makei total-size 3)
+			       (makej (+ 1 (* 8 total-size)) 148))))))
 	 (array (if simple-vector-p
 		    content
 		    (makei 4 4 total-size
@@ -2033,22 +2001,23 @@
 			   content
 			   (when displaced-to displaced-index-offset)))))
     (unless displaced-to
-      (if initial-contents
-	  (initial-contents array nil initial-contents)
-	  (let ((i 0))
-	    (tagbody
-	     start
-	       (when (< i total-size)
-		 (setf (aref content i) initial-element)
-		 (incf i)
-		 (go start))))))
+      (cond (initial-contents
+	     (initial-contents array nil initial-contents))
+	    ((or initial-element (eq element-type t))
+	     (let ((i 0))
+	       (tagbody
+		start
+		  (when (< i total-size)
+		    (setf (aref content i) initial-element)
+		    (incf i)
+		    (go start)))))))
     array))
 (defun adjust-array (array dimensions &key element-type initial-element
 		     initial-contents fill-pointer displaced-to
 		     (displaced-index-offset 0))
   (setq dimensions (designator-list dimensions))
   (case (array-type array)
-    ((0 1 2 4) nil)
+    ((0 1 2 4 5) nil)
     (3 (let ((offset (iref array 5)))
 	 (if offset
 	     nil
@@ -2075,19 +2044,14 @@
        array)))
 (defun adjustable-array-p (array)
   (case (array-type array)
-    ((0 1 2) nil)
+    ((0 1 2 5) nil)
     ((3 4) t)
     (t (error "not an array"))))
-(defun aref (array &rest subscripts)
-  (row-major-aref array (apply #'array-row-major-index array subscripts)))
-(defun (setf aref) (new-element array &rest subscripts)
-  (setf (row-major-aref array (apply #'array-row-major-index array subscripts))
-	new-element))
 (defun array-dimension (array axis-number)
   (nth axis-number (array-dimensions array)))
 (defun array-dimensions (array)
   (case (array-type array)
-    (0 (list (- (/ (jref array 0) 64) 4)))
+    ((0 5) (list (- (/ (jref array 0) 64) 4)))
     (1 (list (- (/ (jref array 0) 8) 31)))
     (2 (list (/ (iref array 0) 8)))
     ((3 4) (let ((dims/fill (iref array 3)))
@@ -2095,7 +2059,7 @@
 (defun array-has-fill-pointer-p (array)
   (case (array-type array)
     ((3 4) (atom (iref array 3)))
-    ((0 1 2) nil)
+    ((0 1 2 5) nil)
     (t (error "not an array"))))
 (defun array-displacement (array)
   (case (array-type array)
@@ -2103,7 +2067,7 @@
 	     (if offset
 		 (values (iref array 4) offset)
 		 (values nil 0))))
-    ((0 1 2) (values nil 0))
+    ((0 1 2 5) (values nil 0))
     (t (error "not an array"))))
 (defun array-in-bounds-p (array &rest subscripts)
   (dolist (dim (array-dimensions array) t)
@@ -2124,7 +2088,7 @@
     index))
 (defun array-total-size (array)
   (case (array-type array)
-    ((0 1 2) (length array))
+    ((0 1 2 5) (length array))
     ((3 4) (iref array 2))
     (t (error "not an array"))))
 (defun arrayp (object)
@@ -2132,7 +2096,7 @@
     (2 (case (iref object 1)
 	 ((3 4 7) t)))
     (3 (case (jref object 1)
-	 ((20 116) t)))))
+	 ((20 116 148) t)))))
 (defun fill-pointer (vector)
   (case (array-type vector)
     ((3 4) (let ((dims/fill (iref vector 3)))
@@ -2151,73 +2115,16 @@
 	       (error "no fill pointer"))
 	     (setf (iref vector 3) new-fill-pointer)))
     (t (error "not a vector with fill pointer"))))
-(defparameter *big-endian* (= (ldb '(8 . 0) (jref "ABCD" 2)) 68))
-(if *big-endian*
-    (defun row-major-aref (array index)
-      (case (array-type array)
-	(0 (code-char (ldb (cons 8 (* 8 (- 3 (ldb '(2 . 0) index))))
-			   (jref array (+ 2 (/ index 4))))))
-	(1 (ldb (cons 1 (ldb '(5 . 0) index)) (jref array (+ 2 (/ index 32)))))
-	(2 (iref array (+ 2 index)))
-	(3 (row-major-aref (iref array 4) index))
-	(4 (error "accessing nil array"))
-	(t (error "not an array"))))
-    (defun row-major-aref (array index)
-      (case (array-type array)
-	(0 (code-char (ldb (cons 8 (* 8 (ldb '(2 . 0) index)))
-			   (jref array (+ 2 (/ index 4))))))
-	(1 (ldb (cons 1 (ldb '(5 . 0) index)) (jref array (+ 2 (/ index 32)))))
-	(2 (iref array (+ 2 index)))
-	(3 (row-major-aref (iref array 4) index))
-	(4 (error "accessing nil array"))
-	(t (error "not an array")))))
-(if *big-endian*
-    (defun (setf row-major-aref) (new-element array index)
-      (case (array-type array)
-	(0 (multiple-value-bind (index-major index-minor)
-	       (floor index 4)
-	     (setf (jref array (+ 2 index-major))
-		   (dpb (char-code new-element)
-			(cons 8 (* 8 (- 3 index-minor)))
-			(jref array (+ 2 index-major))))))
-	(1 (multiple-value-bind (index-major index-minor)
-	       (floor index 32)
-	     (setf (jref array (+ 2 index-major))
-		   (dpb new-element
-			(cons 1 index-minor)
-			(jref array (+ 2 index-major))))))
-	(2 (setf (iref array (+ 2 index)) new-element))
-	(3 (setf (row-major-aref (iref array 4) index) new-element))
-	(4 (error "accessing nil array"))
-	(t (error "not an array")))
-      new-element)
-    (defun (setf row-major-aref) (new-element array index)
-      (case (array-type array)
-	(0 (multiple-value-bind (index-major index-minor)
-	       (floor index 4)
-	     (setf (jref array (+ 2 index-major))
-		   (dpb (char-code new-element)
-			(cons 8 (* 8 index-minor))
-			(jref array (+ 2 index-major))))))
-	(1 (multiple-value-bind (index-major index-minor)
-	       (floor index 32)
-	     (setf (jref array (+ 2 index-major))
-		   (dpb new-element
-			(cons 1 index-minor)
-			(jref array (+ 2 index-major))))))
-	(2 (setf (iref array (+ 2 index)) new-element))
-	(3 (setf (row-major-aref (iref array 4) index) new-element))
-	(4 (error "accessing nil array"))
-	(t (error "not an array")))
-      new-element))
 (defun upgraded-array-element-type (typespec &optional environment)
   (setf typespec (designator-list typespec))
   (case (car typespec)
     ((base-char character) 'character)
     ((bit) 'bit)
-    ((unsigned-byte) (if (and (= (length typespec) 2)
-			      (= (second typespec) 1))
-			 'bit
+    ((unsigned-byte) (if (= (length typespec) 2)
+			 (case (second typespec)
+			   (1 'bit)
+			   ((2 3 4 5 6 7 8) '(unsigned-byte 8))
+			   (t 't))
 			 't))
     ((integer) (if (and (= (length typespec) 3)
 			(= (second typespec) 0)
@@ -2229,10 +2136,6 @@
   (case (ldb '(2 . 0) (ival object))
     (2 (= (iref object 1) 3))
     (3 (member (jref object 1) '(20 116)))))
-(defun svref (simple-vector index)
-  (aref simple-vector index))
-(defun (setf svref) (new-element simple-vector index)
-  (setf (aref simple-vector index) new-element))
 (defun vector (&rest objects)
   (let ((vector (makei (length objects) 3))
 	(i 2))
@@ -2261,49 +2164,75 @@
     (2 (case (iref object 1)
 	 (3 t)
 	 ((4 7) (atom (iref object 3)))))
-    (3 (member (jref object 1) '(20 116)))))
+    (3 (member (jref object 1) '(20 116 148)))))
 (defun simple-bit-vector-p (object)
   (and (= (ldb '(2 . 0) (ival object)) 3) (= (jref object 1) 116)))
 (defun bit-vector-p (object)
   (let ((tag (ldb '(2 . 0) (ival object))))
     (or (and (= tag 3) (= (jref object 1) 116))
 	(and (= tag 2) (= (iref object 1) 4) (bit-vector-p (iref object 4))))))
+(defun bit-result (bit-array opt-arg)
+  (case opt-arg
+    ((nil) (make-array (array-dimensions bit-array) :element-type 'bit))
+    ((t) bit-array)
+    (t opt-arg)))
+(defun bit-and (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 8 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-andc1 (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 2 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-andc2 (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 4 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-eqv (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 9 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-ior (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 14 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-nand (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 7 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-nor (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 1 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-orc1 (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 11 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-orc2 (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 13 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-xor (bit-array1 bit-array2 &optional opt-arg)
+  (bit-boole 6 bit-array1 bit-array2 (bit-result bit-array1 opt-arg)))
+(defun bit-not (bit-array &optional opt-arg)
+  (bit-boole 3 bit-array bit-array (bit-result bit-array opt-arg)))
+;; OCTETS-REF formats: the size in octets, plus 16 if signed, 32 if a float
+;; and 64 if big-endian.
+(defmacro define-octets-accessor (name format)
+  `(progn
+    (defun ,name (octets offset)
+      (octets-ref octets offset ,format))
+    (defun (setf ,name) (value octets offset)
+      (setf (octets-ref octets offset ,format) value))))
+(define-octets-accessor octets-u8 1)
+(define-octets-accessor octets-s8 17)
+(define-octets-accessor octets-u16-le 2)
+(define-octets-accessor octets-u16-be 66)
+(define-octets-accessor octets-s16-le 18)
+(define-octets-accessor octets-s16-be 82)
+(define-octets-accessor octets-u32-le 4)
+(define-octets-accessor octets-u32-be 68)
+(define-octets-accessor octets-s32-le 20)
+(define-octets-accessor octets-s32-be 84)
+(define-octets-accessor octets-f32-le 36)
+(define-octets-accessor octets-f32-be 100)
+(define-octets-accessor octets-f64-le 40)
+(define-octets-accessor octets-f64-be 104)
 (defun simple-string-p (object)
   (and (= (ldb '(2 . 0) (ival object)) 3) (= (jref object 1) 20)))
-(defun char (string index)
-  (aref string index))
-(defun (setf char) (new-character string index)
-  (setf (aref string index) new-character))
-(defun schar (string index)
-  (aref string index))
-(defun (setf schar) (new-character string index)
-  (setf (aref string index) new-character))
 (defun string-upcase (string &key (start 0) end)
-  (nstring-upcase (copy-seq string) :start start :end end))
+  (string-case (subseq (designator-string string) 0) start end nil))
 (defun string-downcase (string &key (start 0) end)
-  (nstring-downcase (copy-seq string) :start start :end end))
+  (string-case (subseq (designator-string string) 0) start end t))
 (defun string-capitalize (string &key (start 0) end)
-  (nstring-capitalize (copy-seq string) :start start :end end))
+  (nstring-capitalize (subseq (designator-string string) 0)
+		      :start start :end end))
 (defun nstring-upcase (string &key (start 0) end)
-  (setq string (designator-string string))
-  (unless end (setq end (length string)))
-  (tagbody
-   start
-     (when (< start end)
-       (setf (aref string start) (char-upcase (aref string start)))
-       (incf start)
-       (go start)))
-  string)
+  (string-case (designator-string string) start end nil))
 (defun nstring-downcase (string &key (start 0) end)
-  (setq string (designator-string string))
-  (unless end (setq end (length string)))
-  (tagbody
-   start
-     (when (< start end)
-       (setf (aref string start) (char-downcase (aref string start)))
-       (incf start)
-       (go start)))
-  string)
+  (string-case (designator-string string) start end t))
 (defun nstring-capitalize (string &key (start 0) end)
   (setq string (designator-string string))
   (unless end (setq end (length string)))
@@ -2321,104 +2250,105 @@
 	 (incf start)
 	 (go start))))
   string)
+(defun string-trim-sides (character-bag string left right)
+  (setq string (designator-string string))
+  (multiple-value-bind (start end)
+      (string-trim-bounds string character-bag left right)
+    (subseq string start end)))
 (defun string-trim (character-bag string)
-  (let ((i 0)
-	(j (length string)))
-    (tagbody
-     start
-       (when (and (< i j) (position (aref string i) character-bag))
-	 (incf i)
-	 (go start)))
-    (tagbody
-     start
-       (when (and (plusp j) (position (aref string (- j 1)) character-bag))
-	 (decf j)
-	 (go start)))
-    (if (< i j)
-	(subseq string i j)
-	"")))
+  (string-trim-sides character-bag string t t))
 (defun string-left-trim (character-bag string)
-  (let ((i 0))
-    (tagbody
-     start
-       (when (and (< i (length string))
-		  (position (aref string i) character-bag))
-	 (incf i)
-	 (go start)))
-    (subseq string i)))
+  (string-trim-sides character-bag string t nil))
 (defun string-right-trim (character-bag string)
-  (let ((i (length string)))
-    (tagbody
-     start
-       (when (and (plusp i) (position (aref string (- i 1)) character-bag))
-	 (decf j)
-	 (go start)))
-    (subseq string 0 i)))
-(flet ((string-mismatch (comparator string1 string2
-				    &key (start1 0) end1 (start2 0) end2)
-	 (setq string1 (designator-string string1))
-	 (setq string2 (designator-string string2))
-	 (unless end1 (setq end1 (length string1)))
-	 (unless end2 (setq end2 (length string2)))
-	 (tagbody
-	  start
-	    (when (and (< start1 end1) (< start2 end2))
-	      (unless (funcall comparator
-			       (aref string1 start1) (aref string2 start2))
-		(return-from string-mismatch start1))
-	      (incf start1)
-	      (incf start2)
-	      (go start)))
-	 (if (or (< start1 end1) (< start2 end2))
-	     start1
-	     nil)))
+  (string-trim-sides character-bag string nil t))
+;; STRING-COMPARE finds where two strings part in C and says which way
+;; they order there: 0 for less, 1 for equal and 2 for greater.
+(flet ((string-mismatch (orders fold string1 string2
+			 &key (start1 0) end1 (start2 0) end2)
+	 (multiple-value-bind (index order)
+	     (string-compare (designator-string string1) start1 end1
+			     (designator-string string2) start2 end2 fold)
+	   (when (member order orders)
+	     index))))
   (defun string/= (&rest rest)
-    (apply #'string-mismatch #'char= rest))
+    (apply #'string-mismatch '(0 2) nil rest))
   (defun string-not-equal (&rest rest)
-    (apply #'string-mismatch #'char-equal rest)))
-(defun *string= (&rest rest)
-  (not (apply #'string/= rest)))
-(defun string-equal (&rest rest)
-  (not (apply #'string-not-equal rest)))
-(flet ((string-mismatch (exit continue default1 default2 default3
-			 string1 string2 &key (start1 0) end1 (start2 0) end2)
-	 (setq string1 (designator-string string1))
-	 (setq string2 (designator-string string2))
-	 (unless end1 (setq end1 (length string1)))
-	 (unless end2 (setq end2 (length string2)))
-	 (tagbody
-	  start
-	    (when (and (< start1 end1) (< start2 end2))
-	      (let ((c1 (aref string1 start1))
-		    (c2 (aref string2 start2)))
-		(when (funcall exit c1 c2)
-		  (return-from string-mismatch start1))
-		(unless (funcall continue c1 c2)
-		  (return-from string-mismatch)))
-	      (incf start1)
-	      (incf start2)
-	      (go start)))
-	 (when (cond
-		 ((< start1 end1) default1)
-		 ((< start2 end2) default2)
-		 (t default3))
-	   start1)))
+    (apply #'string-mismatch '(0 2) t rest))
   (defun string< (&rest rest)
-    (apply #'string-mismatch #'char< #'char= nil t nil rest))
+    (apply #'string-mismatch '(0) nil rest))
   (defun string<= (&rest rest)
-    (apply #'string-mismatch #'char< #'char= nil t t rest))
+    (apply #'string-mismatch '(0 1) nil rest))
   (defun string> (&rest rest)
-    (apply #'string-mismatch #'char> #'char= t nil nil rest))
+    (apply #'string-mismatch '(2) nil rest))
   (defun string>= (&rest rest)
-    (apply #'string-mismatch #'char> #'char= t nil t rest))
+    (apply #'string-mismatch '(1 2) nil rest))
   (defun string-lessp (&rest rest)
-    (apply #'string-mismatch #'char-lessp #'char-equal nil t nil rest))
+    (apply #'string-mismatch '(0) t rest))
   (defun string-not-greaterp (&rest rest)
-    (apply #'string-mismatch #'char-lessp #'char-equal nil t t rest))
+    (apply #'string-mismatch '(0 1) t rest))
   (defun string-greaterp (&rest rest)
-    (apply #'string-mismatch #'char-greaterp #'char-equal t nil nil rest))
+    (apply #'string-mismatch '(2) t rest))
   (defun string-not-lessp (&rest rest)
-    (apply #'string-not-lessp #'char-greaterp #'char-equal t nil t rest)))
+    (apply #'string-mismatch '(1 2) t rest)))
+(defun *string= (&rest rest)
+  (not (apply #'string/= rest)))
+(defun string-equal (&rest rest)
+  (not (apply #'string-not-equal rest)))
+;; SORT-LIST, SORT-VECTOR and MERGE-LISTS are merge sorts in C; the kind
+;; lets them compare numbers and strings inline for these predicates.
+(defun sort-predicate-kind (predicate)
+  (let ((function (if (symbolp predicate)
+		      (fdefinition predicate)
+		      predicate)))
+    (cond ((eq function #'<) 1)
+	  ((eq function #'>) 2)
+	  ((eq function #'string<) 3)
+	  ((eq function #'string>) 4)
+	  (t 0))))
+(defun stable-sort (sequence predicate &key key)
+  (let ((kind (sort-predicate-kind predicate)))
+    (if (listp sequence)
+	(sort-list sequence predicate key kind)
+	(let ((content sequence)
+	      (start 0)
+	      (length (length sequence)))
+	  (when (= (array-type sequence) 3)
+	    (setq content (iref sequence 4))
+	    (setq start (or (iref sequence 5) 0)))
+	  (if (= (array-type content) 2)
+	      (sort-vector content predicate key kind start (+ start length))
+	      (let ((vector (makei length 3)))
+		(dotimes (i length)
+		  (setf (iref vector (+ 2 i)) (aref sequence i)))
+		(sort-vector vector predicate key kind 0 length)
+		(dotimes (i length)
+		  (setf (aref sequence i) (iref vector (+ 2 i))))))
+	  sequence))))
+(defun sort (sequence predicate &key key)
+  (stable-sort sequence predicate :key key))
+(defun merge (result-type sequence1 sequence2 predicate &key key)
+  (flet ((sequence-list (sequence)
+	   (if (listp sequence)
+	       sequence
+	       (let ((list nil))
+		 (dotimes (i (length sequence) (nreverse list))
+		   (push (aref sequence i) list))))))
+    (let ((list (merge-lists (sequence-list sequence1)
+			     (sequence-list sequence2)
+			     predicate key (sort-predicate-kind predicate))))
+      (if (member result-type '(list cons))
+	  list
+	  (let ((vector (make-array (length list)
+				    :element-type
+				    (if (member result-type
+						'(string simple-string
+						  base-string simple-base-string))
+					'character
+					t)))
+		(i 0))
+	    (dolist (element list vector)
+	      (setf (aref vector i) element)
+	      (incf i)))))))
 (defun stringp (object)
   (case (ldb '(2 . 0) (ival object))
     (2 (and (member (iref object 1) '(4 7))
@@ -2439,26 +2369,6 @@
     (setf (jref string (+ 2 (/ size 4)))
 	  (dpb init (cons (* 8 (ldb '(2 . 0) size)) 0) 0))
     string))
-(defun reverse (sequence)
-  (if (listp sequence)
-      (let ((acc nil))
-	(dolist (elem sequence)
-	  (push elem acc))
-	acc)
-      "FIXME"))
-(defun nreverse (sequence)
-  (if (listp sequence)
-      (let ((prev nil))
-	(tagbody
-	 start
-	   (when sequence
-	     (let ((next (cdr sequence)))
-	       (setf (cdr sequence) prev)
-	       (setf prev sequence)
-	       (setf sequence next))
-	     (go start)))
-	prev)
-      "FIXME"))
 (defun get-properties (plist indicator-list)
   (tagbody
    start
@@ -2579,8 +2489,13 @@
 	       (setf result list-1)
 	       (setf list-1 item))))
        (go start))))
-(defun array-element-type (sequence)
-  (if (stringp sequence) 'character 't))
+(defun array-element-type (array)
+  (case (array-type array)
+    (0 'character)
+    (1 'bit)
+    (3 (array-element-type (iref array 4)))
+    (5 '(unsigned-byte 8))
+    (t 't)))
 (defun copy-seq (sequence)
   (if (listp sequence)
       (copy-list sequence)
@@ -2606,8 +2521,15 @@
   (let ((type-head (car (designator-list result-type))))
     (case type-head
       ((list cons null)	(make-list size :initial-element initial-element))
-      (string (make-string size :initial-element initial-element))
-      (vector (make-array size :initial-element initial-element))
+      ((string simple-string)
+       (make-string size :initial-element (or initial-element (code-char 0))))
+      ((bit-vector simple-bit-vector)
+       (make-array size :element-type 'bit :initial-element initial-element))
+      ((vector simple-array)
+       (make-array size :element-type (or (second (designator-list result-type))
+					  t)
+		   :initial-element initial-element))
+      (simple-vector (make-array size :initial-element initial-element))
       (t (error 'type-error :datum result-type :expected-type 'sequence)))))
 (defun subseq (sequence start &optional end)
   (if (listp sequence)
@@ -2622,32 +2544,17 @@
 		   (go start)))
 	      (reverse result))
 	    (copy-list tail)))
-      (let ((tag (ldb '(2 . 0) (ival sequence))))
-	(unless end (setq end (length sequence)))
-	(let ((new-sequence (if (= tag 2)
-				(if (= (iref sequence 1) 3)
-				    (makei (- end start) 3)
-				    (return-from subseq
-				      (let ((offset (iref sequence 5)))
-					(if offset
-					    (subseq (iref sequence 4)
-						     (+ start offset)
-						     (min (length sequence)
-							  (+ end offset)))
-					    (subseq (iref sequence 4)
-						     start end)))))
-				(if (= (jref sequence 1) 20)
-				    (makej (+ 1 (* 8 (- end start))) 20)
-				    (makej (- end start) 116))))
-	      (index 0))
-	  (tagbody
-	   start
-	     (when (< start end)
-	       (setf (aref new-sequence index) (aref sequence start))
-	       (incf index)
-	       (incf start)
-	       (go start)))
-	  new-sequence))))
+      (if (= (ldb '(2 . 0) (ival sequence)) 2)
+	  (if (= (iref sequence 1) 3)
+	      (vector-subseq sequence start end)
+	      (let ((offset (iref sequence 5)))
+		(unless end (setq end (length sequence)))
+		(if offset
+		    (subseq (iref sequence 4)
+			    (+ start offset)
+			    (min (length sequence) (+ end offset)))
+		    (subseq (iref sequence 4) start end))))
+	  (vector-subseq sequence start end))))
 (defun (setf subseq) (new-subsequence sequence start &optional end)
   (let ((result new-subsequence))
     (if (listp sequence)
@@ -2682,132 +2589,60 @@
       result-string)))
 (defun designator-list (designator)
   (if (listp designator) designator (list designator)))
-(defparameter *standard-class* (makei 1 0))
-(setf (iref *standard-class* 1) *standard-class*)
-(defparameter *structure-class* (makei 1 *standard-class*))
-(defparameter *hash-table* (makei 1 *structure-class*))
-(defun hash-eql (object)
-  (if (and (= (ldb '(2 . 0) (ival object)) 3) (= (jref object 1) 84))
-      (floor (abs object))
-      (ival object)))
-(defun sxhash (object &optional (level 4))
-  (if (zerop level)
-      0
-      (let ((lvl (- level 1)))
-	(case (ldb '(2 . 0) (ival object))
-	  (0 (ival object))
-	  (1 (+ (sxhash (car object) lvl) (sxhash (cdr object) lvl)))
-	  (2 (case (iref object 1)
-	       (t (ival object))))
-	  (3 (case (jref object 1)
-	       (20 (hash object))
-	       (84 (floor (abs object)))
-	       (t (ival object))))))))
+;; The entries are hash, key and value triples in simple-vectors of at most
+;; 256 triples each that GETHASH, (SETF GETHASH), REMHASH and CLRHASH work
+;; on in C; a table that is growing keeps its old entries in slot 8 until
+;; they have been moved.
 (defun make-hash-table (&key (test 'eql) (size 61) (rehash-size 1.999)
 			(rehash-threshold 1))
   (when (functionp test)
     (setq test (iref test 6)))
-  (makei 6 *hash-table* 0 rehash-size rehash-threshold test
-	 (case test
-	   (eq #'ival)
-	   (eql #'hash-eql)
-	   (equal #'sxhash)
-	   (equalp #'hash-equalp)
-	   (t (error "Unknown test function ~A." test)))
-	 (makei size 3)))
-(defun gethash (key hash-table &optional default)
-  (let* ((table (hash-table-table hash-table))
-	 (test (hash-table-test hash-table))
-	 (index (mod (funcall (hash-table-hash hash-table) key)
-		     (length table))))
-    (dolist (cons (iref table (+ 2 index)) (values default nil))
-      (when (funcall test (car cons) key)
-	(return (values (cdr cons) t))))))
-(defun (setf gethash) (new-value key hash-table &optional default)
-  (let* ((table (hash-table-table hash-table))
-	 (test (hash-table-test hash-table))
-	 (index (mod (funcall (hash-table-hash hash-table) key)
-		     (length table))))
-    (dolist (cons (iref table (+ 2 index))
-	     (progn
-	       (push (cons key new-value) (iref table (+ 2 index)))
-	       (unless (< (incf (hash-table-count hash-table))
-			  (* (hash-table-rehash-threshold hash-table)
-			     (length table)))
-		 (setf (hash-table-table hash-table)
-		       (makei (floor (* (hash-table-rehash-size hash-table)
-					(length table)))
-			      3))
-		 (setf (hash-table-count hash-table) 0)
-		 (dotimes (index (length table))
-		   (dolist (cons (iref table (+ 2 index)))
-		     (setf (gethash (car cons) hash-table) (cdr cons)))))))
-      (when (funcall test (car cons) key)
-	(setf (cdr cons) new-value)
-	(return (values (cdr cons) t)))))
-  new-value)
-(defun remhash (key hash-table)
-  (let* ((table (hash-table-table hash-table))
-	 (test (hash-table-test hash-table))
-	 (index (mod (funcall (hash-table-hash hash-table) key)
-		     (length table)))
-	 (cons (iref table (+ 2 index)))
-	 (prev-cons nil))
-    (tagbody
-     start
-       (unless cons (return-from remhash))
-       (unless (funcall test (caar cons) key)
-	 (setq prev-cons cons)
-	 (setq cons (cdr cons))
-	 (go start)))
-    (if prev-cons
-	(setf (cdr prev-cons) (cdr cons))
-	(setf (iref table (+ 2 index)) (cdr cons)))
-    (decf (hash-table-count hash-table))
-    t))
+  (do ((capacity 8 (* 2 capacity)))
+      ((>= (* 3 capacity) (* 4 size))
+       (makei 9 *hash-table* 0 rehash-size rehash-threshold test
+	      (case test
+		(eq 0)
+		(eql 1)
+		(equal 2)
+		(equalp 3)
+		(t (error "Unknown test function ~A." test)))
+	      (let ((entries (makei (max 1 (/ capacity 256)) 3)))
+		(dotimes (i (length entries) entries)
+		  (setf (iref entries (+ 2 i))
+			(makei (* 3 (min capacity 256)) 3))))
+	      nil 0 0))))
 (defun maphash (function hash-table)
-  (let ((table (hash-table-table hash-table)))
-    (dotimes (index (length table))
-      (dolist (cons (iref table (+ 2 index)))
-	(funcall function (car cons) (cdr cons))))))
+  (dolist (entries (list (iref hash-table 7) (iref hash-table 8)))
+    (when entries
+      (dotimes (i (length entries))
+	(let ((segment (iref entries (+ 2 i))))
+	  (do ((index 2 (+ index 3)))
+	      ((>= index (+ 2 (length segment))))
+	    (when (and (iboundp segment index) (iref segment index))
+	      (funcall function
+		       (iref segment (+ 1 index))
+		       (iref segment (+ 2 index))))))))))
 (defun hash-table-iterator (hash-table)
-  (let ((table (hash-table-table hash-table))
-	(index 0)
-	(cons nil))
+  (let ((entries nil))
+    (maphash #'(lambda (key value) (push (cons key value) entries))
+	     hash-table)
     #'(lambda ()
-	(block nil
-	  (tagbody
-	   start
-	     (unless cons
-	       (unless (< index (length table))
-		 (return))
-	       (setq cons (iref table (+ 2 index)))
-	       (incf index)
-	       (go start)))
-	  (let ((pair (pop cons)))
-	    (values t (car pair) (cdr pair)))))))
+	(when entries
+	  (let ((entry (pop entries)))
+	    (values t (car entry) (cdr entry)))))))
 (defmacro with-hash-table-iterator ((name hash-table) &rest forms)
   (let ((iterator (gensym)))
     `(let ((,iterator (hash-table-iterator ,hash-table)))
       (macrolet ((,name ()
 		   `(funcall ,,iterator)))
 	,@forms))))
-(defun clrhash (hash-table)
-  (let ((table (hash-table-table hash-table)))
-    (dotimes (index (length table))
-      (setf (iref table (+ 2 index)) nil)))
-  (setf (hash-table-count hash-table) 0)
-  hash-table)
 (defun hash-table-count (hash-table) (iref hash-table 2))
-(defun (setf hash-table-count) (new-value hash-table)
-  (setf (iref hash-table 2) new-value))
 (defun hash-table-rehash-size (hash-table) (iref hash-table 3))
 (defun hash-table-rehash-threshold (hash-table) (iref hash-table 4))
 (defun hash-table-test (hash-table) (iref hash-table 5))
-(defun hash-table-hash (hash-table) (iref hash-table 6))
-(defun hash-table-table (hash-table) (iref hash-table 7))
-(defun (setf hash-table-table) (new-value hash-table)
-  (setf (iref hash-table 7) new-value))
+(defun hash-table-size (hash-table)
+  (let ((entries (iref hash-table 7)))
+    (* (length entries) (/ (length (iref entries 2)) 3))))
 (defparameter *class-hash* (make-hash-table))
 (defun find-class (symbol &optional (errorp t) environment)
   (multiple-value-bind (class foundp)
@@ -2933,9 +2768,9 @@
   interactive-function
   report-function
   test-function)
-(defun ansi-stream-read-bytes (stream string start)
+(defun ansi-stream-read-bytes (stream string start end)
   (funcall (stream-class-read-bytes (ansi-stream-stream-class stream))
-	   stream string start))
+	   stream string start end))
 (defun ansi-stream-write-bytes (stream string start end)
   (funcall (stream-class-write-bytes (ansi-stream-stream-class stream))
 	   stream string start end))
@@ -2948,8 +2783,8 @@
 (defun ansi-stream-close (stream)
   (funcall (stream-class-close (ansi-stream-stream-class stream))
 	   stream))
-(defun fd-stream-read-bytes (stream string start)
-  (read-file-stream (fd-stream-file-stream stream) string start))
+(defun fd-stream-read-bytes (stream string start end)
+  (read-file-stream (fd-stream-file-stream stream) string start end))
 (defun fd-stream-write-bytes (stream string start end)
   (write-file-stream (fd-stream-file-stream stream) string start end))
 (defun fd-stream-listen (stream)
@@ -2958,39 +2793,44 @@
   (finish-file-stream (fd-stream-file-stream stream)))
 (defun fd-stream-close (stream)
   (close-file-stream (fd-stream-file-stream stream)))
-(defun string-stream-read-bytes (stream string start)
-  (let* ((length (min (- (length string) start)
-		      (- (string-stream-end stream)
-			 (string-stream-start stream))))
-	 (end (+ (string-stream-start stream) length)))
-    (setf (subseq string start)
-	  (subseq (string-stream-string stream)
-		  (string-stream-start stream) end))
-    (setf (string-stream-start stream) end)
+;; An output string stream fills its string, then starts a bigger one of
+;; up to 16384 characters and keeps the full ones in its chunks, so that
+;; nothing written is copied again until GET-OUTPUT-STREAM-STRING joins
+;; them.
+(defun string-stream-read-bytes (stream string start end)
+  (let ((length (string-copy-into string start (string-stream-string stream)
+				  (string-stream-start stream)
+				  (min (string-stream-end stream)
+				       (+ (string-stream-start stream)
+					  (- end start))))))
+    (setf (string-stream-start stream)
+	  (+ (string-stream-start stream) length))
     length))
 (defun string-stream-write-bytes (stream string start end)
-  (let ((write-length (- end start))
-	(stream-length (length (string-stream-string stream))))
-    (when (< (- stream-length (string-stream-end stream)) write-length)
-      (let* ((new-length (max (* 2 stream-length)
-			     (+ stream-length write-length)))
-	     (new-string (make-string new-length)))
-	(setf (subseq new-string 0 (string-stream-end stream))
-	      (string-stream-string stream))
-	(setf (string-stream-string stream) new-string)))
-    (let ((new-end (+ (string-stream-end stream) write-length)))
-      (setf (subseq (string-stream-string stream)
-		    (string-stream-end stream) new-end)
-	    (subseq string start end))
-      (setf (string-stream-end stream) new-end))
+  (let ((write-length (- end start)))
+    (tagbody
+     start
+       (let ((length (string-copy-into (string-stream-string stream)
+				       (string-stream-end stream)
+				       string start end)))
+	 (setf (string-stream-end stream)
+	       (+ (string-stream-end stream) length))
+	 (setq start (+ start length))
+	 (when (< start end)
+	   (push (string-stream-string stream) (string-stream-chunks stream))
+	   (setf (string-stream-string stream)
+		 (make-string
+		  (min (* 2 (length (string-stream-string stream))) 16384)))
+	   (setf (string-stream-end stream) 0)
+	   (go start))))
     write-length))
 (defun string-stream-listen (stream) t)
 (defun string-stream-finish (stream flag) nil)
 (defun string-stream-close (stream) nil)
-(defun concatenated-stream-read-bytes (stream string start)
+(defun concatenated-stream-read-bytes (stream string start end)
   (let ((streams (concatenated-stream-streams stream)))
     (if streams
-	(ansi-stream-read-bytes (car streams) string start)
+	(ansi-stream-read-bytes (car streams) string start end)
 	0)))
 (defun concatenated-stream-write-bytes (stream string start end)
   (let ((streams (concatenated-stream-streams stream)))
@@ -3008,9 +2848,9 @@
 	(ansi-stream-finish (car streams) flag)
 	nil)))
 (defun concatenated-stream-close (stream) nil)
-(defun echo-stream-read-bytes (stream string start)
+(defun echo-stream-read-bytes (stream string start end)
   (let ((length (ansi-stream-read-bytes (echo-stream-input-stream stream)
-					string start)))
+					string start end)))
     (ansi-stream-write-bytes (echo-stream-output-stream stream)
 			     string start (+ start length))
     length))
@@ -3022,8 +2862,9 @@
 (defun echo-stream-finish (stream flag)
   (ansi-stream-finish (echo-stream-output-stream stream) flag))
 (defun echo-stream-close (stream) nil)
-(defun two-way-stream-read-bytes (stream string start)
-  (ansi-stream-read-bytes (two-way-stream-input-stream stream) string start))
+(defun two-way-stream-read-bytes (stream string start end)
+  (ansi-stream-read-bytes (two-way-stream-input-stream stream)
+			  string start end))
 (defun two-way-stream-write-bytes (stream string start end)
   (ansi-stream-write-bytes (two-way-stream-output-stream stream)
 			   string start end))
@@ -3032,7 +2873,7 @@
 (defun two-way-stream-finish (stream flag)
   (ansi-stream-finish (two-way-stream-output-stream stream) flag))
 (defun two-way-stream-close (stream) nil)
-(defun broadcast-stream-read-bytes (stream string start)
+(defun broadcast-stream-read-bytes (stream string start end)
   (error "cannot read from a broadcast stream"))
 (defun broadcast-stream-write-bytes (stream string start end)
   (dolist (s (broadcast-stream-streams stream))
@@ -3043,9 +2884,9 @@
   (dolist (s (broadcast-stream-streams stream))
     (ansi-stream-finish s flag)))
 (defun broadcast-stream-close (stream) nil)
-(defun synonym-stream-read-bytes (stream string start)
+(defun synonym-stream-read-bytes (stream string start end)
   (ansi-stream-read-bytes (symbol-value (synonym-stream-symbol stream))
-			  string start))
+			  string start end))
 (defun synonym-stream-write-bytes (stream string start end)
   (ansi-stream-write-bytes (symbol-value (synonym-stream-symbol stream))
 			   string start end))
@@ -3121,18 +2962,21 @@
 	(char-code c)
 	(if eof-error-p (error 'end-of-file :stream stream) eof-value))))
 (defun write-byte (byte stream)
-  (ansi-stream-write-bytes stream
-			   (make-string 1 :initial-element (code-char byte))
-			   0 1)
+  (let ((octets (make-array 1 :element-type '(unsigned-byte 8))))
+    (setf (aref octets 0) byte)
+    (ansi-stream-write-bytes stream octets 0 1))
   (setf (ansi-stream-line-start stream) (= byte 10))
   byte)
 (defun prim-read-char (stream)
-  (if (ansi-stream-unread stream)
-      (prog1 (ansi-stream-unread stream)
-	(setf (ansi-stream-unread stream) nil))
-      (let ((string (make-string 1)))
-	(when (= (ansi-stream-read-bytes stream string 0) 1)
-	  (aref string 0)))))
+  (cond ((ansi-stream-unread stream)
+	 (prog1 (ansi-stream-unread stream)
+	   (setf (ansi-stream-unread stream) nil)))
+	((fd-stream-p stream)
+	 (let ((c (read-char-file-stream (fd-stream-file-stream stream))))
+	   (if (consp c) (error 'stream-error :stream stream) c)))
+	(t (let ((string (make-string 1)))
+	     (when (= (ansi-stream-read-bytes stream string 0 1) 1)
+	       (aref string 0))))))
 (defun make-fd-stream (direction file-stream)
   (construct-fd-stream *fd-stream-class* direction file-stream))
 (defstruct ansi-stream
@@ -3151,7 +2995,8 @@
 	     (:include ansi-stream))
   string
   start
-  end)
+  end
+  chunks)
 (defstruct (concatenated-stream
 	     (:constructor construct-concatenated-stream (stream-class streams))
 	     (:include ansi-stream (direction :input)))
@@ -3227,10 +3072,18 @@
        (write-byte 10 output-stream)))
 (defun unread-char (character &optional (input-stream *standard-input*))
   (setq input-stream (designator-input-stream input-stream))
-  (setf (ansi-stream-unread input-stream) character))
+  (unless (and (fd-stream-p input-stream)
+	       (unread-char-file-stream (fd-stream-file-stream input-stream)
+					character))
+    (setf (ansi-stream-unread input-stream) character))
+  nil)
 (defun write-char (character &optional (output-stream *standard-output*))
   (setq output-stream (designator-output-stream output-stream))
-  (write-file-stream (make-string 1 :initial-character character) 0 1)
+  (if (fd-stream-p output-stream)
+      (write-char-file-stream (fd-stream-file-stream output-stream) character)
+      (ansi-stream-write-bytes output-stream
+			       (make-string 1 :initial-element character)
+			       0 1))
   (setf (ansi-stream-line-start output-stream) (= (char-code character) 10))
   character)
 (defun read-line (&optional (input-stream *standard-input*) (eof-error-p t)
@@ -3271,9 +3124,26 @@
 			   0 1)
   (setf (ansi-stream-line-start output-stream) t)
   string)
+(defun octet-sequence-p (sequence)
+  (and (vectorp sequence) (member (array-type sequence) '(0 5))))
 (defun read-sequence (sequence stream &key (start 0) end)
-  (if (eq (type-of sequence) 'string)
-      (+ start (ansi-stream-read-bytes stream sequence start))
+  (unless end (setf end (length sequence)))
+  (if (octet-sequence-p sequence)
+      (let ((index start)
+	    (unread (ansi-stream-unread stream)))
+	(when (and unread (< index end))
+	  (setf (ansi-stream-unread stream) nil)
+	  (setf (aref sequence index)
+		(if (stringp sequence) unread (char-code unread)))
+	  (setf index (+ 1 index)))
+	(tagbody
+	 start
+	   (when (< index end)
+	     (let ((length (ansi-stream-read-bytes stream sequence index end)))
+	       (when (and (fixnump length) (< 0 length))
+		 (setf index (+ index length))
+		 (go start)))))
+	index)
       (let ((index start))
 	(tagbody
 	 start
@@ -3285,17 +3155,74 @@
 		 (go start)))))
 	index)))
 (defun write-sequence (sequence stream &key (start 0) end)
-  (if (eq (type-of sequence) 'string)
-      (write-string sequence stream start end)
-      (let ((index start))
-	(unless end (setf end (length sequence)))
-	(tagbody
-	 start
-	   (when (< index end)
-	     (write-byte (aref sequence index) stream)
-	     (setf index (+ 1 index))
-	     (go start)))
-	sequence)))
+  (unless end (setf end (length sequence)))
+  (cond ((stringp sequence)
+	 (write-string sequence stream :start start :end end))
+	((octet-sequence-p sequence)
+	 (when (< start end)
+	   (ansi-stream-write-bytes stream sequence start end)
+	   (setf (ansi-stream-line-start stream)
+		 (= (aref sequence (- end 1)) 10))))
+	(t (let ((index start))
+	     (tagbody
+	      start
+		(when (< index end)
+		  (write-byte (aref sequence index) stream)
+		  (setf index (+ 1 index))
+		  (go start))))))
+  sequence)
+;; Objects are serialized by SERIALIZE-INTO a page of octets at a time.
+;; The pages are joined into one octet vector or, on a stream, go out as
+;; frames, each a length seven bits to the octet and that many octets, so
+;; that DESERIALIZE reads no further than the object.
+(defun serialize (object &optional stream)
+  (let ((buffer (make-array 4096 :element-type '(unsigned-byte 8)))
+	(table (make-hash-table :test 'eq)))
+    (if stream
+	(progn
+	  (serialize-into buffer
+			  #'(lambda (buffer end)
+			      (do ((n end (floor n 128)))
+				  ((< n 128) (write-byte n stream))
+				(write-byte (+ 128 (mod n 128)) stream))
+			      (write-sequence buffer stream :end end))
+			  table object)
+	  object)
+	(let ((chunks nil)
+	      (length 0))
+	  (serialize-into buffer
+			  #'(lambda (buffer end)
+			      (push (vector-subseq buffer 0 end) chunks)
+			      (setq length (+ length end)))
+			  table object)
+	  (if (cdr chunks)
+	      (let ((octets (make-array length
+					:element-type '(unsigned-byte 8))))
+		(dolist (chunk chunks octets)
+		  (setq length (- length (length chunk)))
+		  (string-copy-into octets length chunk 0 (length chunk))))
+	      (car chunks))))))
+(defun deserialize (source &key (start 0) end)
+  (if (streamp source)
+      (let ((remaining 0))
+	(values
+	 (deserialize-from
+	  (make-array 4096 :element-type '(unsigned-byte 8))
+	  #'(lambda (buffer)
+	      (when (zerop remaining)
+		(do ((shift 1 (* shift 128))
+		     (byte (read-byte source nil 0) (read-byte source nil 0)))
+		    ((< byte 128) (setq remaining (+ remaining (* byte shift))))
+		  (setq remaining (+ remaining (* (- byte 128) shift)))))
+	      (let ((n (read-sequence buffer source
+				      :end (min remaining (length buffer)))))
+		(when (zerop n)
+		  (error 'end-of-file :stream source))
+		(setq remaining (- remaining n))
+		n))
+	  (make-hash-table) 0 0)))
+      (values (deserialize-from source nil (make-hash-table) start
+				(or end (length source))))))
 (defun file-length (stream)
   "FIXME"
   nil)
@@ -3308,16 +3235,20 @@
       1))
 (defun open (filespec &key (direction :input) (element-type 'character)
 	     (if-exists :new-version) (if-does-not-exist "FIXME")
-	     (external-format :default))
-  (make-fd-stream direction
-		  (make-file-stream filespec (eq direction :output))))
+	     (external-format :default) buffer-size)
+  (let ((file-stream (make-file-stream filespec (eq direction :output)
+				       buffer-size)))
+    (cond
+      ((not (fixnump file-stream)) (make-fd-stream direction file-stream))
+      ((and (eq direction :input) (null if-does-not-exist)) nil)
+      (t (error 'file-error :pathname filespec)))))
 (defun stream-external-format (stream)
   :default)
 (defmacro with-open-file ((stream filespec &rest options) &rest body)
   `(let ((,stream (open ,filespec ,@options)))
     (unwind-protect
 	 (progn ,@body)
-      (close ,stream))))
+      (when ,stream (close ,stream)))))
 (defun close (stream &key abort)
   (ansi-stream-close stream)
   t)
@@ -3369,15 +3300,17 @@
   `(let ((,var (make-string-input-stream ,string ,start ,end)))
     (unwind-protect
 	 (progn ,@forms)
-      ,@(when index `(setf ,place (string-stream-start ,var)))
+      ,@(when index `((setf ,index (string-stream-start ,var))))
       (close ,var))))
 (defun make-string-output-stream (&key (element-type 'character))
   (let ((string (make-string 256)))
     (construct-string-stream *string-stream-class* :output string 0 0)))
 (defun get-output-stream-string (string-output-stream)
   (prog1
-      (subseq (string-stream-string string-output-stream)
-	      0 (string-stream-end string-output-stream))
+      (string-chunks (string-stream-chunks string-output-stream)
+		     (string-stream-string string-output-stream)
+		     (string-stream-end string-output-stream))
+    (setf (string-stream-chunks string-output-stream) nil)
     (setf (string-stream-end string-output-stream) 0)))
 (defmacro with-output-to-string ((var &optional string-form
 				      &key (element-type 'character))
@@ -3440,11 +3373,11 @@
   (with-output-to-string (stream)
     (apply #'write object :stream stream rest)))
 (defun prin1-to-string (object)
-  (with-output-to-string (*standard-output*)
-    (prin1 object)))
+  (with-output-to-string (stream)
+    (prin1 object stream)))
 (defun princ-to-string (object)
-  (with-output-to-string (*standard-output*)
-    (princ object)))
+  (with-output-to-string (stream)
+    (princ object stream)))
 (defun parse-control-string (control-string)
   (let ((result nil)
 	(i 0)
@@ -3739,7 +3672,9 @@
     (tagbody
        (when token-chars (go even))
      start
-       (setq c (read-char input-stream eof-error-p eof-value recursive-p))
+       (setq c (read-char input-stream eof-error-p nil recursive-p))
+       (unless c
+	 (return-from read-internal eof-value))
        (setq f (aref function (char-code c)))
        (when (eq f :whitespace)
 	 (go start))
@@ -3823,15 +3758,19 @@
 	 (return-from read-internal
 	   (if convertp
 	       (if symbol
-		   (let ((colon-position (position (char-code 58) string)))
+		   (let ((colon-position (position (code-char 58) string)))
 		     (if colon-position
 			 (if (= colon-position 0) (intern (subseq string 1) "KEYWORD")
-			   (multiple-value-bind (symbol status)
-			       (find-symbol (subseq string (+ 1 colon-position))
-					    (subseq string 0 colon-position))
-			     (if (eq status :external)
-				 symbol
-			       (error 'reader-error))))
+			   (let ((package (subseq string 0 colon-position))
+				 (name (subseq string (+ 1 colon-position))))
+			     (if (and (> (length name) 0)
+				      (= (char-code (char name 0)) 58))
+				 (intern (subseq name 1) package)
+			       (multiple-value-bind (symbol status)
+				   (find-symbol name package)
+				 (if (eq status :external)
+				     symbol
+				   (error 'reader-error))))))
 		       (intern string)))
 		 (parse-number string))
 	     string))))))
@@ -4260,6 +4199,7 @@
 	 (20 (find-class 'string))
 	 (84 (find-class 'real))
 	 (116 (find-class 'bit-vector))
+	 (148 (find-class 'vector))
 	 (t (find-class 't))))))
 (defparameter *funcallable-standard-class* (makei 1 *standard-class*))
 (defparameter *standard-direct-slot-definition* (makei 1 *standard-class*))
@@ -4311,13 +4251,14 @@
 					    super))
 				    direct-superclasses))
   (setf (iref class 2)
-	(makei 9 3 name direct-superclasses
+	(makei 11 3 name direct-superclasses
 	       (mapcar #'(lambda (slot)
 			   (apply #'make-standard-direct-slot slot))
 		       direct-slots)
 	       nil nil nil nil
 	       direct-default-initargs))
   (setf (find-class name) class)
+  (setf (dispatch-epoch) (+ 1 (dispatch-epoch)))
   (dolist (super direct-superclasses)
     (push class (iref (iref super 2) 7)))
   (dolist (slot (iref (iref class 2) 4))
@@ -4333,8 +4274,23 @@
     (setf (iref (iref class 2) 5)
 	  (standard-compute-class-precedence-list class))
     (setf (iref (iref class 2) 6)
-	  (standard-compute-slots class)))
+	  (standard-compute-slots class))
+    (when (standard-class-p class)
+      (setf (iref (iref class 2) 11) (standard-compute-slot-locations class))))
   (values))
+(defun standard-class-p (class)
+  (or (eq (iref class 1) *standard-class*)
+      (eq (iref class 1) *funcallable-standard-class*)))
+;; Alist from slot names to the index of the slot in the storage of an
+;; instance, or to the effective slot definition of a class slot.
+(defun standard-compute-slot-locations (class)
+  (let ((index 2))
+    (mapcar #'(lambda (slot)
+		(cons (iref (iref slot 2) 2)
+		      (if (eq :instance (iref (iref slot 2) 6))
+			  (prog1 index (incf index))
+			  slot)))
+	    (iref (iref class 2) 6))))
 (defun standard-compute-class-precedence-list (class)
   (let ((superclasses (cons class (reduce #'union
 					  (mapcar #'(lambda (super)
@@ -4407,8 +4363,8 @@
 			     :qualifiers nil
 			     :specializers (list class)
 			     :function
-			     #'(lambda (args next)
-				 (slot-value (car args) slot-name))))))
+			     (make-slot-accessor
+			      (makei 4 3 nil 0 slot-name nil))))))
 (defun add-writer-method (class fn-name slot)
   (let ((slot-name (iref (iref slot 2) 2))
 	(gf (ensure-generic-function fn-name
@@ -4421,9 +4377,24 @@
 			     :qualifiers nil
 			     :specializers (list (find-class 't) class)
 			     :function
-			     #'(lambda (args next)
-				 (setf (slot-value (cadr args) slot-name)
-				       (car args)))))))
+			     (make-slot-accessor
+			      (makei 4 3 nil 0 slot-name t))))))
+;; Called by an accessor method function made by make-slot-accessor when
+;; the class of its object is not the one it last saw. Caches where the slot
+;; is in instances of the class, which holds until the class is redefined.
+(defun slot-access-miss (cache args)
+  (let* ((writerp (iref cache 5))
+	 (object (if writerp (cadr args) (car args)))
+	 (class (class-of object))
+	 (location (and (standard-class-p class)
+			(cdr (assoc (iref cache 4) (iref (iref class 2) 11))))))
+    (when (fixnump location)
+      (setf (iref cache 2) nil)
+      (setf (iref cache 3) location)
+      (setf (iref cache 2) (iref class 2)))
+    (if writerp
+	(setf (slot-value object (iref cache 4)) (car args))
+	(slot-value object (iref cache 4)))))
 (defun slot-value (object slot-name)
   (let ((class (iref object 1)))
     (if (or (eq (iref class 1) *standard-class*)
@@ -4433,19 +4404,15 @@
 				(find slot-name (class-slots class)
 				      :key #'slot-definition-name)))))
 (defun standard-slot-value (class object slot-name)
-  (let ((index 2))
-    (dolist (slot (iref (iref class 2) 6))
-      (cond
-	((eq :instance (iref (iref slot 2) 6))
-	 (when (eq slot-name (iref (iref slot 2) 2))
-	   (unless (iboundp (iref object 2) index)
-	     (write-line "unbound slot")
-	     (write-line (symbol-name slot-name)))
-	   (return (iref (iref object 2) index)))
-	 (incf index))
-	(t
-	 (when (eq slot-name (iref (iref slot 2) 2))
-	   (return (iref (iref (iref (iref slot 2) 8) 2) 10))))))))
+  (let ((location (cdr (assoc slot-name (iref (iref class 2) 11)))))
+    (cond
+      ((fixnump location)
+       (unless (iboundp (iref object 2) location)
+	 (write-line "unbound slot")
+	 (write-line (symbol-name slot-name)))
+       (iref (iref object 2) location))
+      (location
+       (iref (iref (iref (iref location 2) 8) 2) 10)))))
 (defun (setf slot-value) (new-value object slot-name)
   (let ((class (iref object 1)))
     (if (eq (iref class 1) *standard-class*)
@@ -4454,17 +4421,12 @@
 				      (find slot-name (class-slots class)
 					    :key #'slot-definition-name))))))
 (defun (setf standard-slot-value) (new-value class object slot-name)
-  (let ((index 2))
-    (dolist (slot (iref (iref class 2) 6))
-      (cond
-	((eq :instance (iref (iref slot 2) 6))
-	 (when (eq slot-name (iref (iref slot 2) 2))
-	   (return (setf (iref (iref object 2) index) new-value)))
-	 (incf index))
-	(t
-	 (when (eq slot-name (iref (iref slot 2) 2))
-	   (return (setf (iref (iref (iref (iref slot 2) 8) 2) 10)
-			 new-value))))))))
+  (let ((location (cdr (assoc slot-name (iref (iref class 2) 11)))))
+    (cond
+      ((fixnump location)
+       (setf (iref (iref object 2) location) new-value))
+      (location
+       (setf (iref (iref (iref (iref location 2) 8) 2) 10) new-value)))))
 (defun ensure-generic-function (function-name &rest rest
 				&key (generic-function-class
 				      *standard-generic-function*))
@@ -4501,70 +4463,95 @@
   (setf (iref (iref method 2) 3) generic-function)
   (setf (iref (iref generic-function 2) 10)
 	(length (iref (iref method 2) 5)))
+  (clrhash (iref (iref generic-function 2) 9))
   (let ((df (compute-standard-discriminating-function generic-function)))
     (set-funcallable-instance-function generic-function df)))
 (defparameter *emf-args* (gensym))
+(defconstant dispatch-cache-lines 8)
+;; A closure of the C function dispatch over an empty cache, see
+;; dispatch-miss.
 (defun compute-standard-discriminating-function (generic-function)
-  #'(lambda (&rest arguments)
-      (let* ((classes (mapcar #'class-of
-			      (subseq arguments
-				      0 (iref (iref generic-function 2) 10))))
-	     (emf (gethash classes (iref (iref generic-function 2) 9))))
-	(if emf
-	    (apply emf arguments)
-	    (multiple-value-bind (methods memoizablep)
-		(compute-standard-applicable-methods-using-classes
-		 generic-function classes)
-	      (unless memoizablep
-		(setq methods (compute-standard-applicable-methods
-			       generic-function arguments)))
-	      (unless methods
-		(apply #'no-applicable-method generic-function arguments))
-	      (multiple-value-bind (effective-method effective-method-options)
-		  (compute-standard-effective-method
-		   generic-function (iref (iref generic-function 2) 8) methods)
-		(let ((emf (coerce `(lambda (&rest ,*emf-args*)
-				     ,effective-method)
-				   'function)))
-		  (when memoizablep
-		    (setf (gethash classes (iref (iref generic-function 2) 9))
-			  emf))
-		  (apply emf arguments))))))))
+  (let ((n (iref (iref generic-function 2) 10)))
+    (make-dispatch-function
+     (makei (+ 4 (* dispatch-cache-lines (+ n 1))) 3
+	    generic-function (dispatch-epoch) n 0))))
+;; Called by the discriminating function when no line of its cache matches
+;; the classes of arguments: finds the effective method function, from the
+;; table of the generic function or by computing it, and puts it in the
+;; cache in place of the oldest line.
+(defun dispatch-miss (cache &rest arguments)
+  (let* ((generic-function (iref cache 2))
+	 (n (iref cache 4))
+	 (table (iref (iref generic-function 2) 9))
+	 (classes (mapcar #'class-of (subseq arguments 0 n)))
+	 (emf nil))
+    (unless (= (iref cache 3) (dispatch-epoch))
+      (clrhash table)
+      (dotimes (i (* dispatch-cache-lines (+ n 1)))
+	(setf (iref cache (+ 6 i)) nil))
+      (setf (iref cache 3) (dispatch-epoch))
+      (setf (iref cache 5) 0))
+    (setq emf (gethash classes table))
+    (unless emf
+      (multiple-value-bind (methods memoizablep)
+	  (compute-standard-applicable-methods-using-classes
+	   generic-function classes)
+	(unless memoizablep
+	  (setq methods (compute-standard-applicable-methods
+			 generic-function arguments)))
+	(unless methods
+	  (apply #'no-applicable-method generic-function arguments))
+	(setq emf (compute-standard-effective-method-function
+		   generic-function (iref (iref generic-function 2) 8) methods))
+	(if memoizablep
+	    (setf (gethash classes table) emf)
+	    (return-from dispatch-miss (apply emf arguments)))))
+    (let ((line (+ 6 (* (iref cache 5) (+ n 1)))))
+      (setf (iref cache (+ line n)) nil)
+      (dotimes (i n)
+	(setf (iref cache (+ line i)) (dispatch-class-key (nth i arguments))))
+      (setf (iref cache (+ line n)) emf)
+      (setf (iref cache 5) (mod (+ 1 (iref cache 5)) dispatch-cache-lines)))
+    (apply emf arguments)))
 (defun compute-standard-applicable-methods-using-classes
     (generic-function classes)
-  (let ((applicable nil)
-	(depths nil))
+  (let ((applicable nil))
     (dolist (method (iref (iref generic-function 2) 4))
-      (block method
-	(do ((specializers (iref (iref method 2) 5) (cdr specializers))
-	     (clss classes (cdr clss)))
-	    ((not clss))
-	  (let ((depth 0))
-	    (dolist (class (iref (iref (car clss) 2) 5) (return-from method))
-	      (when (eq (car specializers) class)
-		(push depth depths)
-		(return))
-	      (incf depth))))
-	(let ((prev nil)
-	      (point applicable)
-	      (depths (reverse depths)))
-	  (do () ((or (not point)
-		      (do ((dl depths (cdr dl))
-			   (dr (cdr point) (cdr dr)))
-			  ((not dl))
-			(when (< (car dl) (car dr))
-			  (return t))
-			(when (> (car dl) (car dr))
-			  (return)))))
-	    (setq prev point)
-	    (setq point (cdr point)))
-	  (let ((new (cons (cons method depths) point)))
-	    (if prev
-		(setf (cdr prev) new)
-		(setq applicable new))))))
+      (let ((depths nil))
+	(block method
+	  (do ((specializers (iref (iref method 2) 5) (cdr specializers))
+	       (clss classes (cdr clss)))
+	      ((not clss))
+	    (let ((depth 0))
+	      (dolist (class (iref (iref (car clss) 2) 5) (return-from method))
+		(when (eq (car specializers) class)
+		  (push depth depths)
+		  (return))
+		(incf depth))))
+	  (let ((prev nil)
+		(point applicable)
+		(depths (reverse depths)))
+	    (do () ((or (not point)
+			(do ((dl depths (cdr dl))
+			     (dr (cdar point) (cdr dr)))
+			    ((not dl))
+			  (when (< (car dl) (car dr))
+			    (return t))
+			  (when (> (car dl) (car dr))
+			    (return)))))
+	      (setq prev point)
+	      (setq point (cdr point)))
+	    (let ((new (cons (cons method depths) point)))
+	      (if prev
+		  (setf (cdr prev) new)
+		  (setq applicable new)))))))
     (values (mapcar #'car applicable) t)))
-(defun compute-standard-effective-method (generic-function method-combination
-					  methods)
+;; A closure calling the method functions of the applicable methods in the
+;; order of standard method combination, with the next method lists worked
+;; out here rather than on every call. A lone accessor method is called
+;; through slot-accessor-emf, any other lone primary method directly.
+(defun compute-standard-effective-method-function
+    (generic-function method-combination methods)
   (let ((primary nil)
 	(before nil)
 	(after nil)
@@ -4578,28 +4565,38 @@
 	  ((equal qualifiers '(:around)) (push method around))
 	  (t (error "unknown qualifiers for standard-method-combination ~A"
 		    qualifiers)))))
+    (unless primary
+      (error "No primary method for ~A." (iref (iref generic-function 2) 2)))
     (setq primary (reverse primary))
-    (setq before (reverse before))
     (setq around (reverse around))
-    (flet ((call-methods (methods)
-	     (mapcar #'(lambda (method)
-			 `(call-standard-method ,method))
-		     methods)))
-      (let ((form (if (or before after (rest primary))
-		      `(multiple-value-prog1
-			(progn ,@(call-methods before)
-			       (call-standard-method ,(car primary)
-						     ,(cdr primary)))
-			,@(call-methods after))
-		      `(call-standard-method ,(car primary)))))
+    (flet ((method-functions (methods)
+	     (mapcar #'(lambda (method) (iref (iref method 2) 2)) methods)))
+      (let* ((before-functions (method-functions (reverse before)))
+	     (after-functions (method-functions after))
+	     (function (iref (iref (car primary) 2) 2))
+	     (next (cdr primary))
+	     (emf (cond
+		    ((or before-functions after-functions)
+		     #'(lambda (&rest args)
+			 (dolist (before before-functions)
+			   (funcall before args nil))
+			 (multiple-value-prog1 (funcall function args next)
+			   (dolist (after after-functions)
+			     (funcall after args nil)))))
+		    (next
+		     #'(lambda (&rest args) (funcall function args next)))
+		    ((slot-accessor-emf function))
+		    (t
+		     #'(lambda (&rest args) (funcall function args nil))))))
 	(if around
-	    `(call-method ,(car around) (,@(cdr around) (make-method ,form)))
-	    form)))))
-(defmacro call-standard-method (method &optional next-method-list)
-  `(funcall (if (consp ',method)
-		(make-method-function (cadr ',method))
-		(iref (iref ',method 2) 2))
-    ,*emf-args* ',next-method-list))
+	    (let ((function (iref (iref (car around) 2) 2))
+		  (next (append (cdr around)
+				(list (ensure-method
+				       generic-function
+				       :function #'(lambda (args next)
+						     (apply emf args)))))))
+	      #'(lambda (&rest args) (funcall function args next)))
+	    emf)))))
 (defmacro call-method (method &optional next-method-list)
   `(funcall (method-function ,method) ,*emf-args* ',next-method-list))
 (defun set-funcallable-instance-function (funcallable-instance function)
@@ -4698,7 +4695,9 @@
    (direct-methods :accessor class-direct-methods)
    (direct-default-initargs :accessor class-direct-default-initargs
 			    :initform nil)
-   (default-initargs :accessor class-default-initargs)))
+   (default-initargs :accessor class-default-initargs)
+   (slot-locations)
+   (instance-constructors)))
 (defclass built-in-class (class) ())
 (defclass forward-referenced-class (class) ())
 (defclass standard-class (class) ())
@@ -4735,16 +4734,18 @@
 (defmethod make-instance ((class standard-class) &rest initargs)
   (unless (class-finalized-p class)
     (finalize-inheritance class))
-  (let ((additional-initargs nil))
-    (dolist (default-initarg (class-direct-default-initargs class))
-      (let ((default (getf initargs (car default-initarg))))
-	(when default
-	  (push (car default-initarg) additional-initargs)
-	  (push (funcall (caddr default-initarg)) additional-initargs))))
-    (setq initargs (append initargs (reverse additional-initargs))))
-  (let ((instance (apply #'allocate-instance class initargs)))
-    (apply #'initialize-instance instance initargs)
-    instance))
+  (let ((constructor (instance-constructor class initargs)))
+    (if constructor
+	(funcall constructor initargs)
+	(let ((additional-initargs nil))
+	  (dolist (default-initarg (class-direct-default-initargs class))
+	    (unless (get-properties initargs (list (car default-initarg)))
+	      (push (car default-initarg) additional-initargs)
+	      (push (funcall (caddr default-initarg)) additional-initargs)))
+	  (setq initargs (append initargs (reverse additional-initargs)))
+	  (let ((instance (apply #'allocate-instance class initargs)))
+	    (apply #'initialize-instance instance initargs)
+	    instance)))))
 (defmethod make-instance ((class symbol) &rest initargs)
   (apply #'make-instance (find-class class) initargs))
 (defmethod allocate-instance ((class standard-class) &rest initargs)
@@ -4783,6 +4784,109 @@
       (when (eq :instance (slot-definition-allocation slot))
 	(incf i))))
   instance)
+;; The standard methods of the functions make-instance calls. While these are
+;; the only applicable ones, instance-constructor may skip the calls.
+(defparameter *initialization-functions*
+  '(allocate-instance initialize-instance shared-initialize))
+(defparameter *standard-initialization-methods*
+  (mapcar #'(lambda (name) (car (iref (iref (fdefinition name) 2) 4)))
+	  *initialization-functions*))
+;; A function of initargs making an instance of class the way the standard
+;; initialization methods would, cached in the class for each list of initarg
+;; keys. The cache goes when a method is added to an initialization function.
+;; Returns nil when other methods apply.
+(defun instance-constructor (class initargs)
+  (when (eq (iref class 1) *standard-class*)
+    (let ((cache (iref (iref class 2) 12)))
+      (unless (do ((names *initialization-functions* (cdr names))
+		   (methods (car cache) (cdr methods)))
+		  ((not names) cache)
+		(unless (eq (car methods)
+			    (iref (iref (fdefinition (car names)) 2) 4))
+		  (return nil)))
+	(setq cache (list (mapcar #'(lambda (name)
+				      (iref (iref (fdefinition name) 2) 4))
+				  *initialization-functions*)))
+	(setf (iref (iref class 2) 12) cache))
+      (dolist (entry (cdr cache)
+	       (let ((constructor (compute-instance-constructor class
+								initargs)))
+		 (push (cons (plist-keys initargs) constructor) (cdr cache))
+		 constructor))
+	(when (do ((keys (car entry) (cdr keys))
+		   (plist initargs (cddr plist)))
+		  ((or (not keys) (not plist)) (eq keys plist))
+		(unless (eq (car keys) (car plist))
+		  (return nil)))
+	  (return (cdr entry)))))))
+(defun plist-keys (plist)
+  (let ((keys nil))
+    (do ((plist plist (cddr plist)))
+	((not plist) (reverse keys))
+      (push (car plist) keys))))
+(defun compute-instance-constructor (class initargs)
+  (when (and (equal (compute-standard-applicable-methods-using-classes
+		     #'allocate-instance (list (class-of class)))
+		    (list (first *standard-initialization-methods*)))
+	     (equal (compute-standard-applicable-methods-using-classes
+		     #'initialize-instance (list class))
+		    (list (second *standard-initialization-methods*)))
+	     (equal (compute-standard-applicable-methods-using-classes
+		     #'shared-initialize (list class (class-of t)))
+		    (list (third *standard-initialization-methods*))))
+    (let ((keys (plist-keys initargs))
+	  (defaults nil)
+	  (index 2)
+	  (fills nil)
+	  (shared-fills nil)
+	  (inits nil)
+	  (unbound nil))
+      (dolist (default-initarg (class-direct-default-initargs class))
+	(unless (member (car default-initarg) keys)
+	  (push (car default-initarg) defaults)
+	  (push (caddr default-initarg) defaults)))
+      (setq defaults (reverse defaults))
+      (do ((plist defaults (cddr plist)))
+	  ((not plist))
+	(setq keys (append keys (list (car plist)))))
+      (dolist (slot (iref (iref class 2) 6))
+	(let* ((slot (iref slot 2))
+	       (position (position-if #'(lambda (key)
+					  (member key (iref slot 7)))
+				      keys)))
+	  (cond
+	    ((not (eq :instance (iref slot 6)))
+	     (cond
+	       (position
+		(push (cons (iref (iref slot 8) 2) (+ 1 (* 2 position)))
+		      shared-fills))
+	       ((iref slot 4)
+		(return-from compute-instance-constructor nil))))
+	    (position (push (cons index (+ 1 (* 2 position))) fills))
+	    ((iref slot 4) (push (cons index (iref slot 4)) inits))
+	    (t (push index unbound)))
+	  (when (eq :instance (iref slot 6))
+	    (incf index))))
+      (let ((length (- index 2))
+	    (fills (reverse fills))
+	    (inits (reverse inits)))
+	#'(lambda (initargs)
+	    (when defaults
+	      (do ((plist defaults (cddr plist)))
+		  ((not plist))
+		(setq initargs (append initargs
+				       (list (car plist)
+					     (funcall (cadr plist)))))))
+	    (let ((slots (makei length 3)))
+	      (dolist (index unbound)
+		(imakunbound slots index))
+	      (dolist (fill fills)
+		(setf (iref slots (car fill)) (nth (cdr fill) initargs)))
+	      (dolist (fill shared-fills)
+		(setf (iref (car fill) 10) (nth (cdr fill) initargs)))
+	      (dolist (init inits)
+		(setf (iref slots (car init)) (funcall (cdr init))))
+	      (makei 1 class slots)))))))
 (defmethod reinitialize-instance ((instance standard-object) &rest initargs)
   (apply #'shared-initialize instance nil initargs))
 (defmethod ensure-class-using-class ((class null) name &rest rest
@@ -5049,6 +5153,8 @@
 (define-condition warning (condition) ())
 (define-condition simple-warning (simple-condition warning) ())
 (define-condition storage-condition (serious-condition) ())
+(define-condition interrupt (serious-condition) ())
+(define-condition deadline-exceeded (interrupt) ())
 (define-condition style-warning (warning) ())
 (define-condition unbound-slot (cell-error)
   ((instance :initarg :instance
@@ -5108,6 +5214,12 @@
 		 (write-string (integer-string object *print-base*) stream)
 		 (write-string "#<double>" stream)))
 	 (116 (write-string "#<file-stream>" stream))
+	 (148 (write-string "#(" stream)
+	      (dotimes (i (length object))
+		(when (< 0 i)
+		  (write-string " " stream))
+		(print-object (aref object i) stream))
+	      (write-string ")" stream))
 	 (180 (write-string "" stream))
 	 (t (write-string "#<bit object " stream)
 	    (print-object (jref object 1) stream)
@@ -5171,82 +5283,160 @@
     (7 (error 'program-error))
     (8 (error 'control-error))
     (9 (error 'control-error))
+    (10 (error 'storage-condition))
+    (11 (error 'interrupt))
+    (12 (error 'deadline-exceeded))
+    (13 (error 'package-error :package args))
+    (14 (error 'file-error :pathname args))
+    (15 (error 'type-error :datum args :expected-type 'fixnum))
+    (16 (error 'type-error :datum args :expected-type 'double-float))
+    (17 (error 'type-error :datum args :expected-type 'simple-vector))
+    (18 (error 'type-error :datum args :expected-type 'simple-string))
+    (19 (error 'type-error :datum args :expected-type 'hash-table))
+    (20 (error 'type-error :datum args :expected-type 'sequence))
+    (21 (error 'type-error :datum args :expected-type 'array))
+    (22 (error 'type-error :datum args :expected-type 'character))
+    (23 (error 'type-error :datum args :expected-type '(array bit)))
+    (24 (error 'type-error :datum args :expected-type '(unsigned-byte 8)))
+    (25 (error 'type-error :datum args
+	       :expected-type '(vector (unsigned-byte 8))))
+    (26 (error 'type-error :datum args
+	       :expected-type '(or number character string symbol cons array
+				hash-table structure-object)))
+    (27 (error 'end-of-file :stream args))
+    (28 (error 'parse-error))
+    (29 (error 'type-error :datum args
+	       :expected-type '(member 1 2 4 17 18 20 65 66 68 81 82 84
+				36 40 100 104)))
+    (30 (error 'type-error :datum args
+	       :expected-type '(or null (integer 0 32768))))
+    (31 (error 'type-error :datum args :expected-type '(simple-array bit)))
     (t (error "ierror ~A ~A~%" index args))))
+(defconstant internal-time-units-per-second 1000)
+(defmacro with-deadline ((seconds) &rest forms)
+  (let ((outer (gensym))
+	(deadline (gensym)))
+    `(let* ((,outer (deadline))
+	    (,deadline (+ (get-internal-real-time)
+			  (floor (* ,seconds internal-time-units-per-second)))))
+      (unwind-protect
+	   (progn
+	     (setf (deadline)
+		   (if (and ,outer (< ,outer ,deadline)) ,outer ,deadline))
+	     ,@forms)
+	(setf (deadline) ,outer)))))
 (defvar *compilation*)
 (defparameter *compiler-output* *standard-output*)
+(defparameter *cc-command* "cc -m32 -fPIC -shared -O2 -Ic")
+(defparameter *fasl-type* (if (featurep :windows) "dll" "so"))
+(defparameter *compile-temporary-directory* "/tmp")
+(defvar *temporary-counter* 0)
+;; Recorded in the module so that the auto-compiler can tell its modules
+;; from any other file that happens to have their name.
+(defvar *module-key* "")
+(defstruct (compilation
+	     (:constructor construct-compilation
+			   (package-hash symbol-hash class-hash value-hash
+					 values opaques output)))
+  package-hash
+  symbol-hash
+  class-hash
+  value-hash
+  (packages nil)
+  (symbols nil)
+  (classes nil)
+  values
+  opaques
+  output
+  (label-counter 0))
 (defun start-compilation ()
-  (let ((compilation (construct-compilation
-		      (make-hash-table) (make-hash-table) (make-hash-table)
-		      (make-hash-table)
-		      (make-array 32 :adjustable t :fill-pointer 0
-				  :initial-element 0)
-		      (make-array 32 :adjustable t :fill-pointer 0
-				  :initial-element 0)
-		      *compiler-output*)))
-    (format *compiler-output* "#include \"lisp500.h\"~%")
-    (when (featurep :windows)
-      (format *compiler-output* "#include <windows.h>~%"))
-    (format *compiler-output* "lval *value, *opaque;~%")
-    compilation))
+  (construct-compilation
+   (make-hash-table) (make-hash-table) (make-hash-table) (make-hash-table)
+   (make-array 32 :adjustable t :fill-pointer 0 :initial-element 0)
+   (make-array 32 :adjustable t :fill-pointer 0 :initial-element 0)
+   (make-string-output-stream)))
+(defun next-label ()
+  (incf (compilation-label-counter *compilation*)))
 (if (featurep :windows)
     (defun run-cc (basename)
       (run-program "c:/Program Files/Microsoft Visual Studio/VC98/bin/cl.exe"
-		   (conc-string "cl /LD /Fe" basename ".dll " basename
-				".c lisp500.lib")))
-    (let ((end (if (featurep :cygwin) " lisp500.imp" "")))
+		   (conc-string "cl /LD /Ic /Fe" basename ".dll " basename
+				".c lisp800.lib")))
+    (let ((end (if (featurep :cygwin) " lisp800.imp" "")))
       (defun run-cc (basename)
-	(run-program "/bin/sh" "sh" "-c"
-		     (conc-string "cc -fPIC -shared -g -o " basename ".so "
-				  basename ".c" end)))))
-(defun finish-compilation (&optional init)
+	(unless (zerop (run-program "/bin/sh" "sh" "-c"
+				    (conc-string *cc-command* " -o " basename
+						 ".so " basename ".c" end)))
+	  (error "C compiler failed on ~A.c" basename)))))
+(defun c-integer (n)
+  (if (>= n 2147483648) (- n 4294967296) n))
+(defun write-c-table (name entries)
+  (format *compiler-output* "static lval ~A[] = {~%" name)
+  (dolist (entry entries)
+    (format *compiler-output* "~A,~%" (c-integer entry)))
+  (format *compiler-output* "0~%};~%"))
+(defun fill-pointer-list (vector)
+  (let ((list nil))
+    (dotimes (i (fill-pointer vector) (nreverse list))
+      (push (aref vector i) list))))
+(defun finish-compilation (labels)
   (let ((value-hash (compilation-value-hash *compilation*))
 	(package-hash (compilation-package-hash *compilation*))
 	(symbol-hash (compilation-symbol-hash *compilation*))
-	(class-hash (compilation-class-hash *compilation*))
 	(vals (compilation-values *compilation*))
 	(opaques (compilation-opaques *compilation*)))
-    (format *compiler-output* "lval package[] = {~%")
-    (dolist (package (reverse (compilation-packages *compilation*)))
-      (format *compiler-output* "~A,~%"
-	      (gethash (package-name package) value-hash)))
-    (format *compiler-output* "0~%};~%lval symbol[] = {~%")
-    (dolist (symbol (reverse (compilation-symbols *compilation*)))
-      (format *compiler-output* "~A, /* ~A */~%"
-	      (gethash (symbol-name symbol) value-hash)
-	      (symbol-name symbol)))
-    (format *compiler-output* "0~%};~%lval symbol_package[] = {~%")
-    (dolist (symbol (reverse (compilation-symbols *compilation*)))
-      (format *compiler-output* "~A,~%"
-	      (gethash (symbol-package symbol) package-hash)))
-    (format *compiler-output* "0~%};~%lval klass[] = {~%")
-    (dolist (class (reverse (compilation-classes *compilation*)))
-      (format *compiler-output* "~A,~%"
-	      (gethash (class-name class) symbol-hash)))
-    (format *compiler-output* "0~%};~%lval value_data[] = {~%")
-    (if (zerop (fill-pointer vals))
-	(format *compiler-output* "0,~%0,~%")
-	(dotimes (i (fill-pointer vals))
-	  (format *compiler-output* "~A,~%" (aref vals i))))
-    (format *compiler-output* "0~%};~%lval opaque_data[] = {~%")
-    (if (zerop (fill-pointer opaques))
-	(format *compiler-output* "0,~%0,~%")
-	(dotimes (i (fill-pointer opaques))
-	  (format *compiler-output* "~A,~%" (aref opaques i))))
-    (format *compiler-output* "0~%};~%")
+    (format *compiler-output* "#include \"lisp800.h\"~%")
     (when (featurep :windows)
-      (format *compiler-output* "__declspec(dllexport) "))
-    (format *compiler-output* "lval init(lval *f) {~%")
+      (format *compiler-output* "#include <windows.h>~%"))
+    (format *compiler-output* "static lval *value, *opaque;~%")
+    (write-c-table "package"
+		   (mapcar #'(lambda (package)
+			       (gethash (package-name package) value-hash))
+			   (reverse (compilation-packages *compilation*))))
+    (write-c-table "symbol"
+		   (mapcar #'(lambda (symbol)
+			       (gethash (symbol-name symbol) value-hash))
+			   (reverse (compilation-symbols *compilation*))))
+    (write-c-table "symbol_package"
+		   (mapcar #'(lambda (symbol)
+			       (if (symbol-package symbol)
+				   (gethash (symbol-package symbol) package-hash)
+				   (- 1)))
+			   (reverse (compilation-symbols *compilation*))))
+    (write-c-table "klass"
+		   (mapcar #'(lambda (class)
+			       (gethash (class-name class) symbol-hash))
+			   (reverse (compilation-classes *compilation*))))
+    (write-c-table "value_data" (if (zerop (fill-pointer vals))
+				    '(0 0)
+				    (fill-pointer-list vals)))
+    (write-c-table "opaque_data" (if (zerop (fill-pointer opaques))
+				     '(0 0)
+				     (fill-pointer-list opaques)))
+    (write-string (get-output-stream-string
+		   (compilation-output *compilation*))
+		  *compiler-output*)
+    (dolist (definition
+		(list "const int lisp800_module_abi = LISP800_ABI_VERSION;"
+		      (format nil "const char lisp800_module_key[] = \"~A\";"
+			      *module-key*)
+		      "lval init(lval *f) {"))
+      (when (featurep :windows)
+	(format *compiler-output* "__declspec(dllexport) "))
+      (format *compiler-output* "~A~%" definition))
     (format *compiler-output*
 	    "fasr(f, package, ~A, symbol, symbol_package, ~A, klass, ~A, value_data, ~A, opaque_data, ~A, &value, &opaque);~%"
 	    (hash-table-count package-hash)
 	    (hash-table-count symbol-hash)
-	    (hash-table-count class-hash)
+	    (hash-table-count (compilation-class-hash *compilation*))
 	    (max (fill-pointer vals) 2)
 	    (max (fill-pointer opaques) 2))
-    (when init
-      (format *compiler-output* "*++f = 0;~%")
-      (write-string init *compiler-output*))
-    (format *compiler-output* "return 0;~%")
+    (do ((labels labels (cdr labels)))
+	((not labels) (format *compiler-output* "return 0;~%"))
+      (unless (cdr labels)
+	(format *compiler-output* "return "))
+      (format *compiler-output* "call(f, make_closure(f, F~A, 0, 0, 0, 0), 0);~%"
+	      (car labels)))
     (format *compiler-output* "}~%")
     (when (featurep :windows)
       (format *compiler-output* "BOOL WINAPI DllMain() { return TRUE; }~%"))))
@@ -5257,7 +5447,7 @@
       (:package (conc-string "package[" (integer-string index 10) "]"))
       (:symbol (conc-string "symbol[" (integer-string index 10) "]"))
       (:class (conc-string "klass[" (integer-string index 10) "]"))
-      (:immediate (integer-string index 10))
+      (:immediate (integer-string (c-integer index) 10))
       (:cons (conc-string "(lval)value+"
 			  (integer-string (+ 1 (* 4 index)) 10)))
       (:value (conc-string "(lval)value+"
@@ -5268,9 +5458,9 @@
   (multiple-value-bind (index type)
       (intern-constant value)
     (case type
-      (:package (+ 3221225472 2 (* 4 index)))
-      (:symbol (+ 2147483648 2 (* 4 index)))
-      (:class (+ 1073741824 2 (* 4 index)))
+      (:package (+ 3221225472 2 (* 8 index)))
+      (:symbol (+ 2147483648 2 (* 8 index)))
+      (:class (+ 1073741824 2 (* 8 index)))
       (:immediate index)
       (:cons (+ 1 (* 4 index)))
       (:value (+ 2 (* 4 index)))
@@ -5291,12 +5481,16 @@
      (let* ((hash (compilation-symbol-hash *compilation*))
 	    (index (gethash value hash)))
        (unless index
-	 (intern-constant (symbol-package value))
+	 (when (symbol-package value)
+	   (intern-constant (symbol-package value)))
 	 (intern-constant (symbol-name value))
 	 (setq index (setf (gethash value hash) (hash-table-count hash)))
 	 (push value (compilation-symbols *compilation*)))
        (values index :symbol)))
-    ((typep value 'class)
+    ((and (= (ldb '(2 . 0) (ival value)) 2)
+	  (typep value 'class)
+	  (class-name value)
+	  (eq (find-class (class-name value) nil) value))
      (let* ((hash (compilation-class-hash *compilation*))
 	    (index (gethash value hash)))
        (unless index
@@ -5314,7 +5508,7 @@
 			 (compilation-values *compilation*)))
 	       (length (case tag
 			 (1 2)
-			 (2 (+ 2 (/ (ival (iref value 0)) 256)))
+			 (2 (+ 2 (floor (ival (iref value 0)) 256)))
 			 (3 (+ 2 (floor (jref value 0) 256))))))
 	   (setq index (setf (gethash value hash) (fill-pointer vals)))
 	   (let ((new-fill (+ (fill-pointer vals)
@@ -5338,9 +5532,12 @@
 		       (1 :cons)
 		       (2 :value)
 		       (3 :opaque)))))))
+(defvar *lambda*)
+(defvar *jump-buffers*)
+(defvar *unboxed-locals*)
+(defvar *safety* 1)
 (defparameter *control-obstacles*
-  '(unwind-protect lambda block tagbody catch
-    let-special let*-special))
+  '(unwind-protect lambda block tagbody catch let progv))
 (defparameter *stack-obstacles* '(lambda))
 (defun binding (environment name &optional obstacle-names)
   (let ((obstacles nil))
@@ -5349,12 +5546,14 @@
 	(return (values (cdr bind) obstacles)))
       (when (and (consp (car bind)) (member (caar bind) obstacle-names))
 	(push (cdr bind) obstacles)))))
-(defun user-obstacle-p (user)
-  (dolist (obstacle (aref user 2))
-    (unless (member (aref obstacle 0) '(block-local tagbody-local))
-      (return t))))
-(defun binding-obstacle-p (binding)
-  (some #'user-obstacle-p (binding-users binding)))
+(defun make-binding (kind name &optional init)
+  (vector kind name init nil nil nil nil *lambda* nil nil nil))
+(defun make-variable (name &optional init special)
+  (let ((variable (make-binding 'variable name init)))
+    (setf (aref variable 8) special)
+    variable))
+(defun binding-name (binding)
+  (aref binding 1))
 (defun binding-users (binding)
   (aref binding 3))
 (defun (setf binding-users) (new-users binding)
@@ -5363,39 +5562,201 @@
   (aref binding 4))
 (defun (setf binding-height) (new-height binding)
   (setf (aref binding 4) new-height))
-(defun user-obstacles (user)
-  (aref user 2))
-(defun function-upward-funarg-p (function)
-  (aref function 4))
-(defun user-upward-funarg-p (user)
-  (some #'function-upward-funarg-p (user-obstacles user)))
-(defun binding-upward-funarg-p (binding)
-  (some #'user-upward-funarg-p (binding-users binding)))
-(defun transform-function (lambda-list body environment)
-  (let ((transformed-lambda-list nil))
-    (dolist (elem lambda-list)
-      (if (member elem lambda-list-keywords)
-	  (push elem transformed-lambda-list)
-	  (if (consp elem)
-	      (let* ((initializer (transform (cadr elem) environment))
-		     (binding (vector 'lambda-let initializer nil nil nil)))
-		(push (list* (car elem) binding (cddr elem))
-		      transformed-lambda-list)
-		(push (cons (car elem) binding) environment)
-		(when (cddr elem)
-		  (push (caddr elem) environment)))
-	      (let ((binding (vector 'lambda-let (vector 'constant nil)
-				     nil nil nil)))
-		(push (list elem binding) transformed-lambda-list)
-		(push (cons elem binding) environment)))))
-    (push (cons (list 'lambda) (vector 'lambda nil nil nil nil)) environment)
-    (vector 'lambda (reverse transformed-lambda-list)
-	    (transform-progn body environment)
-	    nil nil (incf (compilation-label-counter *compilation*)))))
+(defun binding-captured (binding)
+  (aref binding 5))
+(defun (setf binding-captured) (new-captured binding)
+  (setf (aref binding 5) new-captured))
+(defun binding-assigned (binding)
+  (aref binding 6))
+(defun (setf binding-assigned) (new-assigned binding)
+  (setf (aref binding 6) new-assigned))
+(defun binding-owner (binding)
+  (aref binding 7))
+(defun variable-special (variable)
+  (aref variable 8))
+(defun variable-type (variable)
+  (aref variable 9))
+(defun (setf variable-type) (new-type variable)
+  (setf (aref variable 9) new-type))
+(defun variable-safety (variable)
+  (aref variable 10))
+(defun declare-type (variable types)
+  (setf (variable-type variable)
+	(declared-type (cdr (assoc (binding-name variable) types))))
+  (setf (aref variable 10) *safety*)
+  variable)
+;; A variable that is never assigned has the type of its initial value.
+(defun infer-type (variable)
+  (unless (or (variable-type variable) (binding-assigned variable))
+    (let ((type (intermediate-type (aref variable 2))))
+      (when (numeric-type-p type)
+	(setf (variable-type variable) type)))))
+(defun binding-boxed-p (binding)
+  (and (binding-captured binding) (binding-assigned binding)))
+(defun lambda-node-p (node)
+  (eq (aref node 0) 'lambda))
+(defun lambda-captured (lambda)
+  (aref lambda 5))
+(defun (setf lambda-captured) (new-captured lambda)
+  (setf (aref lambda 5) new-captured))
+(defun use-binding (binding user obstacles)
+  (push user (binding-users binding))
+  (dolist (obstacle obstacles)
+    (when (lambda-node-p obstacle)
+      (setf (binding-captured binding) t)
+      (pushnew binding (lambda-captured obstacle)))))
+(defun obstacle-unwinds-p (obstacle)
+  (case (aref obstacle 0)
+    ((catch unwind-protect progv let) t)
+    ((block tagbody) (binding-captured obstacle))))
+(defun user-unwinds-p (user)
+  (some #'obstacle-unwinds-p (aref user 2)))
+(defun user-nonlocal-p (user)
+  (some #'lambda-node-p (aref user 2)))
+(defun special-variable-p (symbol)
+  (= (ldb '(1 . 2) (iref symbol 8)) 1))
+;; True when every integer below 2 to the power of bits is a fixnum.
+(defun fixnum-byte-p (bits)
+  (labels ((power (n)
+	     (if (zerop n) 1 (* 2 (power (- n 1))))))
+    (<= (power bits) (+ most-positive-fixnum 1))))
+;; How compiled code represents values of the type: :fixnum and :double
+;; are kept unboxed, :simple-vector is a boxed value known to be one.
+(defun declared-type (specifier)
+  (cond
+    ((member specifier '(fixnum bit)) :fixnum)
+    ((member specifier '(float double-float single-float short-float
+			 long-float))
+     :double)
+    ((eq specifier 'simple-vector) :simple-vector)
+    ((not (consp specifier)) nil)
+    ((eq (car specifier) 'signed-byte)
+     (when (and (cdr specifier) (fixnum-byte-p (- (cadr specifier) 1)))
+       :fixnum))
+    ((eq (car specifier) 'unsigned-byte)
+     (when (and (cdr specifier) (fixnum-byte-p (cadr specifier)))
+       :fixnum))
+    ((eq (car specifier) 'integer)
+     (when (and (fixnump (cadr specifier)) (fixnump (caddr specifier)))
+       :fixnum))
+    ((eq (car specifier) 'simple-vector) :simple-vector)))
+;; The forms after the declarations, the names declared special, an alist
+;; of the declared types and the declared safety, if any.
+(defun parse-body (forms)
+  (let ((specials nil)
+	(types nil)
+	(safety nil))
+    (do ()
+	((not (or (and (consp (car forms)) (eq (caar forms) 'declare))
+		  (and (stringp (car forms)) (cdr forms))))
+	 (values forms specials types safety))
+      (when (consp (car forms))
+	(dolist (declaration (cdar forms))
+	  (when (consp declaration)
+	    (case (car declaration)
+	      (special
+	       (setq specials (append (cdr declaration) specials)))
+	      (type
+	       (dolist (name (cddr declaration))
+		 (push (cons name (cadr declaration)) types)))
+	      (optimize
+	       (dolist (quality (cdr declaration))
+		 (cond
+		   ((eq quality 'safety) (setq safety 3))
+		   ((and (consp quality) (eq (car quality) 'safety))
+		    (setq safety (cadr quality))))))
+	      (t
+	       (when (declared-type (car declaration))
+		 (dolist (name (cdr declaration))
+		   (push (cons name (car declaration)) types))))))))
+      (setq forms (cdr forms)))))
+(defun declare-specials (specials environment)
+  (dolist (name specials environment)
+    (push (cons name :special) environment)))
+(defun transform-function (lambda-list body environment &optional name)
+  (let* ((node (vector 'lambda nil nil name (next-label) nil 0 0))
+	 (*lambda* node)
+	 (environment (acons (list 'lambda) node environment))
+	 (state nil)
+	 (params nil)
+	 (*safety* *safety*))
+    (multiple-value-bind (forms specials types safety)
+	(parse-body body)
+      (when safety
+	(setq *safety* safety))
+      (flet ((bind (name &optional init)
+	       (let ((variable (make-variable name init
+					      (or (member name specials)
+						  (special-variable-p name)))))
+		 (declare-type variable types)
+		 (push (if (variable-special variable)
+			   (cons name :special)
+			   (cons name variable))
+		       environment)
+		 variable))
+	     (parse (elem)
+	       (if (consp elem) elem (list elem))))
+	(dolist (elem lambda-list)
+	  (if (member elem lambda-list-keywords)
+	      (setq state elem)
+	      (case state
+		((nil)
+		 (incf (aref node 6))
+		 (push (list :required (bind elem)) params))
+		(&optional
+		 (let* ((elem (parse elem))
+			(init (transform (cadr elem) environment))
+			(variable (bind (car elem) init)))
+		   (push (list :optional variable init
+			       (when (cddr elem) (bind (caddr elem))))
+			 params)))
+		((&rest &body)
+		 (push (list :rest (bind elem)) params))
+		(&key
+		 (let* ((elem (parse elem))
+			(name (if (consp (car elem)) (cadar elem) (car elem)))
+			(key (if (consp (car elem))
+				 (caar elem)
+				 (intern (symbol-name name) "KEYWORD")))
+			(init (transform (cadr elem) environment))
+			(variable (bind name init)))
+		   (push (list :key variable init
+			       (when (cddr elem) (bind (caddr elem)))
+			       key)
+			 params)))
+		(&aux
+		 (let* ((elem (parse elem))
+			(init (transform (cadr elem) environment)))
+		   (push (list :aux (bind (car elem) init) init) params))))))
+	(setq params (reverse params))
+	(setf (aref node 1) params)
+	(setf (aref node 7)
+	      (if (find-if #'(lambda (param) (member (car param) '(:rest :key)))
+			   params)
+		  (- 1)
+		  (count-if #'(lambda (param)
+				(member (car param) '(:required :optional)))
+			    params)))
+	(setq environment (declare-specials specials environment))
+	(setf (aref node 2)
+	      (transform-progn (if name
+				   (list (list* 'block
+						(if (consp name) (cadr name) name)
+						forms))
+				   forms)
+			       environment))
+	node))))
 (defun transform-progn (forms environment)
   (mapcar #'(lambda (form)
 	      (transform form environment))
 	  forms))
+(defun transform-locally (body environment)
+  (multiple-value-bind (forms specials types safety)
+      (parse-body body)
+    (let ((*safety* (or safety *safety*)))
+      (vector 'progn
+	      (transform-progn forms
+			       (declare-specials specials environment))))))
 (defparameter *transforms* (make-hash-table))
 (defparameter *write-cs* (make-hash-table))
 (defmacro deftransform (operator lambda-list &rest body)
@@ -5403,405 +5764,1284 @@
     #'(lambda ,(cons 'environment lambda-list) ,@body)))
 (defmacro defwrite-c (operator &rest body)
   `(setf (gethash ',operator *write-cs*)
-    #'(lambda (intermediate stack-height frame-height receiver) ,@body)))
+    #'(lambda (intermediate stack-height receiver) ,@body)))
 (deftransform block (tag &rest forms)
-  (let* ((binding (vector 'block tag nil nil
-			  (incf (compilation-label-counter *compilation*))
-			  nil))
-	 (new-env (acons (list 'block tag) binding environment)))
-    (setf (aref binding 2) (transform-progn forms new-env))
-    (unless (binding-obstacle-p binding)
-      (setf (aref binding 0) 'block-local))
-    binding))
-(deftransform catch (tag-form &rest forms)
-  (let* ((binding (vector 'catch (transform tag-form environment) nil nil))
-	 (new-env (acons (list 'catch) binding environment)))
-    (setf (aref binding 2) (transform-progn forms new-env))
-    binding))
-(deftransform flet (bindings &rest forms)
-  (let ((binding (vector 'flet nil nil nil))
-	(functions nil)
-	(new-env environment))
+  (let ((block (make-binding 'block tag)))
+    (setf (aref block 2)
+	  (transform-progn forms (acons (list 'block tag) block environment)))
+    block))
+(deftransform catch (tag &rest forms)
+  (let ((catch (vector 'catch (transform tag environment) nil)))
+    (setf (aref catch 2)
+	  (transform-progn forms (acons (list 'catch) catch environment)))
+    catch))
+(deftransform declare (&rest declarations)
+  (vector 'constant nil))
+(deftransform eval-when (situations &rest forms)
+  (if (or (member :execute situations) (member 'eval situations))
+      (vector 'progn (transform-progn forms environment))
+      (vector 'constant nil)))
+(deftransform flet (bindings &rest body)
+  (let ((new-env environment)
+	(variables nil))
     (dolist (bind bindings)
-      (let* ((rest (cdr bind))
-	     (function (transform-function (car rest) (cdr rest) environment)))
-	(push function functions)
-	(push (cons (list 'function (car bind)) function) new-env)))
-    (setf (aref binding 1) (reverse functions))
-    (setf (aref binding 2) (transform-progn forms new-env))
-    binding))
-(deftransform function (specifier)
-  (if (and (consp specifier) (eq 'lambda (car specifier)))
-      (let ((function (transform-function (cadr specifier) (cddr specifier)
-					  environment)))
-	(setf (aref function 4) t)
-	function)
-      (let ((binding (binding environment (list 'function specifier))))
-	(if binding
-	    (let ((reference (vector 'function-local binding)))
-	      (push reference (aref binding 3))
+      (let ((variable (make-variable (list 'function (car bind))
+				     (transform-function (cadr bind) (cddr bind)
+							 environment
+							 (car bind)))))
+	(push variable variables)
+	(push (cons (list 'function (car bind)) variable) new-env)))
+    (multiple-value-bind (forms specials)
+	(parse-body body)
+      (vector 'let (reverse variables)
+	      (transform-progn forms (declare-specials specials new-env))
+	      nil))))
+(deftransform foreign-call (name library result-type &rest arguments)
+  (unless (or (eq result-type :void)
+	      (cadddr (assoc result-type *foreign-types*)))
+    (error "~S is not a foreign result type." result-type))
+  (dolist (argument arguments)
+    (unless (caddr (assoc (car argument) *foreign-types*))
+      (error "~S is not a foreign argument type." (car argument))))
+  (vector 'foreign-call name library result-type (mapcar #'car arguments)
+	  (transform-progn (mapcar #'cadr arguments) environment)
+	  *safety*))
+(deftransform function (name)
+  (if (and (consp name) (eq (car name) 'lambda))
+      (let ((body (cddr name)))
+	(if (and (consp (car body)) (eq (caar body) 'block)
+		 (cadar body) (null (cdr body)))
+	    (transform-function (cadr name) (cddar body) environment
+				(cadar body))
+	    (transform-function (cadr name) body environment)))
+      (multiple-value-bind (binding obstacles)
+	  (binding environment (list 'function name) *stack-obstacles*)
+	(if (and binding (not (consp binding)))
+	    (let ((reference (vector 'reference binding)))
+	      (use-binding binding reference obstacles)
 	      reference)
-	    (vector 'function-global specifier)))))
+	    (vector 'function-global name)))))
 (deftransform go (tag)
-  (multiple-value-bind (binding obstacles)
+  (multiple-value-bind (target obstacles)
       (binding environment (list 'go tag) *control-obstacles*)
-    (if binding
-	(let ((reference (vector 'go binding obstacles)))
-	  (push reference (aref (cdr binding) 3))
-	  reference)
-	(vector 'go-unbound tag))))
-(deftransform if (if then else)
-  (vector 'if (transform if environment)
-	  (transform then environment)
-	  (transform else environment)))
-(deftransform labels (bindings &rest forms)
-  (let ((binding (vector 'flet nil nil nil)))
+    (unless target
+      (error "No tag named ~S." tag))
+    (let ((go (vector 'go (cdr target) obstacles (car target))))
+      (use-binding (cdr target) go obstacles)
+      go)))
+(deftransform if (test then &optional else)
+  (let ((test (transform test environment)))
+    (if (eq (aref test 0) 'constant)
+	(transform (if (aref test 1) then else) environment)
+	(vector 'if test
+		(transform then environment)
+		(transform else environment)))))
+(deftransform labels (bindings &rest body)
+  (let ((new-env environment)
+	(variables nil))
     (dolist (bind bindings)
-      (push (cons (list 'function (car bind))
-		  (vector 'lambda nil nil nil nil))
-	    environment))
-    (setf (aref binding 1)
-	  (mapcar #'(lambda (bind)
-		      (transform-function (cadr bind) (cddr bind)
-					  environment))))
-    (do ((functions (reverse (aref binding 1)) (cdr functions))
-	 (binds environment))
-	((not functions))
-      (let ((function (car functions))
-	    (bind-fn (cdar binds)))
-	(setf (aref function 3) (aref bind-fn 3))))
-    (setf (aref binding 2) (transform-progn forms environment))
-    binding))
-(deftransform let (bindings &rest forms)
-  (labels ((descend-bind (bindings new-env)
-	     (if bindings
-		 (let* ((bind (car bindings))
-			(binding (vector 'let
-					 (transform (cadr bind) environment)
-					 nil nil nil)))
-		   (setf (aref binding 2)
-			 (descend-bind (cdr bindings)
-				       (acons (car bind) binding new-env)))
-		   binding)
-		 (transform-progn forms new-env))))
-    (descend-bind bindings environment)))
-(deftransform let* (bindings &rest forms)
-  (labels ((descend-bind (bindings new-env)
-	     (if bindings
-		 (let* ((bind (car bindings))
-			(binding (vector 'let
-					 (transform (cadr bind) new-env)
-					 nil nil nil)))
-		   (setf (aref binding 2)
-			 (descend-bind (cdr bindings)
-				       (acons (car bind) binding new-env)))
-		   binding)
-		 (transform-progn forms new-env))))
-    (descend-bind bindings environment)))
-(deftransform macrolet (bindings &rest forms)
+      (let ((variable (make-variable (list 'function (car bind)))))
+	(setf (binding-assigned variable) t)
+	(push variable variables)
+	(push (cons (list 'function (car bind)) variable) new-env)))
+    (setq variables (reverse variables))
+    (do ((binds bindings (cdr binds))
+	 (variables variables (cdr variables)))
+	((not binds))
+      (setf (aref (car variables) 2)
+	    (transform-function (cadar binds) (cddar binds) new-env
+				(caar binds))))
+    (multiple-value-bind (forms specials)
+	(parse-body body)
+      (vector 'labels variables
+	      (transform-progn forms (declare-specials specials new-env))))))
+(defun transform-let (bindings body environment sequentialp)
+  (multiple-value-bind (forms specials types safety)
+      (parse-body body)
+    (let ((let (vector 'let nil nil sequentialp))
+	  (new-env environment)
+	  (variables nil)
+	  (*safety* (or safety *safety*)))
+      (dolist (bind bindings)
+	(let* ((name (if (consp bind) (car bind) bind))
+	       (variable (make-variable
+			  name
+			  (transform (if (consp bind) (cadr bind))
+				     (if sequentialp new-env environment))
+			  (or (member name specials)
+			      (special-variable-p name)))))
+	  (declare-type variable types)
+	  (if (variable-special variable)
+	      (progn
+		(unless (some #'variable-special variables)
+		  (push (cons (list 'let) let) new-env))
+		(push (cons name :special) new-env))
+	      (push (cons name variable) new-env))
+	  (push variable variables)))
+      (setf (aref let 1) (reverse variables))
+      (setf (aref let 2)
+	    (transform-progn forms (declare-specials specials new-env)))
+      (mapc #'infer-type variables)
+      let)))
+(deftransform let (bindings &rest body)
+  (transform-let bindings body environment nil))
+(deftransform let* (bindings &rest body)
+  (transform-let bindings body environment t))
+(deftransform locally (&rest body)
+  (transform-locally body environment))
+(deftransform macrolet (bindings &rest body)
   (dolist (bind bindings)
-    (push (cons (car bind)
-		(list (coerce `#'(lambda ,@(cdr arguments)) 'function)))
+    (push (cons (list 'function (car bind))
+		(list (eval `(function (lambda ,@(cdr bind))))))
 	  environment))
-  (vector 'progn (transform-progn forms environment)))
-(deftransform multiple-value-call (fn-form &rest forms)
+  (transform-locally body environment))
+(deftransform multiple-value-call (function &rest forms)
   (vector 'multiple-value-call
-	  (transform fn-form enviroment)
+	  (transform function environment)
 	  (transform-progn forms environment)))
-(deftransform multiple-value-prog1 (form-1 &rest forms)
+(deftransform multiple-value-prog1 (form &rest forms)
   (vector 'multiple-value-prog1
-	  (transform form-1 environment)
+	  (transform form environment)
 	  (transform-progn forms environment)))
 (deftransform progn (&rest forms)
   (vector 'progn (transform-progn forms environment)))
-(deftransform progv (&rest forms)
-  (vector 'progv (transform-progn forms environment)))
+(deftransform progv (symbols values &rest forms)
+  (let ((progv (vector 'progv (transform symbols environment)
+		       (transform values environment) nil)))
+    (setf (aref progv 3)
+	  (transform-progn forms (acons (list 'progv) progv environment)))
+    progv))
 (deftransform quote (datum)
   (vector 'constant datum))
 (deftransform return-from (tag &optional form)
-  (multiple-value-bind (binding obstacles)
+  (multiple-value-bind (block obstacles)
       (binding environment (list 'block tag) *control-obstacles*)
-    (if binding
-	(let ((reference (vector 'return-from binding obstacles
-				 (transform form environment))))
-	  (push reference (aref binding 3))
-	  reference)
-	(vector 'return-from-unbound tag))))
-(deftransform setq (&rest arguments)
-  (do ((pairs arguments (cddr pairs))
-       (sets nil))
-      ((not pairs) (vector 'progn (reverse sets)))
-    (let ((symbol (car pairs))
-	  (value (cadr pairs)))
-      (multiple-value-bind (binding obstacles)
-	  (binding environment symbol *stack-obstacles*)
-	(if binding
-	    (if (consp binding)
-		(push (transform `(setf ,symbol ,value) environment) sets)
-		(let ((set (vector 'setq binding obstacles
-				   (transform value environment))))
-		  (push set (binding-users binding))
-		  (push set sets)))
-	    (multiple-value-bind (symbol expandedp)
-		(macroexpand-1 symbol)
-	      (if expandedp
-		  (push (transform `(setf ,symbol ,value) environment) sets)
-		  (push (vector 'dynamic-setq symbol
-				(transform value environment))
-			sets))))))))
-(deftransform symbol-macrolet (bindings &rest forms)
+    (unless block
+      (error "No block named ~S." tag))
+    (let ((return-from (vector 'return-from block obstacles
+			       (transform form environment))))
+      (use-binding block return-from obstacles)
+      return-from)))
+(defun transform-setq (name value environment)
+  (multiple-value-bind (binding obstacles)
+      (binding environment name *stack-obstacles*)
+    (cond
+      ((eq binding :special)
+       (vector 'dynamic-setq name (transform value environment)))
+      ((consp binding)
+       (transform `(setf ,(car binding) ,value) environment))
+      (binding
+       (let ((setq (vector 'setq binding (transform value environment))))
+	 (setf (binding-assigned binding) t)
+	 (use-binding binding setq obstacles)
+	 setq))
+      (t
+       (multiple-value-bind (expansion expandedp)
+	   (macroexpand-1 name)
+	 (if expandedp
+	     (transform `(setf ,expansion ,value) environment)
+	     (vector 'dynamic-setq name (transform value environment))))))))
+(deftransform setq (&rest pairs)
+  (let ((sets nil))
+    (do ((pairs pairs (cddr pairs)))
+	((not pairs) (vector 'progn (reverse sets)))
+      (push (transform-setq (car pairs) (cadr pairs) environment) sets))))
+(deftransform symbol-macrolet (bindings &rest body)
   (dolist (bind bindings)
-    (push bind environment))
-  (vector 'progn (transform-progn forms environment)))
-(deftransform tagbody (&rest arguments)
-  (let ((tags (remove-if #'consp arguments))
-	(binding (vector 'tagbody nil nil nil))
-	(label-counter (compilation-label-counter *compilation*)))
-    (push (cons (list 'tagbody) binding) environment)
-    (dolist (tag tags)
-      (push (list* (list 'go tag)
-		   (incf (compilation-label-counter *compilation*))
-		   binding)
-	    environment))
-    (setf (aref binding 1)
+    (push (list (car bind) (cadr bind)) environment))
+  (transform-locally body environment))
+(deftransform tagbody (&rest body)
+  (let* ((tagbody (make-binding 'tagbody nil))
+	 (new-env (acons (list 'tagbody) tagbody environment))
+	 (tags nil))
+    (dolist (form body)
+      (unless (consp form)
+	(let ((label (next-label)))
+	  (push (list form label) tags)
+	  (push (list* (list 'go form) label tagbody) new-env))))
+    (setf (aref tagbody 8) (reverse tags))
+    (setf (aref tagbody 2)
 	  (mapcar #'(lambda (form)
 		      (if (consp form)
-			  (transform form environment)
-			  (vector 'tag (incf label-counter))))
-		  arguments))
-    (unless (binding-obstacle-p binding)
-      (setf (aref binding 0) 'tagbody-local))
-    binding))
-(deftransform throw (&rest arguments)
-  (vector 'throw (transform-progn arguments environment)))
-(deftransform unwind-protect (form-1 &rest forms)
-  (vector 'unwind-protect
-	  (transform form-1 (acons (list 'unwind-protect) nil environment))
-	  (transform-progn forms environment)))
+			  (transform form new-env)
+			  (vector 'tag (cadr (assoc form tags)))))
+		  body))
+    tagbody))
+(deftransform the (type form)
+  (let ((type (declared-type type)))
+    (if type
+	(vector 'the type (transform form environment) *safety*)
+	(transform form environment))))
+(deftransform throw (tag form)
+  (vector 'throw (transform tag environment) (transform form environment)))
+(deftransform unwind-protect (form &rest cleanup)
+  (let ((unwind-protect
+	 (vector 'unwind-protect nil
+		 (transform-function nil cleanup environment))))
+    (setf (aref unwind-protect 1)
+	  (transform form (acons (list 'unwind-protect) unwind-protect
+				 environment)))
+    unwind-protect))
+(defparameter *foldable-functions*
+  '(+ - * / = /= < > <= >= min max abs zerop plusp minusp evenp oddp mod
+    not null eq eql equal car cdr caar cadr cdar cddr length
+    char-code code-char char-upcase char-downcase))
+;; Replace a call to a pure function on constant arguments by its value.
+;; Calls that signal an error are left alone so the error happens at run time.
+(defun fold-constant-call (intermediate)
+  (let ((arguments (aref intermediate 2)))
+    (if (and (member (aref intermediate 1) *foldable-functions*)
+	     (every #'(lambda (argument) (eq (aref argument 0) 'constant))
+		    arguments))
+	(multiple-value-bind (value condition)
+	    (ignore-errors
+	      (apply (aref intermediate 1)
+		     (mapcar #'(lambda (argument) (aref argument 1))
+			     arguments)))
+	  (if condition
+	      intermediate
+	      (vector 'constant value)))
+	intermediate)))
 (defun transform (form &optional environment)
-  (if (consp form)
-      (let* ((operator (car form))
-	     (arguments (cdr form))
-	     (transform (gethash operator *transforms*)))
-	(if transform
-	    (apply transform environment arguments)
-	    (let ((binding (binding environment (list 'function operator)))
-		  (targs (transform-progn arguments environment)))
-	      (if binding
-		  (if (consp binding)
-		      (transform (funcall (car binding) form) environment)
-		      (let ((reference (vector 'funcall-local binding targs
-					       environment)))
-			(push reference (binding-users binding))
-			reference))
-		  (multiple-value-bind (form expandedp)
-		      (macroexpand-1 form)
-		    (if expandedp
-			(transform form environment)
-			(vector 'funcall-global operator targs)))))))
-      (if (symbolp form)
-	  (multiple-value-bind (binding obstacles)
-	      (binding environment form *stack-obstacles*)
-	    (if binding
-		(if (consp binding)
-		    (transform (car binding) environment)
-		    (let ((reference (vector 'reference binding obstacles)))
-		      (push reference (aref binding 3))
-		      reference))
-		(multiple-value-bind (form expandedp)
+  (cond
+    ((consp form)
+     (let ((operator (car form))
+	   (arguments (cdr form)))
+       (if (gethash operator *transforms*)
+	   (apply (gethash operator *transforms*) environment arguments)
+	   (multiple-value-bind (binding obstacles)
+	       (binding environment (list 'function operator)
+			*stack-obstacles*)
+	     (cond
+	       ((consp binding)
+		(transform (apply (car binding) arguments) environment))
+	       (binding
+		(let ((reference (vector 'reference binding)))
+		  (use-binding binding reference obstacles)
+		  (vector 'funcall-local reference
+			  (transform-progn arguments environment))))
+	       ((and (consp operator) (eq (car operator) 'lambda))
+		(transform (list* 'funcall (list 'function operator) arguments)
+			   environment))
+	       (t
+		(multiple-value-bind (expansion expandedp)
 		    (macroexpand-1 form)
 		  (if expandedp
-		      (transform form environment)
-		      (vector 'dynamic-reference form)))))
-	  (vector 'constant form))))
-(defun write-c-progn (intermediate stack-height frame-height receiver)
-  (do ((intermediate intermediate (cdr intermediate)))
-      ((not (cdr intermediate))
-       (write-c (if intermediate (car intermediate) (vector 'constant nil))
-		stack-height frame-height receiver))
-    (write-c (car intermediate) stack-height frame-height nil)))
-(defun write-receive (receiver frame-height)
-  (case receiver
-    ((nil))
-    ((t) (format *compiler-output* "return "))
-    (t (format *compiler-output* "f[~A]=" (- receiver frame-height)))))
-(defwrite-c block-local
-  (setf (aref intermediate 5) receiver)
-  (write-c-progn (aref intermediate 2) stack-height frame-height receiver)
-  (format *compiler-output* "L~A: ;~%" (aref intermediate 4)))
+		      (transform expansion environment)
+		      (fold-constant-call
+		       (vector 'funcall-global operator
+			       (transform-progn arguments environment)
+			       *safety*))))))))))
+    ((and (symbolp form) form (not (eq form t)) (not (keywordp form)))
+     (multiple-value-bind (binding obstacles)
+	 (binding environment form *stack-obstacles*)
+       (cond
+	 ((eq binding :special)
+	  (vector 'dynamic-reference form))
+	 ((consp binding)
+	  (transform (car binding) environment))
+	 (binding
+	  (let ((reference (vector 'reference binding)))
+	    (use-binding binding reference obstacles)
+	    reference))
+	 (t
+	  (multiple-value-bind (expansion expandedp)
+	      (macroexpand-1 form)
+	    (if expandedp
+		(transform expansion environment)
+		(vector 'dynamic-reference form)))))))
+    (t (vector 'constant form))))
+(defun write-c (intermediate stack-height receiver)
+  (funcall (gethash (aref intermediate 0) *write-cs*)
+	   intermediate stack-height receiver))
+(defun write-c-progn (forms stack-height receiver)
+  (if forms
+      (do ((forms forms (cdr forms)))
+	  ((not (cdr forms)) (write-c (car forms) stack-height receiver))
+	(write-c (car forms) stack-height nil))
+      (write-value receiver "0")))
+(defun multiple-value-receiver-p (receiver)
+  (or (eq receiver t) (consp receiver)))
+(defun write-value (receiver value &optional multiple-values-p side-effect-p)
+  (cond
+    ((null receiver)
+     (when side-effect-p
+       (format *compiler-output* "~A;~%" value)))
+    (t
+     (when (and (multiple-value-receiver-p receiver) (not multiple-values-p))
+       (format *compiler-output* "xvalues=8;~%"))
+     (if (eq receiver t)
+	 (format *compiler-output* "return ~A;~%" value)
+	 (format *compiler-output* "f[~A]=~A;~%"
+		 (if (consp receiver) (car receiver) receiver) value)))))
+(defun binding-place (binding)
+  (if (eq (binding-owner binding) *lambda*)
+      (format nil "f[~A]" (binding-height binding))
+      (format nil "env[~A]" (position binding (lambda-captured *lambda*)))))
+(defun binding-value (binding)
+  (if (binding-boxed-p binding)
+      (conc-string "o2c(" (binding-place binding) ")[0]")
+      (binding-place binding)))
+(defun simple-value (intermediate)
+  (case (aref intermediate 0)
+    (constant (intern-constant-string (aref intermediate 1)))
+    (reference (unless (variable-unboxed-p (aref intermediate 1))
+		 (binding-value (aref intermediate 1))))))
+(defun write-c-expression (intermediate stack-height)
+  (or (simple-value intermediate)
+      (progn
+	(write-c intermediate stack-height (+ stack-height 1))
+	(format nil "f[~A]" (+ stack-height 1)))))
+(defun write-c-unwinding (forms stack-height receiver dyns)
+  (if (eq receiver t)
+      (let ((slot (+ stack-height 1)))
+	(write-c-progn forms stack-height (list slot))
+	(format *compiler-output* "unwind(f+~A, f[~A]);~%return f[~A];~%"
+		slot dyns slot))
+      (progn
+	(write-c-progn forms stack-height receiver)
+	(format *compiler-output* "unwind(f+~A, f[~A]);~%"
+		stack-height dyns))))
+;; Call function on arguments. With linkp function is a symbol and the call
+;; goes through a call site of its own that is linked to the symbol's function.
+(defun write-c-call (function arguments stack-height receiver &optional linkp)
+  (let ((height (+ stack-height 1)))
+    (unless (every #'simple-value arguments)
+      (format *compiler-output* "f[~A]=0;~%" height))
+    (dolist (argument arguments)
+      (write-c argument height (+ height 1))
+      (incf height))
+    (format *compiler-output* "f[~A]=0;~%" (+ height 1))
+    (if linkp
+	(progn
+	  (format *compiler-output* "{static call_link k;~%")
+	  (write-value receiver
+		       (format nil "call_linked(f+~A, &k, ~A, ~A)"
+			       stack-height function (length arguments))
+		       t t)
+	  (format *compiler-output* "}~%"))
+	(write-value receiver
+		     (format nil "call(f+~A, ~A, ~A)"
+			     stack-height function (length arguments))
+		     t t))))
+(defparameter *unboxed-operators* '(+ - * /))
+(defparameter *unboxed-comparisons*
+  '((= . "==") (/= . "!=") (< . "<") (> . ">") (<= . "<=") (>= . ">=")))
+(defun double-float-object-p (object)
+  (and (= (ldb '(2 . 0) (ival object)) 3) (= (jref object 1) 84)))
+(defun numeric-type-p (type)
+  (member type '(:fixnum :integer :double)))
+;; Numeric variables live in C locals unless a closure or the dynamic
+;; environment needs to see them.
+(defun variable-unboxed-p (variable)
+  (and (numeric-type-p (variable-type variable))
+       (not (variable-special variable))
+       (not (binding-captured variable))))
+(defun unboxed-local (type)
+  (let ((label (next-label)))
+    (push (cons label type) *unboxed-locals*)
+    label))
+;; What is known of the value of intermediate: :fixnum, :integer (a C
+;; integer that may be too large for a fixnum), :double, :simple-vector or
+;; nil for nothing.
+(defun intermediate-type (intermediate)
+  (case (aref intermediate 0)
+    (constant (let ((value (aref intermediate 1)))
+		(cond
+		  ((fixnump value) :fixnum)
+		  ((double-float-object-p value) :double))))
+    (reference (let ((binding (aref intermediate 1)))
+		 (when (eq (aref binding 0) 'variable)
+		   (variable-type binding))))
+    (the (aref intermediate 1))
+    (funcall-global (arithmetic-type intermediate))))
+;; Type of the result of arithmetic on arguments of known types. Sums and
+;; differences of fixnums are exact in C integers, anything else is computed
+;; in doubles just as the interpreter does, except that safety 0 trusts
+;; fixnum arithmetic not to overflow.
+(defun arithmetic-type (intermediate)
+  (let ((operator (aref intermediate 1))
+	(types (mapcar #'intermediate-type (aref intermediate 2))))
+    (when (and (member operator *unboxed-operators*)
+	       types
+	       (< (length types) 16)
+	       (every #'numeric-type-p types))
+      (cond
+	((or (member :double types) (eq operator '/)) :double)
+	((zerop (aref intermediate 3)) :fixnum)
+	((and (not (eq operator '*))
+	      (every #'(lambda (type) (eq type :fixnum)) types))
+	 :integer)
+	(t :double)))))
+;; C expression converting expression from representation from, which may
+;; also be :lval for a boxed value, to representation to.
+(defun convert-unboxed (expression from to stack-height safety)
+  (cond
+    ((eq from to) expression)
+    ((eq to :double)
+     (cond
+       ((not (eq from :lval)) (format nil "(double) ~A" expression))
+       ((zerop safety) (format nil "o2d(~A)" expression))
+       (t (format nil "double_value(f+~A, ~A)" stack-height expression))))
+    ((eq from :lval)
+     (if (zerop safety)
+	 (format nil "LVAL_AS_INT(~A)" expression)
+	 (format nil "fixnum_value(f+~A, ~A)" stack-height expression)))
+    ((eq from :double)
+     (if (zerop safety)
+	 (format nil "(lint) ~A" expression)
+	 (format nil "fixnum_of_double(f+~A, ~A)" stack-height expression)))
+    ((and (eq from :integer) (eq to :fixnum) (not (zerop safety)))
+     (format nil "fixnum_check(f+~A, ~A)" stack-height expression))
+    (t expression)))
+(defun box-unboxed (expression type stack-height)
+  (case type
+    (:fixnum (format nil "(INT_AS_LVAL(~A) | 16)" expression))
+    (:integer (format nil "box_integer(f+~A, ~A)" stack-height expression))
+    (t (format nil "d2o(f+~A, ~A)" stack-height expression))))
+;; C expression for the value of intermediate, and its representation:
+;; :fixnum, :integer, :double, or :lval when it is boxed.
+(defun unboxed-value (intermediate stack-height)
+  (let ((type (intermediate-type intermediate)))
+    (case (and (numeric-type-p type) (aref intermediate 0))
+      (constant
+       (if (eq type :fixnum)
+	   (values (integer-string (aref intermediate 1) 10) :fixnum)
+	   (values (format nil "o2d(~A)"
+			   (intern-constant-string (aref intermediate 1)))
+		   :double)))
+      (reference
+       (let ((variable (aref intermediate 1)))
+	 (if (variable-unboxed-p variable)
+	     (values (format nil "u~A" (binding-height variable)) type)
+	     (values (binding-value variable) :lval))))
+      (the
+       (multiple-value-bind (expression from)
+	   (unboxed-value (aref intermediate 2) stack-height)
+	 (values (convert-unboxed expression from type stack-height
+				  (aref intermediate 3))
+		 type)))
+      (funcall-global
+       (values (write-c-arithmetic intermediate type stack-height) type))
+      (t
+       (values (write-c-expression intermediate stack-height) :lval)))))
+(defun write-c-unboxed (intermediate type stack-height safety)
+  (multiple-value-bind (expression from)
+      (unboxed-value intermediate stack-height)
+    (convert-unboxed expression from type stack-height safety)))
+(defun write-c-arithmetic (intermediate type stack-height)
+  (let* ((operator (aref intermediate 1))
+	 (operand-type (if (eq type :double) :double :integer))
+	 (height stack-height)
+	 (operands (mapcar #'(lambda (argument)
+			       (prog1 (write-c-unboxed argument operand-type
+						       height
+						       (aref intermediate 3))
+				 (incf height)))
+			   (aref intermediate 2))))
+    (cond
+      ((cdr operands)
+       (let ((expression (car operands)))
+	 (dolist (operand (cdr operands) (conc-string "(" expression ")"))
+	   (setq expression (format nil "~A ~A ~A" expression operator operand)))))
+      ((eq operator '-) (format nil "(-~A)" (car operands)))
+      ((eq operator '/) (format nil "(1 / ~A)" (car operands)))
+      (t (car operands)))))
+(defun comparison-p (intermediate)
+  (and (eq (aref intermediate 0) 'funcall-global)
+       (assoc (aref intermediate 1) *unboxed-comparisons*)
+       (= (length (aref intermediate 2)) 2)
+       (every #'(lambda (argument)
+		  (numeric-type-p (intermediate-type argument)))
+	      (aref intermediate 2))))
+(defun write-c-comparison (intermediate stack-height)
+  (let* ((arguments (aref intermediate 2))
+	 (type (if (find :double (mapcar #'intermediate-type arguments))
+		   :double
+		   :integer)))
+    (format nil "(~A ~A ~A)"
+	    (write-c-unboxed (car arguments) type stack-height
+			     (aref intermediate 3))
+	    (cdr (assoc (aref intermediate 1) *unboxed-comparisons*))
+	    (write-c-unboxed (cadr arguments) type (+ stack-height 1)
+			     (aref intermediate 3)))))
+;; Entries are (type c-type argument-conversion result-template): numbers
+;; are converted through doubles, other arguments by the named C function,
+;; which passes the characters of a string, the octets of an octet vector or
+;; a string, or an integer address or nil.
+(defparameter *foreign-types*
+  '((:int "int" :number "box_integer(f+~A, ~A)")
+    (:unsigned-int "unsigned int" :number "d2o(f+~A, ~A)")
+    (:long "long" :number "box_integer(f+~A, ~A)")
+    (:unsigned-long "unsigned long" :number "d2o(f+~A, ~A)")
+    (:double "double" :number "d2o(f+~A, ~A)")
+    (:float "float" :number "d2o(f+~A, ~A)")
+    (:string "char *" "foreign_buffer" "foreign_string(f+~A, ~A)")
+    (:octets "unsigned char *" "foreign_octets" nil)
+    (:pointer "void *" "foreign_pointer" "box_pointer(f+~A, ~A)")
+    (:void "void" nil nil)))
+(defun comma-separated (strings)
+  (let ((result (if strings (car strings) "")))
+    (dolist (string (cdr strings) result)
+      (setq result (conc-string result ", " string)))))
+(defparameter *inline-predicates*
+  '((not 1 "!~A") (null 1 "!~A") (eq 2 "(~A == ~A)")
+    (consp 1 "cp(~A)") (atom 1 "!cp(~A)")))
+(defparameter *inline-functions*
+  '((car 1 "car(~A)") (cdr 1 "cdr(~A)")
+    (caar 1 "car(car(~A))") (cadr 1 "car(cdr(~A))")
+    (cdar 1 "cdr(car(~A))") (cddr 1 "cdr(cdr(~A))")
+    (cons 2 "cons(f+~A, ~A, ~A)" t)))
+;; Entry of table for a global call with the right number of arguments.
+;; Entries are (operator argument-count template &optional allocatingp).
+(defun inline-entry (intermediate table)
+  (and (eq (aref intermediate 0) 'funcall-global)
+       (let ((entry (assoc (aref intermediate 1) table)))
+	 (and entry
+	      (= (length (aref intermediate 2)) (cadr entry))
+	      entry))))
+;; Allocating entries get the stack top first; the slots above it that hold
+;; the operands need no protection, as the allocator roots its arguments.
+(defun write-c-inline (entry arguments stack-height)
+  (let ((height stack-height)
+	(operands nil))
+    (dolist (argument arguments)
+      (push (write-c-expression argument height) operands)
+      (incf height))
+    (apply #'format nil (caddr entry)
+	   (if (cadddr entry)
+	       (cons stack-height (reverse operands))
+	       (reverse operands)))))
+;; C expression that is true when the value of intermediate is not nil.
+(defun write-c-test (intermediate stack-height)
+  (let ((predicate (inline-entry intermediate *inline-predicates*)))
+    (cond
+      ((comparison-p intermediate)
+       (write-c-comparison intermediate stack-height))
+      ((member (car predicate) '(not null))
+       (format nil "!~A" (write-c-test (car (aref intermediate 2))
+				       stack-height)))
+      (predicate
+       (write-c-inline predicate (aref intermediate 2) stack-height))
+      (t (write-c-expression intermediate stack-height)))))
+(defun vector-access-p (intermediate)
+  (and (eq (aref intermediate 0) 'funcall-global)
+       (member (aref intermediate 1) '(aref svref))
+       (= (length (aref intermediate 2)) 2)
+       (eq (intermediate-type (car (aref intermediate 2))) :simple-vector)))
+(defun vector-store-p (intermediate)
+  (and (eq (aref intermediate 0) 'funcall-global)
+       (eq (aref intermediate 1) 'funcall)
+       (let ((arguments (aref intermediate 2)))
+	 (and (= (length arguments) 4)
+	      (eq (aref (car arguments) 0) 'function-global)
+	      (member (aref (car arguments) 1) '((setf aref) (setf svref))
+		      :test #'equal)
+	      (eq (intermediate-type (caddr arguments)) :simple-vector)))))
+(defun write-c-vector-place (vector index stack-height safety)
+  (let ((vector (write-c-expression vector stack-height))
+	(index (write-c-unboxed index :fixnum (+ stack-height 1) safety)))
+    (if (zerop safety)
+	(format nil "o2a(~A)[2+~A]" vector index)
+	(format nil "svref_place(f+~A, ~A, ~A)[0]" (+ stack-height 2)
+		vector index))))
+(defun write-lambda-function (lambda)
+  (let* ((*lambda* lambda)
+	 (*jump-buffers* 0)
+	 (*unboxed-locals* nil)
+	 (body (with-output-to-string (*compiler-output*)
+		 (write-lambda-body lambda)))
+	 (output (compilation-output *compilation*)))
+    (format output "static lval F~A(lval *f, lval *h) {~%" (aref lambda 4))
+    (when (lambda-captured lambda)
+      (format output "lval *env = o2a(o2a(f[0])[3]) + 2;~%"))
+    (when (> *jump-buffers* 0)
+      (format output "lval vs;~%")
+      (dotimes (i *jump-buffers*)
+	(format output "jmp_buf J~A;~%" (+ i 1))))
+    (dolist (local *unboxed-locals*)
+      (format output "~A~A u~A;~%"
+	      (if (> *jump-buffers* 0) "volatile " "")
+	      (if (eq (cdr local) :double) "double" "lint")
+	      (car local)))
+    (when (find-if #'(lambda (param)
+		       (member (car param) '(:optional :rest :key)))
+		   (aref lambda 1))
+      (format output "int n = h - f - 1;~%"))
+    (write-string body output)
+    (format output "}~%")))
+(defun write-lambda-body (lambda)
+  (let* ((params (aref lambda 1))
+	 (positional (count-if #'(lambda (param)
+				   (member (car param) '(:required :optional)))
+			       params))
+	 (height positional)
+	 (slot 0)
+	 (rest nil)
+	 (dyns nil))
+    (flet ((bind (variable slot)
+	     (setf (binding-height variable) slot)
+	     (when (variable-unboxed-p variable)
+	       (setf (binding-height variable)
+		     (unboxed-local (variable-type variable)))
+	       (format *compiler-output* "u~A=~A;~%"
+		       (binding-height variable)
+		       (convert-unboxed (format nil "f[~A]" slot) :lval
+					(variable-type variable) height
+					(variable-safety variable))))
+	     (when (binding-boxed-p variable)
+	       (format *compiler-output* "f[~A]=cons(f+~A, f[~A], 0);~%"
+		       slot height slot))
+	     (when (variable-special variable)
+	       (unless dyns
+		 (setq dyns (incf height))
+		 (format *compiler-output* "f[~A]=dyns;~%" dyns))
+	       (format *compiler-output* "bind_special(f+~A, ~A, f[~A]);~%"
+		       height (intern-constant-string (binding-name variable))
+		       slot))))
+      (when (find :optional params :key #'car)
+	(format *compiler-output* "{~%lval *p = h;~%while (p <= f+~A) {~%*p++ = 0;~%}~%}~%"
+		positional))
+      (when (find-if #'(lambda (param) (member (car param) '(:rest :key)))
+		     params)
+	(setq rest (incf height))
+	(format *compiler-output* "f[~A]=n > ~A ? rest(h, f+~A) : 0;~%"
+		rest positional rest))
+      (dolist (param params)
+	(let ((variable (cadr param))
+	      (init (caddr param))
+	      (svar (cadddr param)))
+	  (case (car param)
+	    (:required
+	     (bind variable (incf slot)))
+	    (:optional
+	     (incf slot)
+	     (format *compiler-output* "if (n < ~A) {~%" slot)
+	     (write-c init height slot)
+	     (format *compiler-output* "}~%")
+	     (bind variable slot)
+	     (when svar
+	       (format *compiler-output* "f[~A]=n < ~A ? 0 : ~A;~%"
+		       (incf height) slot (intern-constant-string t))
+	       (bind svar height)))
+	    (:rest
+	     (bind variable rest))
+	    (:key
+	     (let ((key-slot (incf height)))
+	       (when svar
+		 (format *compiler-output* "f[~A]=0;~%" (incf height)))
+	       (format *compiler-output* "f[~A]=getkey(f[~A], ~A);~%if (f[~A]==8) {~%"
+		       key-slot rest (intern-constant-string (nth 4 param))
+		       key-slot)
+	       (write-c init height key-slot)
+	       (when svar
+		 (format *compiler-output* "} else {~%f[~A]=~A;~%"
+			 (+ key-slot 1) (intern-constant-string t)))
+	       (format *compiler-output* "}~%")
+	       (bind variable key-slot)
+	       (when svar
+		 (bind svar (+ key-slot 1)))))
+	    (:aux
+	     (write-c init height (+ height 1))
+	     (bind variable (incf height))))))
+      (if dyns
+	  (write-c-unwinding (aref lambda 2) height t dyns)
+	  (write-c-progn (aref lambda 2) height t)))))
+(defwrite-c block
+  (let ((label (next-label)))
+    (setf (aref intermediate 8) label)
+    (if (binding-captured intermediate)
+	(let* ((dyns (+ stack-height 1))
+	       (tag (+ stack-height 2))
+	       (slot (+ stack-height 3))
+	       (buffer (incf *jump-buffers*)))
+	  (setf (binding-height intermediate) tag)
+	  (setf (aref intermediate 9) (list slot))
+	  (setf (aref intermediate 10) dyns)
+	  (format *compiler-output* "f[~A]=dyns;~%f[~A]=ms(f+~A, 1, 52, &J~A);~%"
+		  dyns tag dyns buffer)
+	  (format *compiler-output* "f[~A]=cons(f+~A, f[~A], f[~A]);~%"
+		  tag tag dyns tag)
+	  (format *compiler-output* "dyns=cons(f+~A, cdr(f[~A]), dyns);~%"
+		  tag tag)
+	  (format *compiler-output* "if (!(vs=setjmp(J~A))) {~%" buffer)
+	  (write-c-progn (aref intermediate 2) tag (list slot))
+	  (format *compiler-output* "} else {~%f[~A]=mvalues(car(vs));~%}~%"
+		  slot)
+	  (format *compiler-output* "L~A: ;~%unwind(f+~A, f[~A]);~%"
+		  label slot dyns)
+	  (write-value receiver (format nil "f[~A]" slot) t))
+	(let ((height stack-height))
+	  (when (some #'user-unwinds-p (binding-users intermediate))
+	    (setq height (+ stack-height 1))
+	    (setf (aref intermediate 10) height)
+	    (format *compiler-output* "f[~A]=dyns;~%" height))
+	  (setf (aref intermediate 9) receiver)
+	  (write-c-progn (aref intermediate 2) height receiver)
+	  (format *compiler-output* "L~A: ;~%" label)))))
+(defwrite-c catch
+  (let ((dyns (+ stack-height 1))
+	(tag (+ stack-height 2))
+	(slot (+ stack-height 3))
+	(buffer (incf *jump-buffers*)))
+    (format *compiler-output* "f[~A]=dyns;~%" dyns)
+    (write-c (aref intermediate 1) dyns tag)
+    (format *compiler-output* "f[~A]=ms(f+~A, 1, 20, &J~A);~%" slot tag buffer)
+    (format *compiler-output* "f[~A]=cons(f+~A, f[~A], f[~A]);~%"
+	    tag slot tag slot)
+    (format *compiler-output* "dyns=cons(f+~A, f[~A], dyns);~%" tag tag)
+    (format *compiler-output* "if (!(vs=setjmp(J~A))) {~%" buffer)
+    (write-c-progn (aref intermediate 2) tag (list slot))
+    (format *compiler-output* "} else {~%f[~A]=mvalues(car(vs));~%}~%dyns=f[~A];~%"
+	    slot dyns)
+    (write-value receiver (format nil "f[~A]" slot) t)))
 (defwrite-c constant
-    (when receiver
-      (write-receive receiver frame-height)
-      (format *compiler-output* "~A;~%"
-	      (intern-constant-string (aref intermediate 1)))))
+  (write-value receiver (intern-constant-string (aref intermediate 1))))
 (defwrite-c dynamic-reference
-    (when receiver
-      (write-receive receiver frame-height)
-      (format *compiler-output* "o2a(~A)[4];~%"
-	      (intern-constant-string (aref intermediate 1)))))
+  (write-value receiver
+	       (format nil "symval(f+~A, ~A)" stack-height
+		       (intern-constant-string (aref intermediate 1)))))
 (defwrite-c dynamic-setq
-  (incf stack-height)
-  (write-c (aref intermediate 2) stack-height frame-height stack-height)
-  (write-receive receiver frame-height)
-  (format *compiler-output* "o2a(~A)[4]=f[~A];~%"
-	  (intern-constant-string (aref intermediate 1))
-	  (- stack-height frame-height)))
-(defwrite-c flet
-  (dolist (function (aref intermediate 1))
-    (setf (binding-height function) (incf stack-height))
-    (write-receive stack-height frame-height)
-    (format *compiler-output*
-	    "ma(f,5,212,ms(f,3,212,F~A,0,-1),0,0,0,0);~%"
-	    (aref function 5))
-    (write-string
-     (with-output-to-string (*compiler-output*)
-       (format *compiler-output* "lval F~A(lval *f, lval *h) {~%"
-	       (aref function 5))
-       (let ((sh stack-height)
-	     (frame-height stack-height))
-	 (dolist (arg (aref function 1))
-	   (let ((binding (cadr arg)))
-	     (setf (binding-height binding) (incf sh))))
-	 (write-c-progn (aref function 2) sh frame-height t))
-       (format *compiler-output* "}~%"))
-     (compilation-output *compilation*)))
-  (write-c-progn (aref intermediate 2) stack-height frame-height receiver))
+  (let ((slot (+ stack-height 1)))
+    (write-c (aref intermediate 2) stack-height slot)
+    (format *compiler-output* "o2a(~A)[4]=f[~A];~%"
+	    (intern-constant-string (aref intermediate 1)) slot)
+    (write-value receiver (format nil "f[~A]" slot))))
+(defwrite-c foreign-call
+  (let ((height stack-height)
+	(safety (aref intermediate 6))
+	(prototype nil)
+	(operands nil))
+    (mapc #'(lambda (type argument)
+	      (let ((entry (assoc type *foreign-types*)))
+		(push (cadr entry) prototype)
+		(push (format nil "(~A) ~A" (cadr entry)
+			      (if (eq (caddr entry) :number)
+				  (write-c-unboxed argument :double height
+						   safety)
+				  (format nil "~A(f+~A, ~A)" (caddr entry)
+					  height
+					  (write-c-expression argument
+							      height))))
+		      operands)
+		(incf height)))
+	  (aref intermediate 4) (aref intermediate 5))
+    (let* ((result (assoc (aref intermediate 3) *foreign-types*))
+	   (call (format nil "((~A (*)(~A)) p)(~A)" (cadr result)
+			 (if prototype
+			     (comma-separated (reverse prototype))
+			     "void")
+			 (comma-separated (reverse operands)))))
+      (format *compiler-output*
+	      "{static void *p;~%if (!p) {~%p=foreign_symbol(f+~A, ~A, ~A);~%}~%"
+	      height (intern-constant-string (aref intermediate 1))
+	      (intern-constant-string (aref intermediate 2)))
+      (if (eq (car result) :void)
+	  (progn
+	    (format *compiler-output* "~A;~%" call)
+	    (write-value receiver "0"))
+	  (write-value receiver (format nil (cadddr result) height call)
+		       nil t))
+      (format *compiler-output* "}~%"))))
 (defwrite-c funcall-global
-  (unless (= frame-height stack-height)
-    (incf stack-height)
-    (format *compiler-output* "f[~A]=f[-1];~%"
-	    (- stack-height frame-height)))
-  (let ((arg-height (+ 2 stack-height)))
-    (dolist (arg (aref intermediate 2))
-      (write-c arg stack-height frame-height arg-height)
-      (incf arg-height)))
-  (write-receive receiver frame-height)
-  (format *compiler-output* "call(f~A, ~A, ~A);~%"
-	  (if (= frame-height stack-height)
-	      ""
-	      (conc-string "+"
-			   (integer-string (- stack-height frame-height))))
-	  (intern-constant-string (aref intermediate 1))
-	  (length (aref intermediate 2))))
+  (let ((type (arithmetic-type intermediate))
+	(arguments (aref intermediate 2))
+	(safety (aref intermediate 3)))
+    (cond
+      (type
+       (write-value receiver
+		    (box-unboxed (write-c-arithmetic intermediate type
+						     stack-height)
+				 type stack-height)
+		    nil t))
+      ((or (comparison-p intermediate)
+	   (inline-entry intermediate *inline-predicates*))
+       (write-value receiver
+		    (format nil "~A ? ~A : 0"
+			    (write-c-test intermediate stack-height)
+			    (intern-constant-string t))
+		    nil t))
+      ((inline-entry intermediate *inline-functions*)
+       (write-value receiver
+		    (write-c-inline (inline-entry intermediate
+						  *inline-functions*)
+				    arguments stack-height)))
+      ((vector-access-p intermediate)
+       (write-value receiver
+		    (write-c-vector-place (car arguments) (cadr arguments)
+					  stack-height safety)
+		    nil t))
+      ((vector-store-p intermediate)
+       (let* ((value (write-c-expression (cadr arguments) stack-height))
+	      (place (write-c-vector-place (caddr arguments)
+					   (cadddr arguments)
+					   (+ stack-height 1) safety)))
+	 (format *compiler-output* "~A=~A;~%" place value)
+	 (write-value receiver value)))
+      (t
+       (write-c-call (intern-constant-string (aref intermediate 1))
+		     arguments stack-height receiver t)))))
 (defwrite-c funcall-local
-  (unless (= frame-height stack-height)
-    (incf stack-height)
-    (format *compiler-output* "f[~A]=f[-1];~%"
-	    (- stack-height frame-height)))
-  (format *compiler-output* "f[~A]=f[~A];~%"
-	  (+ 1 (- stack-height frame-height))
-	  (- (binding-height (aref intermediate 1)) frame-height))
-  (let ((arg-height (+ 2 stack-height)))
-    (dolist (arg (aref intermediate 2))
-      (write-c arg stack-height frame-height arg-height)
-      (incf arg-height))
-    (write-receive receiver frame-height)
-    (format *compiler-output* "F~A(f+~A, f+~A);~%"
-	    (aref (aref intermediate 1) 5)
-	    (+ 1 (- stack-height frame-height))
-	    (- arg-height frame-height))))
+  (write-c-call (binding-value (aref (aref intermediate 1) 1))
+		(aref intermediate 2) stack-height receiver))
 (defwrite-c function-global
-  (when receiver
-    (write-receive receiver frame-height)
-    (let ((name (aref intermediate 1)))
-      (if (consp name)
-	  (format *compiler-output* "o2a(~A)[6];~%"
-		  (intern-constant-string (cadr name)))
-	  (format *compiler-output* "o2a(~A)[5];~%"
-		  (intern-constant-string name))))))
+  (let ((name (aref intermediate 1)))
+    (write-value receiver
+		 (format nil "symfun(f+~A, ~A, ~A)" stack-height
+			 (intern-constant-string (if (consp name)
+						     (cadr name)
+						     name))
+			 (if (consp name) 6 5)))))
 (defwrite-c go
-  (format *compiler-output* "goto L~A;~%" (car (aref intermediate 1))))
-(defwrite-c go-unbound
-  (format *compiler-output* "dbgr(f, 9, ~A, 0);~%"
-	  (intern-constant-string (aref intermediate 1))))
+  (let ((tagbody (aref intermediate 1))
+	(label (aref intermediate 3)))
+    (cond
+      ((user-nonlocal-p intermediate)
+       (format *compiler-output* "tagbody_go(f+~A, ~A, ~A);~%"
+	       stack-height (binding-place tagbody)
+	       (+ 1 (position label (aref tagbody 8) :key #'cadr))))
+      (t
+       (when (user-unwinds-p intermediate)
+	 (format *compiler-output* "unwind(f+~A, ~A);~%" stack-height
+		 (if (binding-captured tagbody)
+		     (format nil "car(f[~A])" (binding-height tagbody))
+		     (format nil "f[~A]" (aref tagbody 10)))))
+       (format *compiler-output*
+	       "if (safepoint_pending) {~%safepoint(f+~A);~%}~%goto L~A;~%"
+	       stack-height label)))
+    (write-value receiver "0")))
 (defwrite-c if
-  (write-c (aref intermediate 1) stack-height frame-height
-	   (+ 1 stack-height))
-  (format *compiler-output* "if (f[~A]) {~%"
-	  (- (+ 1 stack-height) frame-height))
-  (write-c (aref intermediate 2) stack-height frame-height receiver)
+  (format *compiler-output* "if (~A) {~%"
+	  (write-c-test (aref intermediate 1) stack-height))
+  (write-c (aref intermediate 2) stack-height receiver)
   (format *compiler-output* "} else {~%")
-  (write-c (aref intermediate 3) stack-height frame-height receiver)
+  (write-c (aref intermediate 3) stack-height receiver)
   (format *compiler-output* "}~%"))
+(defwrite-c labels
+  (let ((height stack-height)
+	(variables (aref intermediate 1)))
+    (dolist (variable variables)
+      (setf (binding-height variable) (incf height))
+      (format *compiler-output* "f[~A]=~A;~%" height
+	      (if (binding-boxed-p variable)
+		  (format nil "cons(f+~A, 0, 0)" (- height 1))
+		  "0")))
+    (dolist (variable variables)
+      (if (binding-boxed-p variable)
+	  (progn
+	    (write-c (aref variable 2) height (+ height 1))
+	    (format *compiler-output* "o2c(f[~A])[0]=f[~A];~%"
+		    (binding-height variable) (+ height 1)))
+	  (write-c (aref variable 2) height (binding-height variable))))
+    (write-c-progn (aref intermediate 2) height receiver)))
 (defwrite-c lambda
-  (write-string
-   (with-output-to-string (*compiler-output*)
-     (format *compiler-output* "lval F~A(lval *f, lval *h) {~%"
-	     (aref intermediate 5))
-     (let ((frame-height stack-height))
-       "(incf stack-height)"
-       (dolist (arg (aref intermediate 1))
-	 (let ((binding (cadr arg)))
-	   (setf (binding-height binding) (incf stack-height))))
-       (write-c-progn (aref intermediate 2) stack-height frame-height t))
-     (format *compiler-output* "}~%"))
-   (compilation-output *compilation*))
-  (write-receive receiver frame-height)
-  (format *compiler-output* "ma(f,5,212,ms(f,3,212,F~A,0,-1),0,0,0,0);~%"
-	  (aref intermediate 5)))
+  (write-lambda-function intermediate)
+  (when receiver
+    (let ((captured (lambda-captured intermediate))
+	  (height stack-height)
+	  (env "0"))
+      (when captured
+	(format *compiler-output* "f[~A]=ma(f+~A, ~A, 116~A);~%"
+		(+ stack-height 1) stack-height (length captured)
+		(apply #'conc-string
+		       (mapcar #'(lambda (binding)
+				   (conc-string ", " (binding-place binding)))
+			       captured)))
+	(setq env (format nil "f[~A]" (incf height))))
+      (write-value receiver
+		   (format nil "make_closure(f+~A, F~A, ~A, ~A, ~A, ~A)"
+			   height (aref intermediate 4)
+			   (aref intermediate 6) (aref intermediate 7) env
+			   (intern-constant-string (aref intermediate 3)))))))
 (defwrite-c let
-  (incf stack-height)
-  (setf (binding-height intermediate) stack-height)
-  (write-c (aref intermediate 1) (- stack-height 1) frame-height
-	   stack-height)
-  (write-c-progn (aref intermediate 2) stack-height frame-height receiver))
+  (let ((height stack-height)
+	(dyns nil)
+	(sequentialp (aref intermediate 3)))
+    (flet ((bind-special (variable)
+	     (unless dyns
+	       (setq dyns (incf height))
+	       (format *compiler-output* "f[~A]=dyns;~%" dyns))
+	     (format *compiler-output* "bind_special(f+~A, ~A, f[~A]);~%"
+		     height (intern-constant-string (binding-name variable))
+		     (binding-height variable))))
+      (dolist (variable (aref intermediate 1))
+	(if (variable-unboxed-p variable)
+	    (let ((label (unboxed-local (variable-type variable))))
+	      (format *compiler-output* "u~A=~A;~%" label
+		      (write-c-unboxed (aref variable 2)
+				       (variable-type variable) height
+				       (variable-safety variable)))
+	      (setf (binding-height variable) label))
+	    (progn
+	      (write-c (aref variable 2) height (+ height 1))
+	      (setf (binding-height variable) (incf height))
+	      (when (binding-boxed-p variable)
+		(format *compiler-output* "f[~A]=cons(f+~A, f[~A], 0);~%"
+			height height height))
+	      (when (and sequentialp (variable-special variable))
+		(bind-special variable)))))
+      (unless sequentialp
+	(dolist (variable (aref intermediate 1))
+	  (when (variable-special variable)
+	    (bind-special variable))))
+      (if dyns
+	  (write-c-unwinding (aref intermediate 2) height receiver dyns)
+	  (write-c-progn (aref intermediate 2) height receiver)))))
+(defwrite-c multiple-value-call
+  (let* ((function (+ stack-height 1))
+	 (height function))
+    (write-c (aref intermediate 1) stack-height function)
+    (dolist (form (aref intermediate 2))
+      (write-c form height (list (+ height 1)))
+      (incf height)
+      (format *compiler-output* "f[~A]=rvalues(f+~A, f[~A]);~%"
+	      height height height))
+    (write-value receiver
+		 (format nil "mv_call(f+~A, f[~A], f+~A, ~A)" height function
+			 (+ function 1) (length (aref intermediate 2)))
+		 t t)))
+(defwrite-c multiple-value-prog1
+  (let ((slot (+ stack-height 1))
+	(multiple-values-p (multiple-value-receiver-p receiver)))
+    (write-c (aref intermediate 1) stack-height
+	     (if multiple-values-p (list slot) slot))
+    (when multiple-values-p
+      (format *compiler-output* "f[~A]=rvalues(f+~A, f[~A]);~%" slot slot slot))
+    (dolist (form (aref intermediate 2))
+      (write-c form slot nil))
+    (write-value receiver
+		 (format nil (if multiple-values-p "mvalues(f[~A])" "f[~A]") slot)
+		 multiple-values-p)))
 (defwrite-c progn
-  (write-c-progn (aref intermediate 1) stack-height frame-height receiver))
+  (write-c-progn (aref intermediate 1) stack-height receiver))
+(defwrite-c progv
+  (let ((symbols (+ stack-height 1))
+	(values (+ stack-height 2))
+	(dyns (+ stack-height 3)))
+    (write-c (aref intermediate 1) stack-height symbols)
+    (write-c (aref intermediate 2) symbols values)
+    (format *compiler-output* "f[~A]=dyns;~%progv_bind(f+~A, f[~A], f[~A]);~%"
+	    dyns dyns symbols values)
+    (write-c-unwinding (aref intermediate 3) dyns receiver dyns)))
 (defwrite-c reference
-  (when receiver
-    (write-receive receiver frame-height)
-    (format *compiler-output* "f[~A];~%"
-	    (- (binding-height (aref intermediate 1)) frame-height))))
+  (write-value receiver
+	       (or (simple-value intermediate)
+		   (multiple-value-bind (expression type)
+		       (unboxed-value intermediate stack-height)
+		     (box-unboxed expression type stack-height)))))
 (defwrite-c return-from
-  (let ((binding (aref intermediate 1)))
-    (write-c (aref intermediate 3) stack-height frame-height
-	     (aref binding 5))
-    (format *compiler-output* "goto L~A;~%" (aref binding 4))))
-(defwrite-c return-from-unbound
-  (format *compiler-output* "dbgr(f, 8, ~A, 0);~%"
-	  (intern-constant-string (aref intermediate 1))))
+  (let ((block (aref intermediate 1))
+	(slot (+ stack-height 1)))
+    (cond
+      ((user-nonlocal-p intermediate)
+       (write-c (aref intermediate 3) stack-height (list slot))
+       (format *compiler-output* "block_return(f+~A, ~A, f[~A]);~%"
+	       slot (binding-place block) slot))
+      ((user-unwinds-p intermediate)
+       (write-c (aref intermediate 3) stack-height (list slot))
+       (format *compiler-output* "f[~A]=rvalues(f+~A, f[~A]);~%unwind(f+~A, f[~A]);~%"
+	       slot slot slot slot (aref block 10))
+       (write-value (aref block 9) (format nil "mvalues(f[~A])" slot) t)
+       (format *compiler-output* "goto L~A;~%" (aref block 8)))
+      (t
+       (write-c (aref intermediate 3) stack-height (aref block 9))
+       (format *compiler-output* "goto L~A;~%" (aref block 8))))
+    (write-value receiver "0")))
 (defwrite-c setq
-  (write-c (aref intermediate 3) stack-height frame-height
-	   (binding-height (aref intermediate 1))))
+  (let ((variable (aref intermediate 1)))
+    (cond
+      ((variable-unboxed-p variable)
+       (format *compiler-output* "u~A=~A;~%" (binding-height variable)
+	       (write-c-unboxed (aref intermediate 2) (variable-type variable)
+				stack-height (variable-safety variable)))
+       (write-value receiver
+		    (box-unboxed (format nil "u~A" (binding-height variable))
+				 (variable-type variable) stack-height)))
+      ((binding-boxed-p variable)
+       (let ((slot (+ stack-height 1)))
+	 (write-c (aref intermediate 2) stack-height slot)
+	 (format *compiler-output* "~A=f[~A];~%" (binding-value variable) slot)
+	 (write-value receiver (format nil "f[~A]" slot))))
+      (t
+       (write-c (aref intermediate 2) stack-height (binding-height variable))
+       (write-value receiver (binding-value variable))))))
 (defwrite-c tag
   (format *compiler-output* "L~A: ;~%" (aref intermediate 1)))
-(defwrite-c tagbody-local
-  (dolist (form (aref intermediate 1))
-    (write-c form stack-height frame-height nil))
-  (when receiver
-    (write-receive receiver frame-height)
-    (format *compiler-output* "0;~%")))
-(defun write-c (intermediate &optional (stack-height 0) (frame-height 0)
-		receiver)
-  (let ((write-c (gethash (aref intermediate 0) *write-cs*)))
-    (if write-c
-	(funcall write-c intermediate stack-height frame-height receiver)
-	(error))))
-(defstruct (compilation
-	     (:constructor construct-compilation
-			   (package-hash symbol-hash class-hash value-hash
-					 values opaques output)))
-  package-hash
-  symbol-hash
-  class-hash
-  value-hash
-  (value-length 0)
-  (packages nil)
-  (symbols nil)
-  (classes nil)
-  values
-  opaques
-  output
-  (label-counter 0))
-(defun test-compilation (val)
-  (let ((basename "test"))
-    (with-open-file (*compiler-output* (conc-string basename ".c")
-				       :direction :output)
-      (let ((*compilation* (start-compilation)))
-	(finish-compilation (with-output-to-string (*compiler-output*)
-			      (write-c (transform val))))))
-    (run-cc basename)))
-(defun test-transform (val)
-  (let ((*compilation* (start-compilation)))
-    (transform val)))
-
+(defwrite-c the
+  (let ((type (aref intermediate 1)))
+    (if (numeric-type-p type)
+	(multiple-value-bind (expression type)
+	    (unboxed-value intermediate stack-height)
+	  (write-value receiver (box-unboxed expression type stack-height)
+		       nil t))
+	(write-c (aref intermediate 2) stack-height receiver))))
+(defwrite-c tagbody
+  (let ((height stack-height))
+    (if (binding-captured intermediate)
+	(let ((dyns (+ stack-height 1))
+	      (tag (+ stack-height 2))
+	      (buffer (incf *jump-buffers*))
+	      (i 0))
+	  (setq height tag)
+	  (setf (binding-height intermediate) tag)
+	  (setf (aref intermediate 10) dyns)
+	  (format *compiler-output* "f[~A]=dyns;~%f[~A]=ms(f+~A, 1, 52, &J~A);~%"
+		  dyns tag dyns buffer)
+	  (format *compiler-output* "dyns=cons(f+~A, f[~A], dyns);~%" tag tag)
+	  (format *compiler-output* "f[~A]=cons(f+~A, dyns, f[~A]);~%"
+		  tag tag tag)
+	  (format *compiler-output* "switch (setjmp(J~A)) {~%" buffer)
+	  (dolist (tag (aref intermediate 8))
+	    (format *compiler-output* "case ~A:~%goto L~A;~%"
+		    (incf i) (cadr tag)))
+	  (format *compiler-output* "}~%"))
+	(when (some #'user-unwinds-p (binding-users intermediate))
+	  (setq height (+ stack-height 1))
+	  (setf (aref intermediate 10) height)
+	  (format *compiler-output* "f[~A]=dyns;~%" height)))
+    (dolist (form (aref intermediate 2))
+      (write-c form height nil))
+    (when (binding-captured intermediate)
+      (format *compiler-output* "unwind(f+~A, f[~A]);~%"
+	      height (aref intermediate 10)))
+    (write-value receiver "0")))
+(defwrite-c throw
+  (let ((tag (+ stack-height 1))
+	(slot (+ stack-height 2)))
+    (write-c (aref intermediate 1) stack-height tag)
+    (write-c (aref intermediate 2) tag (list slot))
+    (format *compiler-output* "throw_to(f+~A, f[~A], f[~A]);~%" slot tag slot)
+    (write-value receiver "0")))
+(defwrite-c unwind-protect
+  (let ((cleanup (+ stack-height 1))
+	(slot (+ stack-height 2))
+	(multiple-values-p (multiple-value-receiver-p receiver)))
+    (write-c (aref intermediate 2) stack-height cleanup)
+    (format *compiler-output* "f[~A]=ma(f+~A, 2, 52, 0, f[~A]);~%dyns=cons(f+~A, f[~A], dyns);~%"
+	    cleanup cleanup cleanup cleanup cleanup)
+    (write-c (aref intermediate 1) cleanup
+	     (if multiple-values-p (list slot) slot))
+    (when multiple-values-p
+      (format *compiler-output* "f[~A]=rvalues(f+~A, f[~A]);~%" slot slot slot))
+    (format *compiler-output* "unwind(f+~A, cdr(dyns));~%" slot)
+    (write-value receiver
+		 (format nil (if multiple-values-p "mvalues(f[~A])" "f[~A]") slot)
+		 multiple-values-p)))
+(defun compile-thunk (form)
+  (let ((lambda (transform-function nil (list form) nil)))
+    (write-lambda-function lambda)
+    (aref lambda 4)))
+(defparameter *compile-time-operators*
+  '(defmacro defpackage in-package defvar defparameter defconstant deftype
+    defstruct defclass define-condition define-symbol-macro defsetf
+    define-setf-expander define-modify-macro))
+;; Labels of the thunks compiled for the top level form, in reverse order.
+;; Definitions later forms of the file depend on while being compiled are
+;; also evaluated.
+(defun compile-toplevel-form (form)
+  (let ((labels nil))
+    (labels ((process (form compile-time-too)
+	       (if (consp form)
+		   (case (car form)
+		     (progn
+		       (dolist (form (cdr form))
+			 (process form compile-time-too)))
+		     (eval-when
+		       (let ((situations (cadr form)))
+			 (when (or (member :compile-toplevel situations)
+				   (member 'compile situations))
+			   (eval (cons 'progn (cddr form))))
+			 (when (or (member :load-toplevel situations)
+				   (member 'load situations))
+			   (dolist (form (cddr form))
+			     (process form nil)))))
+		     (t
+		      (when (or compile-time-too
+				(member (car form) *compile-time-operators*))
+			(eval form))
+		      (multiple-value-bind (expansion expandedp)
+			  (if (member (car form) *compile-time-operators*)
+			      (values form nil)
+			      (macroexpand-1 form))
+			(if expandedp
+			    (process expansion nil)
+			    (push (compile-thunk form) labels)))))
+		   (push (compile-thunk form) labels))))
+      (process form nil))
+    labels))
+(defun file-basename (pathname)
+  (let* ((slash (position (code-char 47) pathname :from-end t))
+	 (dot (position (code-char 46) pathname :from-end t)))
+    (if (and dot (or (not slash) (> dot slash)))
+	(subseq pathname 0 dot)
+	pathname)))
+(defun write-module (basename labels)
+  (with-open-file (*compiler-output* (conc-string basename ".c")
+				     :direction :output)
+    (finish-compilation labels))
+  (run-cc basename)
+  (conc-string basename "." *fasl-type*))
+;; Compiles the source file to C and runs the C compiler on the result,
+;; giving a module load can read back. The module is named after
+;; output-file, or after input-file when it is not given.
+(defun compile-file (input-file &key output-file)
+  (let ((*package* *package*)
+	(*compilation* (start-compilation))
+	(labels nil)
+	(eof (list nil)))
+    (with-open-file (stream input-file)
+      (do ((form (read stream nil eof) (read stream nil eof)))
+	  ((eq form eof))
+	(setq labels (append (compile-toplevel-form form) labels))))
+    (write-module (file-basename (or output-file input-file))
+		  (reverse labels))))
+(defparameter *interpreted-function-code* (jref (iref #'(lambda ()) 2) 2))
+(defun compiled-function-p (object)
+  (and (functionp object)
+       (not (= (jref (iref object 2) 2) *interpreted-function-code*))))
+;; The function form an interpreted function was made from.
+(defun function-definition-form (function)
+  (multiple-value-bind (expression environment name)
+      (function-lambda-expression function)
+    (list 'function
+	  (if name
+	      (list 'lambda (cadr expression)
+		    (list* 'block name (cddr expression)))
+	      expression))))
+(defun temporary-basename ()
+  (format nil "~A/lisp800-~A-~A" *compile-temporary-directory*
+	  (get-internal-real-time) (incf *temporary-counter*)))
+;; Compiles the function form to the module basename and loads it.
+(defun compile-definition (form basename &optional key keep)
+  (let* ((*compilation* (start-compilation))
+	 (*module-key* (or key ""))
+	 (module (write-module basename (list (compile-thunk form))))
+	 (function (fasl module key)))
+    ;; a loaded module can be unlinked everywhere but on windows
+    (delete-file (conc-string basename ".c"))
+    (unless (or keep (featurep :windows))
+      (delete-file module))
+    function))
+;; Closures over a lexical environment are left interpreted.
+(defun compile (name &optional definition)
+  (let ((function (or definition (fdefinition name))))
+    (unless (or (compiled-function-p function) (iref function 3))
+      (setq function (compile-definition (function-definition-form function)
+					 (temporary-basename))))
+    (if name
+	(progn
+	  (setf (fdefinition name) function)
+	  name)
+	function)))
+;; Where the modules of automatically compiled functions are kept across
+;; sessions: a directory, :default for ~/.cache/lisp800, or nil for none.
+;; Modules are only kept in and loaded from a directory private to the user.
+(defparameter *auto-compile-directory* :default)
+;; Functions compiled automatically in this session by source key.
+(defvar *auto-compiled* (make-hash-table :test #'equal))
+(defvar *auto-compiling* nil)
+;; Four independent hashes of the definition of name, about 100 bits,
+;; which should not change from one session to another. The interpreter
+;; expands macros in place, so uninterned symbols are hashed by order of
+;; appearance.
+(defun source-hash (name form)
+  (let ((a 0)
+	(b 0)
+	(c 0)
+	(d 0)
+	(gensyms nil))
+    (labels ((mix (n)
+	       (setq a (mod (+ (* a 31) n) 33554393)
+		     b (mod (+ (* b 37) n) 33554383)
+		     c (mod (+ (* c 41) n) 33554371)
+		     d (mod (+ (* d 43) n) 33554347)))
+	     (walk (x)
+	       (do ((x x (cdr x)))
+		   ((atom x)
+		    (cond
+		      ((null x) (mix 5))
+		      ((and (symbolp x) (symbol-package x))
+		       (mix (sxhash (symbol-name x))))
+		      ((symbolp x)
+		       (unless (member x gensyms)
+			 (push x gensyms))
+		       (mix 4)
+		       (mix (length (member x gensyms))))
+		      ((and (arrayp x) (not (simple-string-p x)))
+		       (mix 2)
+		       (dotimes (i (length x))
+			 (walk (aref x i))))
+		      (t (mix 3) (mix (mod (sxhash x) 33554393)))))
+		 (mix 1)
+		 (walk (car x)))))
+      (walk (package-name (symbol-package name)))
+      (walk form))
+    (format nil "~A-~A-~A-~A" a b c d)))
+(defun auto-compile-directory ()
+  (let ((directory (if (eq *auto-compile-directory* :default)
+		       (let ((home (posix-getenv "HOME")))
+			 (and home (conc-string home "/.cache/lisp800")))
+		       *auto-compile-directory*)))
+    (and directory (ensure-private-directory directory) directory)))
+;; Compiled function for the definition form of name. A module is only
+;; loaded once in a session, and is taken from the disk cache when one
+;; there was compiled from the same source for the same runtime.
+(defun auto-compiled-function (name form)
+  (let ((key (format nil "~A-~A" (fasl-version) (source-hash name form)))
+	(directory (auto-compile-directory)))
+    (or (gethash key *auto-compiled*)
+	(setf (gethash key *auto-compiled*)
+	      (if directory
+		  (let* ((basename (format nil "~A/auto-~A" directory key))
+			 (module (conc-string basename "." *fasl-type*)))
+		    (or (and (with-open-file (stream module
+						     :if-does-not-exist nil)
+			       stream)
+			     (fasl module key))
+			(compile-definition form basename key t)))
+		  (compile-definition form (temporary-basename) key))))))
+;; Called by the interpreter when function has been called or has looped
+;; (auto-compile-threshold) times: compiles it and installs the compiled code
+;; unless its name has been redefined. Errors leave it interpreted. Returns
+;; nil when busy compiling, so that the interpreter asks again later.
+(defun auto-compile (function)
+  (unless *auto-compiling*
+    (let ((*auto-compiling* t)
+	  (name (iref function 6)))
+      (when (and name (symbolp name) (not (iref function 3))
+		 (fboundp name) (eq (fdefinition name) function))
+	(let ((compiled (ignore-errors
+			  (auto-compiled-function
+			   name (function-definition-form function)))))
+	  (when (and compiled (eq (fdefinition name) function))
+	    (setf (fdefinition name) compiled))))
+      t)))
+;; Calls the C function name of the shared library library, or of the
+;; program when it is nil, on arguments of the form (type form). Only
+;; compiled code makes foreign calls.
+(defmacro foreign-call (name library result-type &rest arguments)
+  `(error "Foreign call to ~A from interpreted code." ,name))
+;; Defines name as a compiled function calling the C function c-name of
+;; library with parameters of the form (parameter type). Types are :int,
+;; :long, :unsigned-int, :unsigned-long, :double and :float for numbers,
+;; :string for the characters of a string and :octets for those of an
+;; octet vector or string, both passed without copying, and :pointer for
+;; an address; results may also be :void. The symbol is looked up on the
+;; first call.
+(defmacro define-foreign-function (name (c-name &optional library)
+				   result-type &rest parameters)
+  (let ((lambda-list (mapcar #'car parameters))
+	(call (list* 'foreign-call c-name library result-type
+		     (mapcar #'(lambda (parameter)
+				 (list (cadr parameter) (car parameter)))
+			     parameters))))
+    `(progn
+      (defun ,name ,lambda-list ,call)
+      (compile-foreign-function ',name '(lambda ,lambda-list ,call)))))
+;; Compiles lambda as the definition of name unless compile-file already
+;; has. Foreign functions close over nothing, so the lexical environment of
+;; the definition does not matter.
+(defun compile-foreign-function (name lambda)
+  (unless (compiled-function-p (fdefinition name))
+    (compile name (eval (list 'function lambda))))
+  name)
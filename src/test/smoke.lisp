@@ -33,5 +33,330 @@
 (is eq 1 (foo))
 (is equal (macroexpand-1 '(defwrap foo)) '(defun foo nil 1))
 
+(defun runaway (n) (+ 1 (runaway n)))
+(is eq :exhausted (handler-case (runaway 0) (storage-condition () :exhausted)))
+(is eq :exhausted (handler-case (runaway 0) (storage-condition () :exhausted)))
+
+(defvar *cleaned-up* nil)
+(defun spin () (tagbody start (go start)))
+(is eq :timeout (handler-case (with-deadline (0.1)
+                                (unwind-protect (spin) (setq *cleaned-up* t)))
+                  (deadline-exceeded () :timeout)))
+(is eq t *cleaned-up*)
+(is eq 3 (with-deadline (10) (+ 1 2)))
+
+(defun square (x) (* x x))
+(compile 'square)
+(is eq t (compiled-function-p #'square))
+(is eq 49 (square 7))
+
+(defun typed-sum (n)
+  (declare (fixnum n))
+  (let ((s 0))
+    (declare (fixnum s))
+    (dotimes (i n s)
+      (declare (fixnum i))
+      (setq s (+ s i)))))
+(compile 'typed-sum)
+(is eq t (compiled-function-p #'typed-sum))
+(is eq 45 (typed-sum 10))
+
+(defun count-a (list)
+  (let ((n 0))
+    (do ((l list (cdr l)))
+        ((atom l) (list n (car '(x y)) (if (< 1 2) 'yes 'no)))
+      (when (eq (car l) 'a)
+        (setq n (+ n 1))))))
+(compile 'count-a)
+(is eq t (compiled-function-p #'count-a))
+(is equal '(2 x yes) (count-a '(a b a)))
+
+(defun callee (x) (+ x 1))
+(defun linked-caller (x) (callee x))
+(compile 'linked-caller)
+(is eq t (compiled-function-p #'linked-caller))
+(is eq 2 (linked-caller 1))
+(defun callee (x) (* x 10))
+(is eq 10 (linked-caller 1))
+
+(defun warm (x) (+ x x))
+(setf (auto-compile-threshold) 20)
+(let ((*auto-compile-directory* nil))
+  (dotimes (i 40) (warm i)))
+(setf (auto-compile-threshold) 0)
+(is eq t (compiled-function-p #'warm))
+(is eq 6 (warm 3))
+(is eq nil (ensure-private-directory "/tmp"))
+
+(define-foreign-function c-strlen ("strlen") :int (string :string))
+(is eq t (compiled-function-p #'c-strlen))
+(is eq 5 (c-strlen "hello"))
+
+(defclass shape () ())
+(defclass square (shape) ())
+(defmethod corners ((s shape)) 0)
+(is eq 0 (corners (make-instance 'square)))
+(defmethod corners ((s square)) 4)
+(is eq 4 (corners (make-instance 'square)))
+(is eq 0 (corners (make-instance 'shape)))
+(defmethod corners :around ((s square)) (+ 1 (call-next-method)))
+(defmethod corners :before ((s shape)) nil)
+(is eq 5 (corners (make-instance 'square)))
+
+(defclass cell () ((value :initarg :value :accessor cell-value)))
+(defparameter *cell* (make-instance 'cell :value 1))
+(setf (cell-value *cell*) 2)
+(is eq 2 (cell-value *cell*))
+(defclass cell () ((label :initform 0)
+                   (value :initarg :value :accessor cell-value)))
+(is eq 3 (cell-value (make-instance 'cell :value 3)))
+(is eq 3 (slot-value (make-instance 'cell :value 3) 'value))
+
+(defclass counter () ((count :initarg :count :accessor counter-count))
+  (:default-initargs :count 10))
+(is eq 10 (counter-count (make-instance 'counter)))
+(is eq 1 (counter-count (make-instance 'counter :count 1)))
+(defmethod initialize-instance :after ((c counter) &rest initargs)
+  (setf (counter-count c) (+ 1 (counter-count c))))
+(is eq 11 (counter-count (make-instance 'counter)))
+
+(defparameter *names* (make-hash-table :test 'equalp))
+(setf (gethash "Key" *names*) 1)
+(is eq 1 (gethash "KEY" *names*))
+(defparameter *squares* (make-hash-table :test 'equal))
+(dotimes (i 1000) (setf (gethash (list i) *squares*) (* i i)))
+(dotimes (i 500) (remhash (list (* 2 i)) *squares*))
+(is eq 500 (hash-table-count *squares*))
+(is equal '(998001 nil) (list (gethash (list 999) *squares*)
+                              (gethash (list 998) *squares*)))
+
+(is eq t (equalp (list "Abc" (vector 1 "x")) (list "aBC" (vector 1 "X"))))
+(is eq nil (equal (list "Abc" 1) (list "aBC" 1)))
+(defparameter *ring* (list 1 2 3))
+(setf (cdr (cddr *ring*)) *ring*)
+(is eq t (fixnump (sxhash *ring*)))
+
+(make-package "SMOKE")
+(dotimes (i 2000) (intern (format nil "S~D" i) "SMOKE"))
+(is eq 'car (find-symbol "CAR" "SMOKE"))
+(is eq t (unintern (find-symbol "S1999" "SMOKE") "SMOKE"))
+(is eq 1999 (let ((n 0)) (do-symbols (s "SMOKE" n) (setq n (+ n 1)))))
+
+(is equal '(1 2 3 4 5) (sort (list 3 5 1 4 2) #'<))
+(is equal '((0 b) (0 d) (1 a) (1 c))
+    (stable-sort (list '(1 a) '(0 b) '(1 c) '(0 d)) #'< :key #'car))
+(is equalp (vector "fig" "pear" "plum")
+    (sort (vector "plum" "fig" "pear") #'string<))
+(is eq t
+    (let ((v (make-array 2000)))
+      (dotimes (i 2000)
+        (setf (aref v i) (cons (mod (* i 7919) 13) i)))
+      (setq v (stable-sort v #'< :key #'car))
+      (dotimes (i 1999 t)
+        (let ((a (aref v i)) (b (aref v (+ i 1))))
+          (unless (or (< (car a) (car b))
+                      (and (= (car a) (car b)) (< (cdr a) (cdr b))))
+            (return nil))))))
+(is equal '(1 2 3 4) (merge 'list (list 1 3) (list 2 4) #'<))
+
+(is eq 3 (position 2 (vector 1 2 3 2 1) :from-end t))
+(is eq 2 (count (code-char 97) "banana" :start 2 :test #'char=))
+(is equal "bnn" (remove (code-char 97) "banana"))
+(is equalp (vector 1 9 3) (substitute 9 2 (vector 1 2 3)))
+(is equal '(59999 2)
+    (let ((bits (make-array 60000 :element-type 'bit :initial-element 0)))
+      (setf (aref bits 5) 1)
+      (let ((kept (remove 1 bits)))
+        (list (length kept) (count 1 (substitute 1 0 bits :count 1))))))
+(is eq 4 (search "cd" "abcdcd" :from-end t))
+(is eq 2 (mismatch "abcd" "abxd"))
+
+(defparameter *long* nil)
+(dotimes (i 5000) (push i *long*))
+(is eq 5000 (length (copy-list *long*)))
+(is eq 0 (nth 4999 *long*))
+(is equal '(1 2 . 3) (append '(1) '(2) 3))
+(is equal '((b . 2)) (member 'b '((a . 1) (b . 2)) :key #'car))
+(is equal '("b" . 2) (assoc "B" '(("a" . 1) ("b" . 2)) :test #'equalp))
+(is equal '(((b . 2)) ("b" . 2))
+    (list (member 'b '((a . 1) (b . 2)) :key #'car :key #'cdr)
+          (assoc "B" '(("a" . 1) ("b" . 2)) :test #'equalp :test #'eq)))
+(is equal '(1 1 2 2) (mapcan #'(lambda (x) (list x x)) '(1 2)))
+
+(defparameter *grid* (make-array '(2 3) :initial-contents '((1 2 3) (4 5 6))))
+(setf (aref *grid* 1 0) 40)
+(is equal '(3 40 6) (list (aref *grid* 0 2) (aref *grid* 1 0)
+                          (row-major-aref *grid* 5)))
+(defparameter *shifted*
+  (make-array 3 :displaced-to (vector 0 1 2 3) :displaced-index-offset 1))
+(is eq 3 (aref *shifted* 2))
+(defparameter *word* (make-string 3 :initial-element (code-char 97)))
+(setf (char *word* 1) (code-char 98))
+(is equal "aba" *word*)
+(is eq :bounds (handler-case (schar *word* 3) (error () :bounds)))
+(defparameter *bits* (make-array 40 :element-type 'bit))
+(setf (bit *bits* 33) 1)
+(is equal '(0 1) (list (sbit *bits* 32) (bit *bits* 33)))
+
+(setf (bit *bits* 2) 1)
+(defparameter *mask* (bit-not *bits*))
+(is equal '(2 38 0) (list (count 1 *bits*) (count 1 *mask*)
+                          (count 1 (bit-and *bits* *mask*))))
+(is equal '(2 33 nil) (list (position 1 *bits*) (position 1 *bits* :from-end t)
+                          (position 1 (bit-xor *mask* (bit-not *bits*)))))
+(is eq *mask* (bit-ior *bits* *mask* *mask*))
+(is eq 40 (count 1 *mask*))
+(is equal '(34 1 1 2 0)
+    (let ((tail (subseq *bits* 2 36)))
+      (list (length tail) (bit tail 0) (bit tail 31) (count 1 tail)
+            (count 1 (subseq *bits* 3 33)))))
+
+(is equal "LOG LINE 42: OK" (string-upcase "log line 42: ok"))
+(is equal "mixed Case" (string-downcase "MIXED Case" :end 5))
+(is eq t (string-equal "Content-Length" "CONTENT-length"))
+(is eq 3 (string< "abcd" "abce"))
+(is eq nil (string> "abc" "abc"))
+(is equal "trim" (string-trim " " "  trim "))
+(is eq 10 (search "error" "log: ok,  error" :test #'char-equal))
+(is eq 10 (search "ErRoR" "log: ok,  eRRor!" :test #'char-equal))
+(is eq 7 (mismatch "Header-x" "HEADER-Y" :test #'char-equal))
+(is eq nil (mismatch "content-LENGTH" "Content-Length" :test 'char-equal))
+
+(defparameter *built*
+  (with-output-to-string (o)
+    (dotimes (i 300) (write-string "0123456789" o))
+    (write-char (code-char 33) o)))
+(is equal '(3001 "789!") (list (length *built*) (subseq *built* 2997)))
+(is equal "X-42" (format nil "~A-~D" :x 42))
+(is equal '(1 "two") (read-from-string "(1 \"two\")"))
+
+(defparameter *octets* (make-array 8 :element-type '(unsigned-byte 8)))
+(setf (octets-u32-be *octets* 0) 4294967294)
+(setf (octets-s16-le *octets* 4) (- 0 3))
+(is equal '(255 254 253 4294967294 65533)
+    (list (aref *octets* 0) (aref *octets* 3) (aref *octets* 4)
+          (octets-u32-be *octets* 0) (octets-u16-le *octets* 4)))
+(is equal (list (- 0 2) (- 0 3))
+    (list (octets-s32-be *octets* 0) (octets-s16-le *octets* 4)))
+(is eq :type (handler-case (setf (aref *octets* 0) 256) (type-error () :type)))
+(is equal '(:type :type :type)
+    (mapcar #'(lambda (format)
+                (handler-case (octets-ref *octets* 0 format)
+                  (type-error () :type)))
+            '(8 3 48)))
+(is eq :type (handler-case (setf (octets-ref *octets* 0 0) 1)
+               (type-error () :type)))
+(setf (aref *octets* 6) 97)
+(setf (aref *octets* 7) 98)
+(is equal "ab" (with-output-to-string (s) (write-sequence *octets* s :start 6)))
+(is equal '(8 121)
+    (with-input-from-string (s "xyz")
+      (list (read-sequence *octets* s :start 6) (aref *octets* 7))))
+(define-foreign-function c-octets-length ("strlen") :int (octets :octets))
+(defparameter *c-octets* (make-array 4 :element-type '(unsigned-byte 8)
+                                       :initial-element 0))
+(setf (aref *c-octets* 0) 200)
+(setf (aref *c-octets* 1) 1)
+(is eq 2 (c-octets-length *c-octets*))
+
+(defun filled-vector (type contents fill-pointer)
+  (let ((v (make-array (length contents) :element-type type
+                       :fill-pointer fill-pointer
+                       :initial-element (aref contents 0))))
+    (dotimes (i (length contents) v)
+      (setf (aref v i) (aref contents i)))))
+(defparameter *filled* (filled-vector 'character "abcd" 2))
+(is eq t (equal "ab" *filled*))
+(is eq nil (equal "abcd" *filled*))
+(is eq t (equal "bc" (make-array 2 :element-type 'character
+                                   :displaced-to *filled*
+                                   :displaced-index-offset 1)))
+(defparameter *bits* (make-array 4 :element-type 'bit :initial-element 1))
+(setf (aref *bits* 0) 0)
+(setf (aref *bits* 3) 0)
+(defparameter *simple-bits* (make-array 3 :element-type 'bit :initial-element 1))
+(setf (aref *simple-bits* 0) 0)
+(is eq t (equal *simple-bits* (filled-vector 'bit *bits* 3)))
+(is eq t (= (sxhash *simple-bits*) (sxhash (filled-vector 'bit *bits* 3))))
+(is equal '(:type :type 1 1 1)
+    (list (handler-case (bit "abc" 0) (type-error () :type))
+          (handler-case (sbit (filled-vector 'bit *bits* 2) 0)
+            (type-error () :type))
+          (bit (filled-vector 'bit *simple-bits* 3) 2)
+          (sbit (make-array '(2 2) :element-type 'bit :initial-element 1)
+                1 1)
+          (setf (sbit (make-array 3 :element-type 'bit) 2) 1)))
+(is eq nil (equal *simple-bits* (filled-vector 'bit *bits* 4)))
+(defparameter *by-name* (make-hash-table :test #'equal))
+(setf (gethash "ab" *by-name*) 1)
+(is eq 1 (gethash *filled* *by-name*))
+(is eq 'car (find-symbol (filled-vector 'character "CAR" 3)))
+
+(defstruct wire-point x y)
+(defparameter *wired*
+  (let ((p (make-wire-point))
+	(h (make-hash-table :test 'equal)))
+    (setf (wire-point-x p) *ring*)
+    (setf (gethash "k" h) p)
+    (list h p :key 'car (vector 7 "s"))))
+(defparameter *unwired* (deserialize (serialize *wired*)))
+(is equal '(t t t 3 t)
+    (list (eq (gethash "k" (car *unwired*)) (cadr *unwired*))
+	  (eq :key (caddr *unwired*))
+	  (eq 'car (cadddr *unwired*))
+	  (caddr (wire-point-x (cadr *unwired*)))
+	  (let ((ring (wire-point-x (cadr *unwired*))))
+	    (eq ring (cdddr ring)))))
+(is equal '((1 "two") 3)
+    (with-input-from-string
+	(in (with-output-to-string (out)
+	      (serialize '(1 "two") out)
+	      (serialize 3 out)))
+      (list (deserialize in) (deserialize in))))
+(is eq :type (handler-case (serialize #'car) (type-error () :type)))
+(defun wire-octets (list)
+  (let ((octets (make-array (length list) :element-type '(unsigned-byte 8))))
+    (dotimes (i (length list) octets)
+      (setf (aref octets i) (nth i list)))))
+(is equal '(:parse :parse :parse :parse)
+    (mapcar #'(lambda (list)
+                (handler-case (deserialize (wire-octets list))
+                  (parse-error () :parse)))
+            '((5 255 255 255 127) (8 100 2 0) (9 200 1) (6 3 65))))
+(is equal '(:parse :parse :eof)
+    (mapcar #'(lambda (frame)
+                (with-open-file (o "/tmp/lisp800-smoke.tmp" :direction :output
+                                   :element-type '(unsigned-byte 8))
+                  (dolist (byte frame)
+                    (write-byte byte o)))
+                (with-open-file (i "/tmp/lisp800-smoke.tmp"
+                                   :element-type '(unsigned-byte 8))
+                  (handler-case (deserialize i)
+                    (parse-error () :parse)
+                    (end-of-file () :eof))))
+            '((5 5 255 255 255 31) (4 8 128 128 64) (6 11 0 255 255 255 15))))
+
+(with-open-file (o "/tmp/lisp800-smoke.tmp" :direction :output :buffer-size 4)
+  (write-line "first line" o)
+  (write-char (code-char 122) o))
+(is equal (list "first line" (code-char 122) nil)
+    (with-open-file (i "/tmp/lisp800-smoke.tmp" :buffer-size 4)
+      (unread-char (read-char i) i)
+      (list (read-line i) (peek-char nil i) (progn (read-char i)
+						  (read-char i nil nil)))))
+(delete-file "/tmp/lisp800-smoke.tmp")
+(is equal '(:type :type :type)
+    (mapcar #'(lambda (size)
+                (handler-case (open "/tmp/lisp800-smoke.tmp"
+                                    :direction :output :buffer-size size)
+                  (type-error () :type)))
+            (list (- 0 1) 'big 1000000)))
+(is eq nil (open "/tmp/lisp800-smoke.tmp" :if-does-not-exist nil))
+(is eq :error
+    (with-open-file (i "/tmp")
+      (handler-case (read-char i)
+        (end-of-file () :eof)
+        (stream-error () :error))))
+
 (write-line "PASSED")
 (quit 0)